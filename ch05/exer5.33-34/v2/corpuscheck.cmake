@@ -0,0 +1,29 @@
+# cmake -DPROC=... -DCORPUS=... -DFLAGS=a;b -P corpuscheck.cmake
+# cmake -DPROC=... -DCORPUS=... -DIMAGE=... -P corpuscheck.cmake
+# runs every program in CORPUS on the tree engine and again with FLAGS,
+# or compiled to the image IMAGE and run from it, and fails on the first
+# program whose output or exit status differs
+file(GLOB programs ${CORPUS}/*.proc)
+list(LENGTH programs count)
+foreach(program ${programs})
+  execute_process(COMMAND ${PROC} ${program}
+    OUTPUT_VARIABLE tree_out ERROR_VARIABLE tree_err RESULT_VARIABLE tree_rc)
+  if(IMAGE)
+    execute_process(COMMAND ${PROC} -o ${IMAGE} ${program}
+      OUTPUT_QUIET ERROR_VARIABLE err RESULT_VARIABLE rc)
+    if(NOT rc EQUAL 0)
+      message(FATAL_ERROR "cannot compile ${program} to an image: ${err}")
+    endif()
+    execute_process(COMMAND ${PROC} -i ${IMAGE}
+      OUTPUT_VARIABLE out ERROR_VARIABLE err RESULT_VARIABLE rc)
+    file(REMOVE ${IMAGE})
+  else()
+    execute_process(COMMAND ${PROC} ${FLAGS} ${program}
+      OUTPUT_VARIABLE out ERROR_VARIABLE err RESULT_VARIABLE rc)
+  endif()
+  if(NOT rc EQUAL tree_rc OR NOT out STREQUAL tree_out OR NOT err STREQUAL tree_err)
+    message(FATAL_ERROR "${program} with ${FLAGS}${IMAGE}: rc ${rc}, the tree engine ${tree_rc}\n"
+      "${out}${err}--- the tree engine:\n${tree_out}${tree_err}")
+  endif()
+endforeach()
+message(STATUS "${count} programs agree with the tree engine")
@@ -0,0 +1,103 @@
+# cmake -DPROC=... -DSHAPE=... -DDEPTH=... [-DFLAGS=a;b] [-DPROFILE=ON]
+#   [-DDUMP=ON] -P deepcheck.cmake
+# runs PROC over a generated program DEPTH levels deep and checks what
+# it prints against what the shape computes; with PROFILE, counts it
+# into a node profile twice over and checks that every line comes back;
+# with DUMP, FLAGS print the program and it checks that the text grows
+# no faster than the program does
+function(repeat out text count)
+  set(result "")
+  set(chunk "${text}")
+  set(n ${count})
+  while(n GREATER 0)
+    math(EXPR bit "${n} % 2")
+    if(bit)
+      set(result "${result}${chunk}")
+    endif()
+    set(chunk "${chunk}${chunk}")
+    math(EXPR n "${n} / 2")
+  endwhile()
+  set(${out} "${result}" PARENT_SCOPE)
+endfunction()
+
+if(SHAPE STREQUAL "diff")
+  # -(-(...-(1,1)...,1),1)
+  repeat(open "-(" ${DEPTH})
+  repeat(close ",1)" ${DEPTH})
+  set(program "${open}1${close}")
+  math(EXPR value "1 - ${DEPTH}")
+  set(expect "\n${value}\n")
+elseif(SHAPE STREQUAL "lets")
+  # 50 names let over and over, each used three times, counting down
+  set(block "")
+  set(prev 49)
+  foreach(i RANGE 49)
+    set(block "${block}let v${i} = -(-(v${prev}, v${prev}), -(1, v${prev})) in\n")
+    set(prev ${i})
+  endforeach()
+  math(EXPR blocks "${DEPTH} / 50")
+  repeat(body "${block}" ${blocks})
+  set(program "let v49 = 0 in\n${body}v49")
+  math(EXPR value "0 - 50 * ${blocks}")
+  set(expect "\n${value}\n")
+elseif(SHAPE STREQUAL "procs")
+  # proc (x) proc (x) ... -(x, 1), applied to 1 once
+  repeat(procs "proc (x) " ${DEPTH})
+  set(program "(${procs}-(x, 1) 1)")
+  set(expect "procedure")
+elseif(SHAPE STREQUAL "ifs")
+  # proc (x) -(if zero?(x) then if zero?(x) then ... 1 else 2 ... else 2, 1),
+  # applied to 0 unless it is only printed, so no pass can fold the ifs
+  repeat(open "if zero?(x) then " ${DEPTH})
+  repeat(close " else 2" ${DEPTH})
+  set(program "proc (x) -(${open}1${close}, 1)")
+  if(DUMP)
+    set(expect "else\n")
+  else()
+    set(program "(${program} 0)")
+    set(expect "\n0\n")
+  endif()
+else()
+  message(FATAL_ERROR "unknown shape ${SHAPE}")
+endif()
+
+set(file ${CMAKE_CURRENT_BINARY_DIR}/deep_${SHAPE}_${DEPTH}.proc)
+file(WRITE ${file} "${program}\n")
+if(PROFILE)
+  set(first ${file}.prof)
+  set(second ${file}.prof2)
+  execute_process(COMMAND ${PROC} ${FLAGS} --count=${first} ${file}
+    OUTPUT_QUIET ERROR_VARIABLE err RESULT_VARIABLE rc)
+  if(rc EQUAL 0)
+    execute_process(COMMAND ${PROC} ${FLAGS} --count=${second} --count-show=${first} ${file}
+      OUTPUT_QUIET ERROR_VARIABLE err RESULT_VARIABLE rc)
+  endif()
+  if(rc EQUAL 0)
+    execute_process(COMMAND ${PROC} ${FLAGS} --count-show=${second} ${file}
+      OUTPUT_VARIABLE out ERROR_VARIABLE err RESULT_VARIABLE rc)
+  endif()
+  # a line of a few dozen bytes per node, not one as long as its path:
+  # no shape makes more than eight nodes a level
+  file(READ ${second} text)
+  string(LENGTH "${text}" size)
+  file(REMOVE ${file} ${first} ${second})
+  math(EXPR limit "64 * 8 * ${DEPTH}")
+  string(REGEX MATCH " 2\n" twice "${out}")
+  if(NOT rc EQUAL 0 OR NOT err STREQUAL "" OR NOT twice OR size GREATER limit)
+    message(FATAL_ERROR "${SHAPE} ${DEPTH} deep profile: rc ${rc}, ${size} bytes\n${out}${err}")
+  endif()
+  return()
+endif()
+execute_process(COMMAND ${PROC} ${FLAGS} ${file}
+  OUTPUT_VARIABLE out ERROR_VARIABLE err RESULT_VARIABLE rc)
+file(REMOVE ${file})
+string(FIND "${out}" "${expect}" at)
+string(LENGTH "${out}" size)
+# a dump line is no longer than its indentation and a few dozen bytes
+math(EXPR limit "128 * 4 * ${DEPTH}")
+if(NOT rc EQUAL 0 OR at EQUAL -1 OR (DUMP AND size GREATER limit))
+  if(DUMP)
+    string(SUBSTRING "${out}" 0 4096 out)
+  endif()
+  message(FATAL_ERROR "${SHAPE} ${DEPTH} deep with ${FLAGS}: rc ${rc}, ${size} bytes, wanted ${expect}\n${out}${err}")
+endif()
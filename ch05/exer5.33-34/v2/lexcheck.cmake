@@ -0,0 +1,13 @@
+# cmake -DHAND=... -DFLEX=... -DCORPUS=... -P lexcheck.cmake
+file(GLOB programs ${CORPUS}/*.proc)
+list(LENGTH programs count)
+foreach(program ${programs})
+  execute_process(COMMAND ${HAND} ${program}
+    OUTPUT_VARIABLE hand_out RESULT_VARIABLE hand_rc)
+  execute_process(COMMAND ${FLEX} ${program}
+    OUTPUT_VARIABLE flex_out RESULT_VARIABLE flex_rc)
+  if(NOT hand_rc EQUAL flex_rc OR NOT hand_out STREQUAL flex_out)
+    message(FATAL_ERROR "scanners disagree on ${program}")
+  endif()
+endforeach()
+message(STATUS "scanners agree on ${count} programs")
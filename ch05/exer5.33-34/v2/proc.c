@@ -2,71 +2,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 #include "proc.h"
 #include "proc_parser.h"
+#ifdef PROC_HAND_SCANNER
+#include "proc_lexer.h"
+#else
 #include "proc_scanner.h"
-
-typedef struct ast_const_s {
-    exp_type type;
-    int num;
-} ast_const_s, *ast_const_t;
-
-typedef struct ast_var_s {
-    exp_type type;
-    symbol_t var;
-} ast_var_s, *ast_var_t;
-
-typedef struct ast_proc_s {
-    exp_type type;
-    symbol_t var;
-    ast_node_t body;
-} ast_proc_s, *ast_proc_t;
-
-typedef struct ast_letrec_s {
-    exp_type type;
-    symbol_t p_name;
-    symbol_t p_var;
-    ast_node_t p_body;
-    ast_node_t letrec_body;
-} ast_letrec_s, *ast_letrec_t;
-
-typedef struct ast_zero_s {
-    exp_type type;
-    ast_node_t exp1;
-} ast_zero_s, *ast_zero_t;
-
-typedef struct ast_if_s {
-    exp_type type;
-    ast_node_t cond;
-    ast_node_t exp1;
-    ast_node_t exp2;
-} ast_if_s, *ast_if_t;
-
-typedef struct ast_let_s {
-    exp_type type;
-    symbol_t id;
-    ast_node_t exp1;
-    ast_node_t exp2;
-} ast_let_s, *ast_let_t;
-
-typedef struct ast_diff_s {
-    exp_type type;
-    ast_node_t exp1;
-    ast_node_t exp2;
-} ast_diff_s, *ast_diff_t;
-
-typedef struct ast_call_s {
-    exp_type type;
-    ast_node_t rator;
-    ast_node_t rand;
-} ast_call_s, *ast_call_t;
-
-typedef struct proc_s {
-    symbol_t id;
-    ast_node_t body;
-    env_t env;
-} proc_s;
+#endif
 
 typedef struct exp_val_s {
     EXP_VAL type;
@@ -96,6 +38,7 @@ typedef struct extend_rec_env_s {
     symbol_t p_name;
     symbol_t p_var;
     ast_node_t p_body;
+    int line;
     exp_val_t proc_val;
     env_t env;
 } extend_rec_env_s, *extend_rec_env_t;
@@ -173,21 +116,29 @@ typedef struct apply_proc_cont_s {
 
 typedef struct apply_proc2_cont_s {
     CONT_TYPE type;
+    proc_t proc; /* the guest procedure this frame is running */
     env_t env;
     continuation_t cont;
 } apply_proc2_cont_s, *apply_proc2_cont_t;
 
-void const_node_free(ast_const_t exp);
-void var_node_free(ast_var_t exp);
-void proc_node_free(ast_proc_t exp);
-void letrec_node_free(ast_letrec_t exp);
-void zero_node_free(ast_zero_t exp);
-void if_node_free(ast_if_t exp);
-void let_node_free(ast_let_t exp);
-void diff_node_free(ast_diff_t exp);
-void call_node_free(ast_call_t exp);
-env_t env_copy(env_t env);
-env_t env_copy_iter(env_t env);
+/* explicit stack of nodes still to visit, so that no tree walk recurses */
+typedef struct ast_worklist_s {
+    ast_node_t *nodes;
+    size_t len;
+    size_t cap;
+} ast_worklist_s, *ast_worklist_t;
+
+void ast_worklist_push(ast_worklist_t w, ast_node_t exp);
+void const_node_free(ast_const_t exp, ast_worklist_t w);
+void var_node_free(ast_var_t exp, ast_worklist_t w);
+void proc_node_free(ast_proc_t exp, ast_worklist_t w);
+void letrec_node_free(ast_letrec_t exp, ast_worklist_t w);
+void zero_node_free(ast_zero_t exp, ast_worklist_t w);
+void if_node_free(ast_if_t exp, ast_worklist_t w);
+void let_node_free(ast_let_t exp, ast_worklist_t w);
+void diff_node_free(ast_diff_t exp, ast_worklist_t w);
+void call_node_free(ast_call_t exp, ast_worklist_t w);
+void fused_node_free(ast_fused_t exp, ast_worklist_t w);
 void report_ast_malloc_fail(const char* node_name);
 void report_exp_val_malloc_fail(const char *val_type);
 void report_invalid_exp_val(const char *val_type);
@@ -248,12 +199,14 @@ ast_node_t new_var_node(symbol_t id) {
     }
 }
 
-ast_node_t new_proc_node(symbol_t var, ast_node_t body) {
+ast_node_t new_proc_node(symbol_t var, ast_node_t body, int line) {
     ast_proc_t e = malloc(sizeof(ast_proc_s));
     if (e) {
         e->type = PROC_EXP;
         e->var = var;
         e->body = body;
+        e->name = NULL;
+        e->line = line;
         return (ast_node_t)e;
     } else {
         report_ast_malloc_fail("proc");
@@ -262,7 +215,7 @@ ast_node_t new_proc_node(symbol_t var, ast_node_t body) {
 }
 
 ast_node_t new_letrec_node(
-    symbol_t p_name, symbol_t p_var, ast_node_t p_body, ast_node_t letrec_body) {
+    symbol_t p_name, symbol_t p_var, ast_node_t p_body, ast_node_t letrec_body, int line) {
     ast_letrec_t e = malloc(sizeof(ast_letrec_s));
     if (e) {
         e->type = LETREC_EXP;
@@ -270,6 +223,7 @@ ast_node_t new_letrec_node(
         e->p_var = p_var;
         e->p_body = p_body;
         e->letrec_body = letrec_body;
+        e->line = line;
         return (ast_node_t)e;
     } else {
         report_ast_malloc_fail("letrec");
@@ -343,6 +297,23 @@ ast_node_t new_call_node(ast_node_t exp1, ast_node_t exp2) {
     }
 }
 
+ast_node_t new_fused_node(exp_type type, symbol_t var1, symbol_t var2, int num,
+                          ast_node_t exp1, ast_node_t exp2) {
+    ast_fused_t e = malloc(sizeof(ast_fused_s));
+    if (e) {
+        e->type = type;
+        e->var1 = var1;
+        e->var2 = var2;
+        e->num = num;
+        e->exp1 = exp1;
+        e->exp2 = exp2;
+        return (ast_node_t)e;
+    } else {
+        report_ast_malloc_fail("fused");
+        exit(1);
+    }
+}
+
 void report_ast_malloc_fail(const char* node_name) {
     fprintf(stderr, "failed to create a new %s ast node!\n", node_name);
     exit(1);
@@ -355,43 +326,71 @@ void ast_program_free(ast_program_t prgm) {
     }
 }
 
-void ast_free(ast_node_t exp) {
-    if (exp) {
+void ast_worklist_push(ast_worklist_t w, ast_node_t exp) {
+    if (w->len == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 64;
+        w->nodes = realloc(w->nodes, w->cap * sizeof(ast_node_t));
+        if (!w->nodes) {
+            fprintf(stderr, "failed to grow ast worklist!\n");
+            exit(1);
+        }
+    }
+    w->nodes[w->len++] = exp;
+}
+
+void ast_free(ast_node_t root) {
+    ast_worklist_s w = { NULL, 0, 0 };
+    if (root) {
+        ast_worklist_push(&w, root);
+    }
+    while (w.len > 0) {
+        ast_node_t exp = w.nodes[--w.len];
         switch (exp->type) {
             case CONST_EXP: {
-                const_node_free((ast_const_t)exp);
+                const_node_free((ast_const_t)exp, &w);
                 break;
             }
             case VAR_EXP: {
-                var_node_free((ast_var_t)exp);
+                var_node_free((ast_var_t)exp, &w);
                 break;
             }
             case PROC_EXP: {
-                proc_node_free((ast_proc_t)exp);
+                proc_node_free((ast_proc_t)exp, &w);
                 break;
             }
             case LETREC_EXP: {
-                letrec_node_free((ast_letrec_t)exp);
+                letrec_node_free((ast_letrec_t)exp, &w);
                 break;
             }
             case ZERO_EXP: {
-                zero_node_free((ast_zero_t)exp);
+                zero_node_free((ast_zero_t)exp, &w);
                 break;
             }
             case IF_EXP: {
-                if_node_free((ast_if_t)exp);
+                if_node_free((ast_if_t)exp, &w);
                 break;
             }
             case LET_EXP: {
-                let_node_free((ast_let_t)exp);
+                let_node_free((ast_let_t)exp, &w);
                 break;
             }
             case DIFF_EXP: {
-                diff_node_free((ast_diff_t)exp);
+                diff_node_free((ast_diff_t)exp, &w);
                 break;
             }
             case CALL_EXP: {
-                call_node_free((ast_call_t)exp);
+                call_node_free((ast_call_t)exp, &w);
+                break;
+            }
+            case DEC_VAR_EXP:
+            case NEG_VAR_EXP:
+            case ADD_VARS_EXP:
+            case ZERO_VAR_EXP:
+            case IF_ZERO_VAR_EXP:
+            case CALL_VARS_EXP:
+            case CALL_DEC_VAR_EXP:
+            case CALL_CURRIED_EXP: {
+                fused_node_free((ast_fused_t)exp, &w);
                 break;
             }
             default: {
@@ -400,54 +399,66 @@ void ast_free(ast_node_t exp) {
             }
         }
     }
+    free(w.nodes);
 }
 
-void const_node_free(ast_const_t exp) {
+/* each node hands its children to the worklist before it is released */
+void const_node_free(ast_const_t exp, ast_worklist_t w) {
     free(exp);
 }
 
-void var_node_free(ast_var_t exp) {
+void var_node_free(ast_var_t exp, ast_worklist_t w) {
     free(exp);
 }
 
-void proc_node_free(ast_proc_t exp) {
-    ast_free(exp->body);
+void proc_node_free(ast_proc_t exp, ast_worklist_t w) {
+    ast_worklist_push(w, exp->body);
     free(exp);
 }
 
-void letrec_node_free(ast_letrec_t exp) {
-    ast_free(exp->p_body);
-    ast_free(exp->letrec_body);
+void letrec_node_free(ast_letrec_t exp, ast_worklist_t w) {
+    ast_worklist_push(w, exp->p_body);
+    ast_worklist_push(w, exp->letrec_body);
     free(exp);
 }
 
-void zero_node_free(ast_zero_t exp) {
-    ast_free(exp->exp1);
+void zero_node_free(ast_zero_t exp, ast_worklist_t w) {
+    ast_worklist_push(w, exp->exp1);
     free(exp);
 }
 
-void if_node_free(ast_if_t exp) {
-    ast_free(exp->cond);
-    ast_free(exp->exp1);
-    ast_free(exp->exp2);
+void if_node_free(ast_if_t exp, ast_worklist_t w) {
+    ast_worklist_push(w, exp->cond);
+    ast_worklist_push(w, exp->exp1);
+    ast_worklist_push(w, exp->exp2);
     free(exp);
 }
 
-void let_node_free(ast_let_t exp) {
-    ast_free(exp->exp1);
-    ast_free(exp->exp2);
+void let_node_free(ast_let_t exp, ast_worklist_t w) {
+    ast_worklist_push(w, exp->exp1);
+    ast_worklist_push(w, exp->exp2);
     free(exp);
 }
 
-void diff_node_free(ast_diff_t exp) {
-    ast_free(exp->exp1);
-    ast_free(exp->exp2);
+void diff_node_free(ast_diff_t exp, ast_worklist_t w) {
+    ast_worklist_push(w, exp->exp1);
+    ast_worklist_push(w, exp->exp2);
     free(exp);
 }
 
-void call_node_free(ast_call_t exp) {
-    ast_free(exp->rator);
-    ast_free(exp->rand);
+void call_node_free(ast_call_t exp, ast_worklist_t w) {
+    ast_worklist_push(w, exp->rator);
+    ast_worklist_push(w, exp->rand);
+    free(exp);
+}
+
+void fused_node_free(ast_fused_t exp, ast_worklist_t w) {
+    if (exp->exp1) {
+        ast_worklist_push(w, exp->exp1);
+    }
+    if (exp->exp2) {
+        ast_worklist_push(w, exp->exp2);
+    }
     free(exp);
 }
 
@@ -458,12 +469,14 @@ void symbol_free(symbol_t id) {
     }
 }
 
-proc_t new_proc(symbol_t id, ast_node_t body, env_t env) {
-    proc_t p = malloc(sizeof(proc_s));
+proc_t new_proc(symbol_t id, ast_node_t body, env_t env, symbol_t name, int line) {
+    proc_t p = heap_alloc(HEAP_NEW_PROC, sizeof(proc_s));
     if (p) {
         p->id = id;
         p->body = body;
         p->env = env_copy_iter(env);
+        p->name = name;
+        p->line = line;
         return p;
     } else {
         report_exp_val_malloc_fail("procedure");
@@ -471,18 +484,22 @@ proc_t new_proc(symbol_t id, ast_node_t body, env_t env) {
     }
 }
 
+const char *proc_name(proc_t p) {
+    return p->name ? p->name->name : "proc";
+}
+
 void proc_free(proc_t p) {
     if (p) {
         env_t e = p->env;
         while (e) {
             e = env_pop(e);
         }
-        free(p);
+        heap_free(p);
     }
 }
 
 exp_val_t new_bool_val(boolean_t val) {
-    exp_val_t ev = malloc(sizeof(exp_val_s));
+    exp_val_t ev = heap_alloc(HEAP_NEW_BOOL_VAL, sizeof(exp_val_s));
     if (ev) {
         ev->type = BOOL_VAL;
         ev->val.bv = val;
@@ -494,7 +511,7 @@ exp_val_t new_bool_val(boolean_t val) {
 }
 
 exp_val_t new_int_val(int val) {
-    exp_val_t ev = malloc(sizeof(exp_val_s));
+    exp_val_t ev = heap_alloc(HEAP_NEW_INT_VAL, sizeof(exp_val_s));
     if (ev) {
         ev->type = NUM_VAL;
         ev->val.iv = val;
@@ -506,7 +523,7 @@ exp_val_t new_int_val(int val) {
 }
 
 exp_val_t new_proc_val(proc_t val) {
-    exp_val_t ev = malloc(sizeof(exp_val_s));
+    exp_val_t ev = heap_alloc(HEAP_NEW_PROC_VAL, sizeof(exp_val_s));
     if (ev) {
         ev->type = PROC_VAL;
         ev->val.pv = val;
@@ -518,11 +535,13 @@ exp_val_t new_proc_val(proc_t val) {
 }
 
 exp_val_t copy_exp_val(exp_val_t val) {
-    exp_val_t cv = malloc(sizeof(exp_val_s));
+    STATS_INC(copy_exp_val);
+    exp_val_t cv = heap_alloc(HEAP_COPY_EXP_VAL, sizeof(exp_val_s));
     if (cv) {
         if (val->type == PROC_VAL) {
             cv->type = PROC_VAL;
-            cv->val.pv = new_proc(val->val.pv->id, val->val.pv->body, val->val.pv->env);
+            proc_t p = val->val.pv;
+            cv->val.pv = new_proc(p->id, p->body, p->env, p->name, p->line);
         } else {
             memcpy(cv, val, sizeof(*val));
         }
@@ -559,7 +578,7 @@ void exp_val_free(exp_val_t val) {
         if (val->type == PROC_VAL) {
             proc_free(val->val.pv);
         }
-        free(val);
+        heap_free(val);
     }
 }
 
@@ -591,10 +610,12 @@ proc_t expval_to_proc(exp_val_t val) {
 }
 
 env_t empty_env() {
-    env_t env = malloc(sizeof(env_s));
+    env_t env = heap_alloc(HEAP_EMPTY_ENV, sizeof(env_s));
     if (env) {
+        STATS_INC(env_alloc);
         env->type = EMPTY_ENV;
         env->ref = 1;
+        PROC_PROBE2(env_alloc, env, env->type);
         return env;
     } else {
         fprintf(stderr, "failed to create a new empty env!\n");
@@ -603,10 +624,12 @@ env_t empty_env() {
 }
 
 env_t extend_env(symbol_t var, exp_val_t val, env_t env) {
-    extend_env_t e = malloc(sizeof(extend_env_s));
+    extend_env_t e = heap_alloc(HEAP_EXTEND_ENV, sizeof(extend_env_s));
     if (e) {
+        STATS_INC(env_alloc);
         e->type = EXTEND_ENV;
         e->ref = 1;
+        PROC_PROBE2(env_alloc, e, e->type);
         e->var = var;
         e->val = val;
         e->env = env;
@@ -618,14 +641,17 @@ env_t extend_env(symbol_t var, exp_val_t val, env_t env) {
     }
 }
 
-env_t extend_env_rec(symbol_t p_name, symbol_t p_var, ast_node_t p_body, env_t env) {
-    extend_rec_env_t e = malloc(sizeof(extend_rec_env_s));
+env_t extend_env_rec(symbol_t p_name, symbol_t p_var, ast_node_t p_body, int line, env_t env) {
+    extend_rec_env_t e = heap_alloc(HEAP_EXTEND_ENV_REC, sizeof(extend_rec_env_s));
     if (e) {
+        STATS_INC(env_alloc);
         e->type = EXTEND_REC_ENV;
         e->ref = 1;
+        PROC_PROBE2(env_alloc, e, e->type);
         e->p_name = p_name;
         e->p_var = p_var;
         e->p_body = p_body;
+        e->line = line;
         e->proc_val = NULL;
         env->ref += 1;
         e->env = env;
@@ -638,11 +664,15 @@ env_t extend_env_rec(symbol_t p_name, symbol_t p_var, ast_node_t p_body, env_t e
 
 env_t empty_env_free(env_t e) {
     if (e->ref == 0) {
-        free(e);
+        STATS_INC(env_free);
+        PROC_PROBE1(env_free, e);
+        heap_free(e);
         return NULL;
     } else if (e->ref == 1) {
         e->ref -= 1;
-        free(e);
+        STATS_INC(env_free);
+        PROC_PROBE1(env_free, e);
+        heap_free(e);
         return NULL;
     } else {
         e->ref -= 1;
@@ -654,14 +684,18 @@ env_t extend_env_free(extend_env_t e) {
     if (e->ref == 0) {
         exp_val_free(e->val);
         env_t next = e->env;
-        free(e);
+        STATS_INC(env_free);
+        PROC_PROBE1(env_free, e);
+        heap_free(e);
         return next;
     } else if (e->ref == 1) {
         e->ref -= 1;
         e->env->ref -= 1;
         exp_val_free(e->val);
         env_t next = e->env;
-        free(e);
+        STATS_INC(env_free);
+        PROC_PROBE1(env_free, e);
+        heap_free(e);
         return next;
     } else {
         e->ref -= 1;
@@ -678,7 +712,9 @@ env_t extend_rec_env_free(extend_rec_env_t e) {
         e->env->ref -= 1;
         exp_val_free(e->proc_val);
         env_t next = e->env;
-        free(e);
+        STATS_INC(env_free);
+        PROC_PROBE1(env_free, e);
+        heap_free(e);
         return next;
     } else {
         e->ref -= 1;
@@ -687,35 +723,39 @@ env_t extend_rec_env_free(extend_rec_env_t e) {
 }
 
 exp_val_t apply_env(env_t env, symbol_t var) {
-    switch (env->type) {
-        case EMPTY_ENV: {
-            report_no_binding_found(var);
-            exit(1);
-        }
-        case EXTEND_ENV: {
-            extend_env_t e = (extend_env_t)env;
-            if (strcmp(e->var->name, var->name) == 0) {
-                return e->val;
-            } else {
-                return apply_env(e->env, var);
+    for (;;) {
+        switch (env->type) {
+            case EMPTY_ENV: {
+                report_no_binding_found(var);
+                exit(1);
             }
-        }
-        case EXTEND_REC_ENV: {
-            extend_rec_env_t e = (extend_rec_env_t)env;
-            if (strcmp(e->p_name->name, var->name) == 0) {
-                if (e->proc_val) {
-                    return e->proc_val;
+            case EXTEND_ENV: {
+                extend_env_t e = (extend_env_t)env;
+                if (strcmp(e->var->name, var->name) == 0) {
+                    return e->val;
                 } else {
-                    e->proc_val = new_proc_val(new_proc(e->p_var, e->p_body, env));
-                    return e->proc_val;
+                    env = e->env;
+                    break;
                 }
-            } else {
-                return apply_env(e->env, var);
             }
-        }
-        default: {
-            report_invalid_env(env);
-            exit(1);
+            case EXTEND_REC_ENV: {
+                extend_rec_env_t e = (extend_rec_env_t)env;
+                if (strcmp(e->p_name->name, var->name) == 0) {
+                    if (e->proc_val) {
+                        return e->proc_val;
+                    } else {
+                        e->proc_val = new_proc_val(new_proc(e->p_var, e->p_body, env, e->p_name, e->line));
+                        return e->proc_val;
+                    }
+                } else {
+                    env = e->env;
+                    break;
+                }
+            }
+            default: {
+                report_invalid_env(env);
+                exit(1);
+            }
         }
     }
 }
@@ -729,7 +769,7 @@ env_t env_copy(env_t env) {
         return (env_t)extend_env(e->var, val, env_copy(e->env));
     } else if (env->type == EXTEND_REC_ENV) {
         extend_rec_env_t e = (extend_rec_env_t)env;
-        return (env_t)extend_env_rec(e->p_name, e->p_var, e->p_body, env_copy(e->env));
+        return (env_t)extend_env_rec(e->p_name, e->p_var, e->p_body, e->line, env_copy(e->env));
     } else {
         report_invalid_env(env);
         return NULL;
@@ -744,9 +784,11 @@ env_t env_copy_iter(env_t env) {
     while (r_cpy_env->type != EMPTY_ENV) {
         if (r_cpy_env->type == EXTEND_ENV) {
             extend_env_t e = (extend_env_t)r_cpy_env;
-            extend_env_t ec = (extend_env_t)malloc(sizeof(*e));
+            extend_env_t ec = heap_alloc(HEAP_ENV_COPY_ITER, sizeof(*e));
             if (ec) {
+                STATS_INC(env_alloc);
                 ec->type = EXTEND_ENV;
+                PROC_PROBE2(env_alloc, ec, ec->type);
                 ec->ref = 1;
                 ec->var = e->var;
                 ec->val = copy_exp_val(e->val);
@@ -768,13 +810,16 @@ env_t env_copy_iter(env_t env) {
             }
         } else if (r_cpy_env->type == EXTEND_REC_ENV) {
             extend_rec_env_t e = (extend_rec_env_t)r_cpy_env;
-            extend_rec_env_t ec = (extend_rec_env_t)malloc(sizeof(*e));
+            extend_rec_env_t ec = heap_alloc(HEAP_ENV_COPY_ITER, sizeof(*e));
             if (ec) {
+                STATS_INC(env_alloc);
                 ec->type = EXTEND_REC_ENV;
+                PROC_PROBE2(env_alloc, ec, ec->type);
                 ec->ref = 1;
                 ec->p_name = e->p_name;
                 ec->p_var = e->p_var;
                 ec->p_body = e->p_body;
+                ec->line = e->line;
                 ec->proc_val = NULL;
                 ec->env = NULL;
                 if (*env_tail == NULL) {
@@ -829,9 +874,11 @@ env_t env_pop(env_t env) {
 }
 
 continuation_t new_end_cont() {
-    continuation_t c = malloc(sizeof(continuation_s));
+    continuation_t c = heap_alloc(HEAP_NEW_END_CONT, sizeof(continuation_s));
     if (c) {
+        STATS_CONT_PUSH();
         c->type = END_CONT;
+        PROC_PROBE2(cont_push, c, c->type);
         return c;
     } else {
         report_cont_build_fail("end");
@@ -840,9 +887,11 @@ continuation_t new_end_cont() {
 }
 
 continuation_t new_zero1_cont(continuation_t cont) {
-    zero1_cont_t c = malloc(sizeof(zero1_cont_s));
+    zero1_cont_t c = heap_alloc(HEAP_NEW_ZERO1_CONT, sizeof(zero1_cont_s));
     if (c) {
+        STATS_CONT_PUSH();
         c->type = ZERO1_CONT;
+        PROC_PROBE2(cont_push, c, c->type);
         c->cont = cont;
         return (continuation_t)c;
     } else {
@@ -852,9 +901,11 @@ continuation_t new_zero1_cont(continuation_t cont) {
 }
 
 continuation_t new_let_cont(symbol_t var, ast_node_t body, env_t env, continuation_t cont) {
-    let_cont_t c = malloc(sizeof(let_cont_s));
+    let_cont_t c = heap_alloc(HEAP_NEW_LET_CONT, sizeof(let_cont_s));
     if (c) {
+        STATS_CONT_PUSH();
         c->type = LET_CONT;
+        PROC_PROBE2(cont_push, c, c->type);
         c->var = var;
         c->body = body;
         c->env = env;
@@ -868,9 +919,11 @@ continuation_t new_let_cont(symbol_t var, ast_node_t body, env_t env, continuati
 }
 
 continuation_t new_if_test_cont(ast_node_t exp2, ast_node_t exp3, env_t env, continuation_t cont) {
-    if_test_cont_t c = malloc(sizeof(if_test_cont_s));
+    if_test_cont_t c = heap_alloc(HEAP_NEW_IF_TEST_CONT, sizeof(if_test_cont_s));
     if (c) {
+        STATS_CONT_PUSH();
         c->type = IF_TEST_CONT;
+        PROC_PROBE2(cont_push, c, c->type);
         c->exp2 = exp2;
         c->exp3 = exp3;
         c->env = env;
@@ -884,9 +937,11 @@ continuation_t new_if_test_cont(ast_node_t exp2, ast_node_t exp3, env_t env, con
 }
 
 continuation_t new_diff1_cont(ast_node_t exp2, env_t env, continuation_t cont) {
-    diff1_cont_t c = malloc(sizeof(diff1_cont_s));
+    diff1_cont_t c = heap_alloc(HEAP_NEW_DIFF1_CONT, sizeof(diff1_cont_s));
     if (c) {
+        STATS_CONT_PUSH();
         c->type = DIFF1_CONT;
+        PROC_PROBE2(cont_push, c, c->type);
         c->exp2 = exp2;
         c->env = env;
         env->ref += 1;
@@ -899,9 +954,11 @@ continuation_t new_diff1_cont(ast_node_t exp2, env_t env, continuation_t cont) {
 }
 
 continuation_t new_diff2_cont(exp_val_t val, continuation_t cont) {
-    diff2_cont_t c = malloc(sizeof(diff2_cont_s));
+    diff2_cont_t c = heap_alloc(HEAP_NEW_DIFF2_CONT, sizeof(diff2_cont_s));
     if (c) {
+        STATS_CONT_PUSH();
         c->type = DIFF2_CONT;
+        PROC_PROBE2(cont_push, c, c->type);
         c->val = val;
         c->cont = cont;
         return (continuation_t)c;
@@ -912,9 +969,11 @@ continuation_t new_diff2_cont(exp_val_t val, continuation_t cont) {
 }
 
 continuation_t new_rator_cont(ast_node_t exp, env_t env, continuation_t cont) {
-    rator_cont_t c = malloc(sizeof(rator_cont_s));
+    rator_cont_t c = heap_alloc(HEAP_NEW_RATOR_CONT, sizeof(rator_cont_s));
     if (c) {
+        STATS_CONT_PUSH();
         c->type = RATOR_CONT;
+        PROC_PROBE2(cont_push, c, c->type);
         c->exp = exp;
         c->env = env;
         env->ref += 1;
@@ -927,9 +986,11 @@ continuation_t new_rator_cont(ast_node_t exp, env_t env, continuation_t cont) {
 }
 
 continuation_t new_rand_cont(exp_val_t val, continuation_t cont) {
-    rand_cont_t c = malloc(sizeof(rand_cont_s));
+    rand_cont_t c = heap_alloc(HEAP_NEW_RAND_CONT, sizeof(rand_cont_s));
     if (c) {
+        STATS_CONT_PUSH();
         c->type = RAND_CONT;
+        PROC_PROBE2(cont_push, c, c->type);
         c->val = val;
         c->cont = cont;
         return (continuation_t)c;
@@ -940,9 +1001,11 @@ continuation_t new_rand_cont(exp_val_t val, continuation_t cont) {
 }
 
 continuation_t new_letrec_cont(env_t env, continuation_t cont) {
-    letrec_cont_t c = malloc(sizeof(letrec_cont_s));
+    letrec_cont_t c = heap_alloc(HEAP_NEW_LETREC_CONT, sizeof(letrec_cont_s));
     if (c) {
+        STATS_CONT_PUSH();
         c->type = LETREC_CONT;
+        PROC_PROBE2(cont_push, c, c->type);
         c->env = env;
         env->ref += 1;
         c->cont = cont;
@@ -954,9 +1017,11 @@ continuation_t new_letrec_cont(env_t env, continuation_t cont) {
 }
 
 continuation_t new_let2_cont(env_t env, continuation_t cont) {
-    let2_cont_t c = malloc(sizeof(let2_cont_s));
+    let2_cont_t c = heap_alloc(HEAP_NEW_LET2_CONT, sizeof(let2_cont_s));
     if (c) {
+        STATS_CONT_PUSH();
         c->type = LET2_CONT;
+        PROC_PROBE2(cont_push, c, c->type);
         c->env = env;
         env->ref += 1;
         c->cont = cont;
@@ -968,9 +1033,11 @@ continuation_t new_let2_cont(env_t env, continuation_t cont) {
 }
 
 continuation_t new_apply_proc_cont(exp_val_t rator, exp_val_t rand, env_t env, continuation_t cont) {
-    apply_proc_cont_t c = malloc(sizeof(apply_proc_cont_s));
+    apply_proc_cont_t c = heap_alloc(HEAP_NEW_APPLY_PROC_CONT, sizeof(apply_proc_cont_s));
     if (c) {
+        STATS_CONT_PUSH();
         c->type = APPLY_PROC_CONT;
+        PROC_PROBE2(cont_push, c, c->type);
         c->rator = rator;
         c->rand = rand;
         c->env = env;
@@ -983,10 +1050,13 @@ continuation_t new_apply_proc_cont(exp_val_t rator, exp_val_t rand, env_t env, c
     }
 }
 
-continuation_t new_apply_proc2_cont(env_t env, continuation_t cont) {
-    apply_proc2_cont_t c = malloc(sizeof(apply_proc2_cont_s));
+continuation_t new_apply_proc2_cont(proc_t proc, env_t env, continuation_t cont) {
+    apply_proc2_cont_t c = heap_alloc(HEAP_NEW_APPLY_PROC2_CONT, sizeof(apply_proc2_cont_s));
     if (c) {
+        STATS_CONT_PUSH();
         c->type = APPLY_PROC2_CONT;
+        PROC_PROBE2(cont_push, c, c->type);
+        c->proc = proc;
         c->env = env;
         env->ref += 1;
         c->cont = cont;
@@ -999,84 +1069,133 @@ continuation_t new_apply_proc2_cont(env_t env, continuation_t cont) {
 
 void end_cont_free(continuation_t cont) {
     if (cont) {
-        free(cont);
+        STATS_CONT_POP();
+        PROC_PROBE2(cont_pop, cont, cont->type);
+        heap_free(cont);
     }
 }
 
 void zero1_cont_free(zero1_cont_t cont) {
     if (cont) {
-        free(cont);
+        STATS_CONT_POP();
+        PROC_PROBE2(cont_pop, cont, cont->type);
+        heap_free(cont);
     }
 }
 
 void let_cont_free(let_cont_t cont) {
     if (cont) {
         env_pop(cont->env);
-        free(cont);
+        STATS_CONT_POP();
+        PROC_PROBE2(cont_pop, cont, cont->type);
+        heap_free(cont);
     }
 }
 
 void if_test_cont_free(if_test_cont_t cont) {
     if (cont) {
         env_pop(cont->env);
-        free(cont);
+        STATS_CONT_POP();
+        PROC_PROBE2(cont_pop, cont, cont->type);
+        heap_free(cont);
     }
 }
 
 void diff1_cont_free(diff1_cont_t cont) {
     if (cont) {
         env_pop(cont->env);
-        free(cont);
+        STATS_CONT_POP();
+        PROC_PROBE2(cont_pop, cont, cont->type);
+        heap_free(cont);
     }
 }
 
 void diff2_cont_free(diff2_cont_t cont) {
     if (cont) {
-        free(cont);
+        STATS_CONT_POP();
+        PROC_PROBE2(cont_pop, cont, cont->type);
+        heap_free(cont);
     }
 }
 
 void rator_cont_free(rator_cont_t cont) {
     if (cont) {
         env_pop(cont->env);
-        free(cont);
+        STATS_CONT_POP();
+        PROC_PROBE2(cont_pop, cont, cont->type);
+        heap_free(cont);
     }
 }
 
 void rand_cont_free(rand_cont_t cont) {
     if (cont) {
-        free(cont);
+        STATS_CONT_POP();
+        PROC_PROBE2(cont_pop, cont, cont->type);
+        heap_free(cont);
     }
 }
 
 void letrec_cont_free(letrec_cont_t cont) {
     if (cont) {
         env_pop(cont->env);
-        free(cont);
+        STATS_CONT_POP();
+        PROC_PROBE2(cont_pop, cont, cont->type);
+        heap_free(cont);
     }
 }
 
 void let2_cont_free(let2_cont_t cont) {
     if (cont) {
         env_pop(cont->env);
-        free(cont);
+        STATS_CONT_POP();
+        PROC_PROBE2(cont_pop, cont, cont->type);
+        heap_free(cont);
     }
 }
 
 void apply_proc_cont_free(apply_proc_cont_t cont) {
     if (cont) {
         env_pop(cont->env);
-        free(cont);
+        STATS_CONT_POP();
+        PROC_PROBE2(cont_pop, cont, cont->type);
+        heap_free(cont);
     }
 }
 
 void apply_proc2_cont_free(apply_proc2_cont_t cont) {
     if (cont) {
         env_pop(cont->env);
-        free(cont);
+        STATS_CONT_POP();
+        PROC_PROBE2(cont_pop, cont, cont->type);
+        heap_free(cont);
+    }
+}
+
+/* a frame of any type, for callers outside apply_cont */
+void cont_free(continuation_t cont) {
+    switch (cont->type) {
+        case END_CONT: end_cont_free(cont); break;
+        case ZERO1_CONT: zero1_cont_free((zero1_cont_t)cont); break;
+        case LET_CONT: let_cont_free((let_cont_t)cont); break;
+        case IF_TEST_CONT: if_test_cont_free((if_test_cont_t)cont); break;
+        case DIFF1_CONT: diff1_cont_free((diff1_cont_t)cont); break;
+        case DIFF2_CONT: diff2_cont_free((diff2_cont_t)cont); break;
+        case RATOR_CONT: rator_cont_free((rator_cont_t)cont); break;
+        case RAND_CONT: rand_cont_free((rand_cont_t)cont); break;
+        case LETREC_CONT: letrec_cont_free((letrec_cont_t)cont); break;
+        case LET2_CONT: let2_cont_free((let2_cont_t)cont); break;
+        case APPLY_PROC_CONT: apply_proc_cont_free((apply_proc_cont_t)cont); break;
+        case APPLY_PROC2_CONT: apply_proc2_cont_free((apply_proc2_cont_t)cont); break;
+        default: {
+            fprintf(stderr, "unknown type of continuation: %d", cont->type);
+            exit(1);
+        }
     }
 }
 
+/* set to evaluate without printing the answer, as the benchmarks do */
+int proc_quiet;
+
 /* global registers */
 static continuation_t cont;
 static env_t env;
@@ -1084,8 +1203,19 @@ static ast_node_t exp;
 static proc_t proc1;
 static exp_val_t val;
 static bounce_s bc;
+static ast_flat_t flat;
+static node_profile_t nprof;
+/* the operands after the first of a call_curried node, on their way to
+ * apply_curried_k */
+static exp_val_t curried[CURRY_MAX];
+static int ncurried;
 void compute_value();
 
+/* under a flat program the exp register holds a node index instead of a
+ * node pointer; continuations and procedures just carry it around */
+#define FLAT_NODE(i) ((ast_node_t)(uintptr_t)(i))
+#define FLAT_INDEX(n) ((uint32_t)(uintptr_t)(n))
+
 /* for exercise 5.33 and 5.34 */
 void value_of_program_k(ast_program_t prgm) {
     env_t e = empty_env();
@@ -1093,22 +1223,115 @@ void value_of_program_k(ast_program_t prgm) {
     env = e;
     exp = prgm->exp;
     bc = NULL;
+    flat = NULL;
     trampoline();
-    print_exp_val(val);
+    if (!proc_quiet) {
+        print_exp_val(val);
+    }
     exp_val_free(val);
     end_cont_free(cont);
+    cont = NULL;
     env_pop(e);
 }
 
+void value_of_program_flat(ast_flat_t prgm) {
+    env_t e = empty_env();
+    cont = new_end_cont();
+    env = e;
+    exp = FLAT_NODE(0);
+    bc = NULL;
+    flat = prgm;
+    trampoline();
+    if (!proc_quiet) {
+        print_exp_val(val);
+    }
+    exp_val_free(val);
+    end_cont_free(cont);
+    cont = NULL;
+    env_pop(e);
+    flat = NULL;
+}
+
+/* runs a flat program while counting into prof; only the flat engine
+ * counts, since it has a dense index for every node */
+void value_of_program_counted(node_profile_t prof) {
+    nprof = prof;
+    value_of_program_flat(prof->flat);
+    nprof = NULL;
+    node_profile_settle(prof);
+}
+
+guest_stack_t engine_call_stack;
+
+/*
+ * The procedures of the APPLY_PROC2_CONT frames on the continuation chain,
+ * innermost call first. Only reads the chain, so the sampling profiler can
+ * call it from a signal handler: the cont register always moves off a frame
+ * before the frame is freed, and a frame's procedure outlives the frame.
+ */
+int guest_call_stack(guest_frame_s *frames, int max, int *more) {
+    if (engine_call_stack) {
+        return engine_call_stack(frames, max, more);
+    }
+    int n = 0;
+    continuation_t c = cont;
+    *more = 0;
+    while (c && c->type != END_CONT) {
+        switch (c->type) {
+            case ZERO1_CONT: c = ((zero1_cont_t)c)->cont; break;
+            case LET_CONT: c = ((let_cont_t)c)->cont; break;
+            case IF_TEST_CONT: c = ((if_test_cont_t)c)->cont; break;
+            case DIFF1_CONT: c = ((diff1_cont_t)c)->cont; break;
+            case DIFF2_CONT: c = ((diff2_cont_t)c)->cont; break;
+            case RATOR_CONT: c = ((rator_cont_t)c)->cont; break;
+            case RAND_CONT: c = ((rand_cont_t)c)->cont; break;
+            case LET2_CONT: c = ((let2_cont_t)c)->cont; break;
+            case LETREC_CONT: c = ((letrec_cont_t)c)->cont; break;
+            case APPLY_PROC_CONT: c = ((apply_proc_cont_t)c)->cont; break;
+            case APPLY_PROC2_CONT: {
+                if (n == max) {
+                    *more = 1;
+                    return n;
+                }
+                proc_t p = ((apply_proc2_cont_t)c)->proc;
+                frames[n].name = p->name;
+                frames[n].line = p->line;
+                n += 1;
+                c = ((apply_proc2_cont_t)c)->cont;
+                break;
+            }
+            default: return n;
+        }
+    }
+    return n;
+}
+
 void trampoline() {
     compute_value();
+    trampoline_loop(bc);
+}
+
+/* the bounce loop on its own, so that proc_micro can time a bounce without
+ * an interpreter step inside it */
+void trampoline_loop(bounce_s first) {
+    bc = first;
     while (bc != NULL) {
+        STATS_INC(bounces);
+        PROC_PROBE0(bounce);
         bc();
     }
 }
 
+void trampoline_set(bounce_s next) {
+    bc = next;
+}
+
 void compute_value() {
 VALUE_OF_K: {
+        if (flat) {
+            goto VALUE_OF_FLAT;
+        }
+        STATS_INC(steps[exp->type]);
         switch (exp->type) {
             case CONST_EXP: {
                 ast_const_t cexp = (ast_const_t)exp;
@@ -1122,12 +1345,12 @@ VALUE_OF_K: {
             }
             case PROC_EXP: {
                 ast_proc_t pexp = (ast_proc_t)exp;
-                val = new_proc_val(new_proc(pexp->var, pexp->body, env));
+                val = new_proc_val(new_proc(pexp->var, pexp->body, env, pexp->name, pexp->line));
                 goto APPLY_CONT;
             }
             case LETREC_EXP: {
                 ast_letrec_t lexp = (ast_letrec_t)exp;
-                env = extend_env_rec(lexp->p_name, lexp->p_var, lexp->p_body, env);
+                env = extend_env_rec(lexp->p_name, lexp->p_var, lexp->p_body, lexp->line, env);
                 cont = new_letrec_cont(env, cont);
                 exp = lexp->letrec_body;
                 goto VALUE_OF_K;
@@ -1162,6 +1385,88 @@ VALUE_OF_K: {
                 exp = cexp->rator;
                 goto VALUE_OF_K;
             }
+            /* superinstructions: operands are variables or constants, so
+             * each one finishes in this dispatch without a continuation */
+            case DEC_VAR_EXP: {
+                ast_fused_t fexp = (ast_fused_t)exp;
+                val = new_int_val(expval_to_int(apply_env(env, fexp->var1)) - fexp->num);
+                goto APPLY_CONT;
+            }
+            case NEG_VAR_EXP: {
+                ast_fused_t fexp = (ast_fused_t)exp;
+                val = new_int_val(0 - expval_to_int(apply_env(env, fexp->var1)));
+                goto APPLY_CONT;
+            }
+            case ADD_VARS_EXP: {
+                ast_fused_t fexp = (ast_fused_t)exp;
+                int x = expval_to_int(apply_env(env, fexp->var1));
+                int y = expval_to_int(apply_env(env, fexp->var2));
+                val = new_int_val(x - (0 - y));
+                goto APPLY_CONT;
+            }
+            case ZERO_VAR_EXP: {
+                ast_fused_t fexp = (ast_fused_t)exp;
+                val = new_bool_val(expval_to_int(apply_env(env, fexp->var1)) == 0 ? TRUE : FALSE);
+                goto APPLY_CONT;
+            }
+            case IF_ZERO_VAR_EXP: {
+                ast_fused_t fexp = (ast_fused_t)exp;
+                exp = expval_to_int(apply_env(env, fexp->var1)) == 0 ? fexp->exp1 : fexp->exp2;
+                goto VALUE_OF_K;
+            }
+            case CALL_VARS_EXP:
+            case CALL_DEC_VAR_EXP: {
+                /* as RAND_CONT would, once the rator and the rand are in */
+                ast_fused_t fexp = (ast_fused_t)exp;
+                exp_val_t rator = copy_exp_val(apply_env(env, fexp->var1));
+                if (exp->type == CALL_VARS_EXP) {
+                    val = copy_exp_val(apply_env(env, fexp->var2));
+                } else {
+                    val = new_int_val(expval_to_int(apply_env(env, fexp->var2)) - fexp->num);
+                }
+                cont = new_apply_proc_cont(rator, val, env, cont);
+                proc1 = expval_to_proc(rator);
+                bc = apply_procedure_k;
+                return;
+            }
+            case CALL_CURRIED_EXP: {
+                /* the calls as they were unless var1 is a chain of num procs */
+                ast_fused_t fexp = (ast_fused_t)exp;
+                exp_val_t f = apply_env(env, fexp->var1);
+                ast_node_t body = f->type == PROC_VAL ? f->val.pv->body : NULL;
+                int depth = 1;
+                while (depth < fexp->num && body && body->type == PROC_EXP) {
+                    body = ((ast_proc_t)body)->body;
+                    depth += 1;
+                }
+                if (depth < fexp->num) {
+                    exp = fexp->exp1;
+                    goto VALUE_OF_K;
+                }
+                /* operands in order, found from the innermost call out */
+                ast_node_t rands[CURRY_MAX];
+                ast_node_t c = fexp->exp1;
+                for (int i = fexp->num - 1; i >= 0; --i) {
+                    rands[i] = ((ast_call_t)c)->rand;
+                    c = ((ast_call_t)c)->rator;
+                }
+                exp_val_t rator = copy_exp_val(f);
+                for (int i = 0; i < fexp->num; ++i) {
+                    exp_val_t v = rands[i]->type == CONST_EXP ?
+                        new_int_val(((ast_const_t)rands[i])->num) :
+                        copy_exp_val(apply_env(env, ((ast_var_t)rands[i])->var));
+                    if (i == 0) {
+                        val = v;
+                    } else {
+                        curried[i - 1] = v;
+                    }
+                }
+                ncurried = fexp->num - 1;
+                cont = new_apply_proc_cont(rator, val, env, cont);
+                proc1 = expval_to_proc(rator);
+                bc = apply_curried_k;
+                return;
+            }
             default: {
                 fprintf(stderr, "unknown type of expression: %d\n", exp->type);
                 exit(1);
@@ -1169,10 +1474,74 @@ VALUE_OF_K: {
         }
     }
 
+VALUE_OF_FLAT: {
+        uint32_t i = FLAT_INDEX(exp);
+        const uint32_t *kids = flat->kids + 2 * i;
+        STATS_INC(steps[flat->kind[i]]);
+        if (nprof) {
+            nprof->counts[i].hits += 1;
+        }
+        switch (flat->kind[i]) {
+            case CONST_EXP: {
+                val = new_int_val(flat->payload[i]);
+                goto APPLY_CONT;
+            }
+            case VAR_EXP: {
+                val = copy_exp_val(apply_env(env, flat->syms[flat->payload[i]]));
+                goto APPLY_CONT;
+            }
+            case PROC_EXP: {
+                symbol_t name = kids[0] == FLAT_NO_SYMBOL ? NULL : flat->syms[kids[0]];
+                val = new_proc_val(new_proc(flat->syms[flat->payload[i]], FLAT_NODE(i + 1), env,
+                                            name, flat->line[i]));
+                goto APPLY_CONT;
+            }
+            case LETREC_EXP: {
+                env = extend_env_rec(flat->syms[flat->payload[i]], flat->syms[kids[1]],
+                                     FLAT_NODE(kids[0]), flat->line[i], env);
+                cont = new_letrec_cont(env, cont);
+                exp = FLAT_NODE(i + 1);
+                goto VALUE_OF_K;
+            }
+            case ZERO_EXP: {
+                cont = new_zero1_cont(cont);
+                exp = FLAT_NODE(i + 1);
+                goto VALUE_OF_K;
+            }
+            case IF_EXP: {
+                cont = new_if_test_cont(FLAT_NODE(kids[0]), FLAT_NODE(kids[1]), env, cont);
+                exp = FLAT_NODE(i + 1);
+                goto VALUE_OF_K;
+            }
+            case LET_EXP: {
+                cont = new_let_cont(flat->syms[flat->payload[i]], FLAT_NODE(kids[0]), env, cont);
+                exp = FLAT_NODE(i + 1);
+                goto VALUE_OF_K;
+            }
+            case DIFF_EXP: {
+                cont = new_diff1_cont(FLAT_NODE(kids[0]), env, cont);
+                exp = FLAT_NODE(i + 1);
+                goto VALUE_OF_K;
+            }
+            case CALL_EXP: {
+                cont = new_rator_cont(FLAT_NODE(kids[0]), env, cont);
+                exp = FLAT_NODE(i + 1);
+                goto VALUE_OF_K;
+            }
+            default: {
+                fprintf(stderr, "unknown type of expression: %d\n", flat->kind[i]);
+                exit(1);
+            }
+        }
+    }
+
 APPLY_CONT: {
+        STATS_INC(conts[cont->type]);
         switch(cont->type) {
             case END_CONT: {
-                printf("End of computation.\n");
+                if (!proc_quiet) {
+                    printf("End of computation.\n");
+                }
                 bc = NULL;
                 return;
             }
@@ -1254,6 +1623,16 @@ APPLY_CONT: {
             }
             case RATOR_CONT: {
                 rator_cont_t rtc = (rator_cont_t)cont;
+                if (nprof) {
+                    /* the rator has just been evaluated, rtc->exp is the rand */
+                    node_counts_t c = &nprof->counts[nprof->parent[FLAT_INDEX(rtc->exp)]];
+                    c->rator[val->type] += 1;
+                    if (val->type == PROC_VAL) {
+                        uint32_t body = FLAT_INDEX(val->val.pv->body);
+                        c->callee = c->callee == NODE_CALLEE_NONE || c->callee == body ?
+                            body : NODE_CALLEE_MANY;
+                    }
+                }
                 cont = new_rand_cont(val, rtc->cont);
                 env = rtc->env;
                 exp = rtc->exp;
@@ -1279,6 +1658,8 @@ APPLY_CONT: {
             }
             case APPLY_PROC2_CONT: {
                 apply_proc2_cont_t ap2c = (apply_proc2_cont_t)cont;
+                TRACE_END(proc_name(ap2c->proc));
+                PROC_PROBE1(call_return, proc_name(ap2c->proc));
                 env = env_pop(ap2c->env);
                 cont = ap2c->cont;
                 apply_proc2_cont_free(ap2c);
@@ -1293,16 +1674,80 @@ APPLY_CONT: {
 }
 
 void apply_procedure_k() {
+    PROC_PROBE3(call_entry, proc_name(proc1), proc1->line,
+                val->type == NUM_VAL ? (long)val->val.iv : 0L);
+    TRACE_BEGIN(proc_name(proc1), proc1->line,
+                val->type == NUM_VAL ? "arg" : NULL, val->type == NUM_VAL ? val->val.iv : 0);
     env = extend_env(proc1->id, copy_exp_val(val), proc1->env);
-    cont = new_apply_proc2_cont(env, cont);
+    cont = new_apply_proc2_cont(proc1, env, cont);
     exp = proc1->body;
     compute_value();
 }
 
+/*
+ * apply_procedure_k for a call_curried node: the body of proc1 is a chain
+ * of at least ncurried more procs, so each of those binds its operand in a
+ * frame under the call, as a let would, and the body of the last one runs
+ * in the env the curried calls would have built.
+ */
+void apply_curried_k() {
+    PROC_PROBE3(call_entry, proc_name(proc1), proc1->line,
+                val->type == NUM_VAL ? (long)val->val.iv : 0L);
+    TRACE_BEGIN(proc_name(proc1), proc1->line,
+                val->type == NUM_VAL ? "arg" : NULL, val->type == NUM_VAL ? val->val.iv : 0);
+    env = extend_env(proc1->id, copy_exp_val(val), proc1->env);
+    cont = new_apply_proc2_cont(proc1, env, cont);
+    exp = proc1->body;
+    for (int i = 0; i < ncurried; ++i) {
+        ast_proc_t pexp = (ast_proc_t)exp;
+        env = extend_env(pexp->var, curried[i], env);
+        cont = new_let2_cont(env, cont);
+        exp = pexp->body;
+    }
+    ncurried = 0;
+    compute_value();
+}
+
+char *read_file(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "cannot open %s\n", path);
+        exit(1);
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *buf = malloc(size + 1);
+    if (buf && fread(buf, 1, size, fp) == (size_t)size) {
+        buf[size] = '\0';
+        fclose(fp);
+        return buf;
+    } else {
+        fprintf(stderr, "failed to read %s\n", path);
+        exit(1);
+    }
+}
+
+/*
+ * Writes the text between nodes of a dump, and the indentation of the
+ * next line when it ends one. Indentation stops growing at DUMP_INDENT
+ * levels, so a chain of nested forms prints in time and space linear in
+ * its length rather than in the square of it.
+ */
+#define DUMP_INDENT 32
+
+void dump_text(FILE *fp, const char *text, int indent) {
+    fputs(text, fp);
+    if (text[0] && text[strlen(text) - 1] == '\n') {
+        fprintf(fp, "%*s", 2 * (indent < DUMP_INDENT ? indent : DUMP_INDENT), "");
+    }
+}
+
 ast_program_t proc_parse(const char *string) {
     yyscan_t scaninfo = NULL;
     ast_program_t prgm = NULL;
     YY_BUFFER_STATE bp;
+    PROC_PROBE2(parse_start, string, (long)strlen(string));
     if (yylex_init_extra(symtab, &scaninfo) == 0) {
         bp = yy_scan_string(string, scaninfo);
         yy_switch_to_buffer(bp, scaninfo);
@@ -1311,6 +1756,7 @@ ast_program_t proc_parse(const char *string) {
             yy_flush_buffer(bp, scaninfo);
             yy_delete_buffer(bp, scaninfo);
             yylex_destroy(scaninfo);
+            PROC_PROBE1(parse_end, prgm);
             return prgm;
         } else {
             exit(1);
@@ -1321,14 +1767,6 @@ ast_program_t proc_parse(const char *string) {
     }
 }
 
-void run(const char *string) {
-    memset(symtab, 0x00, sizeof(symtab));
-    ast_program_t prgm = proc_parse(string);
-    value_of_program_k(prgm);
-    ast_program_free(prgm);
-    symbol_table_free(symtab);
-}
-
 void report_exp_val_malloc_fail(const char *val_type) {
     fprintf(stderr, "failed to create a new %s exp value!\n", val_type);
 }
@@ -1348,34 +1786,3 @@ void report_invalid_env(env_t env) {
 void report_cont_build_fail(const char* name) {
     fprintf(stderr, "failed to create a new %s continuation!\n", name);
 }
-
-int main(int argc, char *argv[]) {
-    const char *programs[] = {
-        "3",
-        "-(3,2)",
-        "let x = 3 in x",
-        "let x = 3 in -(3, x)",
-        "proc (x) -(x, 1)",
-        "(proc (x) -(x, 1) 3)",
-        "let f = proc (x) -(x, 1) in (f 3)",
-        "let x = 3 in let f = proc (x) -(x, 1) in (f x)",
-        "((proc (x) proc (y) -(y,-(0,x)) 3) 4)",
-        "letrec double (x) = if zero?(x) then 0"
-        " else -((double -(x,1)),-2)"
-        " in (double 5000)",
-        "letrec double (x) = if zero?(x) then 0"
-        " else -((double -(x,1)),-2)"
-        " in double",
-        "(((proc (x) proc (y) proc (z) -(z,-(0,-(y,-(0,x)))) 3) 4) 5)",
-        "-(let f = proc (x) proc (y) proc (z) -(z,-(0,-(y,-(0,x)))) in (((f 3) 4) 5), 3)",
-        "let f = letrec g (x) = if zero?(x) then 0 else -((g -(x, 1)),-2) in g in (f 2)",
-        "-(2, let y = 13 in letrec g (x) = if zero?(x) then 0 else -((g -(x, 1)),-2) in (g y))",
-    };
-    for (int i = 0; i < sizeof(programs)/ sizeof(*programs); ++i) {
-        clock_t t1 = clock();
-        run(programs[i]);
-        clock_t t2 = clock();
-        printf("CPU time: %ld\n", (long)(t2 - t1));
-    }
-    return 0;
-}
@@ -1,6 +1,10 @@
 #ifndef __PROC_LANG_H__
 #define __PROC_LANG_H__
 
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+
 /* symbol */
 typedef struct symbol_s {
     char *name;
@@ -11,9 +15,17 @@ void symbol_free(symbol_t sym);
 
 /* simple symtab of fixed size */
 #define NHASH 9997
-symbol_s symtab[NHASH];
+extern symbol_s symtab[NHASH];
 void symbol_table_free(symbol_t table);
 symbol_t symbol_lookup(symbol_t table, char *name);
+unsigned symbol_hash(const char *name, size_t len);
+symbol_t symbol_lookup_len(symbol_t table, const char *name, size_t len, unsigned hash);
+/* names made by passes live beside symtab and are freed with it; every
+ * symbol of either kind has an index below symbol_count(), sym - symtab
+ * for an interned one */
+symbol_t symbol_gensym(const char *name);
+size_t symbol_index(symbol_t sym);
+size_t symbol_count(void);
 
 /* abstract tree */
 typedef enum {
@@ -25,7 +37,16 @@ typedef enum {
     IF_EXP,
     LET_EXP,
     DIFF_EXP,
-    CALL_EXP
+    CALL_EXP,
+    /* superinstructions, only made by ast_fuse for the tree engine */
+    DEC_VAR_EXP,      /* -(var1, num) */
+    NEG_VAR_EXP,      /* -(0, var1) */
+    ADD_VARS_EXP,     /* -(var1, -(0, var2)) */
+    ZERO_VAR_EXP,     /* zero?(var1) */
+    IF_ZERO_VAR_EXP,  /* if zero?(var1) then exp1 else exp2 */
+    CALL_VARS_EXP,    /* (var1 var2) */
+    CALL_DEC_VAR_EXP, /* (var1 -(var2, num)) */
+    CALL_CURRIED_EXP  /* (((var1 a) b) ...) of num operands, exp1 the calls */
 } exp_type;
 
 typedef struct ast_node_s {
@@ -36,29 +57,157 @@ typedef struct ast_program_s {
     ast_node_t exp;
 } ast_program_s, *ast_program_t;
 
+typedef struct ast_const_s {
+    exp_type type;
+    int num;
+} ast_const_s, *ast_const_t;
+
+typedef struct ast_var_s {
+    exp_type type;
+    symbol_t var;
+} ast_var_s, *ast_var_t;
+
+typedef struct ast_proc_s {
+    exp_type type;
+    symbol_t var;
+    ast_node_t body;
+    symbol_t name; /* set when the proc is bound directly by a let */
+    int line;
+} ast_proc_s, *ast_proc_t;
+
+typedef struct ast_letrec_s {
+    exp_type type;
+    symbol_t p_name;
+    symbol_t p_var;
+    ast_node_t p_body;
+    ast_node_t letrec_body;
+    int line;
+} ast_letrec_s, *ast_letrec_t;
+
+typedef struct ast_zero_s {
+    exp_type type;
+    ast_node_t exp1;
+} ast_zero_s, *ast_zero_t;
+
+typedef struct ast_if_s {
+    exp_type type;
+    ast_node_t cond;
+    ast_node_t exp1;
+    ast_node_t exp2;
+} ast_if_s, *ast_if_t;
+
+typedef struct ast_let_s {
+    exp_type type;
+    symbol_t id;
+    ast_node_t exp1;
+    ast_node_t exp2;
+} ast_let_s, *ast_let_t;
+
+typedef struct ast_diff_s {
+    exp_type type;
+    ast_node_t exp1;
+    ast_node_t exp2;
+} ast_diff_s, *ast_diff_t;
+
+typedef struct ast_call_s {
+    exp_type type;
+    ast_node_t rator;
+    ast_node_t rand;
+} ast_call_s, *ast_call_t;
+
+/* one layout for every superinstruction, see exp_type for the fields
+ * each of them uses */
+typedef struct ast_fused_s {
+    exp_type type;
+    symbol_t var1;
+    symbol_t var2;
+    int num;
+    ast_node_t exp1;
+    ast_node_t exp2;
+} ast_fused_s, *ast_fused_t;
+
 ast_program_t new_ast_program(ast_node_t exp);
 ast_node_t new_const_node(int num);
 ast_node_t new_var_node(symbol_t id);
-ast_node_t new_proc_node(symbol_t var, ast_node_t body);
+ast_node_t new_proc_node(symbol_t var, ast_node_t body, int line);
 ast_node_t new_letrec_node(symbol_t p_name,
                            symbol_t p_var,
                            ast_node_t p_body,
-                           ast_node_t letrec_body);
+                           ast_node_t letrec_body,
+                           int line);
 ast_node_t new_zero_node(ast_node_t exp);
 ast_node_t new_if_node(ast_node_t cond, ast_node_t exp1, ast_node_t exp2);
 ast_node_t new_let_node(symbol_t id, ast_node_t exp1, ast_node_t exp2);
 ast_node_t new_diff_node(ast_node_t exp1, ast_node_t exp2);
 ast_node_t new_call_node(ast_node_t exp1, ast_node_t exp2);
+ast_node_t new_fused_node(exp_type type, symbol_t var1, symbol_t var2, int num,
+                          ast_node_t exp1, ast_node_t exp2);
 
 void ast_program_free(ast_program_t prgm);
 void ast_free(ast_node_t ast);
 
+/*
+ * flat ast: the same tree as parallel arrays addressed by 32-bit indices,
+ * numbered in evaluation order. The first child of node i is i + 1; later
+ * children are in kids[2 * i] and kids[2 * i + 1]:
+ *   PROC_EXP    payload var,    body i + 1, name symbol in kids[2 * i]
+ *               or FLAT_NO_SYMBOL
+ *   LETREC_EXP  payload p_name, letrec_body i + 1, p_body kids[2 * i],
+ *               p_var symbol in kids[2 * i + 1]
+ *   IF_EXP      cond i + 1, exp1 kids[2 * i], exp2 kids[2 * i + 1]
+ *   LET_EXP     payload id, exp1 i + 1, exp2 kids[2 * i]
+ *   DIFF_EXP    exp1 i + 1, exp2 kids[2 * i]
+ *   CALL_EXP    rator i + 1, rand kids[2 * i]
+ * payload holds the number of a CONST_EXP and symbol indices otherwise.
+ * line holds the source line of PROC_EXP and LETREC_EXP nodes, 0 elsewhere.
+ * The goto engine walks it on every step, and so do images and --count;
+ * the vm, closure, cps and anf compilers walk the pointer tree once to
+ * build forms of their own, and evaluation never sees that tree.
+ */
+#define FLAT_NO_SYMBOL 0xffffffff
+
+typedef struct ast_flat_s {
+    uint32_t count;
+    uint32_t nsyms;
+    uint8_t *kind;
+    uint32_t *kids;
+    int32_t *payload;
+    int32_t *line;
+    symbol_t *syms;
+} ast_flat_s, *ast_flat_t;
+
+/*
+ * superinstruction selection: a mask has bit FUSE_BIT(t) set for each
+ * fused type t that ast_fuse may make, and ast_fuse counts the sites it
+ * rewrote into the statistics. Only the tree engine runs fused nodes; the
+ * flat builder, images and the vm take the plain tree.
+ */
+#define FUSE_FIRST DEC_VAR_EXP
+#define FUSE_LAST CALL_CURRIED_EXP
+#define FUSE_BIT(t) (1u << ((t) - FUSE_FIRST))
+#define FUSE_ALL (FUSE_BIT(FUSE_LAST + 1) - 1)
+#define CURRY_MAX 8  /* most operands a call_curried node takes */
+extern const uint32_t fuse_default;
+int fuse_parse(const char *list, uint32_t *mask);
+void ast_fuse(ast_program_t prgm, uint32_t mask);
+
+ast_flat_t ast_flat_new(ast_program_t prgm);
+void ast_flat_free(ast_flat_t flat);
+
 /* environment */
 typedef struct env_s *env_t;
 
 /* procedure */
-typedef struct proc_s *proc_t;
-proc_t new_proc(symbol_t id, ast_node_t body, env_t env);
+typedef struct proc_s {
+    symbol_t id;
+    ast_node_t body;
+    env_t env;
+    symbol_t name; /* NULL for an anonymous proc */
+    int line;
+} proc_s, *proc_t;
+
+proc_t new_proc(symbol_t id, ast_node_t body, env_t env, symbol_t name, int line);
+const char *proc_name(proc_t p);
 void proc_free(proc_t p);
 
 /* expressed value */
@@ -93,9 +242,11 @@ typedef enum {
 
 env_t empty_env();
 env_t extend_env(symbol_t var, exp_val_t val, env_t env);
-env_t extend_env_rec(symbol_t p_name, symbol_t p_var, ast_node_t p_body, env_t env);
+env_t extend_env_rec(symbol_t p_name, symbol_t p_var, ast_node_t p_body, int line, env_t env);
 exp_val_t apply_env(env_t env, symbol_t var);
 env_t env_pop(env_t env);
+env_t env_copy(env_t env);
+env_t env_copy_iter(env_t env);
 
 /* continuation */
 typedef enum {
@@ -114,6 +265,19 @@ typedef enum {
 } CONT_TYPE;
 
 typedef struct continuation_s *continuation_t;
+continuation_t new_end_cont();
+continuation_t new_zero1_cont(continuation_t cont);
+continuation_t new_let_cont(symbol_t var, ast_node_t body, env_t env, continuation_t cont);
+continuation_t new_if_test_cont(ast_node_t exp2, ast_node_t exp3, env_t env, continuation_t cont);
+continuation_t new_diff1_cont(ast_node_t exp2, env_t env, continuation_t cont);
+continuation_t new_diff2_cont(exp_val_t val, continuation_t cont);
+continuation_t new_rator_cont(ast_node_t exp, env_t env, continuation_t cont);
+continuation_t new_rand_cont(exp_val_t val, continuation_t cont);
+continuation_t new_letrec_cont(env_t env, continuation_t cont);
+continuation_t new_let2_cont(env_t env, continuation_t cont);
+continuation_t new_apply_proc_cont(exp_val_t rator, exp_val_t rand, env_t env, continuation_t cont);
+continuation_t new_apply_proc2_cont(proc_t proc, env_t env, continuation_t cont);
+void cont_free(continuation_t cont);
 
 /* bounce */
 typedef void(*bounce_s)();
@@ -127,8 +291,299 @@ void value_of_program(ast_program_t prgm);
 void value_of_k();
 void apply_cont();
 void apply_procedure_k();
+void apply_curried_k();
 void trampoline();
+void trampoline_loop(bounce_s first);
+void trampoline_set(bounce_s next);
 void value_of_program_k(ast_program_t prgm);
+void value_of_program_flat(ast_flat_t prgm);
+extern int proc_quiet;
+ast_program_t proc_parse(const char *string);
+char *read_file(const char *path);
+/* text of a dump, indented when it ends a line, for the cps and anf dumps */
+void dump_text(FILE *fp, const char *text, int indent);
+
+/* one guest call as the sampling profiler records it, innermost first */
+typedef struct guest_frame_s {
+    symbol_t name;  /* NULL for an anonymous proc */
+    int line;
+} guest_frame_s;
+typedef int (*guest_stack_t)(guest_frame_s *frames, int max, int *more);
+/* the calls running now, read from a signal handler: the tree engine's
+ * continuation chain, or the stack of whichever engine set
+ * engine_call_stack for as long as it runs */
+extern guest_stack_t engine_call_stack;
+int guest_call_stack(guest_frame_s *frames, int max, int *more);
+
+/* binary ast image */
+typedef struct ast_image_s *ast_image_t;
+int ast_image_write(ast_program_t prgm, const char *path);
+ast_image_t ast_image_open(const char *path);
+void ast_image_close(ast_image_t img);
+void value_of_image(ast_image_t img);
+
+/* closure compilation: every node compiled once into a C function with
+ * its operands decoded, run by a trampoline over env_t and exp_val_t */
+typedef struct cc_program_s *cc_program_t;
+cc_program_t cc_compile(ast_program_t prgm);
+void cc_program_free(cc_program_t prog);
+void value_of_program_cc(cc_program_t prog);
+
+/* cps conversion: the program in continuation-passing style, where every
+ * call is a tail call, and a loop that runs it without a continuation */
+typedef struct cps_program_s *cps_program_t;
+cps_program_t cps_convert(ast_program_t prgm);
+void cps_program_free(cps_program_t prog);
+void cps_program_dump(cps_program_t prog, FILE *fp);
+void value_of_program_cps(cps_program_t prog);
+
+/*
+ * a-normal form: every intermediate result let-bound and every operand an
+ * atom. A mask has bit ANF_BIT(p) set for each pass p that anf_optimize
+ * runs, and each pass counts its rewrites into the statistics. anf_lower
+ * turns the result back into an ast for any engine.
+ */
+typedef enum {
+    ANF_FOLD = 0x00,
+    ANF_CSE,
+    ANF_INLINE,
+    ANF_PASS_COUNT
+} anf_pass_t;
+
+#define ANF_BIT(p) (1u << (p))
+typedef struct anf_program_s *anf_program_t;
+extern const uint32_t anf_default;
+const char *anf_pass_name(anf_pass_t pass);
+int anf_parse(const char *list, uint32_t *mask);
+anf_program_t anf_convert(ast_program_t prgm);
+void anf_optimize(anf_program_t prog, uint32_t mask);
+ast_program_t anf_lower(anf_program_t prog);
+void anf_program_dump(anf_program_t prog, FILE *fp);
+void anf_program_free(anf_program_t prog);
+/* the largest proc body, in nodes, that the inliner copies into a call */
+extern uint32_t anf_inline_size;
+/* where the inliner says what it did with each known call, NULL for nowhere */
+extern FILE *anf_report;
+
+/* register vm: the program compiled to three-address code over per-frame
+ * registers, run by a loop of its own */
+typedef struct vm_program_s *vm_program_t;
+vm_program_t vm_compile(ast_program_t prgm);
+void vm_program_free(vm_program_t prog);
+void vm_program_dump(vm_program_t prog, FILE *fp);
+void value_of_program_vm(vm_program_t prog);
+/* calls before a vm function is compiled to machine code, 0 for no jit */
+extern uint32_t vm_jit_threshold;
+/* self tail calls before a vm function's loop is traced, 0 for none */
+extern uint32_t vm_loop_threshold;
+
+/* runtime statistics */
+#define EXP_TYPE_COUNT (FUSE_LAST + 1)
+#define CONT_TYPE_COUNT (APPLY_PROC2_CONT + 1)
+
+typedef struct proc_stats_s {
+    uint64_t steps[EXP_TYPE_COUNT];
+    uint64_t conts[CONT_TYPE_COUNT];
+    uint64_t bounces;
+    uint64_t env_alloc;
+    uint64_t env_free;
+    uint64_t cont_alloc;
+    uint64_t cont_free;
+    uint64_t cont_depth;
+    uint64_t cont_peak;
+    uint64_t copy_exp_val;
+    uint64_t allocs;      /* through heap_alloc */
+    uint64_t alloc_bytes;
+    uint64_t vm_insns;
+    uint64_t vm_frame_peak;
+    uint64_t jit_functions;
+    uint64_t jit_bytes;
+    uint64_t jit_entries;
+    uint64_t loop_traces;
+    uint64_t loop_aborts;
+    uint64_t loop_entries;
+    uint64_t fuse_sites[FUSE_LAST - FUSE_FIRST + 1];
+    uint64_t curried_procs;  /* let or letrec bound proc chains, by ast_fuse */
+    uint64_t curried_full;   /* of those, the ones only ever fully applied */
+    uint64_t anf_rewrites[ANF_PASS_COUNT];
+} proc_stats_s, *proc_stats_t;
+
+extern proc_stats_t proc_stats;
+void proc_stats_enable(int on);
+void proc_stats_reset();
+void proc_stats_print(FILE *fp, int json);
+const char *exp_type_name(exp_type type);
+const char *cont_type_name(CONT_TYPE type);
+
+#define STATS_INC(field) (proc_stats->field += 1)
+#define STATS_CONT_PUSH()                                               \
+    do {                                                                \
+        proc_stats->cont_alloc += 1;                                    \
+        proc_stats->cont_depth += 1;                                    \
+        proc_stats->cont_peak = proc_stats->cont_depth > proc_stats->cont_peak ? \
+            proc_stats->cont_depth : proc_stats->cont_peak;             \
+    } while (0)
+#define STATS_CONT_POP()                                                \
+    do {                                                                \
+        proc_stats->cont_free += 1;                                     \
+        proc_stats->cont_depth -= 1;                                    \
+    } while (0)
+
+/*
+ * per-node execution profile of a flat program. A node is found by its
+ * parent and its position under it, with children numbered in source
+ * order (if: cond 0, then 1, else 2; letrec: p_body 0, letrec_body 1;
+ * let, diff, call: 0 then 1; proc, zero: 0). The file keys each node by
+ * its parent's line and its position; for a reader, the path from the
+ * root is "0" and child k of path p is "p.k".
+ */
+#define NODE_CALLEE_NONE 0xffffffff /* no procedure called yet */
+#define NODE_CALLEE_MANY 0xfffffffe /* more than one procedure called */
+
+typedef struct node_counts_s {
+    uint64_t hits;
+    uint64_t branch[2];           /* IF_EXP: then taken, else taken */
+    uint64_t rator[PROC_VAL + 1]; /* CALL_EXP: rator values by EXP_VAL */
+    uint32_t callee;              /* CALL_EXP: body node of the procedure called */
+} node_counts_s, *node_counts_t;
+
+typedef struct node_profile_s {
+    ast_flat_t flat;
+    uint32_t *parent;
+    uint8_t *pos;       /* source-order position under the parent */
+    node_counts_t counts;
+} node_profile_s, *node_profile_t;
+
+node_profile_t node_profile_new(ast_flat_t flat);
+void node_profile_free(node_profile_t prof);
+int node_profile_write(node_profile_t prof, const char *path);
+node_profile_t node_profile_load(ast_flat_t flat, const char *path);
+node_counts_t node_profile_at(node_profile_t prof, uint32_t i);
+node_counts_t node_profile_find(node_profile_t prof, const char *path);
+uint32_t node_profile_resolve(ast_flat_t flat, const char *path);
+int node_profile_path(node_profile_t prof, uint32_t i, char *buf, size_t len);
+void node_profile_settle(node_profile_t prof);
+void node_profile_report(node_profile_t prof, FILE *fp, int top);
+void value_of_program_counted(node_profile_t prof);
+
+/* allocation-site heap profile */
+typedef enum {
+    HEAP_NEW_BOOL_VAL = 0x00,
+    HEAP_NEW_INT_VAL,
+    HEAP_NEW_PROC_VAL,
+    HEAP_COPY_EXP_VAL,
+    HEAP_NEW_PROC,
+    HEAP_EMPTY_ENV,
+    HEAP_EXTEND_ENV,
+    HEAP_EXTEND_ENV_REC,
+    HEAP_ENV_COPY_ITER,
+    HEAP_NEW_END_CONT,
+    HEAP_NEW_ZERO1_CONT,
+    HEAP_NEW_LET_CONT,
+    HEAP_NEW_IF_TEST_CONT,
+    HEAP_NEW_DIFF1_CONT,
+    HEAP_NEW_DIFF2_CONT,
+    HEAP_NEW_RATOR_CONT,
+    HEAP_NEW_RAND_CONT,
+    HEAP_NEW_LETREC_CONT,
+    HEAP_NEW_LET2_CONT,
+    HEAP_NEW_APPLY_PROC_CONT,
+    HEAP_NEW_APPLY_PROC2_CONT,
+    HEAP_VM_CLOSURE,
+    HEAP_CPS_CLOSURE,
+    HEAP_CPS_ENV,
+    HEAP_SITE_COUNT
+} heap_site_t;
+
+#ifdef PROC_HEAP_PROFILE
+void *heap_alloc(heap_site_t site, size_t size);
+void heap_free(void *p);
+#else
+#define heap_alloc(site, size)                                          \
+    (proc_stats->allocs += 1, proc_stats->alloc_bytes += (size), malloc(size))
+#define heap_free(p) free(p)
+#endif
+void heap_profile_start(uint64_t every);
+void heap_profile_report(FILE *fp, const char *title);
+uint64_t heap_profile_allocs();
+uint64_t heap_profile_peak_bytes();
+
+/* sampling profiler: guest call stacks in folded format for flame graphs */
+void sample_profile_start(const char *path, int hz);
+void sample_profile_collect();
+
+/* hardware performance counters around evaluation */
+typedef enum {
+    PERF_CTR_CYCLES = 0x00,
+    PERF_CTR_INSTRUCTIONS,
+    PERF_CTR_BRANCH_MISSES,
+    PERF_CTR_L1D_MISSES,
+    PERF_CTR_LLC_MISSES,
+    PERF_CTR_DTLB_MISSES,
+    PERF_CTR_COUNT
+} perf_counter_t;
+
+typedef struct perf_sample_s {
+    uint64_t value[PERF_CTR_COUNT];
+    int valid[PERF_CTR_COUNT];
+} perf_sample_s, *perf_sample_t;
+
+int perf_counters_open();
+void perf_counters_close();
+void perf_counters_start();
+void perf_counters_stop(perf_sample_t s);
+void perf_counters_print(FILE *fp, const char *label, perf_sample_t s);
+const char *perf_counter_name(perf_counter_t c);
+
+/* chrome trace_event export: guest calls and interpreter phases as
+ * begin/end events, written by a background flusher */
+extern int trace_on;
+void trace_start(const char *path);
+void trace_stop();
+void trace_begin(const char *name, int line, const char *arg_name, long arg);
+void trace_end(const char *name);
+
+#define TRACE_BEGIN(name, line, arg_name, arg)                          \
+    do {                                                                \
+        if (trace_on) {                                                 \
+            trace_begin(name, line, arg_name, arg);                     \
+        }                                                               \
+    } while (0)
+#define TRACE_END(name)                                                 \
+    do {                                                                \
+        if (trace_on) {                                                 \
+            trace_end(name);                                            \
+        }                                                               \
+    } while (0)
+
+/*
+ * USDT probes, compiled in with -DPROC_USDT=ON and free when no tracer is
+ * attached. All belong to the provider "proc":
+ *   call_entry   char *name, int line, long arg   guest procedure entry;
+ *                                                 arg is 0 unless a number
+ *   call_return  char *name                       guest procedure exit
+ *   bounce                                        trampoline bounce
+ *   env_alloc    void *env, int type              env frame created
+ *   env_free     void *env                        env frame released
+ *   cont_push    void *cont, int type             continuation created
+ *   cont_pop     void *cont, int type             continuation released
+ *   parse_start  char *source, long bytes
+ *   parse_end    void *program
+ * e.g. bpftrace -e 'usdt:./proc:proc:call_entry { @[str(arg0)] = count(); }'
+ * types are the ENV_TYPE and CONT_TYPE values.
+ */
+#ifdef PROC_USDT
+#include <sys/sdt.h>
+#define PROC_PROBE0(name) DTRACE_PROBE(proc, name)
+#define PROC_PROBE1(name, a) DTRACE_PROBE1(proc, name, a)
+#define PROC_PROBE2(name, a, b) DTRACE_PROBE2(proc, name, a, b)
+#define PROC_PROBE3(name, a, b, c) DTRACE_PROBE3(proc, name, a, b, c)
+#else
+#define PROC_PROBE0(name) do { } while (0)
+#define PROC_PROBE1(name, a) do { } while (0)
+#define PROC_PROBE2(name, a, b) do { } while (0)
+#define PROC_PROBE3(name, a, b, c) do { } while (0)
+#endif
 
 /* error reporter */
 void yyerror(void *lex, symbol_t table, ast_program_t *prgm, const char *fmt, ...);
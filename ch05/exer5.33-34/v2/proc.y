@@ -1,11 +1,18 @@
 %{
 #define YYERROR_VERBOSE
+/* nesting is only bounded by memory: the parser stack is grown on the heap
+ * up to this many entries instead of bison's default of 10000 */
+#define YYMAXDEPTH 100000000
 
 #include <stdarg.h>
 #include <stdio.h>
 #include "proc.h"
 #include "proc_parser.h"
+#ifdef PROC_HAND_SCANNER
+#include "proc_lexer.h"
+#else
 #include "proc_scanner.h"
+#endif
 %}
 
 %define api.pure
@@ -52,12 +59,14 @@ const_exp:      NUMBER { $$ = new_const_node($1); }
 var_exp:        IDENTIFIER { $$ = new_var_node($1); }
                 ;
 
-proc_exp:       PROC '(' IDENTIFIER ')' expression
-                { $$ = new_proc_node($3, $5); }
+/* the mid-rule actions take the line of the keyword, before the body is read */
+proc_exp:       PROC { $<num>$ = yyget_lineno(scanner); } '(' IDENTIFIER ')' expression
+                { $$ = new_proc_node($4, $6, $<num>2); }
                 ;
 
-letrec_exp:     LETREC IDENTIFIER '(' IDENTIFIER ')' '=' expression IN expression
-                { $$ = new_letrec_node($2, $4, $7, $9); }
+letrec_exp:     LETREC { $<num>$ = yyget_lineno(scanner); }
+                IDENTIFIER '(' IDENTIFIER ')' '=' expression IN expression
+                { $$ = new_letrec_node($3, $5, $8, $10, $<num>2); }
                 ;
 
 zero_exp:       ZERO '(' expression ')'
@@ -69,7 +78,13 @@ if_exp:         IF expression THEN expression ELSE expression
                 ;
 
 let_exp:        LET IDENTIFIER '=' expression IN expression
-                { $$ = new_let_node($2, $4, $6); }
+                {
+                    /* let f = proc ... names the procedure for the profiler */
+                    if ($4->type == PROC_EXP) {
+                        ((ast_proc_t)$4)->name = $2;
+                    }
+                    $$ = new_let_node($2, $4, $6);
+                }
                 ;
 
 diff_exp:       '-' '(' expression ',' expression ')'
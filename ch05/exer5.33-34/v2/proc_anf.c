@@ -0,0 +1,843 @@
+/* a-normal form: the ir the optimizer passes share, after exercise 6.34 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proc.h"
+#include "proc_anf.h"
+
+/*
+ * anf_convert names every intermediate result with a let, in the order
+ * the tree engine evaluates them, so a pass sees evaluation order in the
+ * let chain instead of in the nesting of the ast. anf_lower turns the
+ * result back into an ast that any engine runs: a let whose variable is
+ * used once, at the first thing its body evaluates, is put back where
+ * the variable is, so a program the passes leave alone comes back as it
+ * went in.
+ *
+ * A let or letrec nested in an operand is hoisted into the chain around
+ * it, and renamed so that it cannot capture a name of the code after it.
+ * A let that would shadow a visible name is renamed too, so that only the
+ * parameters of procs shadow; they are kept, since a procedure prints
+ * with its parameter. An unbound variable ahead of an operand that is
+ * not an atom is let-bound first, so that it is reported first.
+ */
+static const char *anf_pass_names[ANF_PASS_COUNT] = {
+    [ANF_FOLD] = "fold",
+    [ANF_CSE] = "cse",
+    [ANF_INLINE] = "inline",
+};
+
+const uint32_t anf_default = ANF_BIT(ANF_FOLD) | ANF_BIT(ANF_CSE) | ANF_BIT(ANF_INLINE);
+
+const char *anf_pass_name(anf_pass_t pass) {
+    return anf_pass_names[pass];
+}
+
+/* "all", "none" or a comma separated list of pass names */
+int anf_parse(const char *list, uint32_t *mask) {
+    if (strcmp(list, "all") == 0) {
+        *mask = ANF_BIT(ANF_PASS_COUNT) - 1;
+        return 0;
+    } else if (strcmp(list, "none") == 0) {
+        *mask = 0;
+        return 0;
+    }
+    *mask = 0;
+    while (*list) {
+        size_t len = strcspn(list, ",");
+        int p;
+        for (p = 0; p < ANF_PASS_COUNT; ++p) {
+            if (strlen(anf_pass_names[p]) == len && strncmp(anf_pass_names[p], list, len) == 0) {
+                *mask |= ANF_BIT(p);
+                break;
+            }
+        }
+        if (p == ANF_PASS_COUNT) {
+            fprintf(stderr, "unknown anf pass: %.*s\n", (int)len, list);
+            return -1;
+        }
+        list += len;
+        if (*list == ',') {
+            list += 1;
+        }
+    }
+    return 0;
+}
+
+/* inlining first, for the constants it brings into the bodies it copies;
+ * copy propagation after cse turns its hits into plain variables */
+void anf_optimize(anf_program_t prog, uint32_t mask) {
+    if (mask & ANF_BIT(ANF_INLINE)) {
+        anf_inline(prog);
+    }
+    if (mask & ANF_BIT(ANF_FOLD)) {
+        anf_fold(prog);
+    }
+    if (mask & ANF_BIT(ANF_CSE)) {
+        anf_cse(prog);
+        if (mask & ANF_BIT(ANF_FOLD)) {
+            anf_fold(prog);
+        }
+    }
+}
+
+static void report_anf_malloc_fail(const char *what) {
+    fprintf(stderr, "failed to grow anf %s!\n", what);
+    exit(1);
+}
+
+/* grows *array so that one more element of size fits */
+void *anf_grow(void *array, size_t n, size_t *cap, size_t size, const char *what) {
+    if (n == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        array = realloc(array, *cap * size);
+        if (!array) {
+            report_anf_malloc_fail(what);
+        }
+    }
+    return array;
+}
+
+anf_node_t anf_node_new(anf_program_t prog, anf_type_t type) {
+    prog->nodes = anf_grow(prog->nodes, prog->nnodes, &prog->nodes_cap, sizeof(anf_node_t), "nodes");
+    anf_node_t n = calloc(1, sizeof(struct anf_node_s));
+    if (!n) {
+        report_anf_malloc_fail("nodes");
+    }
+    n->type = type;
+    prog->nodes[prog->nnodes++] = n;
+    return n;
+}
+
+/* grows a by-symbol array of *cap elements of size to cover every
+ * symbol made so far, with the new elements zeroed */
+void *anf_by_symbol(void *array, size_t *cap, size_t size, const char *what) {
+    size_t count = symbol_count();
+    if (count > *cap) {
+        size_t grown = *cap * 2 > count ? *cap * 2 : count;
+        array = realloc(array, grown * size);
+        if (!array) {
+            report_anf_malloc_fail(what);
+        }
+        memset((char *)array + *cap * size, 0x00, (grown - *cap) * size);
+        *cap = grown;
+    }
+    return array;
+}
+
+/* a gensym rather than interned, so that a program cannot fill the
+ * table up with them, and freed with the table since the lowered ast
+ * outlives prog; % cannot start or be part of a name of the program,
+ * and a base that is itself fresh gives up its number */
+symbol_t anf_fresh(anf_program_t prog, const char *base) {
+    char name[64];
+    int len = (int)strcspn(base, "%");
+    snprintf(name, sizeof(name), "%.*s%%%u", len < 40 ? len : 40, base, ++prog->fresh);
+    return symbol_gensym(name);
+}
+
+void anf_program_free(anf_program_t prog) {
+    if (prog) {
+        for (size_t i = 0; i < prog->nnodes; ++i) {
+            free(prog->nodes[i]);
+        }
+        free(prog->nodes);
+        free(prog);
+    }
+}
+
+/* converter */
+
+/*
+ * The names in scope, innermost first: orig as the program spells it and
+ * var as it is bound in the ir. Tasks hold scopes as chains, but names
+ * are looked up in arrays by symbol that stand for the chain of the task
+ * being converted; a task's scope extends the one of the task that made
+ * it, and the worklist runs the tasks one made before any older one, so
+ * moving the arrays from one task's chain to the next enters and leaves
+ * each scope once.
+ */
+typedef struct anf_scope_s *anf_scope_t;
+struct anf_scope_s {
+    symbol_t orig;
+    symbol_t var;
+    anf_scope_t up;
+    size_t depth;
+    symbol_t hidden;  /* what orig resolved to before this scope */
+};
+
+typedef enum {
+    TASK_EXP = 0x00,  /* exp into slot */
+    TASK_TAIL,        /* exp at the cursor, as its value */
+    TASK_BIND,        /* exp at the cursor, bound to var */
+    TASK_OPS,         /* exp over ops, once they are atoms */
+    TASK_CURSOR       /* the cursor back to slot */
+} anf_task_kind_t;
+
+typedef struct anf_operand_s {
+    ast_node_t exp;
+    anf_node_t atom;
+} anf_operand_s;
+
+typedef struct anf_task_s {
+    anf_task_kind_t kind;
+    ast_node_t exp;
+    anf_operand_s ops[2];
+    int nops;
+    symbol_t var;      /* what TASK_BIND and TASK_OPS bind, NULL for a value */
+    anf_scope_t scope;
+    anf_node_t *slot;
+} anf_task_s, *anf_task_t;
+
+typedef struct anf_builder_s {
+    anf_program_t prog;
+    anf_task_s *tasks;
+    size_t ntasks;
+    size_t tasks_cap;
+    anf_scope_t *scopes;
+    size_t nscopes;
+    size_t scopes_cap;
+    anf_node_t *cursor;  /* where the next let of the expression goes */
+    anf_scope_t active;  /* the chain the arrays stand for */
+    anf_scope_t *path;
+    size_t path_cap;
+    symbol_t *resolved;  /* by orig: its var in the active chain */
+    size_t resolved_cap;
+    uint32_t *binding;   /* by var: the scopes of the active chain binding it */
+    size_t binding_cap;
+} anf_builder_s, *anf_builder_t;
+
+static anf_scope_t anf_bind(anf_builder_t b, anf_scope_t up, symbol_t orig, symbol_t var) {
+    b->scopes = anf_grow(b->scopes, b->nscopes, &b->scopes_cap, sizeof(anf_scope_t), "scopes");
+    anf_scope_t s = malloc(sizeof(struct anf_scope_s));
+    if (!s) {
+        report_anf_malloc_fail("scopes");
+    }
+    s->orig = orig;
+    s->var = var;
+    s->up = up;
+    s->depth = up ? up->depth + 1 : 1;
+    s->hidden = NULL;
+    b->scopes[b->nscopes++] = s;
+    if (symbol_count() > b->binding_cap) {
+        b->binding = anf_by_symbol(b->binding, &b->binding_cap, sizeof(uint32_t), "scopes");
+    }
+    return s;
+}
+
+static void anf_scope_enter(anf_builder_t b, anf_scope_t s) {
+    size_t orig = ANF_SYM(s->orig);
+    s->hidden = b->resolved[orig];
+    b->resolved[orig] = s->var;
+    b->binding[ANF_SYM(s->var)] += 1;
+}
+
+static void anf_scope_leave(anf_builder_t b, anf_scope_t s) {
+    b->resolved[ANF_SYM(s->orig)] = s->hidden;
+    b->binding[ANF_SYM(s->var)] -= 1;
+}
+
+/* the arrays made to stand for the chain of to */
+static void anf_activate(anf_builder_t b, anf_scope_t scope) {
+    anf_scope_t from = b->active, to = scope;
+    size_t n = 0;
+    while (from && (!to || from->depth > to->depth)) {
+        anf_scope_leave(b, from);
+        from = from->up;
+    }
+    while (to && (!from || to->depth > from->depth)) {
+        b->path = anf_grow(b->path, n, &b->path_cap, sizeof(anf_scope_t), "scopes");
+        b->path[n++] = to;
+        to = to->up;
+    }
+    while (from != to) {
+        anf_scope_leave(b, from);
+        from = from->up;
+        b->path = anf_grow(b->path, n, &b->path_cap, sizeof(anf_scope_t), "scopes");
+        b->path[n++] = to;
+        to = to->up;
+    }
+    while (n > 0) {
+        anf_scope_enter(b, b->path[--n]);
+    }
+    b->active = scope;
+}
+
+/* in the active chain */
+static symbol_t anf_resolve(anf_builder_t b, symbol_t orig) {
+    return b->resolved[ANF_SYM(orig)];
+}
+
+/* the name a let or letrec of orig binds */
+static symbol_t anf_binder(anf_builder_t b, symbol_t orig, int hoisted) {
+    if (!hoisted && b->binding[ANF_SYM(orig)] == 0) {
+        return orig;
+    }
+    return anf_fresh(b->prog, orig->name);
+}
+
+static void anf_push(anf_builder_t b, anf_task_kind_t kind, ast_node_t exp, symbol_t var,
+                     anf_scope_t scope, anf_node_t *slot) {
+    b->tasks = anf_grow(b->tasks, b->ntasks, &b->tasks_cap, sizeof(anf_task_s), "worklist");
+    anf_task_t t = &b->tasks[b->ntasks++];
+    memset(t, 0x00, sizeof(*t));
+    t->kind = kind;
+    t->exp = exp;
+    t->var = var;
+    t->scope = scope;
+    t->slot = slot;
+}
+
+static void anf_push_ops(anf_builder_t b, anf_task_t from, ast_node_t op1, ast_node_t op2) {
+    anf_push(b, TASK_OPS, from->exp, from->var, from->scope, NULL);
+    anf_task_t t = &b->tasks[b->ntasks - 1];
+    t->ops[0].exp = op1;
+    t->ops[1].exp = op2;
+    t->nops = op2 ? 2 : 1;
+}
+
+/* the value at the cursor, or bound to var there */
+static void anf_place(anf_builder_t b, anf_node_t n, symbol_t var) {
+    if (var) {
+        anf_node_t let = anf_node_new(b->prog, ANF_LET);
+        let->var = var;
+        let->a = n;
+        *b->cursor = let;
+        b->cursor = &let->body;
+    } else {
+        *b->cursor = n;
+    }
+}
+
+static int anf_is_atomic(anf_builder_t b, ast_node_t e) {
+    return e->type == CONST_EXP || e->type == PROC_EXP ||
+        (e->type == VAR_EXP && anf_resolve(b, ((ast_var_t)e)->var));
+}
+
+static anf_node_t anf_atom(anf_builder_t b, ast_node_t e, anf_scope_t scope) {
+    switch (e->type) {
+        case CONST_EXP: {
+            anf_node_t n = anf_node_new(b->prog, ANF_CONST);
+            n->num = ((ast_const_t)e)->num;
+            return n;
+        }
+        case VAR_EXP: {
+            symbol_t var = anf_resolve(b, ((ast_var_t)e)->var);
+            anf_node_t n = anf_node_new(b->prog, var ? ANF_VAR : ANF_UNBOUND);
+            n->var = var ? var : ((ast_var_t)e)->var;
+            return n;
+        }
+        case PROC_EXP: {
+            ast_proc_t p = (ast_proc_t)e;
+            anf_node_t n = anf_node_new(b->prog, ANF_PROC);
+            n->var = p->var;
+            n->name = p->name;
+            n->line = p->line;
+            anf_push(b, TASK_EXP, p->body, NULL, anf_bind(b, scope, p->var, p->var), &n->body);
+            return n;
+        }
+        default: {
+            fprintf(stderr, "not an atom: %d\n", e->type);
+            exit(1);
+        }
+    }
+}
+
+/* e in tail position, or bound to t->var */
+static void anf_convert_exp(anf_builder_t b, anf_task_t t) {
+    ast_node_t e = t->exp;
+    switch (e->type) {
+        case CONST_EXP:
+        case VAR_EXP:
+        case PROC_EXP: {
+            anf_place(b, anf_atom(b, e, t->scope), t->var);
+            break;
+        }
+        case LET_EXP: {
+            ast_let_t l = (ast_let_t)e;
+            symbol_t x = anf_binder(b, l->id, t->var != NULL);
+            anf_push(b, t->kind, l->exp2, t->var, anf_bind(b, t->scope, l->id, x), NULL);
+            anf_push(b, TASK_BIND, l->exp1, x, t->scope, NULL);
+            break;
+        }
+        case LETREC_EXP: {
+            ast_letrec_t l = (ast_letrec_t)e;
+            symbol_t f = anf_binder(b, l->p_name, t->var != NULL);
+            anf_scope_t s = anf_bind(b, t->scope, l->p_name, f);
+            anf_node_t n = anf_node_new(b->prog, ANF_LETREC);
+            anf_node_t p = anf_node_new(b->prog, ANF_PROC);
+            n->var = f;
+            n->a = p;
+            p->var = l->p_var;
+            p->name = f;
+            p->line = l->line;
+            *b->cursor = n;
+            b->cursor = &n->body;
+            anf_push(b, t->kind, l->letrec_body, t->var, s, NULL);
+            anf_push(b, TASK_EXP, l->p_body, NULL, anf_bind(b, s, l->p_var, l->p_var), &p->body);
+            break;
+        }
+        case ZERO_EXP: {
+            anf_push_ops(b, t, ((ast_zero_t)e)->exp1, NULL);
+            break;
+        }
+        case IF_EXP: {
+            anf_push_ops(b, t, ((ast_if_t)e)->cond, NULL);
+            break;
+        }
+        case DIFF_EXP: {
+            anf_push_ops(b, t, ((ast_diff_t)e)->exp1, ((ast_diff_t)e)->exp2);
+            break;
+        }
+        case CALL_EXP: {
+            anf_push_ops(b, t, ((ast_call_t)e)->rator, ((ast_call_t)e)->rand);
+            break;
+        }
+        default: {
+            /* superinstructions are made after lowering */
+            fprintf(stderr, "unknown type of expression: %d\n", e->type);
+            exit(1);
+        }
+    }
+}
+
+static void anf_convert_ops(anf_builder_t b, anf_task_t t) {
+    for (int i = 0; i < t->nops; ++i) {
+        ast_node_t e = t->ops[i].exp;
+        if (t->ops[i].atom || anf_is_atomic(b, e)) {
+            continue;
+        }
+        if (e->type == VAR_EXP) {
+            /* unbound: only bound first if something after it is not an
+             * atom, and so would be evaluated before it */
+            int later = 0;
+            for (int j = i + 1; j < t->nops; ++j) {
+                later |= !t->ops[j].atom && t->ops[j].exp->type != VAR_EXP &&
+                    !anf_is_atomic(b, t->ops[j].exp);
+            }
+            if (!later) {
+                continue;
+            }
+        }
+        anf_task_s rest = *t;
+        symbol_t v = anf_fresh(b->prog, "t");
+        rest.ops[i].exp = NULL;
+        rest.ops[i].atom = anf_node_new(b->prog, ANF_VAR);
+        rest.ops[i].atom->var = v;
+        b->tasks = anf_grow(b->tasks, b->ntasks, &b->tasks_cap, sizeof(anf_task_s), "worklist");
+        b->tasks[b->ntasks++] = rest;
+        anf_push(b, TASK_BIND, e, v, t->scope, NULL);
+        return;
+    }
+    anf_node_t ops[2] = { NULL, NULL };
+    for (int i = 0; i < t->nops; ++i) {
+        ops[i] = t->ops[i].atom ? t->ops[i].atom : anf_atom(b, t->ops[i].exp, t->scope);
+    }
+    anf_node_t n = NULL;
+    switch (t->exp->type) {
+        case ZERO_EXP: n = anf_node_new(b->prog, ANF_ZERO); break;
+        case IF_EXP: n = anf_node_new(b->prog, ANF_IF); break;
+        case DIFF_EXP: n = anf_node_new(b->prog, ANF_DIFF); break;
+        case CALL_EXP: n = anf_node_new(b->prog, ANF_CALL); break;
+        default: {
+            fprintf(stderr, "unknown type of expression: %d\n", t->exp->type);
+            exit(1);
+        }
+    }
+    n->a = ops[0];
+    n->b = ops[1];
+    anf_place(b, n, t->var);
+    if (n->type == ANF_IF) {
+        ast_if_t i = (ast_if_t)t->exp;
+        anf_push(b, TASK_EXP, i->exp2, NULL, t->scope, &n->c);
+        anf_push(b, TASK_EXP, i->exp1, NULL, t->scope, &n->b);
+    }
+}
+
+/* with a worklist, like the other tree walks, so that a deep program
+ * cannot overflow the C stack */
+anf_program_t anf_convert(ast_program_t prgm) {
+    anf_program_t prog = calloc(1, sizeof(struct anf_program_s));
+    if (!prog) {
+        report_anf_malloc_fail("program");
+    }
+    anf_builder_s b;
+    memset(&b, 0x00, sizeof(b));
+    b.prog = prog;
+    /* the names of the program are all made by now */
+    b.resolved = anf_by_symbol(NULL, &b.resolved_cap, sizeof(symbol_t), "scopes");
+    b.binding = anf_by_symbol(NULL, &b.binding_cap, sizeof(uint32_t), "scopes");
+    anf_push(&b, TASK_EXP, prgm->exp, NULL, NULL, &prog->root);
+    while (b.ntasks > 0) {
+        anf_task_s t = b.tasks[--b.ntasks];
+        switch (t.kind) {
+            case TASK_EXP: {
+                anf_push(&b, TASK_CURSOR, NULL, NULL, NULL, b.cursor);
+                b.cursor = t.slot;
+                anf_push(&b, TASK_TAIL, t.exp, NULL, t.scope, NULL);
+                break;
+            }
+            case TASK_TAIL:
+            case TASK_BIND: {
+                anf_activate(&b, t.scope);
+                anf_convert_exp(&b, &t);
+                break;
+            }
+            case TASK_OPS: {
+                anf_activate(&b, t.scope);
+                anf_convert_ops(&b, &t);
+                break;
+            }
+            case TASK_CURSOR: b.cursor = t.slot; break;
+        }
+    }
+    for (size_t i = 0; i < b.nscopes; ++i) {
+        free(b.scopes[i]);
+    }
+    free(b.scopes);
+    free(b.tasks);
+    free(b.path);
+    free(b.resolved);
+    free(b.binding);
+    return prog;
+}
+
+/* lowering */
+
+typedef struct anf_lower_s {
+    anf_node_t node;
+    ast_node_t *out;
+    ast_node_t let;  /* the let made for node, to be decided on */
+} anf_lower_s;
+
+/* the uses of every variable, by symbol, with ANF_UNBOUND_USE set for
+ * one that is unbound somewhere */
+#define ANF_UNBOUND_USE 0x80000000u
+
+static uint32_t *anf_count_uses(anf_program_t prog) {
+    uint32_t *uses = calloc(symbol_count(), sizeof(uint32_t));
+    anf_node_t *stack = NULL;
+    size_t n = 0, cap = 0;
+    if (!uses) {
+        report_anf_malloc_fail("uses");
+    }
+    stack = anf_grow(stack, n, &cap, sizeof(anf_node_t), "worklist");
+    stack[n++] = prog->root;
+    while (n > 0) {
+        anf_node_t e = stack[--n];
+        anf_node_t kids[4] = { e->a, e->b, e->c, e->body };
+        if (e->type == ANF_VAR) {
+            uses[ANF_SYM(e->var)] += 1;
+        } else if (e->type == ANF_UNBOUND) {
+            uses[ANF_SYM(e->var)] |= ANF_UNBOUND_USE;
+        }
+        for (int i = 0; i < 4; ++i) {
+            if (kids[i]) {
+                stack = anf_grow(stack, n, &cap, sizeof(anf_node_t), "worklist");
+                stack[n++] = kids[i];
+            }
+        }
+    }
+    free(stack);
+    return uses;
+}
+
+/*
+ * The slot in e of its reference to var, if that is where e first does
+ * anything that can fail or call: evaluation up to it only reads bound
+ * variables and constants and makes procs, so the value of var can be
+ * computed there instead. Binding a name that is unbound elsewhere stops
+ * the search too, since it could capture that name in the value. Walks e in evaluation order; a NULL on the
+ * stack stands for the operation of a node, which happens after its
+ * operands.
+ */
+static ast_node_t *anf_sink_slot(ast_node_t *root, symbol_t var, uint32_t *uses) {
+    ast_node_t **stack = NULL;
+    ast_node_t *found = NULL;
+    size_t n = 0, cap = 0;
+#define ANF_SINK_PUSH(s)                                                 \
+    do {                                                                \
+        stack = anf_grow(stack, n, &cap, sizeof(ast_node_t *), "worklist"); \
+        stack[n++] = (s);                                               \
+    } while (0)
+    ANF_SINK_PUSH(root);
+    while (n > 0 && !found) {
+        ast_node_t *slot = stack[--n];
+        if (!slot) {
+            break;
+        }
+        ast_node_t e = *slot;
+        switch (e->type) {
+            case CONST_EXP:
+            case PROC_EXP:
+                break;
+            case VAR_EXP: {
+                if (((ast_var_t)e)->var == var) {
+                    found = slot;
+                } else if (uses[ANF_SYM(((ast_var_t)e)->var)] & ANF_UNBOUND_USE) {
+                    n = 0;
+                }
+                break;
+            }
+            case ZERO_EXP: {
+                ANF_SINK_PUSH(NULL);
+                ANF_SINK_PUSH(&((ast_zero_t)e)->exp1);
+                break;
+            }
+            case IF_EXP: {
+                ANF_SINK_PUSH(NULL);
+                ANF_SINK_PUSH(&((ast_if_t)e)->cond);
+                break;
+            }
+            case DIFF_EXP: {
+                ANF_SINK_PUSH(NULL);
+                ANF_SINK_PUSH(&((ast_diff_t)e)->exp2);
+                ANF_SINK_PUSH(&((ast_diff_t)e)->exp1);
+                break;
+            }
+            case CALL_EXP: {
+                ANF_SINK_PUSH(NULL);
+                ANF_SINK_PUSH(&((ast_call_t)e)->rand);
+                ANF_SINK_PUSH(&((ast_call_t)e)->rator);
+                break;
+            }
+            case LET_EXP: {
+                ast_let_t l = (ast_let_t)e;
+                ANF_SINK_PUSH(l->id == var || (uses[ANF_SYM(l->id)] & ANF_UNBOUND_USE) ? NULL : &l->exp2);
+                ANF_SINK_PUSH(&l->exp1);
+                break;
+            }
+            case LETREC_EXP: {
+                ast_letrec_t l = (ast_letrec_t)e;
+                ANF_SINK_PUSH(l->p_name == var || (uses[ANF_SYM(l->p_name)] & ANF_UNBOUND_USE) ?
+                              NULL : &l->letrec_body);
+                break;
+            }
+            default: {
+                n = 0;
+                break;
+            }
+        }
+    }
+#undef ANF_SINK_PUSH
+    free(stack);
+    return found;
+}
+
+static int anf_is_pure(anf_node_t n) {
+    return n->type == ANF_CONST || n->type == ANF_BOOL || n->type == ANF_VAR || n->type == ANF_PROC;
+}
+
+/* a let of var decided now that its body is lowered: dropped when var is
+ * not used and its value cannot fail, or sunk into its one use */
+static void anf_lower_let(anf_lower_s *t, uint32_t *uses) {
+    ast_let_t l = (ast_let_t)t->let;
+    anf_node_t n = t->node;
+    if (uses[ANF_SYM(n->var)] == 0 && anf_is_pure(n->a)) {
+        *t->out = l->exp2;
+        ast_free(l->exp1);
+        free(l);
+        return;
+    }
+    /* a proc keeps the name it is profiled by */
+    if (uses[ANF_SYM(n->var)] == 1 && !(n->a->type == ANF_PROC && n->a->name == n->var)) {
+        ast_node_t *slot = anf_sink_slot(&l->exp2, n->var, uses);
+        if (slot) {
+            ast_free(*slot);
+            *slot = l->exp1;
+            *t->out = l->exp2;
+            free(l);
+        }
+    }
+}
+
+ast_program_t anf_lower(anf_program_t prog) {
+    uint32_t *uses = anf_count_uses(prog);
+    anf_lower_s *stack = NULL;
+    size_t n = 0, cap = 0;
+    ast_node_t root = NULL;
+#define ANF_LOWER_PUSH(nd, o, l)                                        \
+    do {                                                                \
+        stack = anf_grow(stack, n, &cap, sizeof(anf_lower_s), "worklist"); \
+        stack[n].node = (nd);                                           \
+        stack[n].out = (o);                                             \
+        stack[n].let = (l);                                             \
+        n += 1;                                                         \
+    } while (0)
+    ANF_LOWER_PUSH(prog->root, &root, NULL);
+    while (n > 0) {
+        anf_lower_s t = stack[--n];
+        anf_node_t e = t.node;
+        if (t.let) {
+            anf_lower_let(&t, uses);
+            continue;
+        }
+        switch (e->type) {
+            case ANF_CONST: *t.out = new_const_node(e->num); break;
+            case ANF_BOOL: *t.out = new_zero_node(new_const_node(e->num ? 0 : 1)); break;
+            case ANF_VAR:
+            case ANF_UNBOUND: *t.out = new_var_node(e->var); break;
+            case ANF_PROC: {
+                ast_proc_t p = (ast_proc_t)new_proc_node(e->var, NULL, e->line);
+                p->name = e->name;
+                *t.out = (ast_node_t)p;
+                ANF_LOWER_PUSH(e->body, &p->body, NULL);
+                break;
+            }
+            case ANF_DIFF: {
+                ast_diff_t d = (ast_diff_t)new_diff_node(NULL, NULL);
+                *t.out = (ast_node_t)d;
+                ANF_LOWER_PUSH(e->b, &d->exp2, NULL);
+                ANF_LOWER_PUSH(e->a, &d->exp1, NULL);
+                break;
+            }
+            case ANF_ZERO: {
+                ast_zero_t z = (ast_zero_t)new_zero_node(NULL);
+                *t.out = (ast_node_t)z;
+                ANF_LOWER_PUSH(e->a, &z->exp1, NULL);
+                break;
+            }
+            case ANF_CALL: {
+                ast_call_t c = (ast_call_t)new_call_node(NULL, NULL);
+                *t.out = (ast_node_t)c;
+                ANF_LOWER_PUSH(e->b, &c->rand, NULL);
+                ANF_LOWER_PUSH(e->a, &c->rator, NULL);
+                break;
+            }
+            case ANF_IF: {
+                ast_if_t i = (ast_if_t)new_if_node(NULL, NULL, NULL);
+                *t.out = (ast_node_t)i;
+                ANF_LOWER_PUSH(e->c, &i->exp2, NULL);
+                ANF_LOWER_PUSH(e->b, &i->exp1, NULL);
+                ANF_LOWER_PUSH(e->a, &i->cond, NULL);
+                break;
+            }
+            case ANF_LET: {
+                ast_let_t l = (ast_let_t)new_let_node(e->var, NULL, NULL);
+                *t.out = (ast_node_t)l;
+                /* decided once both halves are lowered */
+                ANF_LOWER_PUSH(e, t.out, (ast_node_t)l);
+                ANF_LOWER_PUSH(e->body, &l->exp2, NULL);
+                ANF_LOWER_PUSH(e->a, &l->exp1, NULL);
+                break;
+            }
+            case ANF_LETREC: {
+                ast_letrec_t l = (ast_letrec_t)new_letrec_node(e->var, e->a->var, NULL, NULL, e->a->line);
+                *t.out = (ast_node_t)l;
+                ANF_LOWER_PUSH(e->body, &l->letrec_body, NULL);
+                ANF_LOWER_PUSH(e->a->body, &l->p_body, NULL);
+                break;
+            }
+        }
+    }
+#undef ANF_LOWER_PUSH
+    free(stack);
+    free(uses);
+    return new_ast_program(root);
+}
+
+/*
+ * Prints the program one let per line. The worklist holds nodes to print
+ * and the text between them, in reverse, and dump_text bounds the
+ * indentation.
+ */
+typedef struct anf_print_s {
+    anf_node_t node;
+    const char *text;
+    int indent;
+} anf_print_s;
+
+void anf_program_dump(anf_program_t prog, FILE *fp) {
+    anf_print_s *stack = NULL;
+    size_t n = 0, cap = 0;
+#define ANF_PRINT(nd, tx, in)                                           \
+    do {                                                                \
+        stack = anf_grow(stack, n, &cap, sizeof(anf_print_s), "worklist"); \
+        stack[n].node = (nd);                                           \
+        stack[n].text = (tx);                                           \
+        stack[n].indent = (in);                                         \
+        n += 1;                                                         \
+    } while (0)
+    ANF_PRINT(NULL, "\n", 0);
+    ANF_PRINT(prog->root, NULL, 0);
+    while (n > 0) {
+        anf_print_s p = stack[--n];
+        if (p.text) {
+            dump_text(fp, p.text, p.indent);
+            continue;
+        }
+        anf_node_t e = p.node;
+        int in = p.indent;
+        switch (e->type) {
+            case ANF_CONST: fprintf(fp, "%d", e->num); break;
+            case ANF_BOOL: fputs(e->num ? "#t" : "#f", fp); break;
+            case ANF_VAR:
+            case ANF_UNBOUND: fputs(e->var->name, fp); break;
+            case ANF_PROC: {
+                fprintf(fp, "proc (%s)", e->var->name);
+                ANF_PRINT(e->body, NULL, in + 1);
+                ANF_PRINT(NULL, "\n", in + 1);
+                break;
+            }
+            case ANF_DIFF: {
+                fputs("-(", fp);
+                ANF_PRINT(NULL, ")", in);
+                ANF_PRINT(e->b, NULL, in);
+                ANF_PRINT(NULL, ", ", in);
+                ANF_PRINT(e->a, NULL, in);
+                break;
+            }
+            case ANF_ZERO: {
+                fputs("zero?(", fp);
+                ANF_PRINT(NULL, ")", in);
+                ANF_PRINT(e->a, NULL, in);
+                break;
+            }
+            case ANF_CALL: {
+                fputs("(", fp);
+                ANF_PRINT(NULL, ")", in);
+                ANF_PRINT(e->b, NULL, in);
+                ANF_PRINT(NULL, " ", in);
+                ANF_PRINT(e->a, NULL, in);
+                break;
+            }
+            case ANF_IF: {
+                fputs("if ", fp);
+                ANF_PRINT(e->c, NULL, in + 1);
+                ANF_PRINT(NULL, "\n", in + 1);
+                ANF_PRINT(NULL, "else", in);
+                ANF_PRINT(NULL, "\n", in);
+                ANF_PRINT(e->b, NULL, in + 1);
+                ANF_PRINT(NULL, "\n", in + 1);
+                ANF_PRINT(NULL, " then", in);
+                ANF_PRINT(e->a, NULL, in);
+                break;
+            }
+            case ANF_LET: {
+                fprintf(fp, "let %s = ", e->var->name);
+                ANF_PRINT(e->body, NULL, in);
+                ANF_PRINT(NULL, " in\n", in);
+                if (e->a->type == ANF_IF) {
+                    ANF_PRINT(e->a, NULL, in + 1);
+                    ANF_PRINT(NULL, "\n", in + 1);
+                } else {
+                    ANF_PRINT(e->a, NULL, in);
+                }
+                break;
+            }
+            case ANF_LETREC: {
+                anf_node_t q = e->a;
+                fprintf(fp, "letrec %s(%s) =", e->var->name, q->var->name);
+                ANF_PRINT(e->body, NULL, in);
+                ANF_PRINT(NULL, "\n", in);
+                ANF_PRINT(NULL, "in", in);
+                ANF_PRINT(NULL, "\n", in);
+                ANF_PRINT(q->body, NULL, in + 1);
+                ANF_PRINT(NULL, "\n", in + 1);
+                break;
+            }
+        }
+    }
+#undef ANF_PRINT
+    free(stack);
+}
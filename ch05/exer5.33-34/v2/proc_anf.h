@@ -0,0 +1,69 @@
+#ifndef __PROC_ANF_H__
+#define __PROC_ANF_H__
+
+/*
+ * Internals of the a-normal form ir, shared by the conversion in
+ * proc_anf.c and the passes over it. Must be included after proc.h.
+ *
+ *   atom     CONST, BOOL, VAR, UNBOUND or PROC
+ *   complex  an atom, DIFF, ZERO or CALL over atoms, or IF over an atom
+ *            whose branches are expressions
+ *   exp      LET var = complex in exp, LETREC var = PROC in exp, or a
+ *            complex
+ *
+ * Every variable is an interned symbol or one anf_fresh made, so passes
+ * can keep facts about one in an array of symbol_count() indexed by
+ * ANF_SYM; a pass that makes names grows its arrays with anf_by_symbol.
+ * A let or letrec never binds a name that is visible where it is bound;
+ * only the parameter of a proc can shadow.
+ */
+typedef enum {
+    ANF_CONST = 0x00,  /* num */
+    ANF_BOOL,          /* num is 0 or 1, made by folding */
+    ANF_VAR,           /* var */
+    ANF_UNBOUND,       /* var, reported when evaluated */
+    ANF_PROC,          /* proc (var) body; name and line as in the ast */
+    ANF_DIFF,          /* -(a, b) */
+    ANF_ZERO,          /* zero?(a) */
+    ANF_CALL,          /* (a b) */
+    ANF_IF,            /* if a then b else c */
+    ANF_LET,           /* let var = a in body */
+    ANF_LETREC         /* letrec var = a in body, a a PROC */
+} anf_type_t;
+
+typedef struct anf_node_s *anf_node_t;
+
+struct anf_node_s {
+    anf_type_t type;
+    int num;
+    symbol_t var;
+    symbol_t name;
+    int line;
+    anf_node_t a;
+    anf_node_t b;
+    anf_node_t c;
+    anf_node_t body;
+};
+
+struct anf_program_s {
+    anf_node_t root;
+    anf_node_t *nodes;  /* every node made, for freeing */
+    size_t nnodes;
+    size_t nodes_cap;
+    unsigned fresh;     /* names made so far */
+};
+
+#define ANF_IS_ATOM(n) ((n)->type <= ANF_PROC)
+#define ANF_SYM(s) symbol_index(s)
+
+anf_node_t anf_node_new(anf_program_t prog, anf_type_t type);
+/* a name no program can spell, from base */
+symbol_t anf_fresh(anf_program_t prog, const char *base);
+void *anf_grow(void *array, size_t n, size_t *cap, size_t size, const char *what);
+void *anf_by_symbol(void *array, size_t *cap, size_t size, const char *what);
+
+void anf_fold(anf_program_t prog);
+void anf_cse(anf_program_t prog);
+void anf_inline(anf_program_t prog);
+
+#endif
@@ -0,0 +1,502 @@
+/* procedure inlining over the a-normal form */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proc.h"
+#include "proc_anf.h"
+
+/*
+ * A call whose rator is a proc, or a variable that a let or letrec in
+ * scope binds to one, is replaced by a copy of the proc's body. The
+ * argument is substituted for the parameter when it is a constant or a
+ * variable, and bound by a let to a fresh name otherwise. Every let and
+ * letrec of the copy is renamed, so binders stay unique. In the value of
+ * a let, the let chain of the copy goes ahead of the let.
+ *
+ * A proc is left alone when its body is larger than anf_inline_size
+ * nodes, when the copies so far have used up the budget of the program,
+ * when it calls itself, when it names an unbound variable, which the
+ * code around the call could bind, or when a parameter between the proc
+ * and the call shadows one of its free variables. A clock orders the
+ * two: every fact and every parameter is stamped with it when it comes
+ * into scope.
+ */
+uint32_t anf_inline_size = 32;
+
+/* the levels of binders past its own that a proc making procs may be
+ * inlined into: the tree and closure engines copy the environment into
+ * every closure they make, so a closure made deeper costs more */
+#define ANF_INLINE_DEEPER 2
+FILE *anf_report = NULL;
+
+typedef enum {
+    INLINE_VISIT = 0x00,  /* the node in slot */
+    INLINE_LET,           /* the let in slot, after its value */
+    INLINE_UNDO           /* the undo stack back to mark */
+} anf_inline_kind_t;
+
+typedef struct anf_inline_task_s {
+    anf_inline_kind_t kind;
+    anf_node_t *slot;
+    size_t mark;
+    int value;  /* slot is the value of a let, whose calls the let inlines */
+    uint32_t depth;
+} anf_inline_task_s;
+
+/* the state of one symbol before it was set */
+typedef struct anf_inline_undo_s {
+    size_t sym;
+    anf_node_t fact;
+    uint32_t fact_time;
+    uint32_t fact_depth;
+    uint32_t param_time;
+} anf_inline_undo_s;
+
+/* a copy of src into slot */
+typedef struct anf_copy_task_s {
+    anf_node_t src;
+    anf_node_t *slot;
+    size_t mark;  /* src NULL: the renames back to mark */
+} anf_copy_task_s;
+
+typedef struct anf_rename_s {
+    size_t sym;
+    anf_node_t old;
+} anf_rename_s;
+
+typedef struct anf_inline_s {
+    anf_program_t prog;
+    anf_inline_task_s *tasks;
+    size_t ntasks;
+    size_t tasks_cap;
+    anf_inline_undo_s *undo;
+    size_t nundo;
+    size_t undo_cap;
+    anf_node_t *facts;     /* by symbol: the proc it is bound to */
+    uint32_t *fact_times;  /* by symbol */
+    uint32_t *fact_depths; /* by symbol: the binders in scope of the proc */
+    uint32_t *param_times; /* by symbol: when a parameter of it came into scope */
+    size_t nsyms;          /* of the by-symbol arrays */
+    uint32_t clock;
+    size_t budget;         /* nodes the copies may still add */
+
+    /* the body being looked at or copied */
+    anf_node_t *scan;
+    size_t nscan;
+    size_t scan_cap;
+    symbol_t *refs;        /* its variables */
+    size_t nrefs;
+    size_t refs_cap;
+    symbol_t *params;      /* the parameters of the procs in it */
+    size_t nparams;
+    size_t params_cap;
+    uint32_t *bound;       /* by symbol: bound by a let or letrec of it, as scan_id */
+    uint32_t scan_id;
+    anf_copy_task_s *copies;
+    size_t ncopies;
+    size_t copies_cap;
+    anf_node_t *renames;   /* by symbol: what the copy says instead */
+    anf_rename_s *rename_undo;
+    size_t nrename_undo;
+    size_t rename_undo_cap;
+} anf_inline_s, *anf_inline_t;
+
+static void anf_inline_push(anf_inline_t s, anf_inline_kind_t kind, anf_node_t *slot, int value,
+                            uint32_t depth) {
+    s->tasks = anf_grow(s->tasks, s->ntasks, &s->tasks_cap, sizeof(anf_inline_task_s), "worklist");
+    s->tasks[s->ntasks].kind = kind;
+    s->tasks[s->ntasks].slot = slot;
+    s->tasks[s->ntasks].mark = s->nundo;
+    s->tasks[s->ntasks].value = value;
+    s->tasks[s->ntasks].depth = depth;
+    s->ntasks += 1;
+}
+
+static void anf_inline_set(anf_inline_t s, size_t sym, anf_node_t fact, uint32_t fact_time,
+                           uint32_t fact_depth, uint32_t param_time) {
+    s->undo = anf_grow(s->undo, s->nundo, &s->undo_cap, sizeof(anf_inline_undo_s), "undo");
+    s->undo[s->nundo].sym = sym;
+    s->undo[s->nundo].fact = s->facts[sym];
+    s->undo[s->nundo].fact_time = s->fact_times[sym];
+    s->undo[s->nundo].fact_depth = s->fact_depths[sym];
+    s->undo[s->nundo].param_time = s->param_times[sym];
+    s->nundo += 1;
+    s->facts[sym] = fact;
+    s->fact_times[sym] = fact_time;
+    s->fact_depths[sym] = fact_depth;
+    s->param_times[sym] = param_time;
+}
+
+static void anf_inline_undo(anf_inline_t s, size_t mark) {
+    while (s->nundo > mark) {
+        anf_inline_undo_s *u = &s->undo[--s->nundo];
+        s->facts[u->sym] = u->fact;
+        s->fact_times[u->sym] = u->fact_time;
+        s->fact_depths[u->sym] = u->fact_depth;
+        s->param_times[u->sym] = u->param_time;
+    }
+}
+
+static void anf_scan_push(anf_inline_t s, anf_node_t n) {
+    if (n) {
+        s->scan = anf_grow(s->scan, s->nscan, &s->scan_cap, sizeof(anf_node_t), "worklist");
+        s->scan[s->nscan++] = n;
+    }
+}
+
+static void anf_sym_push(symbol_t **syms, size_t *n, size_t *cap, symbol_t sym) {
+    *syms = anf_grow(*syms, *n, cap, sizeof(symbol_t), "inline");
+    (*syms)[(*n)++] = sym;
+}
+
+/* the size of the body of p, or 0 when it has an unbound variable;
+ * gathers its variables, its parameters and what its lets bind */
+static size_t anf_inline_scan(anf_inline_t s, anf_node_t p) {
+    size_t size = 0;
+    int unbound = 0;
+    s->nrefs = 0;
+    s->nparams = 0;
+    s->scan_id += 1;
+    anf_scan_push(s, p->body);
+    while (s->nscan > 0) {
+        anf_node_t n = s->scan[--s->nscan];
+        size += 1;
+        switch (n->type) {
+            case ANF_VAR: {
+                anf_sym_push(&s->refs, &s->nrefs, &s->refs_cap, n->var);
+                break;
+            }
+            case ANF_UNBOUND: {
+                unbound = 1;
+                break;
+            }
+            case ANF_PROC: {
+                anf_sym_push(&s->params, &s->nparams, &s->params_cap, n->var);
+                anf_scan_push(s, n->body);
+                break;
+            }
+            case ANF_LET:
+            case ANF_LETREC: {
+                s->bound[ANF_SYM(n->var)] = s->scan_id;
+                anf_scan_push(s, n->a);
+                anf_scan_push(s, n->body);
+                break;
+            }
+            default: {
+                anf_scan_push(s, n->a);
+                anf_scan_push(s, n->b);
+                anf_scan_push(s, n->c);
+                break;
+            }
+        }
+    }
+    return unbound ? 0 : size;
+}
+
+/* why p, stamped with time, cannot be inlined deeper levels down, NULL
+ * if it can */
+static const char *anf_inline_refusal(anf_inline_t s, anf_node_t p, uint32_t time, uint32_t deeper,
+                                      size_t size) {
+    if (size == 0) {
+        return "names an unbound variable";
+    } else if (size > anf_inline_size) {
+        return "too large";
+    } else if (size > s->budget) {
+        return "over budget";
+    } else if (s->nparams > 0 && deeper > ANF_INLINE_DEEPER) {
+        return "makes procs too deep";
+    }
+    for (size_t i = 0; i < s->nrefs; ++i) {
+        symbol_t v = s->refs[i];
+        if (p->name && v == p->name) {
+            return "recursive";
+        } else if (v != p->var && s->bound[ANF_SYM(v)] != s->scan_id &&
+                   s->param_times[ANF_SYM(v)] > time) {
+            return "free variable shadowed";
+        }
+    }
+    return NULL;
+}
+
+static void anf_rename(anf_inline_t s, symbol_t var, anf_node_t to) {
+    size_t sym = ANF_SYM(var);
+    s->rename_undo = anf_grow(s->rename_undo, s->nrename_undo, &s->rename_undo_cap,
+                              sizeof(anf_rename_s), "inline");
+    s->rename_undo[s->nrename_undo].sym = sym;
+    s->rename_undo[s->nrename_undo].old = s->renames[sym];
+    s->nrename_undo += 1;
+    s->renames[sym] = to;
+}
+
+static void anf_unrename(anf_inline_t s, size_t mark) {
+    while (s->nrename_undo > mark) {
+        s->nrename_undo -= 1;
+        s->renames[s->rename_undo[s->nrename_undo].sym] = s->rename_undo[s->nrename_undo].old;
+    }
+}
+
+static void anf_copy_push(anf_inline_t s, anf_node_t src, anf_node_t *slot) {
+    s->copies = anf_grow(s->copies, s->ncopies, &s->copies_cap, sizeof(anf_copy_task_s), "worklist");
+    s->copies[s->ncopies].src = src;
+    s->copies[s->ncopies].slot = slot;
+    s->copies[s->ncopies].mark = s->nrename_undo;
+    s->ncopies += 1;
+}
+
+/* the by-symbol arrays grown to every symbol made so far */
+static void anf_inline_fit(anf_inline_t s) {
+    size_t n = s->nsyms;
+    s->facts = anf_by_symbol(s->facts, &n, sizeof(anf_node_t), "inline");
+    n = s->nsyms;
+    s->fact_times = anf_by_symbol(s->fact_times, &n, sizeof(uint32_t), "inline");
+    n = s->nsyms;
+    s->fact_depths = anf_by_symbol(s->fact_depths, &n, sizeof(uint32_t), "inline");
+    n = s->nsyms;
+    s->param_times = anf_by_symbol(s->param_times, &n, sizeof(uint32_t), "inline");
+    n = s->nsyms;
+    s->bound = anf_by_symbol(s->bound, &n, sizeof(uint32_t), "inline");
+    n = s->nsyms;
+    s->renames = anf_by_symbol(s->renames, &n, sizeof(anf_node_t), "inline");
+    s->nsyms = n;
+}
+
+static anf_node_t anf_fresh_var(anf_inline_t s, symbol_t base) {
+    anf_node_t v = anf_node_new(s->prog, ANF_VAR);
+    v->var = anf_fresh(s->prog, base->name);
+    if (symbol_count() > s->nsyms) {
+        anf_inline_fit(s);
+    }
+    return v;
+}
+
+/* a copy of src under the renames, with fresh names for its lets */
+static void anf_copy(anf_inline_t s, anf_node_t src, anf_node_t *slot) {
+    anf_copy_push(s, src, slot);
+    while (s->ncopies > 0) {
+        anf_copy_task_s t = s->copies[--s->ncopies];
+        anf_node_t n = t.src;
+        if (!n) {
+            anf_unrename(s, t.mark);
+            continue;
+        }
+        switch (n->type) {
+            case ANF_VAR: {
+                anf_node_t to = s->renames[ANF_SYM(n->var)];
+                *t.slot = to ? to : n;
+                break;
+            }
+            case ANF_CONST:
+            case ANF_BOOL:
+            case ANF_UNBOUND: {
+                *t.slot = n;
+                break;
+            }
+            default: {
+                anf_node_t c = anf_node_new(s->prog, n->type);
+                *c = *n;
+                *t.slot = c;
+                if (n->type == ANF_PROC) {
+                    /* the parameter keeps its name: procedures print with it */
+                    anf_copy_push(s, NULL, NULL);
+                    anf_rename(s, n->var, NULL);
+                    anf_copy_push(s, n->body, &c->body);
+                    break;
+                }
+                if (n->type == ANF_LET || n->type == ANF_LETREC) {
+                    anf_node_t v = anf_fresh_var(s, n->var);
+                    c->var = v->var;
+                    anf_rename(s, n->var, v);
+                    anf_copy_push(s, n->body, &c->body);
+                }
+                if (n->type == ANF_LETREC) {
+                    /* a letrec's proc is named by its variable */
+                    anf_node_t p = anf_node_new(s->prog, ANF_PROC);
+                    *p = *n->a;
+                    p->name = c->var;
+                    c->a = p;
+                    anf_copy_push(s, NULL, NULL);
+                    anf_rename(s, p->var, NULL);
+                    anf_copy_push(s, n->a->body, &p->body);
+                    break;
+                }
+                anf_copy_push(s, n->a, &c->a);
+                if (n->b) {
+                    anf_copy_push(s, n->b, &c->b);
+                }
+                if (n->c) {
+                    anf_copy_push(s, n->c, &c->c);
+                }
+                break;
+            }
+        }
+    }
+    anf_unrename(s, 0);
+}
+
+/* the body of the proc call calls, with its argument, or NULL; depth is
+ * the binders in scope of the call */
+static anf_node_t anf_inline_call(anf_inline_t s, anf_node_t call, uint32_t depth) {
+    anf_node_t p = NULL, arg = call->b;
+    uint32_t time = s->clock, from = depth;
+    const char *name = "proc";
+    if (call->a->type == ANF_PROC) {
+        p = call->a;
+    } else if (call->a->type == ANF_VAR && s->facts[ANF_SYM(call->a->var)]) {
+        p = s->facts[ANF_SYM(call->a->var)];
+        time = s->fact_times[ANF_SYM(call->a->var)];
+        from = s->fact_depths[ANF_SYM(call->a->var)];
+        name = call->a->var->name;
+    }
+    if (!p) {
+        return NULL;
+    }
+
+    size_t size = anf_inline_scan(s, p);
+    const char *refusal = anf_inline_refusal(s, p, time, depth > from ? depth - from : 0, size);
+    if (refusal) {
+        if (anf_report) {
+            fprintf(anf_report, "inline %s (line %d): no, %s\n", name, p->line, refusal);
+        }
+        return NULL;
+    }
+    if (anf_report) {
+        fprintf(anf_report, "inline %s (line %d): yes, %zu nodes\n", name, p->line, size);
+    }
+    s->budget -= size;
+    proc_stats->anf_rewrites[ANF_INLINE] += 1;
+
+    int substitute = arg->type == ANF_CONST || arg->type == ANF_BOOL || arg->type == ANF_VAR;
+    for (size_t i = 0; substitute && arg->type == ANF_VAR && i < s->nparams; ++i) {
+        substitute = s->params[i] != arg->var;
+    }
+    anf_node_t body = NULL;
+    if (substitute) {
+        anf_rename(s, p->var, arg);
+        anf_copy(s, p->body, &body);
+    } else {
+        anf_node_t v = anf_fresh_var(s, p->var);
+        body = anf_node_new(s->prog, ANF_LET);
+        body->var = v->var;
+        body->a = arg;
+        anf_rename(s, p->var, v);
+        anf_copy(s, p->body, &body->body);
+    }
+    return body;
+}
+
+static void anf_inline_visit(anf_inline_t s, anf_inline_task_s t) {
+    anf_node_t n = *t.slot;
+    uint32_t d = t.depth;
+    switch (n->type) {
+        case ANF_PROC: {
+            anf_inline_push(s, INLINE_UNDO, NULL, 0, d);
+            anf_inline_set(s, ANF_SYM(n->var), NULL, 0, 0, ++s->clock);
+            anf_inline_push(s, INLINE_VISIT, &n->body, 0, d + 1);
+            break;
+        }
+        case ANF_CALL: {
+            anf_node_t body = t.value ? NULL : anf_inline_call(s, n, d);
+            if (body) {
+                *t.slot = body;
+                anf_inline_push(s, INLINE_VISIT, t.slot, 0, d);
+                break;
+            }
+            anf_inline_push(s, INLINE_VISIT, &n->b, 0, d);
+            anf_inline_push(s, INLINE_VISIT, &n->a, 0, d);
+            break;
+        }
+        case ANF_DIFF: {
+            anf_inline_push(s, INLINE_VISIT, &n->b, 0, d);
+            anf_inline_push(s, INLINE_VISIT, &n->a, 0, d);
+            break;
+        }
+        case ANF_ZERO: {
+            anf_inline_push(s, INLINE_VISIT, &n->a, 0, d);
+            break;
+        }
+        case ANF_IF: {
+            anf_inline_push(s, INLINE_UNDO, NULL, 0, d);
+            anf_inline_push(s, INLINE_VISIT, &n->c, 0, d);
+            anf_inline_push(s, INLINE_UNDO, NULL, 0, d);
+            anf_inline_push(s, INLINE_VISIT, &n->b, 0, d);
+            anf_inline_push(s, INLINE_VISIT, &n->a, 0, d);
+            break;
+        }
+        case ANF_LET: {
+            anf_node_t body = n->a->type == ANF_CALL ? anf_inline_call(s, n->a, d) : NULL;
+            if (body) {
+                /* the let takes the value the copy ends with */
+                anf_node_t *end = &body;
+                while ((*end)->type == ANF_LET || (*end)->type == ANF_LETREC) {
+                    end = &(*end)->body;
+                }
+                n->a = *end;
+                *end = n;
+                *t.slot = body;
+                anf_inline_push(s, INLINE_VISIT, t.slot, 0, d);
+                break;
+            }
+            anf_inline_push(s, INLINE_LET, t.slot, 0, d);
+            anf_inline_push(s, INLINE_VISIT, &n->a, 1, d);
+            break;
+        }
+        case ANF_LETREC: {
+            size_t sym = ANF_SYM(n->var);
+            anf_inline_set(s, sym, n->a, ++s->clock, d + 1, s->param_times[sym]);
+            anf_inline_push(s, INLINE_VISIT, &n->body, 0, d + 1);
+            anf_inline_push(s, INLINE_VISIT, &n->a, 0, d + 1);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/* a let of a proc, or of a variable bound to one, is a fact */
+static void anf_inline_let(anf_inline_t s, anf_inline_task_s t) {
+    anf_node_t n = *t.slot;
+    size_t sym = ANF_SYM(n->var);
+    if (n->a->type == ANF_PROC) {
+        anf_inline_set(s, sym, n->a, ++s->clock, t.depth, s->param_times[sym]);
+    } else if (n->a->type == ANF_VAR && s->facts[ANF_SYM(n->a->var)]) {
+        size_t from = ANF_SYM(n->a->var);
+        anf_inline_set(s, sym, s->facts[from], s->fact_times[from], s->fact_depths[from],
+                       s->param_times[sym]);
+    }
+    anf_inline_push(s, INLINE_VISIT, &n->body, 0, t.depth + 1);
+}
+
+void anf_inline(anf_program_t prog) {
+    anf_inline_t s = calloc(1, sizeof(anf_inline_s));
+    if (!s) {
+        fprintf(stderr, "failed to grow anf inline!\n");
+        exit(1);
+    }
+    anf_inline_fit(s);
+    s->prog = prog;
+    /* copies may at most double the program, past a few of the largest */
+    s->budget = prog->nnodes + 4 * (size_t)anf_inline_size;
+    anf_inline_push(s, INLINE_VISIT, &prog->root, 0, 0);
+    while (s->ntasks > 0) {
+        anf_inline_task_s t = s->tasks[--s->ntasks];
+        switch (t.kind) {
+            case INLINE_VISIT: anf_inline_visit(s, t); break;
+            case INLINE_LET: anf_inline_let(s, t); break;
+            case INLINE_UNDO: anf_inline_undo(s, t.mark); break;
+        }
+    }
+    free(s->tasks);
+    free(s->undo);
+    free(s->facts);
+    free(s->fact_times);
+    free(s->fact_depths);
+    free(s->param_times);
+    free(s->scan);
+    free(s->refs);
+    free(s->params);
+    free(s->bound);
+    free(s->copies);
+    free(s->renames);
+    free(s->rename_undo);
+    free(s);
+}
@@ -0,0 +1,419 @@
+/* optimizer passes over the a-normal form: constant folding and cse */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proc.h"
+#include "proc_anf.h"
+
+/*
+ * Both passes walk the program in evaluation order with facts about the
+ * variables in scope, kept in arrays indexed by symbol. A fact is set
+ * with its old value saved on an undo stack, and a scope ends by popping
+ * the stack back to where it began: at the end of a proc body and of each
+ * branch of an if. A let needs no undo of its own, since its scope runs
+ * to the end of the expression it is in.
+ *
+ * The parameter of a proc is the only binder that can shadow. Entering a
+ * proc hides every fact about its parameter, and every fact that refers
+ * to it: each symbol remembers the height of the undo stack when it was
+ * last set, and a fact naming a variable set above its own is stale.
+ */
+typedef enum {
+    WALK_VISIT = 0x00,  /* the node in slot */
+    WALK_POST,          /* the node in slot, after its operands */
+    WALK_LET,           /* the let in slot, after its value */
+    WALK_IF,            /* the if in slot, after its test */
+    WALK_UNDO           /* the undo stack back to mark */
+} anf_walk_kind_t;
+
+typedef struct anf_walk_s {
+    anf_walk_kind_t kind;
+    anf_node_t *slot;
+    size_t mark;
+    int value;  /* slot is the value of a let, which cannot be a let */
+} anf_walk_s;
+
+typedef struct anf_undo_s {
+    size_t sym;
+    anf_node_t old;
+    size_t old_at;
+} anf_undo_s;
+
+typedef struct anf_walker_s {
+    anf_program_t prog;
+    anf_walk_s *tasks;
+    size_t ntasks;
+    size_t tasks_cap;
+    anf_undo_s *undo;
+    size_t nundo;
+    size_t undo_cap;
+    anf_node_t *facts;  /* by symbol */
+    size_t *fact_at;    /* by symbol: the undo height it was set at, + 1 */
+    size_t nsyms;
+} anf_walker_s, *anf_walker_t;
+
+static void anf_walk_push(anf_walker_t w, anf_walk_kind_t kind, anf_node_t *slot, int value) {
+    w->tasks = anf_grow(w->tasks, w->ntasks, &w->tasks_cap, sizeof(anf_walk_s), "worklist");
+    w->tasks[w->ntasks].kind = kind;
+    w->tasks[w->ntasks].slot = slot;
+    w->tasks[w->ntasks].mark = w->nundo;
+    w->tasks[w->ntasks].value = value;
+    w->ntasks += 1;
+}
+
+static void anf_fact_set(anf_walker_t w, size_t sym, anf_node_t fact) {
+    w->undo = anf_grow(w->undo, w->nundo, &w->undo_cap, sizeof(anf_undo_s), "undo");
+    w->undo[w->nundo].sym = sym;
+    w->undo[w->nundo].old = w->facts[sym];
+    w->undo[w->nundo].old_at = w->fact_at[sym];
+    w->nundo += 1;
+    w->facts[sym] = fact;
+    w->fact_at[sym] = w->nundo;
+}
+
+static void anf_undo(anf_walker_t w, size_t mark) {
+    while (w->nundo > mark) {
+        w->nundo -= 1;
+        w->facts[w->undo[w->nundo].sym] = w->undo[w->nundo].old;
+        w->fact_at[w->undo[w->nundo].sym] = w->undo[w->nundo].old_at;
+    }
+}
+
+static void anf_walker_init(anf_walker_t w, anf_program_t prog) {
+    memset(w, 0x00, sizeof(*w));
+    w->prog = prog;
+    size_t cap = 0;
+    w->facts = anf_by_symbol(NULL, &cap, sizeof(anf_node_t), "facts");
+    w->fact_at = anf_by_symbol(NULL, &w->nsyms, sizeof(size_t), "facts");
+}
+
+static void anf_walker_free(anf_walker_t w) {
+    free(w->tasks);
+    free(w->undo);
+    free(w->facts);
+    free(w->fact_at);
+}
+
+/* ifs go one scope per branch; the if itself is left in slot */
+static void anf_walk_branches(anf_walker_t w, anf_node_t n) {
+    anf_walk_push(w, WALK_UNDO, NULL, 0);
+    anf_walk_push(w, WALK_VISIT, &n->c, 0);
+    anf_walk_push(w, WALK_UNDO, NULL, 0);
+    anf_walk_push(w, WALK_VISIT, &n->b, 0);
+}
+
+/* constant folding */
+
+/*
+ * -( ) and zero?( ) of constants are computed, an if on a known boolean
+ * keeps the branch taken, and a let of a constant or of another variable
+ * is substituted into its body. Operands of the wrong type are left for
+ * the engine to report.
+ */
+static void anf_fold_visit(anf_walker_t w, anf_walk_s t) {
+    anf_node_t n = *t.slot;
+    switch (n->type) {
+        case ANF_VAR: {
+            size_t sym = ANF_SYM(n->var);
+            anf_node_t fact = w->facts[sym];
+            if (fact && fact->type == ANF_VAR && w->fact_at[ANF_SYM(fact->var)] > w->fact_at[sym]) {
+                fact = NULL;
+            }
+            if (fact) {
+                *t.slot = fact;
+                proc_stats->anf_rewrites[ANF_FOLD] += 1;
+            }
+            break;
+        }
+        case ANF_PROC: {
+            /* hides the facts the parameter shadows */
+            anf_walk_push(w, WALK_UNDO, NULL, 0);
+            anf_fact_set(w, ANF_SYM(n->var), NULL);
+            anf_walk_push(w, WALK_VISIT, &n->body, 0);
+            break;
+        }
+        case ANF_DIFF:
+        case ANF_CALL: {
+            anf_walk_push(w, WALK_POST, t.slot, t.value);
+            anf_walk_push(w, WALK_VISIT, &n->b, 0);
+            anf_walk_push(w, WALK_VISIT, &n->a, 0);
+            break;
+        }
+        case ANF_ZERO: {
+            anf_walk_push(w, WALK_POST, t.slot, t.value);
+            anf_walk_push(w, WALK_VISIT, &n->a, 0);
+            break;
+        }
+        case ANF_IF: {
+            anf_walk_push(w, WALK_IF, t.slot, t.value);
+            anf_walk_push(w, WALK_VISIT, &n->a, 0);
+            break;
+        }
+        case ANF_LET: {
+            anf_walk_push(w, WALK_LET, t.slot, 0);
+            anf_walk_push(w, WALK_VISIT, &n->a, 1);
+            break;
+        }
+        case ANF_LETREC: {
+            anf_walk_push(w, WALK_VISIT, &n->body, 0);
+            anf_walk_push(w, WALK_VISIT, &n->a, 0);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void anf_fold_post(anf_walker_t w, anf_walk_s t) {
+    anf_node_t n = *t.slot;
+    if (n->type == ANF_DIFF && n->a->type == ANF_CONST && n->b->type == ANF_CONST) {
+        anf_node_t k = anf_node_new(w->prog, ANF_CONST);
+        /* wraps around as the engines do in practice */
+        k->num = (int)((unsigned)n->a->num - (unsigned)n->b->num);
+        *t.slot = k;
+        proc_stats->anf_rewrites[ANF_FOLD] += 1;
+    } else if (n->type == ANF_ZERO && n->a->type == ANF_CONST) {
+        anf_node_t k = anf_node_new(w->prog, ANF_BOOL);
+        k->num = n->a->num == 0;
+        *t.slot = k;
+        proc_stats->anf_rewrites[ANF_FOLD] += 1;
+    }
+}
+
+static void anf_fold_if(anf_walker_t w, anf_walk_s t) {
+    anf_node_t n = *t.slot;
+    if (n->a->type == ANF_BOOL) {
+        anf_node_t taken = n->a->num ? n->b : n->c;
+        /* the value of a let stays a complex expression */
+        if (!t.value || (taken->type != ANF_LET && taken->type != ANF_LETREC)) {
+            *t.slot = taken;
+            proc_stats->anf_rewrites[ANF_FOLD] += 1;
+            anf_walk_push(w, WALK_VISIT, t.slot, t.value);
+            return;
+        }
+    }
+    anf_walk_branches(w, n);
+}
+
+static void anf_fold_let(anf_walker_t w, anf_walk_s t) {
+    anf_node_t n = *t.slot;
+    anf_type_t type = n->a->type;
+    if (type == ANF_CONST || type == ANF_BOOL || type == ANF_VAR) {
+        anf_fact_set(w, ANF_SYM(n->var), n->a);
+        *t.slot = n->body;
+        proc_stats->anf_rewrites[ANF_FOLD] += 1;
+        anf_walk_push(w, WALK_VISIT, t.slot, 0);
+    } else {
+        anf_walk_push(w, WALK_VISIT, &n->body, 0);
+    }
+}
+
+void anf_fold(anf_program_t prog) {
+    anf_walker_s w;
+    anf_walker_init(&w, prog);
+    anf_walk_push(&w, WALK_VISIT, &prog->root, 0);
+    while (w.ntasks > 0) {
+        anf_walk_s t = w.tasks[--w.ntasks];
+        switch (t.kind) {
+            case WALK_VISIT: anf_fold_visit(&w, t); break;
+            case WALK_POST: anf_fold_post(&w, t); break;
+            case WALK_LET: anf_fold_let(&w, t); break;
+            case WALK_IF: anf_fold_if(&w, t); break;
+            case WALK_UNDO: anf_undo(&w, t.mark); break;
+        }
+    }
+    anf_walker_free(&w);
+}
+
+/* common subexpression elimination */
+
+/*
+ * A -( ), zero?( ) or call over constants and variables that a let in
+ * scope already bound is replaced by the variable. PROC has no side
+ * effects, so this holds for calls too: the earlier call either returned
+ * the same value or never let the program get here.
+ *
+ * Available expressions are a stack chained by hash, popped at the end
+ * of a scope. A proc's parameter hides the expressions over it, and the
+ * one bound to its name, inside the proc: it is marked with the height
+ * of the stack, and only entries above the mark may use it.
+ */
+#define CSE_BUCKETS 4096
+
+typedef struct anf_cse_entry_s {
+    anf_node_t let;
+    size_t next;  /* in the bucket, + 1 */
+} anf_cse_entry_s;
+
+typedef struct anf_cse_task_s {
+    anf_walk_kind_t kind;
+    anf_node_t *slot;
+    size_t entries;   /* WALK_UNDO: the stack heights to go back to */
+    size_t shadows;
+} anf_cse_task_s;
+
+typedef struct anf_cse_s {
+    anf_program_t prog;
+    anf_cse_task_s *tasks;
+    size_t ntasks;
+    size_t tasks_cap;
+    anf_cse_entry_s *entries;
+    size_t nentries;
+    size_t entries_cap;
+    size_t heads[CSE_BUCKETS];  /* + 1 */
+    size_t *shadowed;           /* by symbol */
+    size_t nsyms;
+    anf_undo_s *shadows;        /* old marks, in old */
+    size_t nshadows;
+    size_t shadows_cap;
+} anf_cse_s, *anf_cse_t;
+
+static void anf_cse_push(anf_cse_t c, anf_walk_kind_t kind, anf_node_t *slot) {
+    c->tasks = anf_grow(c->tasks, c->ntasks, &c->tasks_cap, sizeof(anf_cse_task_s), "worklist");
+    c->tasks[c->ntasks].kind = kind;
+    c->tasks[c->ntasks].slot = slot;
+    c->tasks[c->ntasks].entries = c->nentries;
+    c->tasks[c->ntasks].shadows = c->nshadows;
+    c->ntasks += 1;
+}
+
+static int anf_cse_operand(anf_node_t a) {
+    return a->type == ANF_CONST || a->type == ANF_VAR;
+}
+
+static int anf_cse_candidate(anf_node_t n) {
+    return (n->type == ANF_DIFF || n->type == ANF_CALL || n->type == ANF_ZERO) &&
+        anf_cse_operand(n->a) && (n->type == ANF_ZERO || anf_cse_operand(n->b));
+}
+
+static size_t anf_cse_hash(anf_node_t n) {
+    size_t h = n->type;
+    anf_node_t ops[2] = { n->a, n->type == ANF_ZERO ? NULL : n->b };
+    for (int i = 0; i < 2 && ops[i]; ++i) {
+        h = h * 31 + (ops[i]->type == ANF_CONST ? (size_t)(unsigned)ops[i]->num : ANF_SYM(ops[i]->var));
+    }
+    return h & (CSE_BUCKETS - 1);
+}
+
+static int anf_cse_same_atom(anf_node_t x, anf_node_t y) {
+    return x->type == y->type && (x->type == ANF_CONST ? x->num == y->num : x->var == y->var);
+}
+
+/* whether entry i may be read where var is in scope */
+static int anf_cse_visible(anf_cse_t c, size_t i, anf_node_t atom) {
+    return atom->type != ANF_VAR || c->shadowed[ANF_SYM(atom->var)] <= i;
+}
+
+static anf_node_t anf_cse_find(anf_cse_t c, anf_node_t n) {
+    for (size_t i = c->heads[anf_cse_hash(n)]; i; i = c->entries[i - 1].next) {
+        anf_node_t let = c->entries[i - 1].let, v = let->a;
+        if (v->type == n->type && anf_cse_same_atom(v->a, n->a) &&
+            (n->type == ANF_ZERO || anf_cse_same_atom(v->b, n->b)) &&
+            c->shadowed[ANF_SYM(let->var)] <= i - 1 && anf_cse_visible(c, i - 1, v->a) &&
+            (n->type == ANF_ZERO || anf_cse_visible(c, i - 1, v->b))) {
+            return let;
+        }
+    }
+    return NULL;
+}
+
+static void anf_cse_add(anf_cse_t c, anf_node_t let) {
+    size_t h = anf_cse_hash(let->a);
+    c->entries = anf_grow(c->entries, c->nentries, &c->entries_cap, sizeof(anf_cse_entry_s), "cse");
+    c->entries[c->nentries].let = let;
+    c->entries[c->nentries].next = c->heads[h];
+    c->nentries += 1;
+    c->heads[h] = c->nentries;
+}
+
+static void anf_cse_undo(anf_cse_t c, anf_cse_task_s t) {
+    while (c->nentries > t.entries) {
+        c->nentries -= 1;
+        c->heads[anf_cse_hash(c->entries[c->nentries].let->a)] = c->entries[c->nentries].next;
+    }
+    while (c->nshadows > t.shadows) {
+        c->nshadows -= 1;
+        c->shadowed[c->shadows[c->nshadows].sym] = (size_t)(uintptr_t)c->shadows[c->nshadows].old;
+    }
+}
+
+static void anf_cse_shadow(anf_cse_t c, symbol_t var) {
+    size_t p = ANF_SYM(var);
+    c->shadows = anf_grow(c->shadows, c->nshadows, &c->shadows_cap, sizeof(anf_undo_s), "cse");
+    c->shadows[c->nshadows].sym = p;
+    c->shadows[c->nshadows].old = (anf_node_t)(uintptr_t)c->shadowed[p];
+    c->nshadows += 1;
+    c->shadowed[p] = c->nentries;
+}
+
+void anf_cse(anf_program_t prog) {
+    anf_cse_t c = calloc(1, sizeof(anf_cse_s));
+    if (!c) {
+        fprintf(stderr, "failed to grow anf cse!\n");
+        exit(1);
+    }
+    c->shadowed = anf_by_symbol(NULL, &c->nsyms, sizeof(size_t), "cse");
+    c->prog = prog;
+    anf_cse_push(c, WALK_VISIT, &prog->root);
+    while (c->ntasks > 0) {
+        anf_cse_task_s t = c->tasks[--c->ntasks];
+        if (t.kind == WALK_UNDO) {
+            anf_cse_undo(c, t);
+            continue;
+        }
+        anf_node_t n = *t.slot;
+        if (t.kind == WALK_LET) {
+            if (anf_cse_candidate(n->a)) {
+                anf_cse_add(c, n);
+            }
+            anf_cse_push(c, WALK_VISIT, &n->body);
+            continue;
+        }
+        switch (n->type) {
+            case ANF_PROC: {
+                anf_cse_push(c, WALK_UNDO, NULL);
+                anf_cse_shadow(c, n->var);
+                anf_cse_push(c, WALK_VISIT, &n->body);
+                break;
+            }
+            case ANF_DIFF:
+            case ANF_ZERO:
+            case ANF_CALL: {
+                anf_node_t let = anf_cse_candidate(n) ? anf_cse_find(c, n) : NULL;
+                if (let) {
+                    anf_node_t v = anf_node_new(prog, ANF_VAR);
+                    v->var = let->var;
+                    *t.slot = v;
+                    proc_stats->anf_rewrites[ANF_CSE] += 1;
+                }
+                /* procs among the operands are not walked: cse leaves
+                 * them to the fold pass that runs before it */
+                break;
+            }
+            case ANF_IF: {
+                anf_cse_push(c, WALK_UNDO, NULL);
+                anf_cse_push(c, WALK_VISIT, &n->c);
+                anf_cse_push(c, WALK_UNDO, NULL);
+                anf_cse_push(c, WALK_VISIT, &n->b);
+                break;
+            }
+            case ANF_LET: {
+                anf_cse_push(c, WALK_LET, t.slot);
+                anf_cse_push(c, WALK_VISIT, &n->a);
+                break;
+            }
+            case ANF_LETREC: {
+                anf_cse_push(c, WALK_VISIT, &n->body);
+                anf_cse_push(c, WALK_VISIT, &n->a);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    free(c->tasks);
+    free(c->entries);
+    free(c->shadows);
+    free(c->shadowed);
+    free(c);
+}
@@ -0,0 +1,609 @@
+/* workload benchmarks: repeated quiet evaluation of the programs in bench/ */
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE /* wait4 */
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "proc.h"
+
+#ifndef PROC_BENCH_DIR
+#define PROC_BENCH_DIR "bench"
+#endif
+
+typedef enum {
+    ENGINE_TREE = 0x00,
+    ENGINE_FLAT,
+    ENGINE_VM,
+    ENGINE_FUSED,
+    ENGINE_JIT,
+    ENGINE_LOOPS,
+    ENGINE_CC,
+    ENGINE_CPS,
+    ENGINE_COUNT
+} bench_engine_t;
+
+static const char *engine_names[ENGINE_COUNT] = {
+    [ENGINE_TREE] = "tree",
+    [ENGINE_FLAT] = "flat",
+    [ENGINE_VM] = "vm",
+    [ENGINE_FUSED] = "fused",
+    [ENGINE_JIT] = "jit",
+    [ENGINE_LOOPS] = "loops",
+    [ENGINE_CC] = "cc",
+    [ENGINE_CPS] = "cps",
+};
+
+/* what a workload child sends back, followed by its samples */
+typedef struct bench_summary_s {
+    double mean;
+    uint64_t allocs;      /* per run, deterministic */
+    uint64_t alloc_bytes;
+    perf_sample_s perf;   /* per run */
+    int has_perf;
+} bench_summary_s;
+
+typedef struct bench_result_s {
+    const char *name;
+    bench_engine_t engine;
+    int reps;
+    double *samples; /* microseconds, sorted */
+    bench_summary_s sum;
+    long peak_rss_kb;
+} bench_result_s, *bench_result_t;
+
+typedef struct bench_options_s {
+    int warmup;
+    int reps;
+    int engines[ENGINE_COUNT];
+    int perf;
+    const char *json;
+    const char *baseline;
+    double time_threshold;  /* percent */
+    double alloc_threshold;
+    double rss_threshold;
+    double alpha;
+} bench_options_s, *bench_options_t;
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* nearest-rank percentile of sorted samples */
+static double percentile(const double *sorted, int n, double p) {
+    int rank = (int)(p / 100.0 * n + 0.999999);
+    rank = rank < 1 ? 1 : rank > n ? n : rank;
+    return sorted[rank - 1];
+}
+
+/* the program is parsed once; only evaluation is timed */
+static void bench_run(const char *path, bench_engine_t engine, bench_options_t opt, bench_result_t r) {
+    char *string = read_file(path);
+    memset(symtab, 0x00, sizeof(symtab));
+    ast_program_t prgm = proc_parse(string);
+    if (engine == ENGINE_FUSED) {
+        ast_fuse(prgm, fuse_default);
+    }
+    ast_flat_t fprgm = engine == ENGINE_FLAT ? ast_flat_new(prgm) : NULL;
+    vm_program_t vprgm = engine == ENGINE_VM || engine == ENGINE_JIT || engine == ENGINE_LOOPS ?
+        vm_compile(prgm) : NULL;
+    /* loops is the whole native tier: hot functions and loop traces */
+    vm_jit_threshold = engine == ENGINE_JIT || engine == ENGINE_LOOPS ? 100 : 0;
+    vm_loop_threshold = engine == ENGINE_LOOPS ? 50 : 0;
+    cc_program_t cprgm = engine == ENGINE_CC ? cc_compile(prgm) : NULL;
+    cps_program_t kprgm = engine == ENGINE_CPS ? cps_convert(prgm) : NULL;
+    perf_sample_s total;
+    memset(&total, 0x00, sizeof(total));
+
+    r->engine = engine;
+    r->reps = opt->reps;
+    r->samples = malloc(opt->reps * sizeof(double));
+    if (!r->samples) {
+        fprintf(stderr, "failed to allocate bench samples!\n");
+        exit(1);
+    }
+    for (int i = -opt->warmup; i < opt->reps; ++i) {
+        perf_sample_s s;
+        if (i == 0) {
+            proc_stats_reset();
+        }
+        if (opt->perf) {
+            perf_counters_start();
+        }
+        double t1 = now_us();
+        if (fprgm) {
+            value_of_program_flat(fprgm);
+        } else if (vprgm) {
+            value_of_program_vm(vprgm);
+        } else if (cprgm) {
+            value_of_program_cc(cprgm);
+        } else if (kprgm) {
+            value_of_program_cps(kprgm);
+        } else {
+            value_of_program_k(prgm);
+        }
+        double t2 = now_us();
+        if (opt->perf) {
+            perf_counters_stop(&s);
+        }
+        if (i >= 0) {
+            r->samples[i] = t2 - t1;
+            for (int c = 0; opt->perf && c < PERF_CTR_COUNT; ++c) {
+                total.value[c] += s.value[c];
+                total.valid[c] = s.valid[c];
+            }
+        }
+    }
+
+    qsort(r->samples, r->reps, sizeof(double), compare_doubles);
+    r->sum.mean = 0;
+    for (int i = 0; i < r->reps; ++i) {
+        r->sum.mean += r->samples[i] / r->reps;
+    }
+    r->sum.allocs = proc_stats->allocs / opt->reps;
+    r->sum.alloc_bytes = proc_stats->alloc_bytes / opt->reps;
+    r->sum.has_perf = opt->perf;
+    for (int c = 0; c < PERF_CTR_COUNT; ++c) {
+        r->sum.perf.value[c] = total.value[c] / opt->reps;
+        r->sum.perf.valid[c] = total.valid[c];
+    }
+
+    ast_flat_free(fprgm);
+    vm_program_free(vprgm);
+    cc_program_free(cprgm);
+    cps_program_free(kprgm);
+    ast_program_free(prgm);
+    symbol_table_free(symtab);
+    free(string);
+}
+
+static void report_bench_child_fail(const char *name) {
+    fprintf(stderr, "benchmark %s failed\n", name);
+    exit(1);
+}
+
+/*
+ * Every workload runs in its own child, so its peak RSS is its own and not
+ * the high-water mark of everything that ran before it in this process.
+ */
+static void bench_isolated(const char *path, bench_engine_t engine, bench_options_t opt,
+                           bench_result_t r) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        report_bench_child_fail(r->name);
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        report_bench_child_fail(r->name);
+    } else if (pid == 0) {
+        close(fds[0]);
+        if (opt->perf) {
+            perf_counters_open();
+        }
+        proc_stats_enable(1);
+        bench_run(path, engine, opt, r);
+        if (write(fds[1], &r->sum, sizeof(r->sum)) != sizeof(r->sum) ||
+            write(fds[1], r->samples, r->reps * sizeof(double)) != (ssize_t)(r->reps * sizeof(double))) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    r->engine = engine;
+    r->reps = opt->reps;
+    r->samples = malloc(opt->reps * sizeof(double));
+    FILE *in = fdopen(fds[0], "rb");
+    int ok = r->samples && in &&
+        fread(&r->sum, sizeof(r->sum), 1, in) == 1 &&
+        fread(r->samples, sizeof(double), r->reps, in) == (size_t)r->reps;
+    if (in) {
+        fclose(in);
+    }
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0 || !ok) {
+        report_bench_child_fail(r->name);
+    }
+    r->peak_rss_kb = ru.ru_maxrss;
+}
+
+static void print_result(FILE *fp, bench_result_t r) {
+    int n = r->reps;
+    fprintf(fp, "%-16s %-5s %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10llu %8ld\n", r->name,
+            engine_names[r->engine], r->samples[0], percentile(r->samples, n, 50),
+            r->sum.mean, percentile(r->samples, n, 95), percentile(r->samples, n, 99),
+            r->samples[n - 1], (unsigned long long)r->sum.allocs, r->peak_rss_kb);
+}
+
+static void write_json(const char *path, bench_options_t opt, bench_result_t results, int nresults) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "cannot open %s for the bench results\n", path);
+        exit(1);
+    }
+    fprintf(fp, "{\n  \"warmup\": %d,\n  \"reps\": %d,\n  \"unit\": \"us\",\n  \"results\": [",
+            opt->warmup, opt->reps);
+    for (int i = 0; i < nresults; ++i) {
+        bench_result_t r = &results[i];
+        int n = r->reps;
+        fprintf(fp, "%s\n    {\"name\": \"%s\", \"engine\": \"%s\", \"min\": %.3f, \"median\": %.3f, "
+                "\"mean\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f,\n"
+                "     \"allocs\": %llu, \"alloc_bytes\": %llu, \"peak_rss_kb\": %ld,\n"
+                "     \"samples\": [",
+                i ? "," : "", r->name, engine_names[r->engine], r->samples[0],
+                percentile(r->samples, n, 50), r->sum.mean, percentile(r->samples, n, 95),
+                percentile(r->samples, n, 99), r->samples[n - 1],
+                (unsigned long long)r->sum.allocs, (unsigned long long)r->sum.alloc_bytes,
+                r->peak_rss_kb);
+        for (int j = 0; j < n; ++j) {
+            fprintf(fp, "%s%.3f", j ? ", " : "", r->samples[j]);
+        }
+        fputc(']', fp);
+        if (r->sum.has_perf) {
+            fputs(",\n     \"perf\": {", fp);
+            for (int c = 0, first = 1; c < PERF_CTR_COUNT; ++c) {
+                if (r->sum.perf.valid[c]) {
+                    fprintf(fp, "%s\"%s\": %llu", first ? "" : ", ", perf_counter_name(c),
+                            (unsigned long long)r->sum.perf.value[c]);
+                    first = 0;
+                }
+            }
+            fputc('}', fp);
+        }
+        fputc('}', fp);
+    }
+    fputs("\n  ]\n}\n", fp);
+    fclose(fp);
+}
+
+/* one entry of a baseline file */
+typedef struct bench_baseline_s {
+    char name[64];
+    char engine[8];
+    double median;
+    uint64_t allocs;
+    long peak_rss_kb;
+    int nsamples;
+    double *samples;
+    int matched;
+} bench_baseline_s, *bench_baseline_t;
+
+static const char *json_field(const char *obj, const char *end, const char *key) {
+    char pat[32];
+    snprintf(pat, sizeof(pat), "\"%s\": ", key);
+    const char *p = strstr(obj, pat);
+    return p && p < end ? p + strlen(pat) : NULL;
+}
+
+/*
+ * Only reads what write_json writes: one object per result, each starting
+ * with its name. Anything malformed is fatal, since a gate that silently
+ * compares against nothing would always pass.
+ */
+static bench_baseline_t load_baseline(const char *path, int *n) {
+    char *text = read_file(path);
+    bench_baseline_t base = NULL;
+    int cap = 0;
+    *n = 0;
+    for (const char *obj = strstr(text, "{\"name\": "); obj; ) {
+        const char *next = strstr(obj + 1, "{\"name\": ");
+        const char *end = next ? next : obj + strlen(obj);
+        const char *name = json_field(obj, end, "name");
+        const char *engine = json_field(obj, end, "engine");
+        const char *median = json_field(obj, end, "median");
+        const char *allocs = json_field(obj, end, "allocs");
+        const char *rss = json_field(obj, end, "peak_rss_kb");
+        const char *samples = json_field(obj, end, "samples");
+        if (*n == cap) {
+            cap = cap ? cap * 2 : 16;
+            base = realloc(base, cap * sizeof(bench_baseline_s));
+        }
+        if (!base) {
+            fprintf(stderr, "failed to load the baseline!\n");
+            exit(1);
+        }
+        bench_baseline_t b = &base[*n];
+        memset(b, 0x00, sizeof(*b));
+        if (!name || !engine || !median || !allocs || !rss || !samples ||
+            sscanf(name, "\"%63[^\"]\"", b->name) != 1 ||
+            sscanf(engine, "\"%7[^\"]\"", b->engine) != 1) {
+            fprintf(stderr, "%s: malformed baseline entry %d\n", path, *n + 1);
+            exit(1);
+        }
+        b->median = strtod(median, NULL);
+        b->allocs = strtoull(allocs, NULL, 10);
+        b->peak_rss_kb = strtol(rss, NULL, 10);
+        b->samples = malloc((end - samples) / 2 * sizeof(double) + sizeof(double));
+        for (char *p = (char *)samples + 1; *p && *p != ']';) {
+            char *q;
+            double v = strtod(p, &q);
+            if (q == p) {
+                break;
+            }
+            b->samples[b->nsamples++] = v;
+            p = q + (*q == ',');
+        }
+        if (b->nsamples == 0) {
+            fprintf(stderr, "%s: baseline entry %s has no samples\n", path, b->name);
+            exit(1);
+        }
+        *n += 1;
+        obj = next;
+    }
+    free(text);
+    return base;
+}
+
+/*
+ * One-sided Mann-Whitney U test that the new samples come from a slower
+ * distribution than the baseline ones, by the normal approximation with a
+ * tie correction. Timings are never normal, so no t-test; the rank test
+ * only asks whether one set tends to be larger than the other.
+ */
+static double mann_whitney_p(const double *base, int nb, const double *cur, int nc) {
+    int n = nb + nc;
+    double *all = malloc(n * sizeof(double));
+    if (!all) {
+        fprintf(stderr, "failed to rank samples!\n");
+        exit(1);
+    }
+    memcpy(all, base, nb * sizeof(double));
+    memcpy(all + nb, cur, nc * sizeof(double));
+    qsort(all, n, sizeof(double), compare_doubles);
+
+    /* rank sum of the new samples, ties at their average rank */
+    double rank_sum = 0, ties = 0;
+    for (int i = 0; i < n;) {
+        int j = i;
+        while (j < n && all[j] == all[i]) {
+            ++j;
+        }
+        double t = j - i;
+        ties += t * t * t - t;
+        for (int k = 0; k < nc; ++k) {
+            if (cur[k] == all[i]) {
+                rank_sum += (i + 1 + j) / 2.0;
+            }
+        }
+        i = j;
+    }
+    free(all);
+    double u = rank_sum - nc * (nc + 1) / 2.0;
+    double mu = (double)nb * nc / 2.0;
+    double var = (double)nb * nc / 12.0 * ((n + 1) - ties / ((double)n * (n - 1)));
+    if (var <= 0) {
+        return 1.0;
+    }
+    double z = (u - mu - 0.5) / sqrt(var);
+    return 0.5 * erfc(z / sqrt(2.0));
+}
+
+static double percent_over(double now, double then) {
+    return then > 0 ? 100.0 * (now - then) / then : now > 0 ? 100.0 : 0.0;
+}
+
+/*
+ * Time regresses only when it is both significant and large: a p-value
+ * alone flags 1% drifts on quiet machines, a threshold alone flags noise.
+ * Allocation counts are deterministic, so they need no test at all.
+ */
+static int compare_baseline(const char *path, bench_options_t opt,
+                            bench_result_t results, int nresults) {
+    int nbase, regressions = 0;
+    bench_baseline_t base = load_baseline(path, &nbase);
+    printf("\n%-16s %-5s %9s %9s %9s %9s  %s\n",
+           "workload", "eng", "median %", "p", "allocs %", "rss %", "verdict");
+    for (int i = 0; i < nresults; ++i) {
+        bench_result_t r = &results[i];
+        bench_baseline_t b = NULL;
+        for (int j = 0; j < nbase && !b; ++j) {
+            if (strcmp(base[j].name, r->name) == 0 && strcmp(base[j].engine, engine_names[r->engine]) == 0) {
+                b = &base[j];
+            }
+        }
+        if (!b) {
+            printf("%-16s %-5s %9s %9s %9s %9s  new\n", r->name, engine_names[r->engine], "-", "-", "-", "-");
+            continue;
+        }
+        b->matched = 1;
+        double dt = percent_over(percentile(r->samples, r->reps, 50), b->median);
+        double p = mann_whitney_p(b->samples, b->nsamples, r->samples, r->reps);
+        double da = percent_over(r->sum.allocs, b->allocs);
+        double dr = percent_over(r->peak_rss_kb, b->peak_rss_kb);
+        char verdict[64] = "";
+        if (dt > opt->time_threshold && p < opt->alpha) {
+            strcat(verdict, " time");
+        }
+        if (da > opt->alloc_threshold) {
+            strcat(verdict, " allocs");
+        }
+        if (dr > opt->rss_threshold) {
+            strcat(verdict, " rss");
+        }
+        regressions += verdict[0] != '\0';
+        printf("%-16s %-5s %+8.1f%% %9.4f %+8.1f%% %+8.1f%%  %s%s\n", r->name, engine_names[r->engine],
+               dt, p, da, dr, verdict[0] ? "REGRESSED:" : "ok", verdict);
+    }
+    for (int j = 0; j < nbase; ++j) {
+        if (!base[j].matched) {
+            printf("%-16s %-5s %9s %9s %9s %9s  not run\n", base[j].name, base[j].engine, "-", "-", "-", "-");
+        }
+        free(base[j].samples);
+    }
+    free(base);
+    printf("%d regression%s against %s\n", regressions, regressions == 1 ? "" : "s", path);
+    return regressions;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* the *.proc files of dir, sorted so that runs line up */
+static char **list_workloads(const char *dir, int *n) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "cannot open workload directory %s\n", dir);
+        exit(1);
+    }
+    char **paths = NULL;
+    int cap = 0;
+    *n = 0;
+    for (struct dirent *e; (e = readdir(d)) != NULL;) {
+        size_t len = strlen(e->d_name);
+        if (len <= 5 || strcmp(e->d_name + len - 5, ".proc") != 0) {
+            continue;
+        }
+        if (*n == cap) {
+            cap = cap ? cap * 2 : 16;
+            paths = realloc(paths, cap * sizeof(char *));
+        }
+        paths[*n] = malloc(strlen(dir) + len + 2);
+        if (!paths || !paths[*n]) {
+            fprintf(stderr, "failed to list workloads!\n");
+            exit(1);
+        }
+        sprintf(paths[*n], "%s/%s", dir, e->d_name);
+        *n += 1;
+    }
+    closedir(d);
+    qsort(paths, *n, sizeof(char *), compare_names);
+    return paths;
+}
+
+/* file name without directory and .proc */
+static const char *workload_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    const char *base = slash ? slash + 1 : path;
+    char *name = strdup(base);
+    char *dot = strrchr(name, '.');
+    if (dot && strcmp(dot, ".proc") == 0) {
+        *dot = '\0';
+    }
+    return name;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [options] [FILE...]\n"
+            "runs every workload in " PROC_BENCH_DIR " unless files are given\n"
+            "options: --warmup=N           untimed runs first, 3 by default\n"
+            "         --reps=N             timed runs, 20 by default\n"
+            "         --engine=E[,E]       tree, flat, vm, fused, jit, loops,\n"
+            "                              cc, cps or all,\n"
+            "                              tree by default\n"
+            "         --perf               average hardware counters per run\n"
+            "         --json=OUT           write every sample and summary to OUT\n"
+            "         --save-baseline=OUT  the same, meant to be checked in\n"
+            "         --baseline=IN        compare against IN, exit 1 on a regression\n"
+            "         --time-threshold=P   median slowdown to flag, 10 (percent) by default\n"
+            "         --alloc-threshold=P  allocation growth to flag, 5 by default\n"
+            "         --rss-threshold=P    peak RSS growth to flag, 20 by default\n"
+            "         --alpha=A            significance level for time, 0.01 by default\n",
+            name);
+}
+
+int main(int argc, char *argv[]) {
+    bench_options_s opt = { 3, 20, { 0 }, 0, NULL, NULL, 10.0, 5.0, 20.0, 0.01 };
+    char **files = malloc(argc * sizeof(char *));
+    int nfiles = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--warmup=", 9) == 0) {
+            opt.warmup = atoi(argv[i] + 9);
+        } else if (strncmp(argv[i], "--reps=", 7) == 0) {
+            opt.reps = atoi(argv[i] + 7);
+        } else if (strncmp(argv[i], "--engine=", 9) == 0) {
+            const char *e = argv[i] + 9;
+            opt.engines[ENGINE_TREE] |= strstr(e, "tree") || strcmp(e, "all") == 0;
+            opt.engines[ENGINE_FLAT] |= strstr(e, "flat") || strcmp(e, "all") == 0;
+            opt.engines[ENGINE_VM] |= strstr(e, "vm") || strcmp(e, "all") == 0;
+            opt.engines[ENGINE_FUSED] |= strstr(e, "fused") || strcmp(e, "all") == 0;
+            opt.engines[ENGINE_JIT] |= strstr(e, "jit") || strcmp(e, "all") == 0;
+            opt.engines[ENGINE_LOOPS] |= strstr(e, "loops") || strcmp(e, "all") == 0;
+            opt.engines[ENGINE_CC] |= strstr(e, "cc") || strcmp(e, "all") == 0;
+            opt.engines[ENGINE_CPS] |= strstr(e, "cps") || strcmp(e, "all") == 0;
+        } else if (strcmp(argv[i], "--perf") == 0) {
+            opt.perf = 1;
+        } else if (strncmp(argv[i], "--json=", 7) == 0) {
+            opt.json = argv[i] + 7;
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            opt.json = argv[++i];
+        } else if (strncmp(argv[i], "--save-baseline=", 16) == 0) {
+            opt.json = argv[i] + 16;
+        } else if (strncmp(argv[i], "--baseline=", 11) == 0) {
+            opt.baseline = argv[i] + 11;
+        } else if (strncmp(argv[i], "--time-threshold=", 17) == 0) {
+            opt.time_threshold = atof(argv[i] + 17);
+        } else if (strncmp(argv[i], "--alloc-threshold=", 18) == 0) {
+            opt.alloc_threshold = atof(argv[i] + 18);
+        } else if (strncmp(argv[i], "--rss-threshold=", 16) == 0) {
+            opt.rss_threshold = atof(argv[i] + 16);
+        } else if (strncmp(argv[i], "--alpha=", 8) == 0) {
+            opt.alpha = atof(argv[i] + 8);
+        } else if (argv[i][0] != '-') {
+            files[nfiles++] = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opt.reps < 1 || opt.warmup < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!opt.engines[ENGINE_TREE] && !opt.engines[ENGINE_FLAT] && !opt.engines[ENGINE_VM] &&
+        !opt.engines[ENGINE_FUSED] && !opt.engines[ENGINE_JIT] &&
+        !opt.engines[ENGINE_LOOPS] && !opt.engines[ENGINE_CC] && !opt.engines[ENGINE_CPS]) {
+        opt.engines[ENGINE_TREE] = 1;
+    }
+    if (nfiles == 0) {
+        free(files);
+        files = list_workloads(PROC_BENCH_DIR, &nfiles);
+    }
+    /* children open their own counters; this only finds out whether they can */
+    if (opt.perf) {
+        opt.perf = perf_counters_open() > 0;
+        perf_counters_close();
+    }
+
+    proc_quiet = 1;
+    bench_result_t results = calloc(nfiles * ENGINE_COUNT, sizeof(bench_result_s));
+    int nresults = 0;
+    printf("%-16s %-5s %10s %10s %10s %10s %10s %10s %10s %8s\n",
+           "workload", "eng", "min us", "median", "mean", "p95", "p99", "max", "allocs", "rss kb");
+    for (int i = 0; i < nfiles; ++i) {
+        for (int e = 0; e < ENGINE_COUNT; ++e) {
+            if (opt.engines[e]) {
+                bench_result_t r = &results[nresults++];
+                r->name = workload_name(files[i]);
+                bench_isolated(files[i], e, &opt, r);
+                print_result(stdout, r);
+                if (r->sum.has_perf) {
+                    perf_counters_print(stdout, engine_names[e], &r->sum.perf);
+                }
+            }
+        }
+    }
+    if (opt.json) {
+        write_json(opt.json, &opt, results, nresults);
+    }
+    if (opt.baseline && compare_baseline(opt.baseline, &opt, results, nresults) > 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,552 @@
+/* closure compilation: each node compiled once into a step function */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proc.h"
+
+/*
+ * A cc node is a C function pointer with its operands decoded ahead of
+ * time. The function is picked by the shape of the node's children, so
+ * the common shapes (a variable less a constant, an if on zero? of a
+ * variable, a call of a variable) run in one step with no continuation,
+ * and the variables they only read as numbers are not copied. Everything
+ * else runs as the tree engine would, one node per step.
+ *
+ * Values and environments are the tree engine's exp_val_t and env_t,
+ * with the same ownership: a step that leaves a value in cc_val hands it
+ * to whatever continues. Procedures keep their compiled body in the
+ * ast_node_t body field, as the flat engine keeps a node index there.
+ *
+ * The trampoline runs steps until one leaves a value, then pops a frame
+ * off its own stack and runs its continuation. Frames grow on the heap,
+ * so deep recursion in the guest never touches the C stack.
+ */
+typedef struct cc_node_s *cc_node_t;
+typedef void (*cc_step_t)(cc_node_t n);
+
+struct cc_node_s {
+    cc_step_t step;
+    exp_type type;    /* of the ast node, for the statistics */
+    symbol_t var1;
+    symbol_t var2;
+    int num;
+    cc_node_t kid1;
+    cc_node_t kid2;
+    cc_node_t kid3;
+    symbol_t name;
+    int line;
+};
+
+struct cc_program_s {
+    cc_node_t root;
+    cc_node_t *nodes;
+    size_t nnodes;
+    size_t cap;
+};
+
+#define CC_BODY(n) ((ast_node_t)(n))
+#define CC_NODE(b) ((cc_node_t)(b))
+
+typedef struct cc_frame_s *cc_frame_t;
+typedef void (*cc_kont_t)(cc_frame_t f);
+
+typedef struct cc_frame_s {
+    cc_kont_t k;
+    cc_node_t n;      /* the node that pushed the frame */
+    env_t env;        /* to go back to; the caller's env of a return */
+    exp_val_t val;    /* an operand waiting, or the rator a return owns */
+    proc_t proc;      /* the procedure a return frame is running */
+} cc_frame_s;
+
+/* machine registers */
+static env_t cc_env;
+static exp_val_t cc_val;
+static cc_node_t cc_next;
+static cc_frame_s *cc_frames;
+static size_t cc_sp;
+static size_t cc_cap;
+static volatile int cc_moving;  /* the frames are being reallocated */
+
+static void report_cc_malloc_fail(const char *what) {
+    fprintf(stderr, "failed to grow cc %s!\n", what);
+    exit(1);
+}
+
+/* a frame is filled in before the stack grows over it, so the sampling
+ * profiler only ever sees whole frames */
+static cc_frame_t cc_push(cc_kont_t k, cc_node_t n) {
+    if (cc_sp == cc_cap) {
+        cc_cap = cc_cap ? cc_cap * 2 : 256;
+        cc_moving = 1;
+        cc_frames = realloc(cc_frames, cc_cap * sizeof(cc_frame_s));
+        if (!cc_frames) {
+            report_cc_malloc_fail("frames");
+        }
+        cc_moving = 0;
+    }
+    cc_frame_t f = &cc_frames[cc_sp];
+    f->k = k;
+    f->n = n;
+    f->env = cc_env;
+    f->val = NULL;
+    f->proc = NULL;
+    if (++cc_sp > proc_stats->cont_peak) {
+        proc_stats->cont_peak = cc_sp;
+    }
+    return f;
+}
+
+/* continuations */
+
+static void cc_k_zero(cc_frame_t f) {
+    boolean_t z = expval_to_int(cc_val) == 0 ? TRUE : FALSE;
+    exp_val_free(cc_val);
+    cc_val = new_bool_val(z);
+}
+
+static void cc_k_if(cc_frame_t f) {
+    boolean_t b = expval_to_bool(cc_val);
+    exp_val_free(cc_val);
+    cc_env = f->env;
+    cc_next = b ? f->n->kid2 : f->n->kid3;
+}
+
+static void cc_k_diff2(cc_frame_t f);
+static void cc_k_let2(cc_frame_t f);
+static void cc_k_rand(cc_frame_t f);
+
+static void cc_k_diff1(cc_frame_t f) {
+    cc_env = f->env;
+    cc_frame_t g = cc_push(cc_k_diff2, f->n);
+    g->val = cc_val;
+    cc_next = f->n->kid2;
+}
+
+static void cc_k_diff2(cc_frame_t f) {
+    int d = expval_to_int(f->val) - expval_to_int(cc_val);
+    exp_val_free(cc_val);
+    exp_val_free(f->val);
+    cc_val = new_int_val(d);
+}
+
+/* -(exp, num): exp is in */
+static void cc_k_diff_k(cc_frame_t f) {
+    int d = expval_to_int(cc_val) - f->n->num;
+    exp_val_free(cc_val);
+    cc_val = new_int_val(d);
+}
+
+static void cc_k_let(cc_frame_t f) {
+    cc_env = extend_env(f->n->var1, cc_val, f->env);
+    cc_push(cc_k_let2, f->n);
+    cc_next = f->n->kid2;
+}
+
+/* the end of a let or letrec body: drop the binding */
+static void cc_k_let2(cc_frame_t f) {
+    cc_env = env_pop(cc_env);
+}
+
+static void cc_k_rator(cc_frame_t f) {
+    cc_env = f->env;
+    cc_frame_t g = cc_push(cc_k_rand, f->n);
+    g->val = cc_val;
+    cc_next = f->n->kid2;
+}
+
+static void cc_k_return(cc_frame_t f) {
+    TRACE_END(proc_name(f->proc));
+    PROC_PROBE1(call_return, proc_name(f->proc));
+    env_pop(cc_env);
+    cc_env = f->env;
+    exp_val_free(f->val);
+}
+
+/*
+ * Runs rator on rand, which the callee's env takes over; the return frame
+ * frees rator. Rators are copies, as in the tree engine: a procedure
+ * borrowed from its binding would cache the next one in its own env's
+ * letrec frame, and a deep recursion would leave a chain of them that
+ * only a recursive free could take apart.
+ */
+static void cc_apply(exp_val_t rator, exp_val_t rand) {
+    proc_t p = expval_to_proc(rator);
+    /* exp_val_s is private to proc.c, so the events go without the arg */
+    PROC_PROBE3(call_entry, proc_name(p), p->line, 0L);
+    TRACE_BEGIN(proc_name(p), p->line, NULL, 0);
+    cc_frame_t f = cc_push(cc_k_return, NULL);
+    f->proc = p;
+    f->val = rator;
+    cc_env = extend_env(p->id, rand, p->env);
+    cc_next = CC_NODE(p->body);
+}
+
+static void cc_k_rand(cc_frame_t f) {
+    cc_apply(f->val, cc_val);
+}
+
+/* the procedures of the return frames, innermost call first, for the
+ * sampling profiler; a return frame gets its procedure after the push */
+static int cc_call_stack(guest_frame_s *frames, int max, int *more) {
+    int n = 0;
+    *more = 0;
+    if (cc_moving) {
+        return 0;
+    }
+    for (size_t i = cc_sp; i > 0; --i) {
+        cc_frame_t f = &cc_frames[i - 1];
+        if (f->k != cc_k_return || !f->proc) {
+            continue;
+        }
+        if (n == max) {
+            *more = 1;
+            break;
+        }
+        frames[n].name = f->proc->name;
+        frames[n].line = f->proc->line;
+        n += 1;
+    }
+    return n;
+}
+
+/* the rator is still the binding: copied only now, so that a deep
+ * recursion in the rand does not keep a copy alive at every level */
+static void cc_k_rand_var(cc_frame_t f) {
+    cc_apply(copy_exp_val(f->val), cc_val);
+}
+
+/* steps */
+
+static void cc_const(cc_node_t n) {
+    cc_val = new_int_val(n->num);
+}
+
+static void cc_var(cc_node_t n) {
+    cc_val = copy_exp_val(apply_env(cc_env, n->var1));
+}
+
+static void cc_proc(cc_node_t n) {
+    cc_val = new_proc_val(new_proc(n->var1, CC_BODY(n->kid1), cc_env, n->name, n->line));
+}
+
+static void cc_letrec(cc_node_t n) {
+    cc_env = extend_env_rec(n->var1, n->var2, CC_BODY(n->kid1), n->line, cc_env);
+    cc_push(cc_k_let2, n);
+    cc_next = n->kid2;
+}
+
+static void cc_zero(cc_node_t n) {
+    cc_push(cc_k_zero, n);
+    cc_next = n->kid1;
+}
+
+/* zero?(var) */
+static void cc_zero_v(cc_node_t n) {
+    cc_val = new_bool_val(expval_to_int(apply_env(cc_env, n->var1)) == 0 ? TRUE : FALSE);
+}
+
+static void cc_if(cc_node_t n) {
+    cc_push(cc_k_if, n);
+    cc_next = n->kid1;
+}
+
+/* if zero?(var) then kid2 else kid3 */
+static void cc_if_zero_v(cc_node_t n) {
+    cc_next = expval_to_int(apply_env(cc_env, n->var1)) == 0 ? n->kid2 : n->kid3;
+}
+
+static void cc_let(cc_node_t n) {
+    cc_push(cc_k_let, n);
+    cc_next = n->kid1;
+}
+
+static void cc_diff(cc_node_t n) {
+    cc_push(cc_k_diff1, n);
+    cc_next = n->kid1;
+}
+
+/* -(var, num) */
+static void cc_diff_vk(cc_node_t n) {
+    cc_val = new_int_val(expval_to_int(apply_env(cc_env, n->var1)) - n->num);
+}
+
+/* -(var, var); both are looked up before either is checked, as in the
+ * tree engine */
+static void cc_diff_vv(cc_node_t n) {
+    exp_val_t x = apply_env(cc_env, n->var1);
+    exp_val_t y = apply_env(cc_env, n->var2);
+    cc_val = new_int_val(expval_to_int(x) - expval_to_int(y));
+}
+
+/* -(exp, num) */
+static void cc_diff_gk(cc_node_t n) {
+    cc_push(cc_k_diff_k, n);
+    cc_next = n->kid1;
+}
+
+static void cc_call(cc_node_t n) {
+    cc_push(cc_k_rator, n);
+    cc_next = n->kid1;
+}
+
+/* (var exp) */
+static void cc_call_vg(cc_node_t n) {
+    cc_frame_t f = cc_push(cc_k_rand_var, n);
+    f->val = apply_env(cc_env, n->var1);
+    cc_next = n->kid2;
+}
+
+/* (var var) */
+static void cc_call_vv(cc_node_t n) {
+    exp_val_t rator = copy_exp_val(apply_env(cc_env, n->var1));
+    cc_apply(rator, copy_exp_val(apply_env(cc_env, n->var2)));
+}
+
+/* (var -(var, num)) */
+static void cc_call_vk(cc_node_t n) {
+    exp_val_t rator = copy_exp_val(apply_env(cc_env, n->var1));
+    cc_apply(rator, new_int_val(expval_to_int(apply_env(cc_env, n->var2)) - n->num));
+}
+
+/* compiler */
+
+typedef struct cc_task_s {
+    ast_node_t exp;
+    cc_node_t *slot;
+} cc_task_s;
+
+typedef struct cc_builder_s {
+    cc_program_t prog;
+    cc_task_s *tasks;
+    size_t len;
+    size_t cap;
+} cc_builder_s, *cc_builder_t;
+
+static void cc_task_push(cc_builder_t b, ast_node_t exp, cc_node_t *slot) {
+    if (b->len == b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 64;
+        b->tasks = realloc(b->tasks, b->cap * sizeof(cc_task_s));
+        if (!b->tasks) {
+            report_cc_malloc_fail("worklist");
+        }
+    }
+    b->tasks[b->len].exp = exp;
+    b->tasks[b->len].slot = slot;
+    b->len += 1;
+}
+
+static cc_node_t cc_node_new(cc_builder_t b, cc_step_t step, exp_type type) {
+    cc_program_t prog = b->prog;
+    if (prog->nnodes == prog->cap) {
+        prog->cap = prog->cap ? prog->cap * 2 : 64;
+        prog->nodes = realloc(prog->nodes, prog->cap * sizeof(cc_node_t));
+        if (!prog->nodes) {
+            report_cc_malloc_fail("nodes");
+        }
+    }
+    cc_node_t n = calloc(1, sizeof(struct cc_node_s));
+    if (!n) {
+        report_cc_malloc_fail("nodes");
+    }
+    n->step = step;
+    n->type = type;
+    prog->nodes[prog->nnodes++] = n;
+    return n;
+}
+
+static int is_var(ast_node_t e) {
+    return e->type == VAR_EXP;
+}
+
+static int is_const(ast_node_t e) {
+    return e->type == CONST_EXP;
+}
+
+/* -(var, num) */
+static int is_dec_var(ast_node_t e) {
+    return e->type == DIFF_EXP && is_var(((ast_diff_t)e)->exp1) && is_const(((ast_diff_t)e)->exp2);
+}
+
+/* the node for e, with its general children left on the worklist */
+static cc_node_t cc_compile_node(cc_builder_t b, ast_node_t e) {
+    cc_node_t n = NULL;
+    switch (e->type) {
+        case CONST_EXP: {
+            n = cc_node_new(b, cc_const, e->type);
+            n->num = ((ast_const_t)e)->num;
+            break;
+        }
+        case VAR_EXP: {
+            n = cc_node_new(b, cc_var, e->type);
+            n->var1 = ((ast_var_t)e)->var;
+            break;
+        }
+        case PROC_EXP: {
+            ast_proc_t p = (ast_proc_t)e;
+            n = cc_node_new(b, cc_proc, e->type);
+            n->var1 = p->var;
+            n->name = p->name;
+            n->line = p->line;
+            cc_task_push(b, p->body, &n->kid1);
+            break;
+        }
+        case LETREC_EXP: {
+            ast_letrec_t l = (ast_letrec_t)e;
+            n = cc_node_new(b, cc_letrec, e->type);
+            n->var1 = l->p_name;
+            n->var2 = l->p_var;
+            n->line = l->line;
+            cc_task_push(b, l->p_body, &n->kid1);
+            cc_task_push(b, l->letrec_body, &n->kid2);
+            break;
+        }
+        case ZERO_EXP: {
+            ast_zero_t z = (ast_zero_t)e;
+            if (is_var(z->exp1)) {
+                n = cc_node_new(b, cc_zero_v, e->type);
+                n->var1 = ((ast_var_t)z->exp1)->var;
+            } else {
+                n = cc_node_new(b, cc_zero, e->type);
+                cc_task_push(b, z->exp1, &n->kid1);
+            }
+            break;
+        }
+        case IF_EXP: {
+            ast_if_t i = (ast_if_t)e;
+            if (i->cond->type == ZERO_EXP && is_var(((ast_zero_t)i->cond)->exp1)) {
+                n = cc_node_new(b, cc_if_zero_v, e->type);
+                n->var1 = ((ast_var_t)((ast_zero_t)i->cond)->exp1)->var;
+            } else {
+                n = cc_node_new(b, cc_if, e->type);
+                cc_task_push(b, i->cond, &n->kid1);
+            }
+            cc_task_push(b, i->exp1, &n->kid2);
+            cc_task_push(b, i->exp2, &n->kid3);
+            break;
+        }
+        case LET_EXP: {
+            ast_let_t l = (ast_let_t)e;
+            n = cc_node_new(b, cc_let, e->type);
+            n->var1 = l->id;
+            cc_task_push(b, l->exp1, &n->kid1);
+            cc_task_push(b, l->exp2, &n->kid2);
+            break;
+        }
+        case DIFF_EXP: {
+            ast_diff_t d = (ast_diff_t)e;
+            if (is_var(d->exp1) && is_const(d->exp2)) {
+                n = cc_node_new(b, cc_diff_vk, e->type);
+                n->var1 = ((ast_var_t)d->exp1)->var;
+                n->num = ((ast_const_t)d->exp2)->num;
+            } else if (is_var(d->exp1) && is_var(d->exp2)) {
+                n = cc_node_new(b, cc_diff_vv, e->type);
+                n->var1 = ((ast_var_t)d->exp1)->var;
+                n->var2 = ((ast_var_t)d->exp2)->var;
+            } else if (is_const(d->exp2)) {
+                n = cc_node_new(b, cc_diff_gk, e->type);
+                n->num = ((ast_const_t)d->exp2)->num;
+                cc_task_push(b, d->exp1, &n->kid1);
+            } else {
+                n = cc_node_new(b, cc_diff, e->type);
+                cc_task_push(b, d->exp1, &n->kid1);
+                cc_task_push(b, d->exp2, &n->kid2);
+            }
+            break;
+        }
+        case CALL_EXP: {
+            ast_call_t c = (ast_call_t)e;
+            if (!is_var(c->rator)) {
+                n = cc_node_new(b, cc_call, e->type);
+                cc_task_push(b, c->rator, &n->kid1);
+                cc_task_push(b, c->rand, &n->kid2);
+            } else if (is_var(c->rand)) {
+                n = cc_node_new(b, cc_call_vv, e->type);
+                n->var2 = ((ast_var_t)c->rand)->var;
+            } else if (is_dec_var(c->rand)) {
+                ast_diff_t d = (ast_diff_t)c->rand;
+                n = cc_node_new(b, cc_call_vk, e->type);
+                n->var2 = ((ast_var_t)d->exp1)->var;
+                n->num = ((ast_const_t)d->exp2)->num;
+            } else {
+                n = cc_node_new(b, cc_call_vg, e->type);
+                cc_task_push(b, c->rand, &n->kid2);
+            }
+            if (is_var(c->rator)) {
+                n->var1 = ((ast_var_t)c->rator)->var;
+            }
+            break;
+        }
+        default: {
+            /* superinstructions belong to the tree engine */
+            fprintf(stderr, "unknown type of expression: %d\n", e->type);
+            exit(1);
+        }
+    }
+    return n;
+}
+
+/* with a worklist, like the other tree walks, so that a deep program
+ * cannot overflow the C stack */
+cc_program_t cc_compile(ast_program_t prgm) {
+    cc_program_t prog = calloc(1, sizeof(struct cc_program_s));
+    if (!prog) {
+        report_cc_malloc_fail("program");
+    }
+    cc_builder_s b;
+    memset(&b, 0x00, sizeof(b));
+    b.prog = prog;
+    cc_task_push(&b, prgm->exp, &prog->root);
+    while (b.len > 0) {
+        cc_task_s t = b.tasks[--b.len];
+        *t.slot = cc_compile_node(&b, t.exp);
+    }
+    free(b.tasks);
+    return prog;
+}
+
+void cc_program_free(cc_program_t prog) {
+    if (prog) {
+        for (size_t i = 0; i < prog->nnodes; ++i) {
+            free(prog->nodes[i]);
+        }
+        free(prog->nodes);
+        free(prog);
+    }
+}
+
+/* the trampoline */
+
+void value_of_program_cc(cc_program_t prog) {
+    env_t e = empty_env();
+    cc_env = e;
+    cc_val = NULL;
+    cc_next = prog->root;
+    cc_sp = 0;
+    engine_call_stack = cc_call_stack;
+    for (;;) {
+        while (cc_next) {
+            cc_node_t n = cc_next;
+            cc_next = NULL;
+            STATS_INC(steps[n->type]);
+            n->step(n);
+        }
+        if (cc_sp == 0) {
+            break;
+        }
+        /* a continuation may push, and so move the stack */
+        cc_frame_s f = cc_frames[--cc_sp];
+        STATS_INC(bounces);
+        f.k(&f);
+    }
+    engine_call_stack = NULL;
+    if (!proc_quiet) {
+        printf("End of computation.\n");
+        print_exp_val(cc_val);
+    }
+    exp_val_free(cc_val);
+    cc_val = NULL;
+    env_pop(e);
+    free(cc_frames);
+    cc_frames = NULL;
+    cc_cap = 0;
+}
@@ -0,0 +1,1167 @@
+/* cps conversion: the program in continuation-passing style, after chapter 6.3 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proc.h"
+
+/*
+ * cps_convert follows cps-of-exp in ch06/chap06.s03.scm. Simple
+ * expressions (numbers, variables, procs, and -( ) and zero?( ) over
+ * simple expressions) stay as they are; only a call that is not in tail
+ * position gets a continuation, as a proc of one parameter. Every proc of
+ * the program takes its continuation as a second parameter %k.
+ *
+ * Unlike the book:
+ * - a continuation sent a value in the scope it was made in becomes a let
+ *   instead of a call, and one that an if would copy into both branches
+ *   is let-bound first;
+ * - a simple operand that can fail and comes before a call is let-bound
+ *   before the call, so that errors show in the order the tree engine
+ *   reports them;
+ * - variables are resolved to their depth in the environment as they are
+ *   converted.
+ *
+ * The output runs in a loop: every call is a tail call, so there is no
+ * continuation stack, and the only continuations are the procs the
+ * conversion made. Environments are refcounted chains of frames shared
+ * by the closures over them.
+ */
+typedef enum {
+    /* simple */
+    CPS_CONST = 0x00,
+    CPS_VAR,          /* num: depth of the binding */
+    CPS_UNBOUND,      /* reported when reached */
+    CPS_PROC,         /* var, the continuation var2 or NULL, body; num
+                       * frames dropped from the env it closes over */
+    CPS_DIFF,         /* kid1, kid2 */
+    CPS_ZERO,         /* kid1 */
+    /* tail form */
+    CPS_RETURN,       /* kid1 is the value of the program */
+    CPS_IF,           /* kid1 test, kid2 then, kid3 else */
+    CPS_LET,          /* var = kid1 in body */
+    CPS_LETREC,       /* var is the proc kid1 in body */
+    CPS_CALL          /* (kid1 kid2 kid3), kid3 NULL for a continuation */
+} cps_type_t;
+
+typedef struct cps_node_s *cps_node_t;
+
+struct cps_node_s {
+    cps_type_t type;
+    symbol_t var;
+    symbol_t var2;
+    int num;
+    cps_node_t kid1;
+    cps_node_t kid2;
+    cps_node_t kid3;
+    cps_node_t body;
+};
+
+struct cps_program_s {
+    cps_node_t root;
+    cps_node_t *nodes;
+    size_t nnodes;
+    size_t nodes_cap;
+    symbol_t *syms;   /* the fresh variables */
+    size_t nsyms;
+    size_t syms_cap;
+};
+
+static void report_cps_malloc_fail(const char *what) {
+    fprintf(stderr, "failed to grow cps %s!\n", what);
+    exit(1);
+}
+
+/* grows *array so that one more element of size fits */
+static void *cps_grow(void *array, size_t n, size_t *cap, size_t size, const char *what) {
+    if (n == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        array = realloc(array, *cap * size);
+        if (!array) {
+            report_cps_malloc_fail(what);
+        }
+    }
+    return array;
+}
+
+/* converter */
+
+/* the names in scope, innermost first, one per frame of the environment
+ * the code will run in */
+typedef struct cps_scope_s *cps_scope_t;
+struct cps_scope_s {
+    symbol_t var;
+    cps_scope_t up;
+};
+
+/* where a value goes: the end of the program, a continuation variable, or
+ * a continuation proc that was made in scope and is used once */
+typedef enum {
+    K_HALT = 0x00,
+    K_VAR,
+    K_PROC
+} cps_k_kind_t;
+
+typedef struct cps_k_s {
+    cps_k_kind_t kind;
+    symbol_t var;
+    cps_node_t proc;
+    cps_scope_t scope;
+} cps_k_s;
+
+/* an operand of a node being built: an expression of the program, or the
+ * fresh variable that holds its value by now */
+typedef struct cps_operand_s {
+    ast_node_t exp;
+    symbol_t var;
+} cps_operand_s;
+
+typedef enum {
+    TASK_EXP = 0x00,  /* exp to k */
+    TASK_SIMPLE,      /* the simple exp itself */
+    TASK_REST,        /* ops, once they are simple, to the builder */
+} cps_task_kind_t;
+
+typedef struct cps_task_s {
+    cps_task_kind_t kind;
+    ast_node_t exp;
+    cps_operand_s ops[2];
+    int nops;
+    exp_type builder;  /* of the node whose operands ops are */
+    cps_k_s k;
+    cps_scope_t scope;
+    cps_node_t *slot;
+} cps_task_s, *cps_task_t;
+
+/* an open-addressed set of the diff and zero? nodes that are simple */
+typedef struct cps_simple_set_s {
+    ast_node_t *keys;
+    size_t cap;
+    size_t len;
+} cps_simple_set_s;
+
+typedef struct cps_builder_s {
+    cps_program_t prog;
+    cps_task_s *tasks;
+    size_t ntasks;
+    size_t tasks_cap;
+    cps_scope_t *scopes;
+    size_t nscopes;
+    size_t scopes_cap;
+    cps_simple_set_s simple;
+    symbol_t k_sym;
+    unsigned fresh;
+} cps_builder_s, *cps_builder_t;
+
+static size_t cps_hash(ast_node_t e, size_t cap) {
+    return ((uintptr_t)e >> 4) * 2654435761u & (cap - 1);
+}
+
+static void cps_simple_add(cps_simple_set_s *s, ast_node_t e) {
+    if (2 * (s->len + 1) > s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 64;
+        ast_node_t *keys = calloc(cap, sizeof(ast_node_t));
+        if (!keys) {
+            report_cps_malloc_fail("simple set");
+        }
+        for (size_t i = 0; i < s->cap; ++i) {
+            if (s->keys[i]) {
+                size_t h = cps_hash(s->keys[i], cap);
+                while (keys[h]) {
+                    h = (h + 1) & (cap - 1);
+                }
+                keys[h] = s->keys[i];
+            }
+        }
+        free(s->keys);
+        s->keys = keys;
+        s->cap = cap;
+    }
+    size_t h = cps_hash(e, s->cap);
+    while (s->keys[h]) {
+        h = (h + 1) & (s->cap - 1);
+    }
+    s->keys[h] = e;
+    s->len += 1;
+}
+
+static int cps_simple_has(cps_simple_set_s *s, ast_node_t e) {
+    if (s->cap == 0) {
+        return 0;
+    }
+    for (size_t h = cps_hash(e, s->cap); s->keys[h]; h = (h + 1) & (s->cap - 1)) {
+        if (s->keys[h] == e) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* inp-exp-simple? */
+static int cps_is_simple(cps_builder_t b, ast_node_t e) {
+    switch (e->type) {
+        case CONST_EXP:
+        case VAR_EXP:
+        case PROC_EXP:
+            return 1;
+        case DIFF_EXP:
+        case ZERO_EXP:
+            return cps_simple_has(&b->simple, e);
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Marks every simple diff and zero? of the program, children first, so
+ * that cps_is_simple is one lookup. A node is pushed once to visit and
+ * once more, tagged in its low bit, to be decided after its children.
+ */
+static void cps_mark_simple(cps_builder_t b, ast_node_t root) {
+    ast_node_t *stack = NULL;
+    size_t n = 0, cap = 0;
+    stack = cps_grow(stack, n, &cap, sizeof(ast_node_t), "worklist");
+    stack[n++] = root;
+    while (n > 0) {
+        ast_node_t e = stack[--n];
+        if ((uintptr_t)e & 1) {
+            e = (ast_node_t)((uintptr_t)e & ~(uintptr_t)1);
+            int simple = e->type == ZERO_EXP ? cps_is_simple(b, ((ast_zero_t)e)->exp1) :
+                cps_is_simple(b, ((ast_diff_t)e)->exp1) && cps_is_simple(b, ((ast_diff_t)e)->exp2);
+            if (simple) {
+                cps_simple_add(&b->simple, e);
+            }
+            continue;
+        }
+        ast_node_t kids[3] = { NULL, NULL, NULL };
+        switch (e->type) {
+            case CONST_EXP:
+            case VAR_EXP:
+                break;
+            case PROC_EXP:
+                kids[0] = ((ast_proc_t)e)->body;
+                break;
+            case LETREC_EXP:
+                kids[0] = ((ast_letrec_t)e)->p_body;
+                kids[1] = ((ast_letrec_t)e)->letrec_body;
+                break;
+            case ZERO_EXP:
+                kids[0] = ((ast_zero_t)e)->exp1;
+                break;
+            case IF_EXP:
+                kids[0] = ((ast_if_t)e)->cond;
+                kids[1] = ((ast_if_t)e)->exp1;
+                kids[2] = ((ast_if_t)e)->exp2;
+                break;
+            case LET_EXP:
+                kids[0] = ((ast_let_t)e)->exp1;
+                kids[1] = ((ast_let_t)e)->exp2;
+                break;
+            case DIFF_EXP:
+                kids[0] = ((ast_diff_t)e)->exp1;
+                kids[1] = ((ast_diff_t)e)->exp2;
+                break;
+            case CALL_EXP:
+                kids[0] = ((ast_call_t)e)->rator;
+                kids[1] = ((ast_call_t)e)->rand;
+                break;
+            default: {
+                /* superinstructions belong to the tree engine */
+                fprintf(stderr, "unknown type of expression: %d\n", e->type);
+                exit(1);
+            }
+        }
+        if (e->type == DIFF_EXP || e->type == ZERO_EXP) {
+            stack = cps_grow(stack, n, &cap, sizeof(ast_node_t), "worklist");
+            stack[n++] = (ast_node_t)((uintptr_t)e | 1);
+        }
+        for (int i = 0; i < 3 && kids[i]; ++i) {
+            stack = cps_grow(stack, n, &cap, sizeof(ast_node_t), "worklist");
+            stack[n++] = kids[i];
+        }
+    }
+    free(stack);
+}
+
+static cps_node_t cps_node_new(cps_builder_t b, cps_type_t type) {
+    cps_program_t prog = b->prog;
+    prog->nodes = cps_grow(prog->nodes, prog->nnodes, &prog->nodes_cap, sizeof(cps_node_t), "nodes");
+    cps_node_t n = calloc(1, sizeof(struct cps_node_s));
+    if (!n) {
+        report_cps_malloc_fail("nodes");
+    }
+    n->type = type;
+    prog->nodes[prog->nnodes++] = n;
+    return n;
+}
+
+static cps_scope_t cps_bind(cps_builder_t b, cps_scope_t up, symbol_t var) {
+    b->scopes = cps_grow(b->scopes, b->nscopes, &b->scopes_cap, sizeof(cps_scope_t), "scopes");
+    cps_scope_t s = malloc(sizeof(struct cps_scope_s));
+    if (!s) {
+        report_cps_malloc_fail("scopes");
+    }
+    s->var = var;
+    s->up = up;
+    b->scopes[b->nscopes++] = s;
+    return s;
+}
+
+/* the depth of var's frame, or -1 */
+static int cps_depth(cps_scope_t s, symbol_t var) {
+    for (int d = 0; s; s = s->up, ++d) {
+        if (s->var == var) {
+            return d;
+        }
+    }
+    return -1;
+}
+
+/* fresh-identifier; % cannot start a name of the program */
+static symbol_t cps_fresh(cps_builder_t b, const char *prefix) {
+    char name[32];
+    snprintf(name, sizeof(name), "%%%s%u", prefix, ++b->fresh);
+    cps_program_t prog = b->prog;
+    prog->syms = cps_grow(prog->syms, prog->nsyms, &prog->syms_cap, sizeof(symbol_t), "symbols");
+    symbol_t s = symbol_new(name);
+    prog->syms[prog->nsyms++] = s;
+    return s;
+}
+
+static cps_node_t cps_var(cps_builder_t b, cps_scope_t scope, symbol_t var) {
+    int d = cps_depth(scope, var);
+    cps_node_t n = cps_node_new(b, d < 0 ? CPS_UNBOUND : CPS_VAR);
+    n->var = var;
+    n->num = d;
+    return n;
+}
+
+static void cps_push(cps_builder_t b, cps_task_s t) {
+    b->tasks = cps_grow(b->tasks, b->ntasks, &b->tasks_cap, sizeof(cps_task_s), "worklist");
+    b->tasks[b->ntasks++] = t;
+}
+
+static void cps_push_exp(cps_builder_t b, ast_node_t exp, cps_k_s k, cps_scope_t scope, cps_node_t *slot) {
+    cps_task_s t;
+    memset(&t, 0x00, sizeof(t));
+    t.kind = TASK_EXP;
+    t.exp = exp;
+    t.k = k;
+    t.scope = scope;
+    t.slot = slot;
+    cps_push(b, t);
+}
+
+static void cps_push_simple(cps_builder_t b, ast_node_t exp, cps_scope_t scope, cps_node_t *slot) {
+    cps_task_s t;
+    memset(&t, 0x00, sizeof(t));
+    t.kind = TASK_SIMPLE;
+    t.exp = exp;
+    t.scope = scope;
+    t.slot = slot;
+    cps_push(b, t);
+}
+
+static cps_k_s cps_k_var(symbol_t var) {
+    cps_k_s k = { K_VAR, var, NULL, NULL };
+    return k;
+}
+
+/* a continuation proc of one parameter whose body is left to fill */
+static cps_k_s cps_k_proc(cps_builder_t b, symbol_t var, cps_scope_t scope) {
+    cps_k_s k = { K_PROC, NULL, cps_node_new(b, CPS_PROC), scope };
+    k.proc->var = var;
+    return k;
+}
+
+/* the operand into *slot, now or by a task */
+static void cps_operand(cps_builder_t b, cps_operand_s op, cps_scope_t scope, cps_node_t *slot) {
+    if (op.var) {
+        *slot = cps_var(b, scope, op.var);
+    } else {
+        cps_push_simple(b, op.exp, scope, slot);
+    }
+}
+
+/* k as a value to pass in a call. A continuation proc was converted in
+ * the scope it was made in, which the operands before it may have
+ * extended since: its closure leaves out the frames they added. */
+static cps_node_t cps_k_node(cps_builder_t b, cps_k_s k, cps_scope_t scope) {
+    if (k.kind == K_VAR) {
+        return cps_var(b, scope, k.var);
+    } else if (k.kind == K_PROC) {
+        for (cps_scope_t s = scope; s != k.scope; s = s->up) {
+            k.proc->num += 1;
+        }
+        return k.proc;
+    } else {
+        /* proc (%v) %v */
+        cps_node_t p = cps_node_new(b, CPS_PROC);
+        p->var = cps_fresh(b, "v");
+        p->body = cps_node_new(b, CPS_RETURN);
+        p->body->kid1 = cps_var(b, cps_bind(b, scope, p->var), p->var);
+        return p;
+    }
+}
+
+/* make-send-to-cont; returns where the value goes */
+static cps_node_t *cps_send(cps_builder_t b, cps_k_s k, cps_scope_t scope, cps_node_t *slot) {
+    if (k.kind == K_HALT) {
+        *slot = cps_node_new(b, CPS_RETURN);
+        return &(*slot)->kid1;
+    } else if (k.kind == K_PROC && k.scope == scope) {
+        /* (proc (v) body s) is let v = s in body */
+        k.proc->type = CPS_LET;
+        *slot = k.proc;
+        return &k.proc->kid1;
+    } else {
+        *slot = cps_node_new(b, CPS_CALL);
+        (*slot)->kid1 = cps_k_node(b, k, scope);
+        return &(*slot)->kid2;
+    }
+}
+
+/* a simple expression that can stop the program */
+static int cps_can_fail(cps_operand_s op, cps_scope_t scope) {
+    if (op.var) {
+        return 0;
+    }
+    switch (op.exp->type) {
+        case DIFF_EXP:
+        case ZERO_EXP:
+            return 1;
+        case VAR_EXP:
+            return cps_depth(scope, ((ast_var_t)op.exp)->var) < 0;
+        default:
+            return 0;
+    }
+}
+
+static void cps_convert_simple(cps_builder_t b, cps_task_t t) {
+    ast_node_t e = t->exp;
+    switch (e->type) {
+        case CONST_EXP: {
+            *t->slot = cps_node_new(b, CPS_CONST);
+            (*t->slot)->num = ((ast_const_t)e)->num;
+            break;
+        }
+        case VAR_EXP: {
+            *t->slot = cps_var(b, t->scope, ((ast_var_t)e)->var);
+            break;
+        }
+        case PROC_EXP: {
+            ast_proc_t p = (ast_proc_t)e;
+            cps_node_t n = cps_node_new(b, CPS_PROC);
+            n->var = p->var;
+            n->var2 = b->k_sym;
+            *t->slot = n;
+            cps_scope_t s = cps_bind(b, cps_bind(b, t->scope, p->var), b->k_sym);
+            cps_push_exp(b, p->body, cps_k_var(b->k_sym), s, &n->body);
+            break;
+        }
+        case DIFF_EXP: {
+            cps_node_t n = cps_node_new(b, CPS_DIFF);
+            *t->slot = n;
+            cps_push_simple(b, ((ast_diff_t)e)->exp1, t->scope, &n->kid1);
+            cps_push_simple(b, ((ast_diff_t)e)->exp2, t->scope, &n->kid2);
+            break;
+        }
+        case ZERO_EXP: {
+            cps_node_t n = cps_node_new(b, CPS_ZERO);
+            *t->slot = n;
+            cps_push_simple(b, ((ast_zero_t)e)->exp1, t->scope, &n->kid1);
+            break;
+        }
+        default: {
+            fprintf(stderr, "not a simple expression: %d\n", e->type);
+            exit(1);
+        }
+    }
+}
+
+/* the node for t's builder over its operands, all simple by now */
+static void cps_build(cps_builder_t b, cps_task_t t) {
+    cps_scope_t scope = t->scope;
+    switch (t->builder) {
+        case ZERO_EXP: {
+            cps_node_t *at = cps_send(b, t->k, scope, t->slot);
+            *at = cps_node_new(b, CPS_ZERO);
+            cps_operand(b, t->ops[0], scope, &(*at)->kid1);
+            break;
+        }
+        case DIFF_EXP: {
+            cps_node_t *at = cps_send(b, t->k, scope, t->slot);
+            *at = cps_node_new(b, CPS_DIFF);
+            cps_operand(b, t->ops[0], scope, &(*at)->kid1);
+            cps_operand(b, t->ops[1], scope, &(*at)->kid2);
+            break;
+        }
+        case IF_EXP: {
+            ast_if_t i = (ast_if_t)t->exp;
+            cps_k_s k = t->k;
+            cps_node_t *slot = t->slot;
+            if (k.kind == K_PROC) {
+                /* both branches go to k: bind it rather than copy it */
+                cps_node_t let = cps_node_new(b, CPS_LET);
+                let->var = cps_fresh(b, "k");
+                let->kid1 = cps_k_node(b, k, scope);
+                *slot = let;
+                slot = &let->body;
+                scope = cps_bind(b, scope, let->var);
+                k = cps_k_var(let->var);
+            }
+            cps_node_t n = cps_node_new(b, CPS_IF);
+            *slot = n;
+            cps_operand(b, t->ops[0], scope, &n->kid1);
+            cps_push_exp(b, i->exp1, k, scope, &n->kid2);
+            cps_push_exp(b, i->exp2, k, scope, &n->kid3);
+            break;
+        }
+        case LET_EXP: {
+            ast_let_t l = (ast_let_t)t->exp;
+            cps_node_t n = cps_node_new(b, CPS_LET);
+            n->var = l->id;
+            *t->slot = n;
+            cps_operand(b, t->ops[0], scope, &n->kid1);
+            cps_push_exp(b, l->exp2, t->k, cps_bind(b, scope, l->id), &n->body);
+            break;
+        }
+        case CALL_EXP: {
+            cps_node_t n = cps_node_new(b, CPS_CALL);
+            *t->slot = n;
+            cps_operand(b, t->ops[0], scope, &n->kid1);
+            cps_operand(b, t->ops[1], scope, &n->kid2);
+            n->kid3 = cps_k_node(b, t->k, scope);
+            break;
+        }
+        default: {
+            fprintf(stderr, "unknown type of expression: %d\n", t->builder);
+            exit(1);
+        }
+    }
+}
+
+/* cps-of-rest */
+static void cps_convert_rest(cps_builder_t b, cps_task_t t) {
+    int pos = -1;
+    for (int i = 0; i < t->nops && pos < 0; ++i) {
+        if (!t->ops[i].var && !cps_is_simple(b, t->ops[i].exp)) {
+            pos = i;
+        }
+    }
+    if (pos < 0) {
+        cps_build(b, t);
+        return;
+    }
+    for (int i = 0; i < pos; ++i) {
+        if (cps_can_fail(t->ops[i], t->scope)) {
+            /* evaluate it before the call, as the tree engine does */
+            cps_node_t let = cps_node_new(b, CPS_LET);
+            let->var = cps_fresh(b, "t");
+            *t->slot = let;
+            cps_push_simple(b, t->ops[i].exp, t->scope, &let->kid1);
+            cps_task_s rest = *t;
+            rest.ops[i].exp = NULL;
+            rest.ops[i].var = let->var;
+            rest.scope = cps_bind(b, t->scope, let->var);
+            rest.slot = &let->body;
+            cps_push(b, rest);
+            return;
+        }
+    }
+    cps_k_s k = cps_k_proc(b, cps_fresh(b, "v"), t->scope);
+    cps_task_s rest = *t;
+    ast_node_t exp = t->ops[pos].exp;
+    rest.ops[pos].exp = NULL;
+    rest.ops[pos].var = k.proc->var;
+    rest.scope = cps_bind(b, t->scope, k.proc->var);
+    rest.slot = &k.proc->body;
+    cps_push(b, rest);
+    cps_push_exp(b, exp, k, t->scope, t->slot);
+}
+
+static void cps_push_rest(cps_builder_t b, cps_task_t t, exp_type builder,
+                          ast_node_t op1, ast_node_t op2) {
+    cps_task_s rest = *t;
+    rest.kind = TASK_REST;
+    rest.builder = builder;
+    rest.ops[0].exp = op1;
+    rest.ops[0].var = NULL;
+    rest.ops[1].exp = op2;
+    rest.ops[1].var = NULL;
+    rest.nops = op2 ? 2 : 1;
+    cps_push(b, rest);
+}
+
+/* cps-of-exp */
+static void cps_convert_exp(cps_builder_t b, cps_task_t t) {
+    ast_node_t e = t->exp;
+    if (cps_is_simple(b, e)) {
+        cps_node_t *at = cps_send(b, t->k, t->scope, t->slot);
+        cps_push_simple(b, e, t->scope, at);
+        return;
+    }
+    switch (e->type) {
+        case ZERO_EXP: {
+            cps_push_rest(b, t, ZERO_EXP, ((ast_zero_t)e)->exp1, NULL);
+            break;
+        }
+        case DIFF_EXP: {
+            cps_push_rest(b, t, DIFF_EXP, ((ast_diff_t)e)->exp1, ((ast_diff_t)e)->exp2);
+            break;
+        }
+        case IF_EXP: {
+            cps_push_rest(b, t, IF_EXP, ((ast_if_t)e)->cond, NULL);
+            break;
+        }
+        case LET_EXP: {
+            ast_let_t l = (ast_let_t)e;
+            if (cps_is_simple(b, l->exp1)) {
+                cps_push_rest(b, t, LET_EXP, l->exp1, NULL);
+            } else {
+                /* the continuation of exp1 binds the let's own variable */
+                cps_k_s k = cps_k_proc(b, l->id, t->scope);
+                cps_push_exp(b, l->exp2, t->k, cps_bind(b, t->scope, l->id), &k.proc->body);
+                cps_push_exp(b, l->exp1, k, t->scope, t->slot);
+            }
+            break;
+        }
+        case LETREC_EXP: {
+            ast_letrec_t l = (ast_letrec_t)e;
+            cps_node_t n = cps_node_new(b, CPS_LETREC);
+            cps_node_t p = cps_node_new(b, CPS_PROC);
+            n->var = l->p_name;
+            n->kid1 = p;
+            p->var = l->p_var;
+            p->var2 = b->k_sym;
+            *t->slot = n;
+            cps_scope_t s = cps_bind(b, t->scope, l->p_name);
+            cps_push_exp(b, l->p_body, cps_k_var(b->k_sym),
+                         cps_bind(b, cps_bind(b, s, l->p_var), b->k_sym), &p->body);
+            cps_push_exp(b, l->letrec_body, t->k, s, &n->body);
+            break;
+        }
+        case CALL_EXP: {
+            cps_push_rest(b, t, CALL_EXP, ((ast_call_t)e)->rator, ((ast_call_t)e)->rand);
+            break;
+        }
+        default: {
+            fprintf(stderr, "unknown type of expression: %d\n", e->type);
+            exit(1);
+        }
+    }
+}
+
+/* with a worklist, like the other tree walks, so that a deep program
+ * cannot overflow the C stack */
+cps_program_t cps_convert(ast_program_t prgm) {
+    cps_program_t prog = calloc(1, sizeof(struct cps_program_s));
+    if (!prog) {
+        report_cps_malloc_fail("program");
+    }
+    cps_builder_s b;
+    memset(&b, 0x00, sizeof(b));
+    b.prog = prog;
+    b.k_sym = symbol_lookup(symtab, "%k");
+    cps_mark_simple(&b, prgm->exp);
+    cps_k_s halt = { K_HALT, NULL, NULL, NULL };
+    cps_push_exp(&b, prgm->exp, halt, NULL, &prog->root);
+    while (b.ntasks > 0) {
+        cps_task_s t = b.tasks[--b.ntasks];
+        switch (t.kind) {
+            case TASK_EXP: cps_convert_exp(&b, &t); break;
+            case TASK_SIMPLE: cps_convert_simple(&b, &t); break;
+            case TASK_REST: cps_convert_rest(&b, &t); break;
+        }
+    }
+    for (size_t i = 0; i < b.nscopes; ++i) {
+        free(b.scopes[i]);
+    }
+    free(b.scopes);
+    free(b.tasks);
+    free(b.simple.keys);
+    return prog;
+}
+
+void cps_program_free(cps_program_t prog) {
+    if (prog) {
+        for (size_t i = 0; i < prog->nnodes; ++i) {
+            free(prog->nodes[i]);
+        }
+        for (size_t i = 0; i < prog->nsyms; ++i) {
+            symbol_free(prog->syms[i]);
+        }
+        free(prog->nodes);
+        free(prog->syms);
+        free(prog);
+    }
+}
+
+/*
+ * Prints the program in the syntax of the CPS-OUT language, one tail form
+ * per line. The worklist holds nodes to print and the text between them,
+ * in reverse, and dump_text bounds the indentation.
+ */
+typedef struct cps_print_s {
+    cps_node_t node;
+    const char *text;
+    int indent;
+} cps_print_s;
+
+void cps_program_dump(cps_program_t prog, FILE *fp) {
+    cps_print_s *stack = NULL;
+    size_t n = 0, cap = 0;
+#define CPS_PRINT(nd, tx, in)                                            \
+    do {                                                                \
+        stack = cps_grow(stack, n, &cap, sizeof(cps_print_s), "worklist"); \
+        stack[n].node = (nd);                                           \
+        stack[n].text = (tx);                                           \
+        stack[n].indent = (in);                                         \
+        n += 1;                                                         \
+    } while (0)
+    CPS_PRINT(NULL, "\n", 0);
+    CPS_PRINT(prog->root, NULL, 0);
+    while (n > 0) {
+        cps_print_s p = stack[--n];
+        if (p.text) {
+            dump_text(fp, p.text, p.indent);
+            continue;
+        }
+        cps_node_t e = p.node;
+        int in = p.indent;
+        switch (e->type) {
+            case CPS_CONST: fprintf(fp, "%d", e->num); break;
+            case CPS_VAR:
+            case CPS_UNBOUND: fputs(e->var->name, fp); break;
+            case CPS_PROC: {
+                if (e->var2) {
+                    fprintf(fp, "proc (%s, %s)", e->var->name, e->var2->name);
+                } else {
+                    fprintf(fp, "proc (%s)", e->var->name);
+                }
+                CPS_PRINT(e->body, NULL, in + 1);
+                CPS_PRINT(NULL, "\n", in + 1);
+                break;
+            }
+            case CPS_DIFF: {
+                fputs("-(", fp);
+                CPS_PRINT(NULL, ")", in);
+                CPS_PRINT(e->kid2, NULL, in);
+                CPS_PRINT(NULL, ", ", in);
+                CPS_PRINT(e->kid1, NULL, in);
+                break;
+            }
+            case CPS_ZERO: {
+                fputs("zero?(", fp);
+                CPS_PRINT(NULL, ")", in);
+                CPS_PRINT(e->kid1, NULL, in);
+                break;
+            }
+            case CPS_RETURN: CPS_PRINT(e->kid1, NULL, in); break;
+            case CPS_IF: {
+                fputs("if ", fp);
+                CPS_PRINT(e->kid3, NULL, in + 1);
+                CPS_PRINT(NULL, "\n", in + 1);
+                CPS_PRINT(NULL, "else", in);
+                CPS_PRINT(NULL, "\n", in);
+                CPS_PRINT(e->kid2, NULL, in + 1);
+                CPS_PRINT(NULL, "\n", in + 1);
+                CPS_PRINT(NULL, " then", in);
+                CPS_PRINT(e->kid1, NULL, in);
+                break;
+            }
+            case CPS_LET: {
+                fprintf(fp, "let %s = ", e->var->name);
+                CPS_PRINT(e->body, NULL, in);
+                CPS_PRINT(NULL, " in\n", in);
+                CPS_PRINT(e->kid1, NULL, in);
+                break;
+            }
+            case CPS_LETREC: {
+                cps_node_t q = e->kid1;
+                fprintf(fp, "letrec %s(%s, %s) =", e->var->name, q->var->name, q->var2->name);
+                CPS_PRINT(e->body, NULL, in);
+                CPS_PRINT(NULL, "\n", in);
+                CPS_PRINT(NULL, "in", in);
+                CPS_PRINT(NULL, "\n", in);
+                CPS_PRINT(q->body, NULL, in + 1);
+                CPS_PRINT(NULL, "\n", in + 1);
+                break;
+            }
+            case CPS_CALL: {
+                fputs("(", fp);
+                CPS_PRINT(NULL, ")", in);
+                if (e->kid3) {
+                    CPS_PRINT(e->kid3, NULL, in);
+                    CPS_PRINT(NULL, " ", in);
+                }
+                CPS_PRINT(e->kid2, NULL, in);
+                CPS_PRINT(NULL, " ", in);
+                CPS_PRINT(e->kid1, NULL, in);
+                break;
+            }
+        }
+    }
+#undef CPS_PRINT
+    free(stack);
+}
+
+/* evaluator */
+
+typedef struct cps_env_s *cps_env_t;
+typedef struct cps_closure_s *cps_closure_t;
+
+/* numbers and booleans are unboxed; only closures are counted */
+typedef struct cps_value_s {
+    EXP_VAL type;
+    union {
+        int iv;
+        boolean_t bv;
+        cps_closure_t cv;
+    } v;
+} cps_value_s;
+
+/*
+ * One binding. A letrec frame holds its proc node instead of a value and
+ * makes a closure over itself each time it is read, so that no frame is
+ * ever reachable from itself and counting is enough to free them.
+ */
+struct cps_env_s {
+    int ref;
+    cps_env_t next;
+    cps_node_t rec;
+    cps_value_s val;
+    cps_env_t link;   /* on the list of frames being freed */
+};
+
+struct cps_closure_s {
+    int ref;
+    cps_node_t proc;
+    cps_env_t env;
+    cps_closure_t link;
+};
+
+static void report_cps_type(const char *type) {
+    fprintf(stderr, "not a valid exp val of type %s!\n", type);
+    exit(1);
+}
+
+/*
+ * A chain of frames and closures can be as long as the program ran, e.g.
+ * the continuations of a deep recursion, so releasing one walks two lists
+ * instead of recursing.
+ */
+static void cps_release(cps_env_t env, cps_closure_t c) {
+    cps_env_t envs = NULL;
+    cps_closure_t closures = NULL;
+    if (env && --env->ref == 0) {
+        env->link = envs;
+        envs = env;
+    }
+    if (c && --c->ref == 0) {
+        c->link = closures;
+        closures = c;
+    }
+    while (envs || closures) {
+        if (envs) {
+            cps_env_t e = envs;
+            envs = e->link;
+            if (e->next && --e->next->ref == 0) {
+                e->next->link = envs;
+                envs = e->next;
+            }
+            if (!e->rec && e->val.type == PROC_VAL && --e->val.v.cv->ref == 0) {
+                e->val.v.cv->link = closures;
+                closures = e->val.v.cv;
+            }
+            heap_free(e);
+        } else {
+            cps_closure_t k = closures;
+            closures = k->link;
+            if (k->env && --k->env->ref == 0) {
+                k->env->link = envs;
+                envs = k->env;
+            }
+            heap_free(k);
+        }
+    }
+}
+
+#define CPS_RELEASE(x)                                                  \
+    do {                                                                \
+        if ((x).type == PROC_VAL) {                                     \
+            cps_release(NULL, (x).v.cv);                                \
+        }                                                               \
+    } while (0)
+
+static cps_closure_t cps_closure_new(cps_node_t proc, cps_env_t env) {
+    cps_closure_t c = heap_alloc(HEAP_CPS_CLOSURE, sizeof(struct cps_closure_s));
+    if (!c) {
+        report_cps_malloc_fail("closure");
+    }
+    c->ref = 1;
+    c->proc = proc;
+    c->env = env;
+    if (env) {
+        env->ref += 1;
+    }
+    return c;
+}
+
+/* takes over the caller's reference to next and the value */
+static cps_env_t cps_extend(cps_env_t next, cps_node_t rec, cps_value_s val) {
+    cps_env_t e = heap_alloc(HEAP_CPS_ENV, sizeof(struct cps_env_s));
+    if (!e) {
+        report_cps_malloc_fail("env");
+    }
+    e->ref = 1;
+    e->next = next;
+    e->rec = rec;
+    e->val = val;
+    return e;
+}
+
+static cps_env_t cps_frame(cps_env_t env, int depth) {
+    while (depth-- > 0) {
+        env = env->next;
+    }
+    return env;
+}
+
+static cps_value_s cps_lookup(cps_env_t env, int depth) {
+    cps_env_t e = cps_frame(env, depth);
+    cps_value_s v;
+    if (e->rec) {
+        v.type = PROC_VAL;
+        v.v.cv = cps_closure_new(e->rec, e);
+    } else {
+        v = e->val;
+        if (v.type == PROC_VAL) {
+            v.v.cv->ref += 1;
+        }
+    }
+    return v;
+}
+
+static cps_value_s cps_simple_deep(cps_node_t n, cps_env_t env);
+
+/* value-of-simple-exp; the operands of -( ) are both evaluated before
+ * either is checked, as in the tree engine */
+static cps_value_s cps_simple(cps_node_t n, cps_env_t env) {
+    cps_value_s v;
+    switch (n->type) {
+        case CPS_CONST: {
+            v.type = NUM_VAL;
+            v.v.iv = n->num;
+            return v;
+        }
+        case CPS_VAR: {
+            return cps_lookup(env, n->num);
+        }
+        case CPS_PROC: {
+            v.type = PROC_VAL;
+            v.v.cv = cps_closure_new(n, cps_frame(env, n->num));
+            return v;
+        }
+        case CPS_DIFF: {
+            if (n->kid1->type == CPS_VAR && n->kid2->type == CPS_CONST) {
+                cps_env_t e = cps_frame(env, n->kid1->num);
+                if (e->rec || e->val.type != NUM_VAL) {
+                    report_cps_type("number");
+                }
+                v.type = NUM_VAL;
+                v.v.iv = e->val.v.iv - n->kid2->num;
+                return v;
+            }
+            return cps_simple_deep(n, env);
+        }
+        case CPS_ZERO: {
+            if (n->kid1->type == CPS_VAR) {
+                cps_env_t e = cps_frame(env, n->kid1->num);
+                if (e->rec || e->val.type != NUM_VAL) {
+                    report_cps_type("number");
+                }
+                v.type = BOOL_VAL;
+                v.v.bv = e->val.v.iv == 0 ? TRUE : FALSE;
+                return v;
+            }
+            return cps_simple_deep(n, env);
+        }
+        default: {
+            return cps_simple_deep(n, env);
+        }
+    }
+}
+
+/* kept between calls, freed when the program ends */
+static cps_node_t *cps_work;
+static size_t cps_work_cap;
+static cps_value_s *cps_vals;
+static size_t cps_vals_cap;
+
+/* any simple expression, children first off a worklist of nodes and a
+ * stack of their values; a node is pushed again, tagged in its low bit,
+ * to be combined after its children */
+static cps_value_s cps_simple_deep(cps_node_t root, cps_env_t env) {
+    size_t nwork = 0, nvals = 0;
+    cps_work = cps_grow(cps_work, nwork, &cps_work_cap, sizeof(cps_node_t), "worklist");
+    cps_work[nwork++] = root;
+    while (nwork > 0) {
+        cps_node_t n = cps_work[--nwork];
+        cps_vals = cps_grow(cps_vals, nvals, &cps_vals_cap, sizeof(cps_value_s), "values");
+        if ((uintptr_t)n & 1) {
+            n = (cps_node_t)((uintptr_t)n & ~(uintptr_t)1);
+            if (n->type == CPS_DIFF) {
+                cps_value_s a = cps_vals[nvals - 2], b = cps_vals[nvals - 1];
+                if (a.type != NUM_VAL || b.type != NUM_VAL) {
+                    report_cps_type("number");
+                }
+                nvals -= 1;
+                cps_vals[nvals - 1].v.iv = a.v.iv - b.v.iv;
+            } else {
+                cps_value_s a = cps_vals[nvals - 1];
+                if (a.type != NUM_VAL) {
+                    report_cps_type("number");
+                }
+                cps_vals[nvals - 1].type = BOOL_VAL;
+                cps_vals[nvals - 1].v.bv = a.v.iv == 0 ? TRUE : FALSE;
+            }
+            continue;
+        }
+        switch (n->type) {
+            case CPS_CONST:
+            case CPS_VAR:
+            case CPS_PROC: {
+                cps_vals[nvals++] = cps_simple(n, env);
+                break;
+            }
+            case CPS_UNBOUND: {
+                fprintf(stderr, "no binding for %s\n", n->var->name);
+                exit(1);
+            }
+            case CPS_DIFF:
+            case CPS_ZERO: {
+                cps_work = cps_grow(cps_work, nwork, &cps_work_cap, sizeof(cps_node_t), "worklist");
+                cps_work[nwork++] = (cps_node_t)((uintptr_t)n | 1);
+                if (n->type == CPS_DIFF) {
+                    cps_work = cps_grow(cps_work, nwork, &cps_work_cap, sizeof(cps_node_t), "worklist");
+                    cps_work[nwork++] = n->kid2;
+                }
+                cps_work = cps_grow(cps_work, nwork, &cps_work_cap, sizeof(cps_node_t), "worklist");
+                cps_work[nwork++] = n->kid1;
+                break;
+            }
+            default: {
+                fprintf(stderr, "not a simple cps expression: %d\n", n->type);
+                exit(1);
+            }
+        }
+    }
+    return cps_vals[0];
+}
+
+static void cps_print_value(cps_value_s v) {
+    switch (v.type) {
+        case NUM_VAL: printf("%d\n", v.v.iv); break;
+        case BOOL_VAL: printf("%s\n", v.v.bv == TRUE ? "#t" : "#f"); break;
+        case PROC_VAL: printf("(procedure (%s) ...)\n", v.v.cv->proc->var->name); break;
+    }
+}
+
+/* value-of/k, where every call is a tail call */
+void value_of_program_cps(cps_program_t prog) {
+    cps_env_t env = NULL;
+    cps_node_t n = prog->root;
+    cps_value_s result;
+    for (;;) {
+        switch (n->type) {
+            case CPS_RETURN: {
+                result = cps_simple(n->kid1, env);
+                cps_release(env, NULL);
+                goto DONE;
+            }
+            case CPS_IF: {
+                cps_value_s v = cps_simple(n->kid1, env);
+                if (v.type != BOOL_VAL) {
+                    report_cps_type("boolean");
+                }
+                n = v.v.bv ? n->kid2 : n->kid3;
+                break;
+            }
+            case CPS_LET: {
+                env = cps_extend(env, NULL, cps_simple(n->kid1, env));
+                n = n->body;
+                break;
+            }
+            case CPS_LETREC: {
+                cps_value_s none = { NUM_VAL, { 0 } };
+                env = cps_extend(env, n->kid1, none);
+                n = n->body;
+                break;
+            }
+            case CPS_CALL: {
+                /* a rator read from the environment is borrowed: env keeps
+                 * it alive until the callee's frames are made */
+                cps_node_t p = NULL;
+                cps_env_t penv = NULL;
+                cps_value_s rator = { NUM_VAL, { 0 } };
+                int owned = 0;
+                if (n->kid1->type == CPS_VAR) {
+                    cps_env_t e = cps_frame(env, n->kid1->num);
+                    if (e->rec) {
+                        p = e->rec;
+                        penv = e;
+                    } else {
+                        rator = e->val;
+                    }
+                } else {
+                    rator = cps_simple(n->kid1, env);
+                    owned = 1;
+                }
+                cps_value_s rand = cps_simple(n->kid2, env);
+                cps_value_s k = { NUM_VAL, { 0 } };
+                if (n->kid3) {
+                    k = cps_simple(n->kid3, env);
+                }
+                if (!p) {
+                    if (rator.type != PROC_VAL) {
+                        report_cps_type("procedure");
+                    }
+                    p = rator.v.cv->proc;
+                    penv = rator.v.cv->env;
+                }
+                STATS_INC(bounces);
+                if (penv) {
+                    penv->ref += 1;
+                }
+                cps_env_t callee = cps_extend(penv, NULL, rand);
+                if (p->var2) {
+                    callee = cps_extend(callee, NULL, k);
+                }
+                cps_release(env, NULL);
+                if (owned) {
+                    CPS_RELEASE(rator);
+                }
+                env = callee;
+                n = p->body;
+                break;
+            }
+            default: {
+                fprintf(stderr, "bad cps expression %d\n", n->type);
+                exit(1);
+            }
+        }
+    }
+
+DONE:
+    if (!proc_quiet) {
+        printf("End of computation.\n");
+        cps_print_value(result);
+    }
+    CPS_RELEASE(result);
+    free(cps_work);
+    free(cps_vals);
+    cps_work = NULL;
+    cps_vals = NULL;
+    cps_work_cap = 0;
+    cps_vals_cap = 0;
+}
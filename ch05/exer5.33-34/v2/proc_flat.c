@@ -0,0 +1,185 @@
+/* flat ast: the tree laid out as parallel arrays in evaluation order */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proc.h"
+
+#define NO_SYMBOL 0xffffffff
+#define NO_SLOT 0xffffffff
+
+typedef struct flat_work_s {
+    ast_node_t node;
+    uint32_t slot; /* kids slot waiting for this node's index */
+} flat_work_s;
+
+typedef struct flat_builder_s {
+    ast_flat_t flat;
+    uint32_t cap;
+    uint32_t sym_cap;
+    uint32_t *sym_index; /* by symbol_index */
+    flat_work_s *work;
+    uint32_t nwork;
+    uint32_t work_cap;
+} flat_builder_s, *flat_builder_t;
+
+static void report_flat_malloc_fail(const char *what) {
+    fprintf(stderr, "failed to grow flat ast %s!\n", what);
+    exit(1);
+}
+
+static uint32_t flat_symbol(flat_builder_t b, symbol_t sym) {
+    ast_flat_t flat = b->flat;
+    size_t slot = symbol_index(sym);
+    if (b->sym_index[slot] == NO_SYMBOL) {
+        if (flat->nsyms == b->sym_cap) {
+            b->sym_cap = b->sym_cap ? b->sym_cap * 2 : 64;
+            flat->syms = realloc(flat->syms, b->sym_cap * sizeof(symbol_t));
+            if (!flat->syms) {
+                report_flat_malloc_fail("symbols");
+            }
+        }
+        flat->syms[flat->nsyms] = sym;
+        b->sym_index[slot] = flat->nsyms++;
+    }
+    return b->sym_index[slot];
+}
+
+static uint32_t flat_alloc(flat_builder_t b) {
+    ast_flat_t flat = b->flat;
+    if (flat->count == b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 256;
+        flat->kind = realloc(flat->kind, b->cap * sizeof(*flat->kind));
+        flat->kids = realloc(flat->kids, 2 * b->cap * sizeof(*flat->kids));
+        flat->payload = realloc(flat->payload, b->cap * sizeof(*flat->payload));
+        flat->line = realloc(flat->line, b->cap * sizeof(*flat->line));
+        if (!flat->kind || !flat->kids || !flat->payload || !flat->line) {
+            report_flat_malloc_fail("nodes");
+        }
+    }
+    uint32_t i = flat->count++;
+    flat->kids[2 * i] = 0;
+    flat->kids[2 * i + 1] = 0;
+    flat->payload[i] = 0;
+    flat->line[i] = 0;
+    return i;
+}
+
+static void flat_push(flat_builder_t b, ast_node_t node, uint32_t slot) {
+    if (b->nwork == b->work_cap) {
+        b->work_cap = b->work_cap ? b->work_cap * 2 : 64;
+        b->work = realloc(b->work, b->work_cap * sizeof(flat_work_s));
+        if (!b->work) {
+            report_flat_malloc_fail("worklist");
+        }
+    }
+    b->work[b->nwork].node = node;
+    b->work[b->nwork].slot = slot;
+    b->nwork++;
+}
+
+/*
+ * Nodes are numbered in pre-order, with children visited in the order the
+ * interpreter evaluates them, so the first child of node i is always i + 1
+ * and only the later children need a kids slot. Children are pushed in
+ * reverse so that the first one is popped next.
+ */
+ast_flat_t ast_flat_new(ast_program_t prgm) {
+    flat_builder_t b = calloc(1, sizeof(flat_builder_s));
+    ast_flat_t flat = calloc(1, sizeof(ast_flat_s));
+    if (!b || !flat) {
+        report_flat_malloc_fail("header");
+    }
+    b->flat = flat;
+    b->sym_index = malloc(symbol_count() * sizeof(uint32_t));
+    if (!b->sym_index) {
+        report_flat_malloc_fail("symbols");
+    }
+    memset(b->sym_index, 0xff, symbol_count() * sizeof(uint32_t));
+
+    flat_push(b, prgm->exp, NO_SLOT);
+    while (b->nwork > 0) {
+        flat_work_s w = b->work[--b->nwork];
+        ast_node_t exp = w.node;
+        uint32_t i = flat_alloc(b);
+        if (w.slot != NO_SLOT) {
+            flat->kids[w.slot] = i;
+        }
+        flat->kind[i] = exp->type;
+        switch (exp->type) {
+            case CONST_EXP: {
+                flat->payload[i] = ((ast_const_t)exp)->num;
+                break;
+            }
+            case VAR_EXP: {
+                flat->payload[i] = flat_symbol(b, ((ast_var_t)exp)->var);
+                break;
+            }
+            case PROC_EXP: {
+                ast_proc_t pexp = (ast_proc_t)exp;
+                flat->payload[i] = flat_symbol(b, pexp->var);
+                flat->kids[2 * i] = pexp->name ? flat_symbol(b, pexp->name) : FLAT_NO_SYMBOL;
+                flat->line[i] = pexp->line;
+                flat_push(b, pexp->body, NO_SLOT);
+                break;
+            }
+            case LETREC_EXP: {
+                ast_letrec_t lexp = (ast_letrec_t)exp;
+                flat->payload[i] = flat_symbol(b, lexp->p_name);
+                flat->kids[2 * i + 1] = flat_symbol(b, lexp->p_var);
+                flat->line[i] = lexp->line;
+                flat_push(b, lexp->p_body, 2 * i);
+                flat_push(b, lexp->letrec_body, NO_SLOT);
+                break;
+            }
+            case ZERO_EXP: {
+                flat_push(b, ((ast_zero_t)exp)->exp1, NO_SLOT);
+                break;
+            }
+            case IF_EXP: {
+                ast_if_t iexp = (ast_if_t)exp;
+                flat_push(b, iexp->exp2, 2 * i + 1);
+                flat_push(b, iexp->exp1, 2 * i);
+                flat_push(b, iexp->cond, NO_SLOT);
+                break;
+            }
+            case LET_EXP: {
+                ast_let_t lexp = (ast_let_t)exp;
+                flat->payload[i] = flat_symbol(b, lexp->id);
+                flat_push(b, lexp->exp2, 2 * i);
+                flat_push(b, lexp->exp1, NO_SLOT);
+                break;
+            }
+            case DIFF_EXP: {
+                ast_diff_t dexp = (ast_diff_t)exp;
+                flat_push(b, dexp->exp2, 2 * i);
+                flat_push(b, dexp->exp1, NO_SLOT);
+                break;
+            }
+            case CALL_EXP: {
+                ast_call_t cexp = (ast_call_t)exp;
+                flat_push(b, cexp->rand, 2 * i);
+                flat_push(b, cexp->rator, NO_SLOT);
+                break;
+            }
+            default: {
+                fprintf(stderr, "unknown type of expression: %d\n", exp->type);
+                exit(1);
+            }
+        }
+    }
+    free(b->work);
+    free(b->sym_index);
+    free(b);
+    return flat;
+}
+
+void ast_flat_free(ast_flat_t flat) {
+    if (flat) {
+        free(flat->kind);
+        free(flat->kids);
+        free(flat->payload);
+        free(flat->line);
+        free(flat->syms);
+        free(flat);
+    }
+}
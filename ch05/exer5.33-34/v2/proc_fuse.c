@@ -0,0 +1,433 @@
+/* superinstructions: common shapes of PROC code rewritten into fused nodes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proc.h"
+
+/*
+ * Picked from the hit counts under --fuse=all --stats over corpus/ and
+ * bench/: if_zero_var and call_dec_var each take about 32% of all steps,
+ * dec_var and call_vars about 2%. add_vars fired 6 times, neg_var and
+ * zero_var never (a zero? test is almost always under an if), so those
+ * stay off unless asked for. call_curried takes about a fifth off
+ * bench/church.proc and costs the other benchmarks nothing.
+ */
+const uint32_t fuse_default = FUSE_BIT(DEC_VAR_EXP) | FUSE_BIT(IF_ZERO_VAR_EXP) |
+    FUSE_BIT(CALL_VARS_EXP) | FUSE_BIT(CALL_DEC_VAR_EXP) | FUSE_BIT(CALL_CURRIED_EXP);
+
+/* "all", "none", "default" or a comma separated list of fused type names */
+int fuse_parse(const char *list, uint32_t *mask) {
+    if (strcmp(list, "all") == 0) {
+        *mask = FUSE_ALL;
+        return 0;
+    } else if (strcmp(list, "none") == 0) {
+        *mask = 0;
+        return 0;
+    } else if (strcmp(list, "default") == 0) {
+        *mask = fuse_default;
+        return 0;
+    }
+    *mask = 0;
+    while (*list) {
+        size_t len = strcspn(list, ",");
+        int t;
+        for (t = FUSE_FIRST; t <= FUSE_LAST; ++t) {
+            const char *name = exp_type_name(t);
+            if (strlen(name) == len && strncmp(name, list, len) == 0) {
+                *mask |= FUSE_BIT(t);
+                break;
+            }
+        }
+        if (t > FUSE_LAST) {
+            fprintf(stderr, "unknown superinstruction: %.*s\n", (int)len, list);
+            return -1;
+        }
+        list += len;
+        if (*list == ',') {
+            list += 1;
+        }
+    }
+    return 0;
+}
+
+static int is_var(ast_node_t e) {
+    return e->type == VAR_EXP;
+}
+
+static symbol_t var_of(ast_node_t e) {
+    return ((ast_var_t)e)->var;
+}
+
+static int is_const(ast_node_t e) {
+    return e->type == CONST_EXP;
+}
+
+static int num_of(ast_node_t e) {
+    return ((ast_const_t)e)->num;
+}
+
+/* -(var, num) */
+static int is_dec_var(ast_node_t e) {
+    return e->type == DIFF_EXP && is_var(((ast_diff_t)e)->exp1) && is_const(((ast_diff_t)e)->exp2);
+}
+
+/* -(0, var) */
+static int is_neg_var(ast_node_t e) {
+    return e->type == DIFF_EXP && is_const(((ast_diff_t)e)->exp1) &&
+        num_of(((ast_diff_t)e)->exp1) == 0 && is_var(((ast_diff_t)e)->exp2);
+}
+
+/*
+ * The superinstruction for e under mask, or NULL. A fused node only keeps
+ * symbols and numbers of the shape, so the matched nodes are freed, except
+ * for the branches of an if, which the fused node takes over.
+ */
+static ast_node_t fuse_node(ast_node_t e, uint32_t mask) {
+    ast_node_t f = NULL;
+    switch (e->type) {
+        case DIFF_EXP: {
+            ast_diff_t d = (ast_diff_t)e;
+            if ((mask & FUSE_BIT(ADD_VARS_EXP)) && is_var(d->exp1) && is_neg_var(d->exp2)) {
+                f = new_fused_node(ADD_VARS_EXP, var_of(d->exp1),
+                                   var_of(((ast_diff_t)d->exp2)->exp2), 0, NULL, NULL);
+            } else if ((mask & FUSE_BIT(NEG_VAR_EXP)) && is_neg_var(e)) {
+                f = new_fused_node(NEG_VAR_EXP, var_of(d->exp2), NULL, 0, NULL, NULL);
+            } else if ((mask & FUSE_BIT(DEC_VAR_EXP)) && is_dec_var(e)) {
+                f = new_fused_node(DEC_VAR_EXP, var_of(d->exp1), NULL, num_of(d->exp2), NULL, NULL);
+            }
+            break;
+        }
+        case ZERO_EXP: {
+            ast_zero_t z = (ast_zero_t)e;
+            if ((mask & FUSE_BIT(ZERO_VAR_EXP)) && is_var(z->exp1)) {
+                f = new_fused_node(ZERO_VAR_EXP, var_of(z->exp1), NULL, 0, NULL, NULL);
+            }
+            break;
+        }
+        case IF_EXP: {
+            ast_if_t i = (ast_if_t)e;
+            if ((mask & FUSE_BIT(IF_ZERO_VAR_EXP)) && i->cond->type == ZERO_EXP &&
+                is_var(((ast_zero_t)i->cond)->exp1)) {
+                f = new_fused_node(IF_ZERO_VAR_EXP, var_of(((ast_zero_t)i->cond)->exp1), NULL, 0,
+                                   i->exp1, i->exp2);
+                ast_free(i->cond);
+                free(i);
+                return f;
+            }
+            break;
+        }
+        case CALL_EXP: {
+            ast_call_t c = (ast_call_t)e;
+            if (!is_var(c->rator)) {
+                break;
+            }
+            if ((mask & FUSE_BIT(CALL_VARS_EXP)) && is_var(c->rand)) {
+                f = new_fused_node(CALL_VARS_EXP, var_of(c->rator), var_of(c->rand), 0, NULL, NULL);
+            } else if ((mask & FUSE_BIT(CALL_DEC_VAR_EXP)) && is_dec_var(c->rand)) {
+                ast_diff_t d = (ast_diff_t)c->rand;
+                f = new_fused_node(CALL_DEC_VAR_EXP, var_of(c->rator), var_of(d->exp1),
+                                   num_of(d->exp2), NULL, NULL);
+            }
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+    if (f) {
+        ast_free(e);
+    }
+    return f;
+}
+
+static void fuse_push(ast_node_t ***slots, size_t *len, size_t *cap, ast_node_t *slot) {
+    if (*len == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *slots = realloc(*slots, *cap * sizeof(ast_node_t *));
+        if (!*slots) {
+            fprintf(stderr, "failed to grow fuse worklist!\n");
+            exit(1);
+        }
+    }
+    (*slots)[(*len)++] = slot;
+}
+
+/*
+ * call_curried: a call (((f a) b) ...) with at least two operands applied
+ * at once, all of them variables or constants, becomes a single node. The
+ * tree engine enters f with every operand and binds the rest in frames of
+ * that call, instead of making and copying the env of a closure for each
+ * operand but the last, when the body of f is a chain of enough procs; it
+ * runs the calls as they were otherwise. A let or letrec that binds such a
+ * chain makes a curried proc, and a call of one takes no more operands than
+ * the chain has procs. The chain itself stays a plain proc, so partial
+ * applications and uses as a value still get the curried entry. Knowing
+ * the chain needs the binding f refers to, so this runs before the other
+ * shapes with a scope per node.
+ */
+typedef struct curry_scope_s *curry_scope_t;
+
+struct curry_scope_s {
+    symbol_t var;
+    int chain;          /* index into the chains + 1, 0 for any other value */
+    curry_scope_t up;
+};
+
+typedef struct curry_chain_s {
+    int depth;          /* procs in the chain, at least 2 */
+    int uses;
+    int full;           /* uses with every operand applied */
+} curry_chain_s, *curry_chain_t;
+
+typedef struct curry_task_s {
+    ast_node_t *slot;
+    curry_scope_t scope;
+} curry_task_s;
+
+typedef struct curry_s {
+    curry_task_s *tasks;
+    size_t ntasks;
+    size_t tasks_cap;
+    curry_scope_t *scopes;   /* every scope made, for freeing */
+    size_t nscopes;
+    size_t scopes_cap;
+    curry_chain_t chains;
+    size_t nchains;
+    size_t chains_cap;
+} curry_s, *curry_t;
+
+static void *curry_grow(void *array, size_t n, size_t *cap, size_t size) {
+    if (n == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        array = realloc(array, *cap * size);
+        if (!array) {
+            fprintf(stderr, "failed to grow curried call analysis!\n");
+            exit(1);
+        }
+    }
+    return array;
+}
+
+static void curry_push(curry_t c, ast_node_t *slot, curry_scope_t scope) {
+    c->tasks = curry_grow(c->tasks, c->ntasks, &c->tasks_cap, sizeof(curry_task_s));
+    c->tasks[c->ntasks].slot = slot;
+    c->tasks[c->ntasks].scope = scope;
+    c->ntasks += 1;
+}
+
+/* var bound over up to a value that is a chain of depth procs */
+static curry_scope_t curry_bind(curry_t c, symbol_t var, int depth, curry_scope_t up) {
+    curry_scope_t s = malloc(sizeof(*s));
+    if (!s) {
+        fprintf(stderr, "failed to build curried call scope!\n");
+        exit(1);
+    }
+    s->var = var;
+    s->chain = 0;
+    s->up = up;
+    if (depth >= 2) {
+        c->chains = curry_grow(c->chains, c->nchains, &c->chains_cap, sizeof(curry_chain_s));
+        c->chains[c->nchains].depth = depth;
+        c->chains[c->nchains].uses = 0;
+        c->chains[c->nchains].full = 0;
+        s->chain = ++c->nchains;
+    }
+    c->scopes = curry_grow(c->scopes, c->nscopes, &c->scopes_cap, sizeof(curry_scope_t));
+    c->scopes[c->nscopes++] = s;
+    return s;
+}
+
+static int proc_depth(ast_node_t e) {
+    int depth = 0;
+    while (e->type == PROC_EXP) {
+        depth += 1;
+        e = ((ast_proc_t)e)->body;
+    }
+    return depth;
+}
+
+/* the chain var names under scope, or NULL */
+static curry_chain_t curry_lookup(curry_t c, curry_scope_t scope, symbol_t var) {
+    for (; scope; scope = scope->up) {
+        if (scope->var == var) {
+            return scope->chain ? &c->chains[scope->chain - 1] : NULL;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The call whose slot is *slot is the outermost of k calls over the
+ * variable f, whose value takes up to depth operands at once. Fuses the
+ * innermost of them that it can take, and hands the operands of the others
+ * to the walk.
+ */
+static void curry_call(curry_t c, ast_node_t *slot, int k, int depth, curry_scope_t scope) {
+    int n = k < depth ? k : depth;
+    ast_node_t *inner = slot;
+    for (int i = 0; i < k - n; ++i) {
+        curry_push(c, &((ast_call_t)*inner)->rand, scope);
+        inner = &((ast_call_t)*inner)->rator;
+    }
+    int atoms = n >= 2 && n <= CURRY_MAX;
+    ast_node_t e = *inner;
+    for (int i = 0; i < n; ++i) {
+        ast_node_t rand = ((ast_call_t)e)->rand;
+        atoms = atoms && (is_var(rand) || is_const(rand));
+        curry_push(c, &((ast_call_t)e)->rand, scope);
+        e = ((ast_call_t)e)->rator;
+    }
+    if (atoms) {
+        *inner = new_fused_node(CALL_CURRIED_EXP, var_of(e), NULL, n, *inner, NULL);
+        proc_stats->fuse_sites[CALL_CURRIED_EXP - FUSE_FIRST] += 1;
+    }
+}
+
+static void fuse_curried(ast_program_t prgm) {
+    curry_s c;
+    memset(&c, 0x00, sizeof(c));
+    curry_push(&c, &prgm->exp, NULL);
+    while (c.ntasks > 0) {
+        curry_task_s t = c.tasks[--c.ntasks];
+        ast_node_t e = *t.slot;
+        switch (e->type) {
+            case VAR_EXP: {
+                curry_chain_t chain = curry_lookup(&c, t.scope, var_of(e));
+                if (chain) {
+                    chain->uses += 1;
+                }
+                break;
+            }
+            case PROC_EXP: {
+                ast_proc_t p = (ast_proc_t)e;
+                curry_push(&c, &p->body, curry_bind(&c, p->var, 0, t.scope));
+                break;
+            }
+            case LETREC_EXP: {
+                ast_letrec_t l = (ast_letrec_t)e;
+                curry_scope_t s = curry_bind(&c, l->p_name, 1 + proc_depth(l->p_body), t.scope);
+                curry_push(&c, &l->p_body, curry_bind(&c, l->p_var, 0, s));
+                curry_push(&c, &l->letrec_body, s);
+                break;
+            }
+            case LET_EXP: {
+                ast_let_t l = (ast_let_t)e;
+                curry_push(&c, &l->exp1, t.scope);
+                curry_push(&c, &l->exp2, curry_bind(&c, l->id, proc_depth(l->exp1), t.scope));
+                break;
+            }
+            case ZERO_EXP: {
+                curry_push(&c, &((ast_zero_t)e)->exp1, t.scope);
+                break;
+            }
+            case IF_EXP: {
+                curry_push(&c, &((ast_if_t)e)->cond, t.scope);
+                curry_push(&c, &((ast_if_t)e)->exp1, t.scope);
+                curry_push(&c, &((ast_if_t)e)->exp2, t.scope);
+                break;
+            }
+            case DIFF_EXP: {
+                curry_push(&c, &((ast_diff_t)e)->exp1, t.scope);
+                curry_push(&c, &((ast_diff_t)e)->exp2, t.scope);
+                break;
+            }
+            case CALL_EXP: {
+                int k = 0;
+                ast_node_t f = e;
+                while (f->type == CALL_EXP) {
+                    k += 1;
+                    f = ((ast_call_t)f)->rator;
+                }
+                curry_chain_t chain = is_var(f) ? curry_lookup(&c, t.scope, var_of(f)) : NULL;
+                if (chain) {
+                    chain->uses += 1;
+                    chain->full += k >= chain->depth;
+                    curry_call(&c, t.slot, k, chain->depth, t.scope);
+                } else if (is_var(f) && k >= 2) {
+                    curry_call(&c, t.slot, k, CURRY_MAX, t.scope);
+                } else {
+                    curry_push(&c, &((ast_call_t)e)->rator, t.scope);
+                    curry_push(&c, &((ast_call_t)e)->rand, t.scope);
+                }
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+    }
+    for (size_t i = 0; i < c.nchains; ++i) {
+        proc_stats->curried_procs += 1;
+        proc_stats->curried_full += c.chains[i].uses > 0 && c.chains[i].full == c.chains[i].uses;
+    }
+    for (size_t i = 0; i < c.nscopes; ++i) {
+        free(c.scopes[i]);
+    }
+    free(c.scopes);
+    free(c.chains);
+    free(c.tasks);
+}
+
+/* top down, so that a shape is fused before any of its parts can be */
+void ast_fuse(ast_program_t prgm, uint32_t mask) {
+    ast_node_t **slots = NULL;
+    size_t len = 0, cap = 0;
+    if (mask & FUSE_BIT(CALL_CURRIED_EXP)) {
+        fuse_curried(prgm);
+    }
+    fuse_push(&slots, &len, &cap, &prgm->exp);
+    while (len > 0) {
+        ast_node_t *slot = slots[--len];
+        ast_node_t f = fuse_node(*slot, mask);
+        if (f) {
+            proc_stats->fuse_sites[f->type - FUSE_FIRST] += 1;
+            *slot = f;
+        }
+        ast_node_t e = *slot;
+        switch (e->type) {
+            case PROC_EXP: {
+                fuse_push(&slots, &len, &cap, &((ast_proc_t)e)->body);
+                break;
+            }
+            case LETREC_EXP: {
+                fuse_push(&slots, &len, &cap, &((ast_letrec_t)e)->p_body);
+                fuse_push(&slots, &len, &cap, &((ast_letrec_t)e)->letrec_body);
+                break;
+            }
+            case ZERO_EXP: {
+                fuse_push(&slots, &len, &cap, &((ast_zero_t)e)->exp1);
+                break;
+            }
+            case IF_EXP: {
+                fuse_push(&slots, &len, &cap, &((ast_if_t)e)->cond);
+                fuse_push(&slots, &len, &cap, &((ast_if_t)e)->exp1);
+                fuse_push(&slots, &len, &cap, &((ast_if_t)e)->exp2);
+                break;
+            }
+            case LET_EXP: {
+                fuse_push(&slots, &len, &cap, &((ast_let_t)e)->exp1);
+                fuse_push(&slots, &len, &cap, &((ast_let_t)e)->exp2);
+                break;
+            }
+            case DIFF_EXP: {
+                fuse_push(&slots, &len, &cap, &((ast_diff_t)e)->exp1);
+                fuse_push(&slots, &len, &cap, &((ast_diff_t)e)->exp2);
+                break;
+            }
+            case CALL_EXP: {
+                fuse_push(&slots, &len, &cap, &((ast_call_t)e)->rator);
+                fuse_push(&slots, &len, &cap, &((ast_call_t)e)->rand);
+                break;
+            }
+            case IF_ZERO_VAR_EXP: {
+                fuse_push(&slots, &len, &cap, &((ast_fused_t)e)->exp1);
+                fuse_push(&slots, &len, &cap, &((ast_fused_t)e)->exp2);
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+    }
+    free(slots);
+}
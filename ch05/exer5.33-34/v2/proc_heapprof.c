@@ -0,0 +1,162 @@
+/* allocation-site heap profile for values, environments and continuations */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proc.h"
+
+typedef struct heap_site_stats_s {
+    uint64_t allocs;
+    uint64_t bytes;
+    uint64_t live;
+    uint64_t live_bytes;
+    uint64_t peak_live_bytes;
+} heap_site_stats_s;
+
+static const char *heap_site_names[] = {
+    [HEAP_NEW_BOOL_VAL] = "new_bool_val",
+    [HEAP_NEW_INT_VAL] = "new_int_val",
+    [HEAP_NEW_PROC_VAL] = "new_proc_val",
+    [HEAP_COPY_EXP_VAL] = "copy_exp_val",
+    [HEAP_NEW_PROC] = "new_proc",
+    [HEAP_EMPTY_ENV] = "empty_env",
+    [HEAP_EXTEND_ENV] = "extend_env",
+    [HEAP_EXTEND_ENV_REC] = "extend_env_rec",
+    [HEAP_ENV_COPY_ITER] = "env_copy_iter",
+    [HEAP_NEW_END_CONT] = "new_end_cont",
+    [HEAP_NEW_ZERO1_CONT] = "new_zero1_cont",
+    [HEAP_NEW_LET_CONT] = "new_let_cont",
+    [HEAP_NEW_IF_TEST_CONT] = "new_if_test_cont",
+    [HEAP_NEW_DIFF1_CONT] = "new_diff1_cont",
+    [HEAP_NEW_DIFF2_CONT] = "new_diff2_cont",
+    [HEAP_NEW_RATOR_CONT] = "new_rator_cont",
+    [HEAP_NEW_RAND_CONT] = "new_rand_cont",
+    [HEAP_NEW_LETREC_CONT] = "new_letrec_cont",
+    [HEAP_NEW_LET2_CONT] = "new_let2_cont",
+    [HEAP_NEW_APPLY_PROC_CONT] = "new_apply_proc_cont",
+    [HEAP_NEW_APPLY_PROC2_CONT] = "new_apply_proc2_cont",
+    [HEAP_VM_CLOSURE] = "vm_closure",
+    [HEAP_CPS_CLOSURE] = "cps_closure",
+    [HEAP_CPS_ENV] = "cps_env",
+};
+
+static heap_site_stats_s heap_sites[HEAP_SITE_COUNT];
+static uint64_t heap_allocs;
+static uint64_t heap_live_bytes;
+static uint64_t heap_peak_live_bytes;
+
+#ifdef PROC_HEAP_PROFILE
+static uint64_t heap_snapshot_every;
+static volatile sig_atomic_t heap_snapshot_requested;
+
+/*
+ * Every profiled object carries a small header naming its allocation site,
+ * so heap_free can charge the release to the constructor that made it
+ * whichever *_free function ends up releasing it.
+ */
+typedef struct heap_header_s {
+    uint32_t site;
+    uint32_t size;
+    uint64_t pad; /* keep the object 16-byte aligned */
+} heap_header_s;
+
+void *heap_alloc(heap_site_t site, size_t size) {
+    heap_header_s *h = malloc(sizeof(heap_header_s) + size);
+    if (!h) {
+        return NULL;
+    }
+    h->site = site;
+    h->size = (uint32_t)size;
+    proc_stats->allocs += 1;
+    proc_stats->alloc_bytes += size;
+    heap_site_stats_s *s = &heap_sites[site];
+    s->allocs += 1;
+    s->bytes += size;
+    s->live += 1;
+    s->live_bytes += size;
+    s->peak_live_bytes = s->live_bytes > s->peak_live_bytes ? s->live_bytes : s->peak_live_bytes;
+    heap_live_bytes += size;
+    heap_peak_live_bytes = heap_live_bytes > heap_peak_live_bytes ? heap_live_bytes : heap_peak_live_bytes;
+    heap_allocs += 1;
+    if (heap_snapshot_requested ||
+        (heap_snapshot_every && heap_allocs % heap_snapshot_every == 0)) {
+        heap_snapshot_requested = 0;
+        heap_profile_report(stderr, "snapshot");
+    }
+    return h + 1;
+}
+
+void heap_free(void *p) {
+    if (p) {
+        heap_header_s *h = (heap_header_s *)p - 1;
+        heap_site_stats_s *s = &heap_sites[h->site];
+        s->live -= 1;
+        s->live_bytes -= h->size;
+        heap_live_bytes -= h->size;
+        free(h);
+    }
+}
+#endif
+
+static int compare_sites(const void *a, const void *b) {
+    const heap_site_stats_s *sa = &heap_sites[*(const int *)a];
+    const heap_site_stats_s *sb = &heap_sites[*(const int *)b];
+    if (sa->peak_live_bytes != sb->peak_live_bytes) {
+        return sa->peak_live_bytes < sb->peak_live_bytes ? 1 : -1;
+    }
+    if (sa->bytes != sb->bytes) {
+        return sa->bytes < sb->bytes ? 1 : -1;
+    }
+    return *(const int *)a - *(const int *)b;
+}
+
+/* sites are listed by peak live bytes, the biggest first */
+void heap_profile_report(FILE *fp, const char *title) {
+    int order[HEAP_SITE_COUNT];
+    for (int i = 0; i < HEAP_SITE_COUNT; ++i) {
+        order[i] = i;
+    }
+    qsort(order, HEAP_SITE_COUNT, sizeof(*order), compare_sites);
+    fprintf(fp, "heap %s after %llu allocations, %llu bytes live, peak %llu bytes\n",
+            title, (unsigned long long)heap_allocs,
+            (unsigned long long)heap_live_bytes, (unsigned long long)heap_peak_live_bytes);
+    fprintf(fp, "  %-22s %12s %14s %10s %14s\n", "site", "allocs", "bytes", "live", "peak bytes");
+    for (int i = 0; i < HEAP_SITE_COUNT; ++i) {
+        heap_site_stats_s *s = &heap_sites[order[i]];
+        if (s->allocs) {
+            fprintf(fp, "  %-22s %12llu %14llu %10llu %14llu\n", heap_site_names[order[i]],
+                    (unsigned long long)s->allocs, (unsigned long long)s->bytes,
+                    (unsigned long long)s->live, (unsigned long long)s->peak_live_bytes);
+        }
+    }
+}
+
+#ifdef PROC_HEAP_PROFILE
+static void heap_profile_at_exit() {
+    heap_profile_report(stderr, "profile");
+}
+
+static void heap_profile_on_signal(int sig) {
+    heap_snapshot_requested = 1;
+}
+#endif
+
+/* report at exit; snapshot every n allocations if n > 0, and whenever the
+ * process gets SIGUSR1 */
+void heap_profile_start(uint64_t every) {
+#ifdef PROC_HEAP_PROFILE
+    heap_snapshot_every = every;
+    signal(SIGUSR1, heap_profile_on_signal);
+    atexit(heap_profile_at_exit);
+#else
+    fprintf(stderr, "heap profiling is not compiled in, configure with -DPROC_HEAP_PROFILE=ON\n");
+#endif
+}
+
+uint64_t heap_profile_allocs() {
+    return heap_allocs;
+}
+
+uint64_t heap_profile_peak_bytes() {
+    return heap_peak_live_bytes;
+}
@@ -0,0 +1,224 @@
+/* compact binary ast image: write a parsed program once, mmap it later */
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "proc.h"
+
+#define AST_IMAGE_MAGIC 0x434f5250 /* "PROC" */
+#define AST_IMAGE_VERSION 3
+
+/*
+ * An image is a flat ast (see proc.h) written out array by array in host
+ * byte order, so loading it is just pointing an ast_flat_s into the mapping:
+ *   header
+ *   kids:     2 * count 32-bit child indices
+ *   payload:  count 32-bit numbers or symbol indices
+ *   line:     count 32-bit source lines
+ *   str_offs: nsyms 32-bit offsets into the string area
+ *   kind:     count bytes of exp_type
+ *   strings:  str_bytes bytes of NUL-terminated symbol names
+ * Indices are relative to the arrays, so the image is position independent.
+ */
+typedef struct ast_image_header_s {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t nsyms;
+    uint32_t str_bytes;
+} ast_image_header_s;
+
+typedef struct ast_image_s {
+    void *map;
+    size_t map_size;
+    ast_flat_s flat;
+} ast_image_s;
+
+static void report_image_fail(const char *path, const char *why) {
+    fprintf(stderr, "ast image %s: %s\n", path, why);
+}
+
+int ast_image_write(ast_program_t prgm, const char *path) {
+    ast_flat_t flat = ast_flat_new(prgm);
+    uint32_t str_bytes = 0;
+    for (uint32_t i = 0; i < flat->nsyms; ++i) {
+        str_bytes += strlen(flat->syms[i]->name) + 1;
+    }
+    ast_image_header_s hdr = {
+        .magic = AST_IMAGE_MAGIC,
+        .version = AST_IMAGE_VERSION,
+        .count = flat->count,
+        .nsyms = flat->nsyms,
+        .str_bytes = str_bytes
+    };
+    int ret = 0;
+    FILE *fp = fopen(path, "wb");
+    if (fp) {
+        uint32_t str_off = 0;
+        fwrite(&hdr, sizeof(hdr), 1, fp);
+        fwrite(flat->kids, sizeof(uint32_t), 2 * (size_t)flat->count, fp);
+        fwrite(flat->payload, sizeof(int32_t), flat->count, fp);
+        fwrite(flat->line, sizeof(int32_t), flat->count, fp);
+        for (uint32_t i = 0; i < flat->nsyms; ++i) {
+            fwrite(&str_off, sizeof(str_off), 1, fp);
+            str_off += strlen(flat->syms[i]->name) + 1;
+        }
+        fwrite(flat->kind, sizeof(uint8_t), flat->count, fp);
+        for (uint32_t i = 0; i < flat->nsyms; ++i) {
+            fwrite(flat->syms[i]->name, 1, strlen(flat->syms[i]->name) + 1, fp);
+        }
+        if (ferror(fp)) {
+            report_image_fail(path, "write failed");
+            ret = -1;
+        }
+        fclose(fp);
+    } else {
+        report_image_fail(path, "cannot open for writing");
+        ret = -1;
+    }
+    ast_flat_free(flat);
+    return ret;
+}
+
+/* one linear pass over the nodes, so a broken image is rejected up front
+ * instead of being chased through during evaluation. ast_flat_new numbers
+ * in pre-order, so every later child comes after the first child's
+ * subtree: a kid that points back, or at its own node, could only be a
+ * loop made by hand */
+static int image_check(ast_flat_t flat) {
+    uint32_t n = flat->count;
+    for (uint32_t i = 0; i < n; ++i) {
+        const uint32_t *kids = flat->kids + 2 * i;
+        uint32_t sym = (uint32_t)flat->payload[i];
+        switch (flat->kind[i]) {
+            case CONST_EXP:
+                break;
+            case VAR_EXP:
+                if (sym >= flat->nsyms) return -1;
+                break;
+            case PROC_EXP:
+                if (sym >= flat->nsyms || i + 1 >= n ||
+                    (kids[0] != FLAT_NO_SYMBOL && kids[0] >= flat->nsyms)) return -1;
+                break;
+            case LETREC_EXP:
+                if (sym >= flat->nsyms || kids[1] >= flat->nsyms ||
+                    i + 1 >= n || kids[0] <= i + 1 || kids[0] >= n) return -1;
+                break;
+            case ZERO_EXP:
+                if (i + 1 >= n) return -1;
+                break;
+            case IF_EXP:
+                if (i + 1 >= n || kids[0] <= i + 1 || kids[1] <= kids[0] || kids[1] >= n) return -1;
+                break;
+            case LET_EXP:
+                if (sym >= flat->nsyms || i + 1 >= n || kids[0] <= i + 1 || kids[0] >= n) return -1;
+                break;
+            case DIFF_EXP:
+            case CALL_EXP:
+                if (i + 1 >= n || kids[0] <= i + 1 || kids[0] >= n) return -1;
+                break;
+            default:
+                return -1;
+        }
+    }
+    return n > 0 ? 0 : -1;
+}
+
+ast_image_t ast_image_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        report_image_fail(path, "cannot open");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ast_image_header_s)) {
+        report_image_fail(path, "truncated");
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        report_image_fail(path, "mmap failed");
+        return NULL;
+    }
+
+    const ast_image_header_s *hdr = map;
+    size_t need = sizeof(*hdr) +
+        ((size_t)4 * hdr->count + hdr->nsyms) * sizeof(uint32_t) +
+        hdr->count + hdr->str_bytes;
+    if (hdr->magic != AST_IMAGE_MAGIC || hdr->version != AST_IMAGE_VERSION ||
+        need != (size_t)st.st_size) {
+        report_image_fail(path, "bad header");
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    ast_image_t img = malloc(sizeof(ast_image_s));
+    if (!img) {
+        report_image_fail(path, "out of memory");
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    const uint32_t *words = (const uint32_t *)(hdr + 1);
+    const uint32_t *str_offs = words + 4 * (size_t)hdr->count;
+    const uint8_t *kind = (const uint8_t *)(str_offs + hdr->nsyms);
+    const char *strs = (const char *)(kind + hdr->count);
+    img->map = map;
+    img->map_size = st.st_size;
+    img->flat.count = hdr->count;
+    img->flat.nsyms = hdr->nsyms;
+    img->flat.kids = (uint32_t *)words;
+    img->flat.payload = (int32_t *)(words + 2 * (size_t)hdr->count);
+    img->flat.line = (int32_t *)(words + 3 * (size_t)hdr->count);
+    img->flat.kind = (uint8_t *)kind;
+    img->flat.syms = NULL;
+    if (image_check(&img->flat) != 0) {
+        report_image_fail(path, "corrupt node arrays");
+        ast_image_close(img);
+        return NULL;
+    }
+
+    /* symbols are the only thing interned at load time: one lookup per
+     * distinct name, never one per node */
+    img->flat.syms = malloc((hdr->nsyms ? hdr->nsyms : 1) * sizeof(symbol_t));
+    if (!img->flat.syms) {
+        report_image_fail(path, "out of memory");
+        ast_image_close(img);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < hdr->nsyms; ++i) {
+        if (str_offs[i] >= hdr->str_bytes ||
+            !memchr(strs + str_offs[i], '\0', hdr->str_bytes - str_offs[i])) {
+            report_image_fail(path, "corrupt string area");
+            ast_image_close(img);
+            return NULL;
+        }
+        /* a name made by a pass is made again rather than interned,
+         * since the table has room only for names a program spells */
+        if (strchr(strs + str_offs[i], '%')) {
+            img->flat.syms[i] = symbol_gensym(strs + str_offs[i]);
+        } else {
+            img->flat.syms[i] = symbol_lookup(symtab, (char *)strs + str_offs[i]);
+        }
+    }
+    return img;
+}
+
+void ast_image_close(ast_image_t img) {
+    if (img) {
+        munmap(img->map, img->map_size);
+        free(img->flat.syms);
+        free(img);
+    }
+}
+
+/* the arrays are read in place by the same engine that runs in-memory flat
+ * programs */
+void value_of_image(ast_image_t img) {
+    value_of_program_flat(&img->flat);
+}
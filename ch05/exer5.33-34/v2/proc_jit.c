@@ -0,0 +1,655 @@
+/* template jit: hot vm functions copied out as x86-64 machine code, and
+ * loop traces of self tail calling ones */
+#define _DEFAULT_SOURCE
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proc.h"
+#include "proc_vm.h"
+
+uint32_t vm_jit_threshold;
+uint32_t vm_loop_threshold;
+
+static int vm_loop_compile(vm_function_t fn, vm_loop_rec_t rec);
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Each vm instruction becomes a fixed template over the frame's registers,
+ * which are addressed off rbx; the running closure stays in r12. Arithmetic,
+ * moves and branches run inline, FREE, SELF and CLOSURE call the vm_op_*
+ * helpers. Calls, returns and anything a template's guards turn down (a
+ * wrong type, a closure about to be overwritten) leave through the exit
+ * with the pc of that instruction, and the vm loop carries on from there.
+ * So the frame stack stays with the loop, and errors are reported there.
+ *
+ * Layout: prologue and dispatch through the pc table, exit, one template
+ * per instruction, one bail stub per instruction, then the table of
+ * template addresses. The code is written while the pages are writable
+ * and only then made executable, never both at once.
+ */
+typedef enum {
+    FIX_LABEL = 0x00,  /* rel32 to the template of pc */
+    FIX_STUB,          /* rel32 to the bail stub of pc */
+    FIX_EXIT,          /* rel32 to the exit */
+    FIX_TABLE          /* rip relative rel32 to the pc table */
+} jit_fix_kind_t;
+
+typedef struct jit_fixup_s {
+    size_t at;
+    jit_fix_kind_t kind;
+    uint32_t pc;
+} jit_fixup_s;
+
+typedef struct jit_buf_s {
+    uint8_t *code;
+    size_t len;
+    size_t cap;
+    size_t *labels;
+    size_t *stubs;
+    size_t exit;
+    size_t table;
+    jit_fixup_s *fixups;
+    size_t nfixups;
+    size_t fixups_cap;
+} jit_buf_s, *jit_buf_t;
+
+static void report_jit_malloc_fail() {
+    fprintf(stderr, "failed to grow the jit buffer!\n");
+    exit(1);
+}
+
+static void jit_emit(jit_buf_t b, const uint8_t *p, size_t n) {
+    if (b->len + n > b->cap) {
+        while (b->len + n > b->cap) {
+            b->cap = b->cap ? b->cap * 2 : 4096;
+        }
+        b->code = realloc(b->code, b->cap);
+        if (!b->code) {
+            report_jit_malloc_fail();
+        }
+    }
+    memcpy(b->code + b->len, p, n);
+    b->len += n;
+}
+
+#define JIT(b, ...)                                                     \
+    jit_emit(b, (const uint8_t[]){ __VA_ARGS__ }, sizeof((const uint8_t[]){ __VA_ARGS__ }))
+
+static void jit_u32(jit_buf_t b, uint32_t v) {
+    JIT(b, v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, (v >> 24) & 0xff);
+}
+
+static void jit_u64(jit_buf_t b, uint64_t v) {
+    jit_u32(b, (uint32_t)v);
+    jit_u32(b, (uint32_t)(v >> 32));
+}
+
+static void jit_rel32(jit_buf_t b, jit_fix_kind_t kind, uint32_t pc) {
+    if (b->nfixups == b->fixups_cap) {
+        b->fixups_cap = b->fixups_cap ? b->fixups_cap * 2 : 64;
+        b->fixups = realloc(b->fixups, b->fixups_cap * sizeof(jit_fixup_s));
+        if (!b->fixups) {
+            report_jit_malloc_fail();
+        }
+    }
+    b->fixups[b->nfixups].at = b->len;
+    b->fixups[b->nfixups].kind = kind;
+    b->fixups[b->nfixups].pc = pc;
+    b->nfixups += 1;
+    jit_u32(b, 0);
+}
+
+/* [rbx + disp] of a register's type and value */
+#define TYPE(r) ((uint32_t)((r) * sizeof(vm_value_s) + offsetof(vm_value_s, type)))
+#define VAL(r) ((uint32_t)((r) * sizeof(vm_value_s) + offsetof(vm_value_s, v)))
+
+/* cmp dword [rbx + disp], type; jcc to the bail stub of pc */
+static void jit_guard(jit_buf_t b, uint32_t disp, EXP_VAL type, int bail_if_equal, uint32_t pc) {
+    JIT(b, 0x83, 0xbb);
+    jit_u32(b, disp);
+    JIT(b, type);
+    JIT(b, 0x0f, bail_if_equal ? 0x84 : 0x85);
+    jit_rel32(b, FIX_STUB, pc);
+}
+
+/* mov dword [rbx + disp], imm32 */
+static void jit_store_imm(jit_buf_t b, uint32_t disp, uint32_t imm) {
+    JIT(b, 0xc7, 0x83);
+    jit_u32(b, disp);
+    jit_u32(b, imm);
+}
+
+/* helper(rbx, a, b, r12, extra) */
+static void jit_call(jit_buf_t b, void *helper, uint32_t a, uint32_t bb, void *extra) {
+    JIT(b, 0x48, 0x89, 0xdf);         /* mov rdi, rbx */
+    JIT(b, 0xbe);                     /* mov esi, a */
+    jit_u32(b, a);
+    JIT(b, 0xba);                     /* mov edx, b */
+    jit_u32(b, bb);
+    JIT(b, 0x4c, 0x89, 0xe1);         /* mov rcx, r12 */
+    JIT(b, 0x49, 0xb8);               /* mov r8, extra */
+    jit_u64(b, (uint64_t)(uintptr_t)extra);
+    JIT(b, 0x48, 0xb8);               /* mov rax, helper */
+    jit_u64(b, (uint64_t)(uintptr_t)helper);
+    JIT(b, 0xff, 0xd0);               /* call rax */
+}
+
+/* mov eax, pc; jmp exit */
+static void jit_leave(jit_buf_t b, uint32_t pc) {
+    JIT(b, 0xb8);
+    jit_u32(b, pc);
+    JIT(b, 0xe9);
+    jit_rel32(b, FIX_EXIT, 0);
+}
+
+static void jit_template(jit_buf_t b, vm_program_t prog, vm_insn_t i, uint32_t pc) {
+    switch (i->op) {
+        case VM_LOADK: {
+            jit_guard(b, TYPE(i->a), PROC_VAL, 1, pc);
+            jit_store_imm(b, TYPE(i->a), NUM_VAL);
+            jit_store_imm(b, VAL(i->a), (uint32_t)i->b);
+            break;
+        }
+        case VM_MOV: {
+            /* refcounted moves are left to the loop */
+            jit_guard(b, TYPE(i->b), PROC_VAL, 1, pc);
+            jit_guard(b, TYPE(i->a), PROC_VAL, 1, pc);
+            JIT(b, 0x48, 0x8b, 0x83);     /* mov rax, [rbx + b] */
+            jit_u32(b, TYPE(i->b));
+            JIT(b, 0x48, 0x8b, 0x93);     /* mov rdx, [rbx + b + 8] */
+            jit_u32(b, TYPE(i->b) + 8);
+            JIT(b, 0x48, 0x89, 0x83);     /* mov [rbx + a], rax */
+            jit_u32(b, TYPE(i->a));
+            JIT(b, 0x48, 0x89, 0x93);     /* mov [rbx + a + 8], rdx */
+            jit_u32(b, TYPE(i->a) + 8);
+            break;
+        }
+        case VM_SUB:
+        case VM_SUBK: {
+            jit_guard(b, TYPE(i->b), NUM_VAL, 0, pc);
+            if (i->op == VM_SUB) {
+                jit_guard(b, TYPE(i->c), NUM_VAL, 0, pc);
+            }
+            jit_guard(b, TYPE(i->a), PROC_VAL, 1, pc);
+            JIT(b, 0x8b, 0x83);           /* mov eax, [rbx + b] */
+            jit_u32(b, VAL(i->b));
+            if (i->op == VM_SUB) {
+                JIT(b, 0x2b, 0x83);       /* sub eax, [rbx + c] */
+                jit_u32(b, VAL(i->c));
+            } else {
+                JIT(b, 0x2d);             /* sub eax, c */
+                jit_u32(b, (uint32_t)i->c);
+            }
+            jit_store_imm(b, TYPE(i->a), NUM_VAL);
+            JIT(b, 0x89, 0x83);           /* mov [rbx + a], eax */
+            jit_u32(b, VAL(i->a));
+            break;
+        }
+        case VM_ISZERO: {
+            jit_guard(b, TYPE(i->b), NUM_VAL, 0, pc);
+            jit_guard(b, TYPE(i->a), PROC_VAL, 1, pc);
+            JIT(b, 0x83, 0xbb);           /* cmp dword [rbx + b], 0 */
+            jit_u32(b, VAL(i->b));
+            JIT(b, 0x00);
+            JIT(b, 0x0f, 0x94, 0xc0);     /* sete al */
+            JIT(b, 0x0f, 0xb6, 0xc0);     /* movzx eax, al */
+            jit_store_imm(b, TYPE(i->a), BOOL_VAL);
+            JIT(b, 0x89, 0x83);           /* mov [rbx + a], eax */
+            jit_u32(b, VAL(i->a));
+            break;
+        }
+        case VM_JMPF: {
+            jit_guard(b, TYPE(i->a), BOOL_VAL, 0, pc);
+            JIT(b, 0x83, 0xbb);           /* cmp dword [rbx + a], FALSE */
+            jit_u32(b, VAL(i->a));
+            JIT(b, FALSE);
+            JIT(b, 0x0f, 0x84);           /* je b */
+            jit_rel32(b, FIX_LABEL, i->b);
+            break;
+        }
+        case VM_JMP: {
+            JIT(b, 0xe9);
+            jit_rel32(b, FIX_LABEL, i->b);
+            break;
+        }
+        case VM_FREE: {
+            jit_call(b, (void *)(uintptr_t)vm_op_free, i->a, i->b, NULL);
+            break;
+        }
+        case VM_SELF: {
+            jit_call(b, (void *)(uintptr_t)vm_op_self, i->a, 0, NULL);
+            break;
+        }
+        case VM_CLOSURE: {
+            jit_call(b, (void *)(uintptr_t)vm_op_closure, i->a, i->b, prog);
+            break;
+        }
+        default: {
+            /* CALL, TAILCALL, RET and UNBOUND belong to the loop */
+            jit_leave(b, pc);
+            break;
+        }
+    }
+}
+
+static void jit_buf_free(jit_buf_t b) {
+    free(b->code);
+    free(b->labels);
+    free(b->stubs);
+    free(b->fixups);
+}
+
+/*
+ * Resolves the fixups and copies the code into fresh pages, filling in
+ * the first ntable labels as the pc table. The pages are writable while
+ * that happens and executable after, never both. NULL, with b freed, if
+ * either step fails; the caller then leaves the function interpreted.
+ */
+static uint8_t *jit_finish(jit_buf_t b, uint32_t ntable, size_t *size) {
+    for (size_t k = 0; k < b->nfixups; ++k) {
+        jit_fixup_s *f = &b->fixups[k];
+        size_t target = f->kind == FIX_LABEL ? b->labels[f->pc] :
+            f->kind == FIX_STUB ? b->stubs[f->pc] :
+            f->kind == FIX_EXIT ? b->exit : b->table;
+        int32_t rel = (int32_t)((int64_t)target - (int64_t)(f->at + 4));
+        memcpy(b->code + f->at, &rel, sizeof(rel));
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    *size = (b->len + page - 1) / page * page;
+    uint8_t *mem = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        jit_buf_free(b);
+        return NULL;
+    }
+    memcpy(mem, b->code, b->len);
+    for (uint32_t pc = 0; pc < ntable; ++pc) {
+        uint64_t addr = (uint64_t)(uintptr_t)(mem + b->labels[pc]);
+        memcpy(mem + b->table + 8 * pc, &addr, sizeof(addr));
+    }
+    if (mprotect(mem, *size, PROT_READ | PROT_EXEC) != 0) {
+        /* no executable pages here */
+        munmap(mem, *size);
+        jit_buf_free(b);
+        return NULL;
+    }
+    return mem;
+}
+
+/* push rbx; push r12; sub rsp, 8; rbx = regs; r12 = self */
+static void jit_prologue(jit_buf_t b) {
+    JIT(b, 0x53);
+    JIT(b, 0x41, 0x54);
+    JIT(b, 0x48, 0x83, 0xec, 0x08);
+    JIT(b, 0x48, 0x89, 0xfb);
+    JIT(b, 0x49, 0x89, 0xd4);
+}
+
+/* the exit: eax holds the pc for the loop */
+static void jit_epilogue(jit_buf_t b) {
+    b->exit = b->len;
+    JIT(b, 0x48, 0x83, 0xc4, 0x08);      /* add rsp, 8 */
+    JIT(b, 0x41, 0x5c);                  /* pop r12 */
+    JIT(b, 0x5b);                        /* pop rbx */
+    JIT(b, 0xc3);                        /* ret */
+}
+
+void vm_jit_compile(vm_program_t prog, vm_function_t fn) {
+    if (fn->jit || sizeof(vm_value_s) != 16 || sizeof(EXP_VAL) != 4 || TRUE != 1 || FALSE != 0) {
+        return;
+    }
+    jit_buf_s b;
+    memset(&b, 0x00, sizeof(b));
+    b.labels = malloc(fn->ncode * sizeof(size_t));
+    b.stubs = malloc(fn->ncode * sizeof(size_t));
+    if (!b.labels || !b.stubs) {
+        report_jit_malloc_fail();
+    }
+
+    jit_prologue(&b);
+    JIT(&b, 0x89, 0xf6);                  /* mov esi, esi */
+    JIT(&b, 0x48, 0x8d, 0x05);            /* lea rax, [rip + table] */
+    jit_rel32(&b, FIX_TABLE, 0);
+    JIT(&b, 0xff, 0x24, 0xf0);            /* jmp [rax + rsi * 8] */
+    jit_epilogue(&b);
+
+    for (uint32_t pc = 0; pc < fn->ncode; ++pc) {
+        b.labels[pc] = b.len;
+        jit_template(&b, prog, &fn->code[pc], pc);
+    }
+    for (uint32_t pc = 0; pc < fn->ncode; ++pc) {
+        b.stubs[pc] = b.len;
+        jit_leave(&b, pc);
+    }
+    while (b.len % 8) {
+        JIT(&b, 0xcc);
+    }
+    b.table = b.len;
+    for (uint32_t pc = 0; pc < fn->ncode; ++pc) {
+        jit_u64(&b, 0);
+    }
+
+    size_t size;
+    uint8_t *mem = jit_finish(&b, fn->ncode, &size);
+    if (!mem) {
+        return;
+    }
+    fn->jit_mem = mem;
+    fn->jit_size = size;
+    fn->jit = (vm_jit_code_t)(uintptr_t)mem;
+    proc_stats->jit_functions += 1;
+    proc_stats->jit_bytes += b.len;
+    jit_buf_free(&b);
+}
+
+void vm_jit_free_code(vm_function_t fn) {
+    if (fn->jit_mem) {
+        munmap(fn->jit_mem, fn->jit_size);
+        fn->jit_mem = NULL;
+        fn->jit = NULL;
+    }
+    if (fn->loop_mem) {
+        munmap(fn->loop_mem, fn->loop_size);
+        fn->loop_mem = NULL;
+        fn->loop = NULL;
+    }
+}
+
+/*
+ * Loop traces. A recorded iteration runs straight through: its JMPFs
+ * become guards on the direction they went, its SELF and the tail call
+ * back into it become a jump to the top. Types are known all the way
+ * down once r0 is checked to be a number at the entry, so the only other
+ * guards are those branches. The vm registers live in machine registers
+ * (unboxed, just the int or the boolean) and the frame in memory stays
+ * as the call left it, fresh: r0 the argument, all else the number 0.
+ * A side exit writes back r0 and whatever this iteration has set so far,
+ * and returns the pc the branch would have gone to; the vm loop carries
+ * on from there in the same frame.
+ */
+typedef enum {
+    LOOP_FRESH = 0x00,  /* not set this iteration, still 0 in the frame */
+    LOOP_NUM,
+    LOOP_BOOL,
+    LOOP_SELF           /* the running closure, materialized only on exit */
+} loop_kind_t;
+
+/* rcx, rdx, rsi, rdi, r8-r11: caller saved, and nothing is called on the
+ * way round; eax is the scratch register */
+static const int loop_regs[] = { 1, 2, 6, 7, 8, 9, 10, 11 };
+#define LOOP_NREGS (sizeof(loop_regs) / sizeof(loop_regs[0]))
+#define RAX 0
+
+typedef struct loop_exit_s {
+    uint32_t pc;
+    uint8_t kinds[LOOP_NREGS];
+} loop_exit_s;
+
+/* op r/m32, r32, both registers */
+static void jit_rr(jit_buf_t b, uint8_t op, int reg, int rm) {
+    if ((reg | rm) & 8) {
+        JIT(b, 0x40 | ((reg & 8) >> 1) | ((rm & 8) >> 3));
+    }
+    JIT(b, op, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* mov r32, [rbx + disp] */
+static void jit_load_reg(jit_buf_t b, int reg, uint32_t disp) {
+    if (reg & 8) {
+        JIT(b, 0x44);
+    }
+    JIT(b, 0x8b, 0x83 | ((reg & 7) << 3));
+    jit_u32(b, disp);
+}
+
+/* mov [rbx + disp], r32 */
+static void jit_store_reg(jit_buf_t b, uint32_t disp, int reg) {
+    if (reg & 8) {
+        JIT(b, 0x44);
+    }
+    JIT(b, 0x89, 0x83 | ((reg & 7) << 3));
+    jit_u32(b, disp);
+}
+
+/* mov r32, imm32 */
+static void jit_mov_imm(jit_buf_t b, int reg, uint32_t imm) {
+    if (reg & 8) {
+        JIT(b, 0x41);
+    }
+    JIT(b, 0xb8 + (reg & 7));
+    jit_u32(b, imm);
+}
+
+/* jcc to a new side exit at pc, with the kinds as they are now */
+static void loop_side_exit(jit_buf_t b, uint8_t jcc, loop_exit_s *exits, uint32_t *nexits,
+                           uint32_t pc, const uint8_t *kinds) {
+    exits[*nexits].pc = pc;
+    memcpy(exits[*nexits].kinds, kinds, LOOP_NREGS);
+    JIT(b, 0x0f, jcc);
+    jit_rel32(b, FIX_STUB, *nexits);
+    *nexits += 1;
+}
+
+/* the body of one iteration; 0 if the recording holds something a trace
+ * cannot, which the kinds tell apart from what it can */
+static int loop_body(jit_buf_t b, vm_function_t fn, vm_loop_rec_t rec, uint8_t *kinds,
+                     loop_exit_s *exits, uint32_t *nexits) {
+    for (uint32_t k = 0; k < rec->len; ++k) {
+        uint32_t pc = rec->pcs[k];
+        vm_insn_t i = &fn->code[pc];
+        switch (i->op) {
+            case VM_LOADK: {
+                jit_mov_imm(b, loop_regs[i->a], (uint32_t)i->b);
+                kinds[i->a] = LOOP_NUM;
+                break;
+            }
+            case VM_MOV: {
+                if (kinds[i->b] == LOOP_FRESH) {
+                    return 0;
+                }
+                if (kinds[i->b] != LOOP_SELF) {
+                    jit_rr(b, 0x89, loop_regs[i->b], loop_regs[i->a]);
+                }
+                kinds[i->a] = kinds[i->b];
+                break;
+            }
+            case VM_SUB:
+            case VM_SUBK: {
+                if (kinds[i->b] != LOOP_NUM || (i->op == VM_SUB && kinds[i->c] != LOOP_NUM)) {
+                    return 0;
+                }
+                jit_rr(b, 0x89, loop_regs[i->b], RAX);          /* mov eax, b */
+                if (i->op == VM_SUB) {
+                    jit_rr(b, 0x29, loop_regs[i->c], RAX);      /* sub eax, c */
+                } else {
+                    JIT(b, 0x2d);                               /* sub eax, c */
+                    jit_u32(b, (uint32_t)i->c);
+                }
+                jit_rr(b, 0x89, RAX, loop_regs[i->a]);          /* mov a, eax */
+                kinds[i->a] = LOOP_NUM;
+                break;
+            }
+            case VM_ISZERO: {
+                if (kinds[i->b] != LOOP_NUM) {
+                    return 0;
+                }
+                jit_rr(b, 0x85, loop_regs[i->b], loop_regs[i->b]);  /* test b, b */
+                JIT(b, 0x0f, 0x94, 0xc0);                       /* sete al */
+                JIT(b, 0x0f, 0xb6, 0xc0);                       /* movzx eax, al */
+                jit_rr(b, 0x89, RAX, loop_regs[i->a]);          /* mov a, eax */
+                kinds[i->a] = LOOP_BOOL;
+                break;
+            }
+            case VM_JMPF: {
+                if (kinds[i->a] != LOOP_BOOL) {
+                    return 0;
+                }
+                jit_rr(b, 0x85, loop_regs[i->a], loop_regs[i->a]);  /* test a, a */
+                if (rec->taken[k]) {
+                    /* went to b: leave if true */
+                    loop_side_exit(b, 0x85, exits, nexits, pc + 1, kinds);
+                } else {
+                    loop_side_exit(b, 0x84, exits, nexits, (uint32_t)i->b, kinds);
+                }
+                break;
+            }
+            case VM_JMP: {
+                break;
+            }
+            case VM_SELF: {
+                kinds[i->a] = LOOP_SELF;
+                break;
+            }
+            case VM_TAILCALL: {
+                if (k + 1 != rec->len || kinds[i->b] != LOOP_SELF || kinds[i->c] != LOOP_NUM) {
+                    return 0;
+                }
+                if (i->c != 0) {
+                    jit_rr(b, 0x89, loop_regs[i->c], loop_regs[0]);
+                }
+                JIT(b, 0xe9);                                   /* jmp top */
+                jit_rel32(b, FIX_LABEL, 0);
+                return 1;
+            }
+            default: {
+                return 0;
+            }
+        }
+    }
+    return 0;
+}
+
+/* writes back what the iteration has set, then leaves with exit's pc */
+static void loop_exit_stub(jit_buf_t b, vm_function_t fn, loop_exit_s *e) {
+    for (uint32_t r = 0; r < fn->nregs; ++r) {
+        if (e->kinds[r] == LOOP_NUM || e->kinds[r] == LOOP_BOOL) {
+            jit_store_imm(b, TYPE(r), e->kinds[r] == LOOP_NUM ? NUM_VAL : BOOL_VAL);
+            jit_store_reg(b, VAL(r), loop_regs[r]);
+        }
+    }
+    /* the helper may clobber the machine registers, so those go last */
+    for (uint32_t r = 0; r < fn->nregs; ++r) {
+        if (e->kinds[r] == LOOP_SELF) {
+            jit_call(b, (void *)(uintptr_t)vm_op_self, r, 0, NULL);
+        }
+    }
+    jit_leave(b, e->pc);
+}
+
+static int vm_loop_compile(vm_function_t fn, vm_loop_rec_t rec) {
+    if (fn->loop || fn->nregs > LOOP_NREGS || sizeof(vm_value_s) != 16 ||
+        sizeof(EXP_VAL) != 4 || TRUE != 1 || FALSE != 0) {
+        return 0;
+    }
+    jit_buf_s b;
+    memset(&b, 0x00, sizeof(b));
+    b.labels = malloc(sizeof(size_t));
+    b.stubs = malloc((rec->len + 1) * sizeof(size_t));
+    loop_exit_s *exits = malloc((rec->len + 1) * sizeof(loop_exit_s));
+    if (!b.labels || !b.stubs || !exits) {
+        report_jit_malloc_fail();
+    }
+    uint8_t kinds[LOOP_NREGS];
+    memset(kinds, LOOP_FRESH, sizeof(kinds));
+    uint32_t nexits = 0;
+
+    jit_prologue(&b);
+    /* exit 0: r0 is not a number, nothing is set yet */
+    exits[nexits].pc = 0;
+    memcpy(exits[nexits].kinds, kinds, LOOP_NREGS);
+    nexits += 1;
+    jit_guard(&b, TYPE(0), NUM_VAL, 0, 0);
+    jit_load_reg(&b, loop_regs[0], VAL(0));
+    b.labels[0] = b.len;
+    kinds[0] = LOOP_NUM;
+    if (!loop_body(&b, fn, rec, kinds, exits, &nexits)) {
+        free(exits);
+        jit_buf_free(&b);
+        return 0;
+    }
+    for (uint32_t e = 0; e < nexits; ++e) {
+        b.stubs[e] = b.len;
+        loop_exit_stub(&b, fn, &exits[e]);
+    }
+    jit_epilogue(&b);
+    free(exits);
+
+    size_t size;
+    uint8_t *mem = jit_finish(&b, 0, &size);
+    if (!mem) {
+        return 0;
+    }
+    fn->loop_mem = mem;
+    fn->loop_size = size;
+    fn->loop = (vm_jit_code_t)(uintptr_t)mem;
+    proc_stats->loop_traces += 1;
+    proc_stats->jit_bytes += b.len;
+    jit_buf_free(&b);
+    return 1;
+}
+
+#else
+
+/* no jit for this target: every function stays with the vm loop */
+void vm_jit_compile(vm_program_t prog, vm_function_t fn) {
+}
+
+void vm_jit_free_code(vm_function_t fn) {
+}
+
+static int vm_loop_compile(vm_function_t fn, vm_loop_rec_t rec) {
+    return 0;
+}
+
+#endif
+
+static void vm_loop_abort(vm_loop_rec_t rec) {
+    rec->fn->loop_aborts += 1;
+    rec->fn->loops = 0;
+    proc_stats->loop_aborts += 1;
+    rec->fn = NULL;
+}
+
+void vm_loop_record(vm_loop_rec_t rec, vm_function_t fn, uint32_t pc, vm_value_t regs) {
+    if (fn != rec->fn || rec->len == VM_LOOP_MAX ||
+        (rec->len == 0 && (pc != 0 || regs[0].type != NUM_VAL))) {
+        /* left the function, or an iteration too long or not over a number */
+        vm_loop_abort(rec);
+        return;
+    }
+    vm_insn_t i = &fn->code[pc];
+    switch (i->op) {
+        case VM_LOADK:
+        case VM_MOV:
+        case VM_SUB:
+        case VM_SUBK:
+        case VM_ISZERO:
+        case VM_JMP:
+        case VM_SELF: {
+            break;
+        }
+        case VM_JMPF: {
+            rec->taken[rec->len] = regs[i->a].type == BOOL_VAL && regs[i->a].v.bv == FALSE;
+            break;
+        }
+        case VM_TAILCALL: {
+            rec->pcs[rec->len++] = pc;
+            if (vm_loop_compile(fn, rec)) {
+                rec->fn = NULL;
+            } else {
+                vm_loop_abort(rec);
+            }
+            return;
+        }
+        default: {
+            /* calls, returns and closures stay with the loop */
+            vm_loop_abort(rec);
+            return;
+        }
+    }
+    rec->pcs[rec->len++] = pc;
+}
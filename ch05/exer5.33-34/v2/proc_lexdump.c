@@ -0,0 +1,93 @@
+/* print the token stream of a PROC program, one token per line, so that the
+ * flex scanner and the hand-written one can be compared */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proc.h"
+#include "proc_parser.h"
+#ifdef PROC_HAND_SCANNER
+#include "proc_lexer.h"
+#else
+#include "proc_scanner.h"
+#endif
+
+/* the parser is not linked in, so the scanners report errors here */
+void yyerror(void *lex, symbol_t table, ast_program_t *prgm, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "error: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+}
+
+static const char *token_name(int tok) {
+    switch (tok) {
+        case IF: return "IF";
+        case IN: return "IN";
+        case LET: return "LET";
+        case ELSE: return "ELSE";
+        case PROC: return "PROC";
+        case THEN: return "THEN";
+        case ZERO: return "ZERO";
+        case LETREC: return "LETREC";
+        case IDENTIFIER: return "IDENTIFIER";
+        case NUMBER: return "NUMBER";
+        default: return "CHAR";
+    }
+}
+
+static char *slurp(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "cannot open %s\n", path);
+        exit(1);
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *buf = malloc(size + 1);
+    if (!buf || fread(buf, 1, size, fp) != (size_t)size) {
+        fprintf(stderr, "failed to read %s\n", path);
+        exit(1);
+    }
+    buf[size] = '\0';
+    fclose(fp);
+    return buf;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s FILE\n", argv[0]);
+        return 1;
+    }
+    char *string = slurp(argv[1]);
+    yyscan_t scaninfo = NULL;
+    YYSTYPE lval;
+    memset(symtab, 0x00, sizeof(symtab));
+    if (yylex_init_extra(symtab, &scaninfo) != 0) {
+        fprintf(stderr, "Failed to initialize scanner!\n");
+        return 1;
+    }
+    YY_BUFFER_STATE bp = yy_scan_string(string, scaninfo);
+    yy_switch_to_buffer(bp, scaninfo);
+    int tok;
+    while ((tok = yylex(&lval, scaninfo)) != 0) {
+        int line = yyget_lineno(scaninfo);
+        if (tok == IDENTIFIER) {
+            printf("%d %s %s\n", line, token_name(tok), lval.id->name);
+        } else if (tok == NUMBER) {
+            printf("%d %s %d\n", line, token_name(tok), lval.num);
+        } else if (tok < 256) {
+            printf("%d %s %c\n", line, token_name(tok), tok);
+        } else {
+            printf("%d %s\n", line, token_name(tok));
+        }
+    }
+    yy_delete_buffer(bp, scaninfo);
+    yylex_destroy(scaninfo);
+    symbol_table_free(symtab);
+    free(string);
+    return 0;
+}
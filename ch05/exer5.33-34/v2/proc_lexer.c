@@ -0,0 +1,248 @@
+/* hand-written scanner producing the same tokens as proc.l */
+#include <stdlib.h>
+#include <string.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "proc.h"
+#include "proc_parser.h"
+#include "proc_lexer.h"
+
+/* the input is copied with this much zero padding, so vector loads may run
+ * past the end of the text without leaving the buffer */
+#define LEXER_PAD 32
+
+typedef struct yy_buffer_state {
+    char *text;
+    size_t len;
+} yy_buffer_state;
+
+typedef struct lexer_s {
+    symbol_t table;
+    YY_BUFFER_STATE buf;
+    const char *cur;
+    int lineno;
+} lexer_s, *lexer_t;
+
+static void report_lexer_malloc_fail(const char *what) {
+    yyerror(NULL, NULL, NULL, "failed to create a new %s for the scanner", what);
+    exit(1);
+}
+
+int yylex_init_extra(symbol_t table, yyscan_t *scanner) {
+    lexer_t lx = calloc(1, sizeof(lexer_s));
+    if (!lx) {
+        return 1;
+    }
+    lx->table = table;
+    lx->lineno = 1;
+    *scanner = lx;
+    return 0;
+}
+
+int yylex_destroy(yyscan_t scanner) {
+    lexer_t lx = scanner;
+    if (lx) {
+        yy_delete_buffer(lx->buf, scanner);
+        free(lx);
+    }
+    return 0;
+}
+
+YY_BUFFER_STATE yy_scan_string(const char *string, yyscan_t scanner) {
+    YY_BUFFER_STATE b = malloc(sizeof(yy_buffer_state));
+    if (!b) {
+        report_lexer_malloc_fail("buffer");
+    }
+    b->len = strlen(string);
+    b->text = malloc(b->len + LEXER_PAD);
+    if (!b->text) {
+        report_lexer_malloc_fail("buffer");
+    }
+    memcpy(b->text, string, b->len);
+    memset(b->text + b->len, 0, LEXER_PAD);
+    yy_switch_to_buffer(b, scanner);
+    return b;
+}
+
+void yy_switch_to_buffer(YY_BUFFER_STATE buf, yyscan_t scanner) {
+    lexer_t lx = scanner;
+    lx->buf = buf;
+    lx->cur = buf->text;
+}
+
+void yy_flush_buffer(YY_BUFFER_STATE buf, yyscan_t scanner) {
+    lexer_t lx = scanner;
+    if (lx->buf == buf) {
+        lx->cur = buf->text + buf->len;
+    }
+}
+
+void yy_delete_buffer(YY_BUFFER_STATE buf, yyscan_t scanner) {
+    lexer_t lx = scanner;
+    if (buf) {
+        if (lx->buf == buf) {
+            lx->buf = NULL;
+            lx->cur = NULL;
+        }
+        free(buf->text);
+        free(buf);
+    }
+}
+
+int yyget_lineno(yyscan_t scanner) {
+    return ((lexer_t)scanner)->lineno;
+}
+
+/*
+ * Both scans below test a whole vector of bytes at once and stop at the
+ * first byte that does not belong to the run. Loads past the end of the
+ * text only ever see the zero padding, which ends every run.
+ */
+#if defined(__AVX2__)
+#define LEXER_STEP 32
+typedef __m256i lexer_vec_t;
+#define vec_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define vec_set1(c) _mm256_set1_epi8(c)
+#define vec_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define vec_gt(a, b) _mm256_cmpgt_epi8(a, b)
+#define vec_or(a, b) _mm256_or_si256(a, b)
+#define vec_and(a, b) _mm256_and_si256(a, b)
+#define vec_mask(a) ((uint32_t)_mm256_movemask_epi8(a))
+#define LEXER_FULL 0xffffffffu
+#elif defined(__SSE2__)
+#define LEXER_STEP 16
+typedef __m128i lexer_vec_t;
+#define vec_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define vec_set1(c) _mm_set1_epi8(c)
+#define vec_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define vec_gt(a, b) _mm_cmpgt_epi8(a, b)
+#define vec_or(a, b) _mm_or_si128(a, b)
+#define vec_and(a, b) _mm_and_si128(a, b)
+#define vec_mask(a) ((uint32_t)_mm_movemask_epi8(a))
+#define LEXER_FULL 0xffffu
+#else
+static int is_space(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static int is_alnum(unsigned char c) {
+    return (unsigned)((c | 0x20) - 'a') < 26 || (unsigned)(c - '0') < 10;
+}
+#endif
+
+static const char *skip_space(const char *p, int *lineno) {
+#ifdef LEXER_STEP
+    const lexer_vec_t sp = vec_set1(' '), tab = vec_set1('\t');
+    const lexer_vec_t cr = vec_set1('\r'), nl = vec_set1('\n');
+    for (;;) {
+        lexer_vec_t v = vec_load(p);
+        lexer_vec_t is_nl = vec_eq(v, nl);
+        uint32_t ws = vec_mask(vec_or(vec_or(vec_eq(v, sp), vec_eq(v, tab)),
+                                      vec_or(vec_eq(v, cr), is_nl)));
+        uint32_t nls = vec_mask(is_nl);
+        if (ws != LEXER_FULL) {
+            uint32_t end = __builtin_ctz(~ws);
+            *lineno += __builtin_popcount(nls & ((1u << end) - 1));
+            return p + end;
+        }
+        *lineno += __builtin_popcount(nls);
+        p += LEXER_STEP;
+    }
+#else
+    while (is_space(*p)) {
+        *lineno += *p == '\n';
+        ++p;
+    }
+    return p;
+#endif
+}
+
+static const char *skip_alnum(const char *p) {
+#ifdef LEXER_STEP
+    const lexer_vec_t case_bit = vec_set1(0x20);
+    const lexer_vec_t before_a = vec_set1('a' - 1), after_z = vec_set1('z' + 1);
+    const lexer_vec_t before_0 = vec_set1('0' - 1), after_9 = vec_set1('9' + 1);
+    for (;;) {
+        lexer_vec_t v = vec_load(p);
+        lexer_vec_t lower = vec_or(v, case_bit);
+        lexer_vec_t alpha = vec_and(vec_gt(lower, before_a), vec_gt(after_z, lower));
+        lexer_vec_t digit = vec_and(vec_gt(v, before_0), vec_gt(after_9, v));
+        uint32_t run = vec_mask(vec_or(alpha, digit));
+        if (run != LEXER_FULL) {
+            return p + __builtin_ctz(~run);
+        }
+        p += LEXER_STEP;
+    }
+#else
+    while (is_alnum(*p)) {
+        ++p;
+    }
+    return p;
+#endif
+}
+
+static int keyword(const char *p, size_t len) {
+    switch (len) {
+        case 2:
+            if (p[0] == 'i' && p[1] == 'f') return IF;
+            if (p[0] == 'i' && p[1] == 'n') return IN;
+            break;
+        case 3:
+            if (memcmp(p, "let", 3) == 0) return LET;
+            break;
+        case 4:
+            if (memcmp(p, "else", 4) == 0) return ELSE;
+            if (memcmp(p, "proc", 4) == 0) return PROC;
+            if (memcmp(p, "then", 4) == 0) return THEN;
+            if (memcmp(p, "zero", 4) == 0 && p[4] == '?') return ZERO;
+            break;
+        case 6:
+            if (memcmp(p, "letrec", 6) == 0) return LETREC;
+            break;
+    }
+    return 0;
+}
+
+int yylex(YYSTYPE *lvalp, yyscan_t scanner) {
+    lexer_t lx = scanner;
+    const char *p = skip_space(lx->cur, &lx->lineno);
+    const char *end = lx->buf->text + lx->buf->len;
+    if (p >= end) {
+        lx->cur = end;
+        return 0;
+    }
+
+    unsigned char c = *p;
+    if ((unsigned)((c | 0x20) - 'a') < 26) {
+        const char *q = skip_alnum(p + 1);
+        size_t len = q - p;
+        int tok = keyword(p, len);
+        if (tok == ZERO) {
+            lx->cur = q + 1;
+            return ZERO;
+        } else if (tok) {
+            lx->cur = q;
+            return tok;
+        }
+        lvalp->id = symbol_lookup_len(lx->table, p, len, symbol_hash(p, len));
+        lx->cur = q;
+        return IDENTIFIER;
+    }
+
+    /* "-"?[0-9]+, accumulated while the digits are scanned */
+    if ((unsigned)(c - '0') < 10 || (c == '-' && (unsigned)(p[1] - '0') < 10)) {
+        int neg = c == '-';
+        unsigned num = 0;
+        p += neg;
+        while ((unsigned)(*p - '0') < 10) {
+            num = num * 10 + (*p++ - '0');
+        }
+        lvalp->num = (int)(neg ? 0u - num : num);
+        lx->cur = p;
+        return NUMBER;
+    }
+
+    lx->cur = p + 1;
+    return c;
+}
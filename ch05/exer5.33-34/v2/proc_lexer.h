@@ -0,0 +1,22 @@
+#ifndef __PROC_LEXER_H__
+#define __PROC_LEXER_H__
+
+/*
+ * Hand-written replacement for the flex scanner in proc.l. It exposes the
+ * subset of the reentrant flex interface that proc.y and proc_parse use, so
+ * either scanner can be linked in. Like the generated proc_scanner.h, it
+ * must be included after proc_parser.h.
+ */
+typedef void *yyscan_t;
+typedef struct yy_buffer_state *YY_BUFFER_STATE;
+
+int yylex_init_extra(symbol_t table, yyscan_t *scanner);
+int yylex_destroy(yyscan_t scanner);
+YY_BUFFER_STATE yy_scan_string(const char *string, yyscan_t scanner);
+void yy_switch_to_buffer(YY_BUFFER_STATE buf, yyscan_t scanner);
+void yy_flush_buffer(YY_BUFFER_STATE buf, yyscan_t scanner);
+void yy_delete_buffer(YY_BUFFER_STATE buf, yyscan_t scanner);
+int yyget_lineno(yyscan_t scanner);
+int yylex(YYSTYPE *lvalp, yyscan_t scanner);
+
+#endif
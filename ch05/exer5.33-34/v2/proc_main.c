@@ -0,0 +1,486 @@
+/* command line driver: runs files, images and the built-in programs */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "proc.h"
+
+/* counters of the last evaluation, when --perf is on */
+static int perf_on;
+static perf_sample_s perf_last;
+
+#define PERF_START()                            \
+    do {                                        \
+        if (perf_on) {                          \
+            perf_counters_start();              \
+        }                                       \
+    } while (0)
+#define PERF_STOP()                             \
+    do {                                        \
+        if (perf_on) {                          \
+            perf_counters_stop(&perf_last);     \
+        }                                       \
+    } while (0)
+
+/* superinstructions for the tree engine, none unless --fuse is given */
+static uint32_t fuse_mask;
+
+/* the anf passes a program goes through before any engine, with --anf */
+static int use_anf;
+static uint32_t anf_mask;
+
+ast_program_t run_anf(ast_program_t prgm) {
+    if (!use_anf) {
+        return prgm;
+    }
+    TRACE_BEGIN("anf", 0, NULL, 0);
+    anf_program_t aprgm = anf_convert(prgm);
+    ast_program_free(prgm);
+    anf_optimize(aprgm, anf_mask);
+    prgm = anf_lower(aprgm);
+    anf_program_free(aprgm);
+    TRACE_END("anf");
+    return prgm;
+}
+
+void run_anf_dump(const char *string) {
+    memset(symtab, 0x00, sizeof(symtab));
+    ast_program_t prgm = proc_parse(string);
+    anf_program_t aprgm = anf_convert(prgm);
+    ast_program_free(prgm);
+    anf_optimize(aprgm, anf_mask);
+    anf_program_dump(aprgm, stdout);
+    anf_program_free(aprgm);
+    symbol_table_free(symtab);
+}
+
+void run(const char *string) {
+    memset(symtab, 0x00, sizeof(symtab));
+    TRACE_BEGIN("parse", 0, "bytes", (long)strlen(string));
+    ast_program_t prgm = proc_parse(string);
+    TRACE_END("parse");
+    prgm = run_anf(prgm);
+    if (fuse_mask) {
+        TRACE_BEGIN("fuse", 0, NULL, 0);
+        ast_fuse(prgm, fuse_mask);
+        TRACE_END("fuse");
+    }
+    TRACE_BEGIN("evaluate", 0, NULL, 0);
+    PERF_START();
+    value_of_program_k(prgm);
+    PERF_STOP();
+    TRACE_END("evaluate");
+    sample_profile_collect();
+    TRACE_BEGIN("free", 0, NULL, 0);
+    ast_program_free(prgm);
+    symbol_table_free(symtab);
+    TRACE_END("free");
+}
+
+void compile_image(const char *path, const char *image_path) {
+    memset(symtab, 0x00, sizeof(symtab));
+    char *string = read_file(path);
+    ast_program_t prgm = run_anf(proc_parse(string));
+    int v = ast_image_write(prgm, image_path);
+    ast_program_free(prgm);
+    symbol_table_free(symtab);
+    free(string);
+    if (v != 0) {
+        exit(1);
+    }
+}
+
+void run_flat(const char *string) {
+    memset(symtab, 0x00, sizeof(symtab));
+    TRACE_BEGIN("parse", 0, "bytes", (long)strlen(string));
+    ast_program_t prgm = proc_parse(string);
+    TRACE_END("parse");
+    prgm = run_anf(prgm);
+    TRACE_BEGIN("flatten", 0, NULL, 0);
+    ast_flat_t fprgm = ast_flat_new(prgm);
+    ast_program_free(prgm);
+    TRACE_END("flatten");
+    TRACE_BEGIN("evaluate", 0, "nodes", (long)fprgm->count);
+    PERF_START();
+    value_of_program_flat(fprgm);
+    PERF_STOP();
+    TRACE_END("evaluate");
+    sample_profile_collect();
+    TRACE_BEGIN("free", 0, NULL, 0);
+    ast_flat_free(fprgm);
+    symbol_table_free(symtab);
+    TRACE_END("free");
+}
+
+void run_cc(const char *string) {
+    memset(symtab, 0x00, sizeof(symtab));
+    TRACE_BEGIN("parse", 0, "bytes", (long)strlen(string));
+    ast_program_t prgm = proc_parse(string);
+    TRACE_END("parse");
+    prgm = run_anf(prgm);
+    TRACE_BEGIN("compile", 0, NULL, 0);
+    cc_program_t cprgm = cc_compile(prgm);
+    ast_program_free(prgm);
+    TRACE_END("compile");
+    TRACE_BEGIN("evaluate", 0, NULL, 0);
+    PERF_START();
+    value_of_program_cc(cprgm);
+    PERF_STOP();
+    TRACE_END("evaluate");
+    sample_profile_collect();
+    TRACE_BEGIN("free", 0, NULL, 0);
+    cc_program_free(cprgm);
+    symbol_table_free(symtab);
+    TRACE_END("free");
+}
+
+void run_cps(const char *string, int dump) {
+    memset(symtab, 0x00, sizeof(symtab));
+    TRACE_BEGIN("parse", 0, "bytes", (long)strlen(string));
+    ast_program_t prgm = proc_parse(string);
+    TRACE_END("parse");
+    prgm = run_anf(prgm);
+    TRACE_BEGIN("convert", 0, NULL, 0);
+    cps_program_t cprgm = cps_convert(prgm);
+    ast_program_free(prgm);
+    TRACE_END("convert");
+    if (dump) {
+        cps_program_dump(cprgm, stdout);
+    } else {
+        TRACE_BEGIN("evaluate", 0, NULL, 0);
+        PERF_START();
+        value_of_program_cps(cprgm);
+        PERF_STOP();
+        TRACE_END("evaluate");
+        sample_profile_collect();
+    }
+    TRACE_BEGIN("free", 0, NULL, 0);
+    cps_program_free(cprgm);
+    symbol_table_free(symtab);
+    TRACE_END("free");
+}
+
+void run_vm(const char *string, int dump) {
+    memset(symtab, 0x00, sizeof(symtab));
+    TRACE_BEGIN("parse", 0, "bytes", (long)strlen(string));
+    ast_program_t prgm = proc_parse(string);
+    TRACE_END("parse");
+    prgm = run_anf(prgm);
+    TRACE_BEGIN("compile", 0, NULL, 0);
+    vm_program_t vprgm = vm_compile(prgm);
+    ast_program_free(prgm);
+    TRACE_END("compile");
+    if (dump) {
+        vm_program_dump(vprgm, stdout);
+    } else {
+        TRACE_BEGIN("evaluate", 0, NULL, 0);
+        PERF_START();
+        value_of_program_vm(vprgm);
+        PERF_STOP();
+        TRACE_END("evaluate");
+        sample_profile_collect();
+    }
+    TRACE_BEGIN("free", 0, NULL, 0);
+    vm_program_free(vprgm);
+    symbol_table_free(symtab);
+    TRACE_END("free");
+}
+
+void run_counted(const char *string, const char *count_out, const char *count_in) {
+    memset(symtab, 0x00, sizeof(symtab));
+    ast_program_t prgm = run_anf(proc_parse(string));
+    ast_flat_t fprgm = ast_flat_new(prgm);
+    ast_program_free(prgm);
+    node_profile_t prof = NULL;
+    if (count_in) {
+        prof = node_profile_load(fprgm, count_in);
+        if (!prof) {
+            exit(1);
+        }
+    } else {
+        prof = node_profile_new(fprgm);
+    }
+    if (count_out) {
+        value_of_program_counted(prof);
+        sample_profile_collect();
+        if (node_profile_write(prof, count_out) != 0) {
+            exit(1);
+        }
+    } else {
+        node_profile_report(prof, stdout, 20);
+    }
+    node_profile_free(prof);
+    ast_flat_free(fprgm);
+    symbol_table_free(symtab);
+}
+
+void run_image(const char *image_path) {
+    memset(symtab, 0x00, sizeof(symtab));
+    TRACE_BEGIN("load", 0, NULL, 0);
+    ast_image_t img = ast_image_open(image_path);
+    TRACE_END("load");
+    if (!img) {
+        exit(1);
+    }
+    TRACE_BEGIN("evaluate", 0, NULL, 0);
+    PERF_START();
+    value_of_image(img);
+    PERF_STOP();
+    TRACE_END("evaluate");
+    sample_profile_collect();
+    TRACE_BEGIN("free", 0, NULL, 0);
+    ast_image_close(img);
+    symbol_table_free(symtab);
+    TRACE_END("free");
+}
+
+void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s                     run the built-in tests\n"
+            "       %s FILE                run a PROC program\n"
+            "       %s -f FILE             run FILE from the flat ast layout\n"
+            "       %s -c FILE             run FILE as closures compiled from the ast\n"
+            "       %s --cps FILE          run FILE converted to continuation-passing style\n"
+            "       %s --cps-dump FILE     print FILE in continuation-passing style\n"
+            "       %s -r FILE             run FILE on the register vm\n"
+            "       %s --vm-dump FILE      print the register vm code of FILE\n"
+            "       %s --anf-dump FILE     print FILE in a-normal form after the passes\n"
+            "       %s --jit[=N] FILE      run FILE on the register vm, compiling a\n"
+            "                              function to machine code after N calls (100)\n"
+            "       %s --loops[=N] FILE    run FILE on the register vm, tracing a self\n"
+            "                              tail calling loop after N iterations (50)\n"
+            "       %s -o IMAGE FILE       compile FILE to a binary ast image\n"
+            "       %s -i IMAGE            run a binary ast image\n"
+            "options: --stats[=text|json]  report runtime counters on stderr\n"
+            "         --heap-profile[=N]   report allocations per constructor at exit,\n"
+            "                              and every N allocations or on SIGUSR1\n"
+            "         --profile=OUT        sample guest call stacks into OUT as folded\n"
+            "                              stacks for flame graph tools; not with --cps\n"
+            "         --profile-hz=N       sampling rate, 1000 by default\n"
+            "         --count=OUT          count every node of FILE into a node profile\n"
+            "         --count-show=IN      print the hottest nodes of FILE from a profile,\n"
+            "                              or add to it when given with --count\n"
+            "         --trace=OUT          write guest calls and phases to OUT as a\n"
+            "                              chrome trace_event json timeline\n"
+            "         --fuse[=S[,S]]       run the tree engine on superinstructions: all,\n"
+            "                              default, or dec_var, neg_var, add_vars,\n"
+            "                              zero_var, if_zero_var, call_vars, call_dec_var,\n"
+            "                              call_curried\n"
+            "         --anf[=P[,P]]        run FILE through the a-normal form passes\n"
+            "                              first: all, none, or fold, cse, inline (all)\n"
+            "         --anf-inline=N       with --anf, inline procs of up to N nodes (32)\n"
+            "         --anf-report         with --anf, say on stderr which calls are inlined\n"
+            "         --perf               count cycles, instructions, branch, cache\n"
+            "                              and dTLB misses of each evaluation\n",
+            name, name, name, name, name, name, name, name, name, name, name, name, name);
+}
+
+int main(int argc, char *argv[]) {
+    const char *file = NULL;
+    const char *image_out = NULL;
+    const char *image_in = NULL;
+    int use_flat = 0;
+    int use_cc = 0;
+    int anf_dump = 0;
+    int use_cps = 0;
+    int cps_dump = 0;
+    int use_vm = 0;
+    int vm_dump = 0;
+    int stats = 0;
+    int stats_json = 0;
+    const char *profile_out = NULL;
+    int profile_hz = 1000;
+    const char *count_out = NULL;
+    const char *count_in = NULL;
+    const char *anf_option = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=text") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            stats = 1;
+            stats_json = 1;
+        } else if (strcmp(argv[i], "--heap-profile") == 0) {
+            heap_profile_start(0);
+        } else if (strncmp(argv[i], "--heap-profile=", 15) == 0) {
+            heap_profile_start(strtoull(argv[i] + 15, NULL, 10));
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            profile_out = argv[i] + 10;
+        } else if (strncmp(argv[i], "--profile-hz=", 13) == 0) {
+            profile_hz = atoi(argv[i] + 13);
+        } else if (strcmp(argv[i], "--fuse") == 0) {
+            fuse_mask = fuse_default;
+        } else if (strncmp(argv[i], "--fuse=", 7) == 0) {
+            if (fuse_parse(argv[i] + 7, &fuse_mask) != 0) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--anf") == 0) {
+            use_anf = 1;
+            anf_mask = anf_default;
+        } else if (strncmp(argv[i], "--anf=", 6) == 0) {
+            use_anf = 1;
+            if (anf_parse(argv[i] + 6, &anf_mask) != 0) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--anf-dump") == 0) {
+            anf_dump = 1;
+        } else if (strncmp(argv[i], "--anf-inline=", 13) == 0) {
+            anf_inline_size = strtoul(argv[i] + 13, NULL, 10);
+            anf_option = argv[i];
+        } else if (strcmp(argv[i], "--anf-report") == 0) {
+            anf_report = stderr;
+            anf_option = argv[i];
+        } else if (strcmp(argv[i], "--perf") == 0) {
+            perf_on = 1;
+        } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+            trace_start(argv[i] + 8);
+        } else if (strncmp(argv[i], "--count=", 8) == 0) {
+            count_out = argv[i] + 8;
+        } else if (strncmp(argv[i], "--count-show=", 13) == 0) {
+            count_in = argv[i] + 13;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            image_out = argv[++i];
+        } else if (strcmp(argv[i], "-f") == 0) {
+            use_flat = 1;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            use_cc = 1;
+        } else if (strcmp(argv[i], "--cps") == 0) {
+            use_cps = 1;
+        } else if (strcmp(argv[i], "--cps-dump") == 0) {
+            use_cps = 1;
+            cps_dump = 1;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            use_vm = 1;
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            use_vm = 1;
+            vm_jit_threshold = 100;
+        } else if (strncmp(argv[i], "--jit=", 6) == 0) {
+            use_vm = 1;
+            vm_jit_threshold = strtoul(argv[i] + 6, NULL, 10);
+        } else if (strcmp(argv[i], "--loops") == 0) {
+            use_vm = 1;
+            vm_loop_threshold = 50;
+        } else if (strncmp(argv[i], "--loops=", 8) == 0) {
+            use_vm = 1;
+            vm_loop_threshold = strtoul(argv[i] + 8, NULL, 10);
+        } else if (strcmp(argv[i], "--vm-dump") == 0) {
+            use_vm = 1;
+            vm_dump = 1;
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            image_in = argv[++i];
+        } else if (argv[i][0] != '-' && !file) {
+            file = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    /* superinstructions are made for the tree engine only; anywhere else
+     * --fuse would be taken and quietly do nothing */
+    if (fuse_mask && (use_flat || use_cc || use_cps || use_vm || anf_dump || image_in ||
+                      image_out || count_out || count_in)) {
+        fprintf(stderr, "%s: --fuse runs on the tree engine only\n", argv[0]);
+        usage(argv[0]);
+        return 1;
+    }
+    /* the inliner runs only as one of the anf passes */
+    if (anf_option && !use_anf && !anf_dump) {
+        fprintf(stderr, "%s: %s needs --anf or --anf-dump\n", argv[0], anf_option);
+        usage(argv[0]);
+        return 1;
+    }
+    /* every call of a cps program is a tail call, so there is no call
+     * stack to sample and each sample would be main */
+    if (profile_out && use_cps) {
+        fprintf(stderr, "%s: --profile has no call stack to sample under --cps\n", argv[0]);
+        usage(argv[0]);
+        return 1;
+    }
+    proc_stats_enable(stats);
+    if (perf_on && perf_counters_open() == 0) {
+        perf_on = 0;
+    }
+    if (profile_out) {
+        sample_profile_start(profile_out, profile_hz);
+    }
+    if (image_in) {
+        run_image(image_in);
+        if (perf_on) {
+            perf_counters_print(stderr, "image", &perf_last);
+        }
+        if (stats) {
+            proc_stats_print(stderr, stats_json);
+        }
+        return 0;
+    } else if (image_out && file) {
+        compile_image(file, image_out);
+        return 0;
+    } else if (image_out) {
+        usage(argv[0]);
+        return 1;
+    } else if (file) {
+        char *string = read_file(file);
+        if (anf_dump) {
+            if (!use_anf) {
+                anf_mask = anf_default;
+            }
+            run_anf_dump(string);
+        } else if (count_out || count_in) {
+            run_counted(string, count_out, count_in);
+        } else if (use_vm) {
+            run_vm(string, vm_dump);
+        } else if (use_cps) {
+            run_cps(string, cps_dump);
+        } else if (use_cc) {
+            run_cc(string);
+        } else if (use_flat) {
+            run_flat(string);
+        } else {
+            run(string);
+        }
+        free(string);
+        if (perf_on && !count_out && !count_in && !vm_dump && !cps_dump && !anf_dump) {
+            perf_counters_print(stderr, use_vm ? (vm_loop_threshold ? "loops" : vm_jit_threshold ? "jit" : "vm") :
+                                use_cps ? "cps" : use_cc ? "cc" : use_flat ? "flat" : fuse_mask ? "fused" : "tree", &perf_last);
+        }
+        if (stats) {
+            proc_stats_print(stderr, stats_json);
+        }
+        return 0;
+    }
+
+    const char *programs[] = {
+        "3",
+        "-(3,2)",
+        "let x = 3 in x",
+        "let x = 3 in -(3, x)",
+        "proc (x) -(x, 1)",
+        "(proc (x) -(x, 1) 3)",
+        "let f = proc (x) -(x, 1) in (f 3)",
+        "let x = 3 in let f = proc (x) -(x, 1) in (f x)",
+        "((proc (x) proc (y) -(y,-(0,x)) 3) 4)",
+        "letrec double (x) = if zero?(x) then 0"
+        " else -((double -(x,1)),-2)"
+        " in (double 5000)",
+        "letrec double (x) = if zero?(x) then 0"
+        " else -((double -(x,1)),-2)"
+        " in double",
+        "(((proc (x) proc (y) proc (z) -(z,-(0,-(y,-(0,x)))) 3) 4) 5)",
+        "-(let f = proc (x) proc (y) proc (z) -(z,-(0,-(y,-(0,x)))) in (((f 3) 4) 5), 3)",
+        "let f = letrec g (x) = if zero?(x) then 0 else -((g -(x, 1)),-2) in g in (f 2)",
+        "-(2, let y = 13 in letrec g (x) = if zero?(x) then 0 else -((g -(x, 1)),-2) in (g y))",
+    };
+    for (int i = 0; i < sizeof(programs)/ sizeof(*programs); ++i) {
+        proc_stats_reset();
+        clock_t t1 = clock();
+        run(programs[i]);
+        clock_t t2 = clock();
+        printf("CPU time: %ld\n", (long)(t2 - t1));
+        if (perf_on) {
+            perf_counters_print(stdout, "tree", &perf_last);
+        }
+        if (stats) {
+            proc_stats_print(stderr, stats_json);
+        }
+    }
+    return 0;
+}
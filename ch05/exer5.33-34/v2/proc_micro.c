@@ -0,0 +1,364 @@
+/* microbenchmarks of runtime primitives, in ns per operation */
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "proc.h"
+
+/* times iters operations of one primitive at size arg, setup excluded */
+typedef double (*micro_fn_t)(long arg, long iters);
+
+typedef struct micro_case_s {
+    const char *name;
+    micro_fn_t fn;
+    long arg;
+    int sized;  /* arg is a size worth printing, not just a selector */
+} micro_case_s, *micro_case_t;
+
+typedef struct micro_options_s {
+    int reps;
+    double min_ms;  /* per timed batch */
+    const char *filter;
+    const char *json;
+} micro_options_s, *micro_options_t;
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report_micro_malloc_fail() {
+    fprintf(stderr, "failed to set up a microbenchmark!\n");
+    exit(1);
+}
+
+/* keeps results alive so the timed calls are not optimized away */
+static volatile uintptr_t micro_sink;
+
+/* symbol table filled to load percent with s0, s1, ... */
+static symbol_s micro_table[NHASH];
+
+static char **micro_names(const char *prefix, long n) {
+    char **names = malloc(n * sizeof(char *));
+    if (!names) {
+        report_micro_malloc_fail();
+    }
+    for (long i = 0; i < n; ++i) {
+        names[i] = malloc(24);
+        if (!names[i]) {
+            report_micro_malloc_fail();
+        }
+        sprintf(names[i], "%s%ld", prefix, i);
+    }
+    return names;
+}
+
+static void micro_names_free(char **names, long n) {
+    for (long i = 0; i < n; ++i) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+static long micro_table_fill(long load) {
+    long n = NHASH * load / 100;
+    char **names = micro_names("s", n);
+    symbol_table_free(micro_table);
+    memset(micro_table, 0x00, sizeof(micro_table));
+    for (long i = 0; i < n; ++i) {
+        symbol_lookup(micro_table, names[i]);
+    }
+    micro_names_free(names, n);
+    return n;
+}
+
+static double bench_symbol_hit(long load, long iters) {
+    long n = micro_table_fill(load);
+    char **names = micro_names("s", n);
+    double t1 = now_ns();
+    for (long i = 0, j = 0; i < iters; ++i, j = j + 1 == n ? 0 : j + 1) {
+        micro_sink += (uintptr_t)symbol_lookup(micro_table, names[j]);
+    }
+    double t2 = now_ns();
+    micro_names_free(names, n);
+    return t2 - t1;
+}
+
+/* a miss inserts, so each one is timed with taking its entry back out;
+ * the entry is the last of its probe chain, so nothing else moves */
+static double bench_symbol_miss(long load, long iters) {
+    long n = 1024;
+    micro_table_fill(load);
+    char **names = micro_names("m", n);
+    double t1 = now_ns();
+    for (long i = 0, j = 0; i < iters; ++i, j = j + 1 == n ? 0 : j + 1) {
+        symbol_t sp = symbol_lookup(micro_table, names[j]);
+        free(sp->name);
+        sp->name = NULL;
+    }
+    double t2 = now_ns();
+    micro_names_free(names, n);
+    return t2 - t1;
+}
+
+/* an environment of depth frames over the empty one, v0 the deepest */
+static env_t micro_env(long depth, symbol_t **vars) {
+    env_t e = empty_env();
+    *vars = malloc((depth + 1) * sizeof(symbol_t));
+    if (!*vars) {
+        report_micro_malloc_fail();
+    }
+    for (long i = 0; i < depth; ++i) {
+        char name[24];
+        sprintf(name, "v%ld", i);
+        (*vars)[i] = symbol_new(name);
+        e = extend_env((*vars)[i], new_int_val(i), e);
+    }
+    return e;
+}
+
+static void micro_env_free(env_t e, symbol_t *vars, long depth) {
+    while (e) {
+        e = env_pop(e);
+    }
+    for (long i = 0; i < depth; ++i) {
+        symbol_free(vars[i]);
+    }
+    free(vars);
+}
+
+/* the value goes with the frame, so a fresh one is part of every pair */
+static double bench_extend_pop(long arg, long iters) {
+    symbol_t *vars;
+    env_t base = micro_env(1, &vars);
+    double t1 = now_ns();
+    for (long i = 0; i < iters; ++i) {
+        env_pop(extend_env(vars[0], new_int_val(i), base));
+    }
+    double t2 = now_ns();
+    micro_env_free(base, vars, 1);
+    return t2 - t1;
+}
+
+static double bench_apply_env(long depth, long iters) {
+    symbol_t *vars;
+    env_t e = micro_env(depth, &vars);
+    double t1 = now_ns();
+    for (long i = 0; i < iters; ++i) {
+        micro_sink += (uintptr_t)apply_env(e, vars[0]);
+    }
+    double t2 = now_ns();
+    micro_env_free(e, vars, depth);
+    return t2 - t1;
+}
+
+/* every constructor paired with cont_free, over a live env and cont */
+static double bench_cont(long type, long iters) {
+    symbol_t *vars;
+    env_t e = micro_env(1, &vars);
+    exp_val_t v = new_int_val(1);
+    proc_t p = new_proc(vars[0], NULL, e, NULL, 0);
+    continuation_t k = new_end_cont();
+    continuation_t c = NULL;
+    double t1 = now_ns();
+    for (long i = 0; i < iters; ++i) {
+        switch (type) {
+            case END_CONT: c = new_end_cont(); break;
+            case ZERO1_CONT: c = new_zero1_cont(k); break;
+            case LET_CONT: c = new_let_cont(vars[0], NULL, e, k); break;
+            case IF_TEST_CONT: c = new_if_test_cont(NULL, NULL, e, k); break;
+            case DIFF1_CONT: c = new_diff1_cont(NULL, e, k); break;
+            case DIFF2_CONT: c = new_diff2_cont(v, k); break;
+            case RATOR_CONT: c = new_rator_cont(NULL, e, k); break;
+            case RAND_CONT: c = new_rand_cont(v, k); break;
+            case LETREC_CONT: c = new_letrec_cont(e, k); break;
+            case LET2_CONT: c = new_let2_cont(e, k); break;
+            case APPLY_PROC_CONT: c = new_apply_proc_cont(v, v, e, k); break;
+            case APPLY_PROC2_CONT: c = new_apply_proc2_cont(p, e, k); break;
+        }
+        cont_free(c);
+    }
+    double t2 = now_ns();
+    cont_free(k);
+    proc_free(p);
+    exp_val_free(v);
+    micro_env_free(e, vars, 1);
+    return t2 - t1;
+}
+
+/* the recursive copy and its free, as v1 closures did it */
+static double bench_env_copy(long depth, long iters) {
+    symbol_t *vars;
+    env_t e = micro_env(depth, &vars);
+    double t1 = now_ns();
+    for (long i = 0; i < iters; ++i) {
+        env_t c = env_copy(e);
+        while (c) {
+            c = env_pop(c);
+        }
+    }
+    double t2 = now_ns();
+    micro_env_free(e, vars, depth);
+    return t2 - t1;
+}
+
+/* what copying a closure costs now: copy_exp_val through env_copy_iter */
+static double bench_copy_proc(long depth, long iters) {
+    symbol_t *vars;
+    env_t e = micro_env(depth, &vars);
+    exp_val_t pv = new_proc_val(new_proc(vars[0], NULL, e, NULL, 0));
+    double t1 = now_ns();
+    for (long i = 0; i < iters; ++i) {
+        exp_val_free(copy_exp_val(pv));
+    }
+    double t2 = now_ns();
+    exp_val_free(pv);
+    micro_env_free(e, vars, depth);
+    return t2 - t1;
+}
+
+static long micro_bounces;
+
+static void micro_bounce() {
+    trampoline_set(--micro_bounces > 0 ? micro_bounce : NULL);
+}
+
+/* the bounce loop with nothing in the bounce but setting the next one */
+static double bench_bounce(long arg, long iters) {
+    micro_bounces = iters;
+    double t1 = now_ns();
+    trampoline_loop(micro_bounce);
+    double t2 = now_ns();
+    return t2 - t1;
+}
+
+static micro_case_s micro_cases[] = {
+    { "symbol_lookup hit, load %", bench_symbol_hit, 10, 1 },
+    { "symbol_lookup hit, load %", bench_symbol_hit, 50, 1 },
+    { "symbol_lookup hit, load %", bench_symbol_hit, 90, 1 },
+    { "symbol_lookup miss, load %", bench_symbol_miss, 10, 1 },
+    { "symbol_lookup miss, load %", bench_symbol_miss, 50, 1 },
+    { "symbol_lookup miss, load %", bench_symbol_miss, 90, 1 },
+    { "extend_env+env_pop", bench_extend_pop, 0, 0 },
+    { "apply_env, depth", bench_apply_env, 1, 1 },
+    { "apply_env, depth", bench_apply_env, 10, 1 },
+    { "apply_env, depth", bench_apply_env, 100, 1 },
+    { "apply_env, depth", bench_apply_env, 1000, 1 },
+    { "end cont+free", bench_cont, END_CONT, 0 },
+    { "zero1 cont+free", bench_cont, ZERO1_CONT, 0 },
+    { "let cont+free", bench_cont, LET_CONT, 0 },
+    { "if_test cont+free", bench_cont, IF_TEST_CONT, 0 },
+    { "diff1 cont+free", bench_cont, DIFF1_CONT, 0 },
+    { "diff2 cont+free", bench_cont, DIFF2_CONT, 0 },
+    { "rator cont+free", bench_cont, RATOR_CONT, 0 },
+    { "rand cont+free", bench_cont, RAND_CONT, 0 },
+    { "letrec cont+free", bench_cont, LETREC_CONT, 0 },
+    { "let2 cont+free", bench_cont, LET2_CONT, 0 },
+    { "apply_proc cont+free", bench_cont, APPLY_PROC_CONT, 0 },
+    { "apply_proc2 cont+free", bench_cont, APPLY_PROC2_CONT, 0 },
+    { "env_copy+free, frames", bench_env_copy, 1, 1 },
+    { "env_copy+free, frames", bench_env_copy, 10, 1 },
+    { "env_copy+free, frames", bench_env_copy, 100, 1 },
+    { "env_copy+free, frames", bench_env_copy, 1000, 1 },
+    { "copy_exp_val proc, frames", bench_copy_proc, 1, 1 },
+    { "copy_exp_val proc, frames", bench_copy_proc, 10, 1 },
+    { "copy_exp_val proc, frames", bench_copy_proc, 100, 1 },
+    { "copy_exp_val proc, frames", bench_copy_proc, 1000, 1 },
+    { "trampoline bounce", bench_bounce, 0, 0 },
+};
+
+#define MICRO_CASE_COUNT (sizeof(micro_cases) / sizeof(*micro_cases))
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* the iteration count doubles until one batch takes min_ms, then that
+ * batch is repeated; the minimum is the least disturbed run */
+static void micro_run(micro_case_t c, micro_options_t opt, double *min, double *median) {
+    long iters = 16;
+    while (c->fn(c->arg, iters) < opt->min_ms * 1e6 && iters < (1L << 40)) {
+        iters *= 2;
+    }
+    double *ns = malloc(opt->reps * sizeof(double));
+    if (!ns) {
+        report_micro_malloc_fail();
+    }
+    for (int i = 0; i < opt->reps; ++i) {
+        ns[i] = c->fn(c->arg, iters) / iters;
+    }
+    qsort(ns, opt->reps, sizeof(double), compare_doubles);
+    *min = ns[0];
+    *median = ns[opt->reps / 2];
+    free(ns);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "options: --reps=N             timed batches per primitive, 5 by default\n"
+            "         --min-ms=T           shortest batch, 20 by default\n"
+            "         --filter=TEXT        only primitives whose name contains TEXT\n"
+            "         --json=OUT           write the results to OUT\n",
+            name);
+}
+
+int main(int argc, char *argv[]) {
+    micro_options_s opt = { 5, 20.0, NULL, NULL };
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--reps=", 7) == 0) {
+            opt.reps = atoi(argv[i] + 7);
+        } else if (strncmp(argv[i], "--min-ms=", 9) == 0) {
+            opt.min_ms = atof(argv[i] + 9);
+        } else if (strncmp(argv[i], "--filter=", 9) == 0) {
+            opt.filter = argv[i] + 9;
+        } else if (strncmp(argv[i], "--json=", 7) == 0) {
+            opt.json = argv[i] + 7;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opt.reps < 1 || opt.min_ms <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    FILE *fp = opt.json ? fopen(opt.json, "w") : NULL;
+    if (opt.json && !fp) {
+        fprintf(stderr, "cannot open %s for the results\n", opt.json);
+        return 1;
+    }
+    if (fp) {
+        fputs("{\n  \"unit\": \"ns/op\",\n  \"results\": [", fp);
+    }
+
+    printf("%-28s %6s %12s %12s\n", "primitive", "n", "min ns/op", "median");
+    for (size_t i = 0, first = 1; i < MICRO_CASE_COUNT; ++i) {
+        micro_case_t c = &micro_cases[i];
+        double min, median;
+        if (opt.filter && !strstr(c->name, opt.filter)) {
+            continue;
+        }
+        micro_run(c, &opt, &min, &median);
+        char n[24] = "-";
+        if (c->sized) {
+            sprintf(n, "%ld", c->arg);
+        }
+        printf("%-28s %6s %12.2f %12.2f\n", c->name, n, min, median);
+        fflush(stdout);
+        if (fp) {
+            fprintf(fp, "%s\n    {\"name\": \"%s\", \"n\": %ld, \"min\": %.3f, \"median\": %.3f}",
+                    first ? "" : ",", c->name, c->sized ? c->arg : 0L, min, median);
+            first = 0;
+        }
+    }
+    if (fp) {
+        fputs("\n  ]\n}\n", fp);
+        fclose(fp);
+    }
+    symbol_table_free(micro_table);
+    return 0;
+}
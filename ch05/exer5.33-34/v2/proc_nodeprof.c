@@ -0,0 +1,365 @@
+/* per-node execution counts of a flat program, written and read by shape */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proc.h"
+
+#define NODE_NONE 0xffffffff
+#define NODE_PROFILE_MAGIC "# proc node profile 2"
+
+static void report_node_profile_malloc_fail() {
+    fprintf(stderr, "failed to create a node profile!\n");
+    exit(1);
+}
+
+/* child k of node i in source order, NODE_NONE past the last child */
+static uint32_t flat_child(ast_flat_t flat, uint32_t i, unsigned k) {
+    const uint32_t *kids = flat->kids + 2 * i;
+    switch (flat->kind[i]) {
+        case PROC_EXP:
+        case ZERO_EXP:
+            return k == 0 ? i + 1 : NODE_NONE;
+        case LETREC_EXP:
+            return k == 0 ? kids[0] : k == 1 ? i + 1 : NODE_NONE;
+        case IF_EXP:
+            return k == 0 ? i + 1 : k == 1 ? kids[0] : k == 2 ? kids[1] : NODE_NONE;
+        case LET_EXP:
+        case DIFF_EXP:
+        case CALL_EXP:
+            return k == 0 ? i + 1 : k == 1 ? kids[0] : NODE_NONE;
+        default:
+            return NODE_NONE;
+    }
+}
+
+node_profile_t node_profile_new(ast_flat_t flat) {
+    node_profile_t prof = malloc(sizeof(node_profile_s));
+    if (prof) {
+        prof->flat = flat;
+        prof->parent = malloc(flat->count * sizeof(uint32_t));
+        prof->pos = malloc(flat->count);
+        prof->counts = calloc(flat->count, sizeof(node_counts_s));
+        if (!prof->parent || !prof->pos || !prof->counts) {
+            report_node_profile_malloc_fail();
+        }
+        prof->parent[0] = NODE_NONE;
+        prof->pos[0] = 0;
+        for (uint32_t i = 0; i < flat->count; ++i) {
+            uint32_t c;
+            prof->counts[i].callee = NODE_CALLEE_NONE;
+            for (unsigned k = 0; (c = flat_child(flat, i, k)) != NODE_NONE; ++k) {
+                prof->parent[c] = i;
+                prof->pos[c] = k;
+            }
+        }
+        return prof;
+    } else {
+        report_node_profile_malloc_fail();
+        exit(1);
+    }
+}
+
+void node_profile_free(node_profile_t prof) {
+    if (prof) {
+        free(prof->parent);
+        free(prof->pos);
+        free(prof->counts);
+        free(prof);
+    }
+}
+
+node_counts_t node_profile_at(node_profile_t prof, uint32_t i) {
+    return i < prof->flat->count ? &prof->counts[i] : NULL;
+}
+
+/* walks down from the root, so a path that does not fit this program's
+ * shape resolves to NODE_NONE instead of some unrelated node */
+uint32_t node_profile_resolve(ast_flat_t flat, const char *path) {
+    char *end;
+    if (strtoul(path, &end, 10) != 0 || end == path) {
+        return NODE_NONE;
+    }
+    uint32_t i = 0;
+    while (*end == '.') {
+        const char *p = end + 1;
+        unsigned long k = strtoul(p, &end, 10);
+        if (end == p || k > 2 || (i = flat_child(flat, i, k)) == NODE_NONE) {
+            return NODE_NONE;
+        }
+    }
+    return *end == '\0' ? i : NODE_NONE;
+}
+
+node_counts_t node_profile_find(node_profile_t prof, const char *path) {
+    uint32_t i = node_profile_resolve(prof->flat, path);
+    return i == NODE_NONE ? NULL : &prof->counts[i];
+}
+
+/* the path of node i into buf; -1 if it does not fit */
+int node_profile_path(node_profile_t prof, uint32_t i, char *buf, size_t len) {
+    size_t depth = 0;
+    for (uint32_t j = i; j != 0; j = prof->parent[j]) {
+        depth += 1;
+    }
+    if (2 * depth + 2 > len) {
+        return -1;
+    }
+    /* positions are single digits, so every level takes two characters */
+    buf[0] = '0';
+    buf[2 * depth + 1] = '\0';
+    for (uint32_t j = i; j != 0; j = prof->parent[j], --depth) {
+        buf[2 * depth - 1] = '.';
+        buf[2 * depth] = '0' + prof->pos[j];
+    }
+    return 0;
+}
+
+/* a branch is taken exactly as often as its first node runs */
+void node_profile_settle(node_profile_t prof) {
+    ast_flat_t flat = prof->flat;
+    for (uint32_t i = 0; i < flat->count; ++i) {
+        if (flat->kind[i] == IF_EXP) {
+            prof->counts[i].branch[0] = prof->counts[flat->kids[2 * i]].hits;
+            prof->counts[i].branch[1] = prof->counts[flat->kids[2 * i + 1]].hits;
+        }
+    }
+}
+
+/* the callee as its id, or as its path for a reader */
+static void write_callee(node_profile_t prof, uint32_t callee, int by_path, FILE *fp) {
+    char buf[256];
+    if (callee == NODE_CALLEE_NONE) {
+        fputs("-", fp);
+    } else if (callee == NODE_CALLEE_MANY) {
+        fputs("*", fp);
+    } else if (!by_path) {
+        fprintf(fp, "%u", callee);
+    } else if (node_profile_path(prof, callee, buf, sizeof(buf)) == 0) {
+        fputs(buf, fp);
+    } else {
+        fputs("...", fp);
+    }
+}
+
+/*
+ * One line per node that ran, in evaluation order:
+ *   ID PARENT POS KIND HITS THEN ELSE BOOL NUM PROC CALLEE
+ * ID labels the node within the file and PARENT is the ID of its parent,
+ * "-" for the root; POS is its source-order position under the parent,
+ * so a node is found again by walking down from the root and the keys do
+ * not depend on the engine's numbering. Every ancestor of a node that ran
+ * ran before it, so its line comes first. CALLEE is the ID of the body of
+ * the only procedure a call site called, "*" if it called several and "-"
+ * if none.
+ */
+int node_profile_write(node_profile_t prof, const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "cannot open %s for the node profile\n", path);
+        return -1;
+    }
+    ast_flat_t flat = prof->flat;
+    fprintf(fp, "%s\n# id parent pos kind hits then else bool num proc callee\n", NODE_PROFILE_MAGIC);
+    for (uint32_t i = 0; i < flat->count; ++i) {
+        node_counts_t c = &prof->counts[i];
+        if (!c->hits) {
+            continue;
+        }
+        if (i == 0) {
+            fputs("0 - 0", fp);
+        } else {
+            fprintf(fp, "%u %u %u", i, prof->parent[i], prof->pos[i]);
+        }
+        fprintf(fp, " %s %llu %llu %llu %llu %llu %llu ",
+                exp_type_name(flat->kind[i]), (unsigned long long)c->hits,
+                (unsigned long long)c->branch[0], (unsigned long long)c->branch[1],
+                (unsigned long long)c->rator[BOOL_VAL], (unsigned long long)c->rator[NUM_VAL],
+                (unsigned long long)c->rator[PROC_VAL]);
+        write_callee(prof, c->callee, 0, fp);
+        fputc('\n', fp);
+    }
+    int ret = ferror(fp) ? -1 : 0;
+    if (fclose(fp) != 0) {
+        ret = -1;
+    }
+    if (ret != 0) {
+        fprintf(stderr, "cannot write the node profile %s\n", path);
+    }
+    return ret;
+}
+
+/* the ids of a profile file and the nodes they resolved to, in file order */
+typedef struct node_profile_ids_s {
+    uint32_t *id;
+    uint32_t *node;
+    uint32_t *callee;  /* the callee id of the line, or NODE_CALLEE_NONE */
+    size_t n;
+    size_t cap;
+} node_profile_ids_s, *node_profile_ids_t;
+
+static void ids_add(node_profile_ids_t ids, uint32_t id, uint32_t node, uint32_t callee) {
+    if (ids->n == ids->cap) {
+        ids->cap = ids->cap ? 2 * ids->cap : 256;
+        ids->id = realloc(ids->id, ids->cap * sizeof(uint32_t));
+        ids->node = realloc(ids->node, ids->cap * sizeof(uint32_t));
+        ids->callee = realloc(ids->callee, ids->cap * sizeof(uint32_t));
+        if (!ids->id || !ids->node || !ids->callee) {
+            report_node_profile_malloc_fail();
+        }
+    }
+    ids->id[ids->n] = id;
+    ids->node[ids->n] = node;
+    ids->callee[ids->n] = callee;
+    ids->n += 1;
+}
+
+/* the node id resolved to, NODE_NONE if its line was stale or missing;
+ * ids only grow down the file, so they can be searched by halves */
+static uint32_t ids_find(node_profile_ids_t ids, uint32_t id) {
+    size_t lo = 0, hi = ids->n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ids->id[mid] < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < ids->n && ids->id[lo] == id ? ids->node[lo] : NODE_NONE;
+}
+
+static int parse_id(const char *s, uint32_t *id) {
+    char *end;
+    unsigned long v = strtoul(s, &end, 10);
+    if (end == s || *end != '\0' || v >= NODE_CALLEE_MANY) {
+        return -1;
+    }
+    *id = (uint32_t)v;
+    return 0;
+}
+
+/*
+ * Counts from the file are added to a fresh profile of flat. Lines whose
+ * parent, position or kind no longer match the program are skipped with
+ * a warning, and so are the lines under them, so a profile taken from an
+ * older version of the source degrades gracefully.
+ */
+node_profile_t node_profile_load(ast_flat_t flat, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "cannot open node profile %s\n", path);
+        return NULL;
+    }
+    char line[512];
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, NODE_PROFILE_MAGIC, strlen(NODE_PROFILE_MAGIC)) != 0) {
+        fprintf(stderr, "%s is not a node profile\n", path);
+        fclose(fp);
+        return NULL;
+    }
+    node_profile_t prof = node_profile_new(flat);
+    node_profile_ids_s ids;
+    memset(&ids, 0x00, sizeof(ids));
+    unsigned long stale = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        char id_s[16], parent_s[16], kind[16], callee_s[16];
+        unsigned pos;
+        unsigned long long hits, then_hits, else_hits, bools, nums, procs;
+        uint32_t id, parent, i = NODE_NONE, callee = NODE_CALLEE_NONE;
+        if (line[0] == '#') {
+            continue;
+        }
+        if (sscanf(line, "%15s %15s %u %15s %llu %llu %llu %llu %llu %llu %15s", id_s, parent_s, &pos,
+                   kind, &hits, &then_hits, &else_hits, &bools, &nums, &procs, callee_s) != 11 ||
+            parse_id(id_s, &id) != 0 || (ids.n > 0 && id <= ids.id[ids.n - 1])) {
+            stale += 1;
+            continue;
+        }
+        if (strcmp(parent_s, "-") == 0) {
+            i = pos == 0 ? 0 : NODE_NONE;
+        } else if (parse_id(parent_s, &parent) == 0 && (parent = ids_find(&ids, parent)) != NODE_NONE) {
+            i = flat_child(flat, parent, pos);
+        }
+        if (strcmp(callee_s, "*") == 0) {
+            callee = NODE_CALLEE_MANY;
+        } else if (strcmp(callee_s, "-") != 0 && parse_id(callee_s, &callee) != 0) {
+            callee = NODE_CALLEE_MANY;
+        }
+        if (i == NODE_NONE || strcmp(kind, exp_type_name(flat->kind[i])) != 0) {
+            stale += 1;
+            continue;
+        }
+        ids_add(&ids, id, i, callee);
+        node_counts_t c = &prof->counts[i];
+        c->hits += hits;
+        c->branch[0] += then_hits;
+        c->branch[1] += else_hits;
+        c->rator[BOOL_VAL] += bools;
+        c->rator[NUM_VAL] += nums;
+        c->rator[PROC_VAL] += procs;
+    }
+    fclose(fp);
+    /* a callee may be a body further down the file */
+    for (size_t k = 0; k < ids.n; ++k) {
+        node_counts_t c = &prof->counts[ids.node[k]];
+        if (ids.callee[k] == NODE_CALLEE_MANY) {
+            c->callee = NODE_CALLEE_MANY;
+        } else if (ids.callee[k] != NODE_CALLEE_NONE) {
+            uint32_t body = ids_find(&ids, ids.callee[k]);
+            c->callee = body == NODE_NONE ? NODE_CALLEE_MANY : body;
+        }
+    }
+    free(ids.id);
+    free(ids.node);
+    free(ids.callee);
+    if (stale) {
+        fprintf(stderr, "node profile %s: %lu stale lines skipped\n", path, stale);
+    }
+    return prof;
+}
+
+static node_profile_t sort_prof;
+
+static int compare_hits(const void *a, const void *b) {
+    uint64_t ha = sort_prof->counts[*(const uint32_t *)a].hits;
+    uint64_t hb = sort_prof->counts[*(const uint32_t *)b].hits;
+    if (ha != hb) {
+        return ha < hb ? 1 : -1;
+    }
+    return *(const uint32_t *)a < *(const uint32_t *)b ? -1 : 1;
+}
+
+/* the top hottest nodes, with branch outcomes and call targets */
+void node_profile_report(node_profile_t prof, FILE *fp, int top) {
+    ast_flat_t flat = prof->flat;
+    uint32_t *order = malloc(flat->count * sizeof(uint32_t));
+    if (!order) {
+        report_node_profile_malloc_fail();
+    }
+    for (uint32_t i = 0; i < flat->count; ++i) {
+        order[i] = i;
+    }
+    sort_prof = prof;
+    qsort(order, flat->count, sizeof(uint32_t), compare_hits);
+    fprintf(fp, "%-24s %-7s %12s\n", "path", "kind", "hits");
+    for (uint32_t n = 0; n < flat->count && n < (uint32_t)top; ++n) {
+        uint32_t i = order[n];
+        node_counts_t c = &prof->counts[i];
+        char buf[256];
+        if (!c->hits) {
+            break;
+        }
+        if (node_profile_path(prof, i, buf, sizeof(buf)) != 0) {
+            strcpy(buf, "...");
+        }
+        fprintf(fp, "%-24s %-7s %12llu", buf, exp_type_name(flat->kind[i]), (unsigned long long)c->hits);
+        if (flat->kind[i] == IF_EXP) {
+            fprintf(fp, "  then %llu else %llu",
+                    (unsigned long long)c->branch[0], (unsigned long long)c->branch[1]);
+        } else if (flat->kind[i] == CALL_EXP) {
+            fputs("  callee ", fp);
+            write_callee(prof, c->callee, 1, fp);
+        }
+        fputc('\n', fp);
+    }
+    free(order);
+}
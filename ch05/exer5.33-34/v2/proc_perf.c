@@ -0,0 +1,135 @@
+/* hardware performance counters around evaluation, through perf_event_open */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "proc.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+
+#define CACHE_READ_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} perf_events[PERF_CTR_COUNT] = {
+    [PERF_CTR_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    [PERF_CTR_INSTRUCTIONS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    [PERF_CTR_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    [PERF_CTR_L1D_MISSES] = { PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D) },
+    [PERF_CTR_LLC_MISSES] = { PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL) },
+    [PERF_CTR_DTLB_MISSES] = { PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+};
+#endif
+
+static const char *perf_counter_names[PERF_CTR_COUNT] = {
+    [PERF_CTR_CYCLES] = "cycles",
+    [PERF_CTR_INSTRUCTIONS] = "instructions",
+    [PERF_CTR_BRANCH_MISSES] = "branch-misses",
+    [PERF_CTR_L1D_MISSES] = "L1d-misses",
+    [PERF_CTR_LLC_MISSES] = "LLC-misses",
+    [PERF_CTR_DTLB_MISSES] = "dTLB-misses",
+};
+
+/* -1 for a counter the kernel or the cpu would not give us */
+static int perf_fds[PERF_CTR_COUNT] = { -1, -1, -1, -1, -1, -1 };
+static int perf_open_count;
+
+const char *perf_counter_name(perf_counter_t c) {
+    return perf_counter_names[c];
+}
+
+/*
+ * Each counter is opened on its own rather than as a group, so one that is
+ * missing (LLC on some VMs, everything under perf_event_paranoid 3) only
+ * blanks its own column. Kernel time is excluded, which is also what lets
+ * an unprivileged process open them at paranoid level 2.
+ */
+int perf_counters_open() {
+#ifdef __linux__
+    int err = 0;
+    for (int i = 0; i < PERF_CTR_COUNT; ++i) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        perf_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (perf_fds[i] >= 0) {
+            perf_open_count += 1;
+        } else {
+            err = errno;
+        }
+    }
+    if (perf_open_count == 0) {
+        fprintf(stderr, "perf counters unavailable: %s\n", strerror(err));
+    }
+#else
+    fprintf(stderr, "perf counters unavailable on this platform\n");
+#endif
+    return perf_open_count;
+}
+
+void perf_counters_close() {
+    for (int i = 0; i < PERF_CTR_COUNT; ++i) {
+        if (perf_fds[i] >= 0) {
+            close(perf_fds[i]);
+            perf_fds[i] = -1;
+        }
+    }
+    perf_open_count = 0;
+}
+
+void perf_counters_start() {
+#ifdef __linux__
+    for (int i = 0; i < PERF_CTR_COUNT; ++i) {
+        if (perf_fds[i] >= 0) {
+            ioctl(perf_fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(perf_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+/* counts are scaled up when the kernel had to multiplex the counters */
+void perf_counters_stop(perf_sample_t s) {
+    memset(s, 0x00, sizeof(*s));
+#ifdef __linux__
+    for (int i = 0; i < PERF_CTR_COUNT; ++i) {
+        uint64_t buf[3];
+        if (perf_fds[i] < 0) {
+            continue;
+        }
+        ioctl(perf_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fds[i], buf, sizeof(buf)) == sizeof(buf) && buf[2] > 0) {
+            s->value[i] = buf[2] < buf[1] ? (uint64_t)((double)buf[0] * buf[1] / buf[2]) : buf[0];
+            s->valid[i] = 1;
+        }
+    }
+#endif
+}
+
+void perf_counters_print(FILE *fp, const char *label, perf_sample_t s) {
+    fprintf(fp, "perf %s:", label);
+    for (int i = 0; i < PERF_CTR_COUNT; ++i) {
+        if (s->valid[i]) {
+            fprintf(fp, " %s %llu", perf_counter_names[i], (unsigned long long)s->value[i]);
+        } else {
+            fprintf(fp, " %s n/a", perf_counter_names[i]);
+        }
+    }
+    if (s->valid[PERF_CTR_CYCLES] && s->valid[PERF_CTR_INSTRUCTIONS] && s->value[PERF_CTR_CYCLES]) {
+        fprintf(fp, " IPC %.2f", (double)s->value[PERF_CTR_INSTRUCTIONS] / s->value[PERF_CTR_CYCLES]);
+    }
+    fputc('\n', fp);
+}
@@ -0,0 +1,210 @@
+/* sampling profiler: every SIGPROF tick records the guest call stack */
+#define _XOPEN_SOURCE 700
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "proc.h"
+
+#define PROF_MAX_DEPTH 256 /* innermost calls kept per sample */
+#define PROF_FRAMES (1 << 20)
+#define PROF_SAMPLES (1 << 16)
+
+typedef struct prof_sample_s {
+    uint32_t first;
+    uint16_t depth;
+    uint8_t more;
+} prof_sample_s;
+
+/* folded stacks seen so far, "main;outer:1;inner:4" -> number of samples */
+typedef struct prof_stack_s {
+    char *stack;
+    uint64_t count;
+} prof_stack_s;
+
+static const char *prof_path;
+static guest_frame_s *prof_frames;
+static prof_sample_s *prof_samples;
+static volatile uint32_t prof_nframes;
+static volatile uint32_t prof_nsamples;
+static volatile uint64_t prof_dropped;
+static prof_stack_s *prof_stacks;
+static size_t prof_nstacks;
+static size_t prof_cap;
+static uint64_t prof_total;
+
+static void report_prof_malloc_fail() {
+    fprintf(stderr, "failed to grow the sampling profile!\n");
+    exit(1);
+}
+
+/*
+ * Runs in the signal handler: no allocation, only copies of name and line
+ * into buffers reserved up front. Samples that do not fit are counted and
+ * dropped until the next sample_profile_collect empties the buffers.
+ */
+static void prof_tick(int sig) {
+    int more;
+    if (prof_nsamples == PROF_SAMPLES || prof_nframes + PROF_MAX_DEPTH > PROF_FRAMES) {
+        prof_dropped += 1;
+        return;
+    }
+    prof_sample_s *s = &prof_samples[prof_nsamples];
+    int n = guest_call_stack(&prof_frames[prof_nframes], PROF_MAX_DEPTH, &more);
+    s->first = prof_nframes;
+    s->depth = n;
+    s->more = more;
+    prof_nframes += n;
+    prof_nsamples += 1;
+}
+
+static uint64_t prof_hash(const char *s) {
+    uint64_t h = 14695981039346656037ull;
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 1099511628211ull;
+    }
+    return h;
+}
+
+/* adds count samples of stack, which the table takes over */
+static void prof_add(char *stack, uint64_t count) {
+    size_t mask = prof_cap - 1;
+    for (size_t i = prof_hash(stack) & mask;; i = (i + 1) & mask) {
+        if (!prof_stacks[i].stack) {
+            prof_stacks[i].stack = stack;
+            prof_stacks[i].count = count;
+            prof_nstacks += 1;
+            return;
+        } else if (strcmp(prof_stacks[i].stack, stack) == 0) {
+            prof_stacks[i].count += count;
+            free(stack);
+            return;
+        }
+    }
+}
+
+static void prof_count(char *stack) {
+    if (2 * (prof_nstacks + 1) > prof_cap) {
+        prof_stack_s *old = prof_stacks;
+        size_t old_cap = prof_cap;
+        prof_cap = prof_cap ? prof_cap * 2 : 1024;
+        prof_stacks = calloc(prof_cap, sizeof(prof_stack_s));
+        if (!prof_stacks) {
+            report_prof_malloc_fail();
+        }
+        prof_nstacks = 0;
+        for (size_t i = 0; i < old_cap; ++i) {
+            if (old[i].stack) {
+                prof_add(old[i].stack, old[i].count);
+            }
+        }
+        free(old);
+    }
+    prof_add(stack, 1);
+    prof_total += 1;
+}
+
+/* root first, the way flame graph tools expect folded stacks */
+static char *prof_fold(prof_sample_s *s) {
+    size_t len = 0, cap = 64;
+    char *buf = malloc(cap);
+    if (!buf) {
+        report_prof_malloc_fail();
+    }
+    len = sprintf(buf, "main%s", s->more ? ";[truncated]" : "");
+    for (int i = s->depth - 1; i >= 0; --i) {
+        guest_frame_s *f = &prof_frames[s->first + i];
+        const char *name = f->name ? f->name->name : "proc";
+        size_t need = len + strlen(name) + 16;
+        if (need > cap) {
+            cap = need * 2;
+            buf = realloc(buf, cap);
+            if (!buf) {
+                report_prof_malloc_fail();
+            }
+        }
+        len += sprintf(buf + len, ";%s:%d", name, f->line);
+    }
+    return buf;
+}
+
+/* folds the buffered samples while their symbols are still interned, so it
+ * has to run before each program's symbol table is freed */
+void sample_profile_collect() {
+    if (!prof_path) {
+        return;
+    }
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPROF);
+    sigprocmask(SIG_BLOCK, &set, &old);
+    for (uint32_t i = 0; i < prof_nsamples; ++i) {
+        prof_count(prof_fold(&prof_samples[i]));
+    }
+    prof_nsamples = 0;
+    prof_nframes = 0;
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+static int compare_stacks(const void *a, const void *b) {
+    return strcmp(((const prof_stack_s *)a)->stack, ((const prof_stack_s *)b)->stack);
+}
+
+static void prof_write() {
+    struct itimerval off;
+    memset(&off, 0, sizeof(off));
+    setitimer(ITIMER_PROF, &off, NULL);
+    sample_profile_collect();
+
+    size_t n = 0;
+    for (size_t i = 0; i < prof_cap; ++i) {
+        if (prof_stacks[i].stack) {
+            prof_stacks[n++] = prof_stacks[i];
+        }
+    }
+    qsort(prof_stacks, n, sizeof(prof_stack_s), compare_stacks);
+    FILE *fp = fopen(prof_path, "w");
+    if (fp) {
+        for (size_t i = 0; i < n; ++i) {
+            fprintf(fp, "%s %llu\n", prof_stacks[i].stack, (unsigned long long)prof_stacks[i].count);
+        }
+        fclose(fp);
+        fprintf(stderr, "profile: %llu samples, %llu dropped, written to %s\n",
+                (unsigned long long)prof_total, (unsigned long long)prof_dropped, prof_path);
+    } else {
+        fprintf(stderr, "cannot open %s for the profile\n", prof_path);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        free(prof_stacks[i].stack);
+    }
+    free(prof_stacks);
+    free(prof_frames);
+    free(prof_samples);
+}
+
+/* samples CPU time at hz ticks a second until exit, then writes the folded
+ * stacks to path */
+void sample_profile_start(const char *path, int hz) {
+    prof_frames = malloc(PROF_FRAMES * sizeof(guest_frame_s));
+    prof_samples = malloc(PROF_SAMPLES * sizeof(prof_sample_s));
+    if (!prof_frames || !prof_samples) {
+        report_prof_malloc_fail();
+    }
+    prof_path = path;
+    atexit(prof_write);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = prof_tick;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    struct itimerval it;
+    long usec = 1000000L / (hz > 0 ? hz : 1000);
+    it.it_interval.tv_sec = usec / 1000000L;
+    it.it_interval.tv_usec = usec % 1000000L;
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_PROF, &it, NULL);
+}
@@ -0,0 +1,176 @@
+/* runtime statistics, reported by --stats */
+#include <stdio.h>
+#include <string.h>
+#include "proc.h"
+
+/* counters always go somewhere, so the interpreter never tests whether
+ * statistics are on: when they are off, they pile up in the sink */
+static proc_stats_s proc_stats_on;
+static proc_stats_s proc_stats_sink;
+proc_stats_t proc_stats = &proc_stats_sink;
+
+static const char *exp_type_names[] = {
+    [CONST_EXP] = "const",
+    [VAR_EXP] = "var",
+    [PROC_EXP] = "proc",
+    [LETREC_EXP] = "letrec",
+    [ZERO_EXP] = "zero",
+    [IF_EXP] = "if",
+    [LET_EXP] = "let",
+    [DIFF_EXP] = "diff",
+    [CALL_EXP] = "call",
+    [DEC_VAR_EXP] = "dec_var",
+    [NEG_VAR_EXP] = "neg_var",
+    [ADD_VARS_EXP] = "add_vars",
+    [ZERO_VAR_EXP] = "zero_var",
+    [IF_ZERO_VAR_EXP] = "if_zero_var",
+    [CALL_VARS_EXP] = "call_vars",
+    [CALL_DEC_VAR_EXP] = "call_dec_var",
+    [CALL_CURRIED_EXP] = "call_curried",
+};
+
+static const char *cont_type_names[] = {
+    [END_CONT] = "end",
+    [ZERO1_CONT] = "zero1",
+    [LET_CONT] = "let",
+    [IF_TEST_CONT] = "if_test",
+    [DIFF1_CONT] = "diff1",
+    [DIFF2_CONT] = "diff2",
+    [RATOR_CONT] = "rator",
+    [RAND_CONT] = "rand",
+    [LET2_CONT] = "let2",
+    [LETREC_CONT] = "letrec",
+    [APPLY_PROC_CONT] = "apply_proc",
+    [APPLY_PROC2_CONT] = "apply_proc2",
+};
+
+const char *exp_type_name(exp_type type) {
+    if (type >= CONST_EXP && type < sizeof(exp_type_names) / sizeof(*exp_type_names) &&
+        exp_type_names[type]) {
+        return exp_type_names[type];
+    }
+    return "unknown";
+}
+
+const char *cont_type_name(CONT_TYPE type) {
+    if (type >= END_CONT && type <= APPLY_PROC2_CONT) {
+        return cont_type_names[type];
+    }
+    return "unknown";
+}
+
+void proc_stats_enable(int on) {
+    proc_stats = on ? &proc_stats_on : &proc_stats_sink;
+    proc_stats_reset();
+}
+
+void proc_stats_reset() {
+    memset(proc_stats, 0x00, sizeof(*proc_stats));
+}
+
+void proc_stats_print(FILE *fp, int json) {
+    proc_stats_t s = proc_stats;
+    if (json) {
+        fprintf(fp, "{\"steps\": {");
+        for (int t = CONST_EXP; t < EXP_TYPE_COUNT; ++t) {
+            fprintf(fp, "%s\"%s\": %llu", t == CONST_EXP ? "" : ", ",
+                    exp_type_name(t), (unsigned long long)s->steps[t]);
+        }
+        fprintf(fp, "}, \"fuse_sites\": {");
+        for (int t = FUSE_FIRST; t <= FUSE_LAST; ++t) {
+            fprintf(fp, "%s\"%s\": %llu", t == FUSE_FIRST ? "" : ", ",
+                    exp_type_name(t), (unsigned long long)s->fuse_sites[t - FUSE_FIRST]);
+        }
+        fprintf(fp, "}, \"curried_procs\": %llu, \"curried_full\": %llu, \"anf_rewrites\": {",
+                (unsigned long long)s->curried_procs, (unsigned long long)s->curried_full);
+        for (int p = 0; p < ANF_PASS_COUNT; ++p) {
+            fprintf(fp, "%s\"%s\": %llu", p == 0 ? "" : ", ",
+                    anf_pass_name(p), (unsigned long long)s->anf_rewrites[p]);
+        }
+        fprintf(fp, "}, \"apply_cont\": {");
+        for (int t = END_CONT; t <= APPLY_PROC2_CONT; ++t) {
+            fprintf(fp, "%s\"%s\": %llu", t == END_CONT ? "" : ", ",
+                    cont_type_name(t), (unsigned long long)s->conts[t]);
+        }
+        fprintf(fp, "}, \"bounces\": %llu, \"env_alloc\": %llu, \"env_free\": %llu, "
+                "\"cont_alloc\": %llu, \"cont_free\": %llu, \"cont_peak\": %llu, "
+                "\"copy_exp_val\": %llu, \"allocs\": %llu, \"alloc_bytes\": %llu, "
+                "\"vm_insns\": %llu, \"vm_frame_peak\": %llu, \"jit_functions\": %llu, "
+                "\"jit_bytes\": %llu, \"jit_entries\": %llu, \"loop_traces\": %llu, "
+                "\"loop_aborts\": %llu, \"loop_entries\": %llu}\n",
+                (unsigned long long)s->bounces,
+                (unsigned long long)s->env_alloc, (unsigned long long)s->env_free,
+                (unsigned long long)s->cont_alloc, (unsigned long long)s->cont_free,
+                (unsigned long long)s->cont_peak, (unsigned long long)s->copy_exp_val,
+                (unsigned long long)s->allocs, (unsigned long long)s->alloc_bytes,
+                (unsigned long long)s->vm_insns, (unsigned long long)s->vm_frame_peak,
+                (unsigned long long)s->jit_functions, (unsigned long long)s->jit_bytes,
+                (unsigned long long)s->jit_entries, (unsigned long long)s->loop_traces,
+                (unsigned long long)s->loop_aborts, (unsigned long long)s->loop_entries);
+    } else {
+        uint64_t steps = 0, fused = 0;
+        fprintf(fp, "evaluation steps:\n");
+        for (int t = CONST_EXP; t < FUSE_FIRST; ++t) {
+            if (s->steps[t]) {
+                fprintf(fp, "  %-12s %12llu\n", exp_type_name(t), (unsigned long long)s->steps[t]);
+            }
+            steps += s->steps[t];
+        }
+        for (int t = FUSE_FIRST; t <= FUSE_LAST; ++t) {
+            fused += s->steps[t] + s->fuse_sites[t - FUSE_FIRST];
+        }
+        if (fused) {
+            for (int t = FUSE_FIRST; t <= FUSE_LAST; ++t) {
+                steps += s->steps[t];
+            }
+            fprintf(fp, "superinstructions:         sites         hits  of steps\n");
+            for (int t = FUSE_FIRST; t <= FUSE_LAST; ++t) {
+                if (s->steps[t] || s->fuse_sites[t - FUSE_FIRST]) {
+                    fprintf(fp, "  %-12s %12llu %12llu %8.1f%%\n", exp_type_name(t),
+                            (unsigned long long)s->fuse_sites[t - FUSE_FIRST],
+                            (unsigned long long)s->steps[t],
+                            steps ? 100.0 * s->steps[t] / steps : 0.0);
+                }
+            }
+        }
+        if (s->curried_procs) {
+            fprintf(fp, "curried procs/fully applied:%9llu %12llu\n",
+                    (unsigned long long)s->curried_procs, (unsigned long long)s->curried_full);
+        }
+        fprintf(fp, "apply_cont dispatches:\n");
+        for (int t = END_CONT; t <= APPLY_PROC2_CONT; ++t) {
+            if (s->conts[t]) {
+                fprintf(fp, "  %-12s %12llu\n", cont_type_name(t), (unsigned long long)s->conts[t]);
+            }
+        }
+        fprintf(fp, "trampoline bounces:      %12llu\n", (unsigned long long)s->bounces);
+        fprintf(fp, "env frames alloc/free:   %12llu %12llu\n",
+                (unsigned long long)s->env_alloc, (unsigned long long)s->env_free);
+        fprintf(fp, "continuations alloc/free:%12llu %12llu\n",
+                (unsigned long long)s->cont_alloc, (unsigned long long)s->cont_free);
+        fprintf(fp, "peak continuation depth: %12llu\n", (unsigned long long)s->cont_peak);
+        fprintf(fp, "copy_exp_val calls:      %12llu\n", (unsigned long long)s->copy_exp_val);
+        fprintf(fp, "heap allocations/bytes:  %12llu %12llu\n",
+                (unsigned long long)s->allocs, (unsigned long long)s->alloc_bytes);
+        if (s->vm_insns) {
+            fprintf(fp, "vm instructions:         %12llu\n", (unsigned long long)s->vm_insns);
+            fprintf(fp, "peak vm frame depth:     %12llu\n", (unsigned long long)s->vm_frame_peak);
+        }
+        if (s->jit_functions) {
+            fprintf(fp, "jit functions/bytes:     %12llu %12llu\n",
+                    (unsigned long long)s->jit_functions, (unsigned long long)s->jit_bytes);
+            fprintf(fp, "jit entries:             %12llu\n", (unsigned long long)s->jit_entries);
+        }
+        if (s->loop_traces || s->loop_aborts) {
+            fprintf(fp, "loop traces/aborts:      %12llu %12llu\n",
+                    (unsigned long long)s->loop_traces, (unsigned long long)s->loop_aborts);
+            fprintf(fp, "loop trace entries:      %12llu\n", (unsigned long long)s->loop_entries);
+        }
+        for (int p = 0; p < ANF_PASS_COUNT; ++p) {
+            if (s->anf_rewrites[p]) {
+                fprintf(fp, "anf %-8s rewrites:   %12llu\n", anf_pass_name(p),
+                        (unsigned long long)s->anf_rewrites[p]);
+            }
+        }
+    }
+}
@@ -0,0 +1,558 @@
+/* scaling sweep: generated workloads at growing sizes, until an engine falls over */
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE /* wait4, MAP_ANONYMOUS */
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "proc.h"
+
+#define SWEEP_PAINT 0xa5
+#define SWEEP_PAINT_MARGIN 1024 /* left alone below the painting frame */
+
+typedef enum {
+    ENGINE_TREE = 0x00,
+    ENGINE_FLAT,
+    ENGINE_VM,
+    ENGINE_FUSED,
+    ENGINE_JIT,
+    ENGINE_LOOPS,
+    ENGINE_CC,
+    ENGINE_CPS,
+    ENGINE_COUNT
+} sweep_engine_t;
+
+static const char *engine_names[ENGINE_COUNT] = {
+    [ENGINE_TREE] = "tree",
+    [ENGINE_FLAT] = "flat",
+    [ENGINE_VM] = "vm",
+    [ENGINE_FUSED] = "fused",
+    [ENGINE_JIT] = "jit",
+    [ENGINE_LOOPS] = "loops",
+    [ENGINE_CC] = "cc",
+    [ENGINE_CPS] = "cps",
+};
+
+typedef enum {
+    PHASE_START = 0x00,
+    PHASE_PARSE,
+    PHASE_FLATTEN,
+    PHASE_COMPILE,
+    PHASE_EVALUATE,
+    PHASE_FREE,
+    PHASE_DONE
+} sweep_phase_t;
+
+static const char *phase_names[] = {
+    [PHASE_START] = "start",
+    [PHASE_PARSE] = "parse",
+    [PHASE_FLATTEN] = "flatten",
+    [PHASE_COMPILE] = "compile",
+    [PHASE_EVALUATE] = "evaluate",
+    [PHASE_FREE] = "free",
+    [PHASE_DONE] = "done",
+};
+
+/* one workload, as PROC source for a given size */
+typedef struct sweep_workload_s {
+    const char *name;
+    const char *grows; /* what n is */
+    char *(*source)(long n);
+} sweep_workload_s, *sweep_workload_t;
+
+/* shared with the child, so a crash still says how far it got */
+typedef struct sweep_shared_s {
+    volatile sweep_phase_t phase;
+    volatile int overflow;
+} sweep_shared_s, *sweep_shared_t;
+
+/* what a child reports for one run */
+typedef struct sweep_point_s {
+    long n;
+    int ok;
+    double time_us;      /* evaluation only */
+    long peak_rss_kb;
+    long stack_bytes;    /* deepest C stack during evaluation */
+    uint64_t cont_peak;  /* longest continuation chain, vm or cc frame stack */
+    uint64_t allocs;
+    char failure[48];
+    sweep_phase_t phase;
+} sweep_point_s, *sweep_point_t;
+
+typedef struct sweep_options_s {
+    long from;
+    long to;
+    long factor;
+    int timeout;       /* seconds per run */
+    long stack_kb;     /* for the evaluating thread */
+    long mem_mb;       /* address space limit, 0 for none */
+    double superlinear;
+    int engines[ENGINE_COUNT];
+    const char *workloads;
+    const char *json;
+} sweep_options_s, *sweep_options_t;
+
+/* the evaluating thread and its own stack */
+typedef struct sweep_job_s {
+    const char *source;
+    sweep_engine_t engine;
+    sweep_shared_t shared;
+    sweep_point_t point;
+    uint8_t *stack_lo;   /* just above the guard page */
+    uint8_t *stack_hi;
+    uint8_t *guard;
+    size_t page;
+} sweep_job_s, *sweep_job_t;
+
+static sweep_job_t sweep_job;
+
+static char *source_buffer(size_t size) {
+    char *s = malloc(size);
+    if (!s) {
+        fprintf(stderr, "failed to generate a sweep workload!\n");
+        exit(1);
+    }
+    return s;
+}
+
+/* non-tail recursion: the continuation chain grows with n */
+static char *recursion_source(long n) {
+    char *s = source_buffer(128);
+    sprintf(s, "letrec double (x) = if zero?(x) then 0 else -((double -(x,1)), -2)\n"
+               "in (double %ld)\n", n);
+    return s;
+}
+
+/* tail recursion: nothing should grow with n but time */
+static char *tail_source(long n) {
+    char *s = source_buffer(128);
+    sprintf(s, "letrec count (x) = if zero?(x) then 0 else (count -(x,1))\n"
+               "in (count %ld)\n", n);
+    return s;
+}
+
+/* n nested lets of one name shadowing itself, so the environment and the
+ * AST are n deep but the names are few, and a lookup at the bottom of the
+ * environment after them */
+static char *env_source(long n) {
+    char *s = source_buffer(32 * (n + 1));
+    char *p = s + sprintf(s, "let x0 = 0\nin let y = 0\n");
+    for (long i = 2; i < n; ++i) {
+        p += sprintf(p, "in let y = -(y, -1)\n");
+    }
+    sprintf(p, "in -(y, x0)\n");
+    return s;
+}
+
+/* n live closures, each calling the one it captured */
+static char *closures_source(long n) {
+    char *s = source_buffer(192);
+    sprintf(s, "letrec make (n) = if zero?(n) then proc (z) z\n"
+               "  else let f = (make -(n,1)) in proc (z) -((f z), -1)\n"
+               "in ((make %ld) 0)\n", n);
+    return s;
+}
+
+static sweep_workload_s sweep_workloads[] = {
+    { "recursion", "call depth", recursion_source },
+    { "tail", "tail calls", tail_source },
+    { "env", "let depth", env_source },
+    { "closures", "closures", closures_source },
+};
+
+#define SWEEP_WORKLOAD_COUNT (sizeof(sweep_workloads) / sizeof(*sweep_workloads))
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * Everything below this frame, less a margin for the frame of memset,
+ * gets the paint byte; whatever evaluation then overwrites is how deep it
+ * went. Kept out of line so that the frame is its own and not one with
+ * the caller's locals below it.
+ */
+static __attribute__((noinline)) void stack_paint(sweep_job_t job) {
+    uintptr_t top = (uintptr_t)__builtin_frame_address(0) - SWEEP_PAINT_MARGIN;
+    memset(job->stack_lo, SWEEP_PAINT, top - (uintptr_t)job->stack_lo);
+}
+
+static long stack_used(sweep_job_t job) {
+    uint8_t *p = job->stack_lo;
+    while (p < job->stack_hi && *p == SWEEP_PAINT) {
+        ++p;
+    }
+    return job->stack_hi - p;
+}
+
+/* a fault in the guard page is a C stack overflow, anything else a crash */
+static void sweep_segv(int sig, siginfo_t *info, void *ctx) {
+    uint8_t *addr = info->si_addr;
+    if (sweep_job && addr >= sweep_job->guard && addr < sweep_job->guard + sweep_job->page) {
+        sweep_job->shared->overflow = 1;
+    }
+    _exit(128 + sig);
+}
+
+static void *sweep_thread(void *arg) {
+    sweep_job_t job = arg;
+    sweep_point_t pt = job->point;
+
+    /* the handler needs a stack of its own, ours is the one that ran out */
+    stack_t alt;
+    alt.ss_sp = malloc(SIGSTKSZ);
+    alt.ss_size = SIGSTKSZ;
+    alt.ss_flags = 0;
+    if (!alt.ss_sp || sigaltstack(&alt, NULL) != 0) {
+        fprintf(stderr, "failed to set up the signal stack!\n");
+        exit(1);
+    }
+
+    job->shared->phase = PHASE_PARSE;
+    memset(symtab, 0x00, sizeof(symtab));
+    ast_program_t prgm = proc_parse(job->source);
+    ast_flat_t fprgm = NULL;
+    if (job->engine == ENGINE_FLAT) {
+        job->shared->phase = PHASE_FLATTEN;
+        fprgm = ast_flat_new(prgm);
+    }
+    if (job->engine != ENGINE_TREE && job->engine != ENGINE_FLAT) {
+        job->shared->phase = PHASE_COMPILE;
+    }
+    if (job->engine == ENGINE_FUSED) {
+        ast_fuse(prgm, fuse_default);
+    }
+    vm_program_t vprgm = NULL;
+    if (job->engine == ENGINE_VM || job->engine == ENGINE_JIT || job->engine == ENGINE_LOOPS) {
+        vprgm = vm_compile(prgm);
+    }
+    /* the thresholds proc_bench uses, so the two measure the same tiers */
+    vm_jit_threshold = job->engine == ENGINE_JIT || job->engine == ENGINE_LOOPS ? 100 : 0;
+    vm_loop_threshold = job->engine == ENGINE_LOOPS ? 50 : 0;
+    cc_program_t cprgm = job->engine == ENGINE_CC ? cc_compile(prgm) : NULL;
+    cps_program_t kprgm = job->engine == ENGINE_CPS ? cps_convert(prgm) : NULL;
+
+    volatile uint8_t base;
+    stack_paint(job);
+    proc_stats_reset();
+    job->shared->phase = PHASE_EVALUATE;
+    double t1 = now_us();
+    if (fprgm) {
+        value_of_program_flat(fprgm);
+    } else if (vprgm) {
+        value_of_program_vm(vprgm);
+    } else if (cprgm) {
+        value_of_program_cc(cprgm);
+    } else if (kprgm) {
+        value_of_program_cps(kprgm);
+    } else {
+        value_of_program_k(prgm);
+    }
+    double t2 = now_us();
+    pt->time_us = t2 - t1;
+    pt->stack_bytes = stack_used(job) - (job->stack_hi - (uint8_t *)&base);
+    pt->cont_peak = vprgm ? proc_stats->vm_frame_peak : proc_stats->cont_peak;
+    pt->allocs = proc_stats->allocs;
+
+    job->shared->phase = PHASE_FREE;
+    ast_flat_free(fprgm);
+    vm_program_free(vprgm);
+    cc_program_free(cprgm);
+    cps_program_free(kprgm);
+    ast_program_free(prgm);
+    symbol_table_free(symtab);
+    job->shared->phase = PHASE_DONE;
+    return NULL;
+}
+
+static void report_sweep_child_fail(const char *what) {
+    fprintf(stderr, "sweep child: %s failed\n", what);
+    _exit(1);
+}
+
+/* runs in the child: evaluate on a thread whose stack we own and can read */
+static void sweep_child(sweep_options_t opt, sweep_job_t job, int fd) {
+    if (opt->mem_mb > 0) {
+        struct rlimit lim = { opt->mem_mb << 20, opt->mem_mb << 20 };
+        setrlimit(RLIMIT_AS, &lim);
+    }
+    alarm(opt->timeout);
+
+    job->page = sysconf(_SC_PAGESIZE);
+    size_t size = ((opt->stack_kb << 10) + job->page - 1) / job->page * job->page;
+    job->guard = mmap(NULL, size + job->page, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (job->guard == MAP_FAILED || mprotect(job->guard, job->page, PROT_NONE) != 0) {
+        report_sweep_child_fail("stack mapping");
+    }
+    job->stack_lo = job->guard + job->page;
+    job->stack_hi = job->stack_lo + size;
+    sweep_job = job;
+
+    struct sigaction sa;
+    memset(&sa, 0x00, sizeof(sa));
+    sa.sa_sigaction = sweep_segv;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigaction(SIGSEGV, &sa, NULL);
+    sigaction(SIGBUS, &sa, NULL);
+
+    pthread_attr_t attr;
+    pthread_t tid;
+    if (pthread_attr_init(&attr) != 0 || pthread_attr_setstack(&attr, job->stack_lo, size) != 0 ||
+        pthread_create(&tid, &attr, sweep_thread, job) != 0 || pthread_join(tid, NULL) != 0) {
+        report_sweep_child_fail("evaluation thread");
+    }
+    job->point->ok = 1;
+    if (write(fd, job->point, sizeof(sweep_point_s)) != sizeof(sweep_point_s)) {
+        _exit(1);
+    }
+    _exit(0);
+}
+
+static void sweep_run(sweep_options_t opt, sweep_workload_t w, sweep_engine_t engine,
+                      long n, sweep_point_t pt) {
+    memset(pt, 0x00, sizeof(*pt));
+    pt->n = n;
+    sweep_shared_t shared = mmap(NULL, sizeof(sweep_shared_s), PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    int fds[2];
+    if (shared == MAP_FAILED || pipe(fds) != 0) {
+        fprintf(stderr, "failed to start a sweep run!\n");
+        exit(1);
+    }
+    shared->phase = PHASE_START;
+    shared->overflow = 0;
+    char *source = w->source(n);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "failed to fork a sweep run!\n");
+        exit(1);
+    } else if (pid == 0) {
+        sweep_job_s job = { source, engine, shared, pt, NULL, NULL, NULL, 0 };
+        close(fds[0]);
+        sweep_child(opt, &job, fds[1]);
+    }
+    close(fds[1]);
+    sweep_point_s got;
+    ssize_t len = read(fds[0], &got, sizeof(got));
+    close(fds[0]);
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) != pid) {
+        fprintf(stderr, "lost a sweep run!\n");
+        exit(1);
+    }
+    if (len == sizeof(got) && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        *pt = got;
+    } else if (shared->overflow) {
+        strcpy(pt->failure, "C stack overflow");
+    } else if (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM) {
+        sprintf(pt->failure, "timeout after %ds", opt->timeout);
+    } else if (WIFSIGNALED(status)) {
+        snprintf(pt->failure, sizeof(pt->failure), "%s", strsignal(WTERMSIG(status)));
+    } else if (WEXITSTATUS(status) > 128) {
+        snprintf(pt->failure, sizeof(pt->failure), "%s", strsignal(WEXITSTATUS(status) - 128));
+    } else {
+        sprintf(pt->failure, "exit %d", WEXITSTATUS(status));
+    }
+    pt->phase = shared->phase;
+    pt->peak_rss_kb = ru.ru_maxrss;
+    munmap(shared, sizeof(sweep_shared_s));
+    free(source);
+}
+
+/* slope of log time against log n between two points, 0 when either is
+ * too quick to say anything */
+static double growth(sweep_point_t a, sweep_point_t b) {
+    if (!a->ok || !b->ok || a->time_us < 1000 || b->time_us < 1000) {
+        return 0;
+    }
+    return log(b->time_us / a->time_us) / log((double)b->n / a->n);
+}
+
+/*
+ * One series is a workload on one engine, doubling (by default) until it
+ * fails, times out or reaches --to. Superlinear is called on two growth
+ * exponents in a row above the threshold, since one can be noise, or on
+ * one followed by a failure, which is the steepest growth of all.
+ */
+static int sweep_series(sweep_options_t opt, sweep_workload_t w, sweep_engine_t engine,
+                        sweep_point_t points) {
+    int count = 0, above = 0;
+    long superlinear_at = 0;
+    double last_growth = 0;
+    printf("\n%s (n = %s), %s\n", w->name, w->grows, engine_names[engine]);
+    printf("%10s %12s %7s %10s %10s %12s %12s\n",
+           "n", "eval ms", "growth", "rss kb", "stack kb", "cont peak", "allocs");
+    for (long n = opt->from; n <= opt->to; n *= opt->factor) {
+        sweep_point_t pt = &points[count++];
+        sweep_run(opt, w, engine, n, pt);
+        if (!pt->ok) {
+            printf("%10ld %12s  %s in %s\n", n, "FAILED", pt->failure, phase_names[pt->phase]);
+            if (above == 1 && !superlinear_at) {
+                superlinear_at = (pt - 1)->n;
+            }
+            break;
+        }
+        double g = count > 1 ? growth(pt - 1, pt) : 0;
+        above = g > opt->superlinear ? above + 1 : 0;
+        if (g != 0) {
+            last_growth = g;
+        }
+        if (above == 2 && !superlinear_at) {
+            superlinear_at = (pt - 1)->n;
+        }
+        char gbuf[16] = "-";
+        if (g != 0) {
+            sprintf(gbuf, "%.2f", g);
+        }
+        printf("%10ld %12.2f %7s %10ld %10.1f %12llu %12llu\n", n, pt->time_us / 1000, gbuf,
+               pt->peak_rss_kb, pt->stack_bytes / 1024.0,
+               (unsigned long long)pt->cont_peak, (unsigned long long)pt->allocs);
+    }
+    sweep_point_t last = &points[count - 1];
+    printf("  %s %s: ", w->name, engine_names[engine]);
+    if (superlinear_at) {
+        printf("superlinear from n=%ld, ", superlinear_at);
+    } else if (last_growth != 0) {
+        printf("last growth %.2f, ", last_growth);
+    } else {
+        printf("too quick to measure growth, ");
+    }
+    if (!last->ok) {
+        printf("fell over at n=%ld (%s in %s)\n", last->n, last->failure, phase_names[last->phase]);
+    } else {
+        printf("ran up to n=%ld\n", last->n);
+    }
+    return count;
+}
+
+static void write_point(FILE *fp, int first, sweep_workload_t w, sweep_engine_t engine, sweep_point_t pt) {
+    fprintf(fp, "%s\n    {\"workload\": \"%s\", \"engine\": \"%s\", \"n\": %ld, \"ok\": %s, "
+            "\"time_us\": %.3f, \"peak_rss_kb\": %ld, \"stack_bytes\": %ld, \"cont_peak\": %llu, "
+            "\"allocs\": %llu",
+            first ? "" : ",", w->name, engine_names[engine], pt->n, pt->ok ? "true" : "false",
+            pt->time_us, pt->peak_rss_kb, pt->stack_bytes, (unsigned long long)pt->cont_peak,
+            (unsigned long long)pt->allocs);
+    if (!pt->ok) {
+        fprintf(fp, ", \"failure\": \"%s\", \"phase\": \"%s\"", pt->failure, phase_names[pt->phase]);
+    }
+    fputc('}', fp);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "options: --from=N             smallest size, 256 by default\n"
+            "         --to=N               largest size, 262144 by default\n"
+            "         --factor=N           size step, 2 by default\n"
+            "         --workload=W[,W]     recursion, tail, env, closures; all by default\n"
+            "         --engine=E[,E]       tree, flat, vm, fused, jit, loops,\n"
+            "                              cc, cps or all, all by default\n"
+            "         --timeout=S          seconds per run, 20 by default\n"
+            "         --stack-kb=K         C stack of the evaluating thread, 8192 by default\n"
+            "         --mem-mb=M           address space limit per run, none by default\n"
+            "         --superlinear=G      growth exponent to flag, 1.3 by default\n"
+            "         --json=OUT           write every point to OUT\n",
+            name);
+}
+
+int main(int argc, char *argv[]) {
+    sweep_options_s opt = { 256, 262144, 2, 20, 8192, 0, 1.3, { 0 }, NULL, NULL };
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--from=", 7) == 0) {
+            opt.from = atol(argv[i] + 7);
+        } else if (strncmp(argv[i], "--to=", 5) == 0) {
+            opt.to = atol(argv[i] + 5);
+        } else if (strncmp(argv[i], "--factor=", 9) == 0) {
+            opt.factor = atol(argv[i] + 9);
+        } else if (strncmp(argv[i], "--workload=", 11) == 0) {
+            opt.workloads = argv[i] + 11;
+        } else if (strncmp(argv[i], "--engine=", 9) == 0) {
+            const char *e = argv[i] + 9;
+            opt.engines[ENGINE_TREE] |= strstr(e, "tree") || strcmp(e, "all") == 0;
+            opt.engines[ENGINE_FLAT] |= strstr(e, "flat") || strcmp(e, "all") == 0;
+            opt.engines[ENGINE_VM] |= strstr(e, "vm") || strcmp(e, "all") == 0;
+            opt.engines[ENGINE_FUSED] |= strstr(e, "fused") || strcmp(e, "all") == 0;
+            opt.engines[ENGINE_JIT] |= strstr(e, "jit") || strcmp(e, "all") == 0;
+            opt.engines[ENGINE_LOOPS] |= strstr(e, "loops") || strcmp(e, "all") == 0;
+            opt.engines[ENGINE_CC] |= strstr(e, "cc") || strcmp(e, "all") == 0;
+            opt.engines[ENGINE_CPS] |= strstr(e, "cps") || strcmp(e, "all") == 0;
+        } else if (strncmp(argv[i], "--timeout=", 10) == 0) {
+            opt.timeout = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--stack-kb=", 11) == 0) {
+            opt.stack_kb = atol(argv[i] + 11);
+        } else if (strncmp(argv[i], "--mem-mb=", 9) == 0) {
+            opt.mem_mb = atol(argv[i] + 9);
+        } else if (strncmp(argv[i], "--superlinear=", 14) == 0) {
+            opt.superlinear = atof(argv[i] + 14);
+        } else if (strncmp(argv[i], "--json=", 7) == 0) {
+            opt.json = argv[i] + 7;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opt.from < 1 || opt.to < opt.from || opt.factor < 2 || opt.timeout < 1 || opt.stack_kb < 64) {
+        usage(argv[0]);
+        return 1;
+    }
+    int any = 0;
+    for (int e = 0; e < ENGINE_COUNT; ++e) {
+        any |= opt.engines[e];
+    }
+    for (int e = 0; !any && e < ENGINE_COUNT; ++e) {
+        opt.engines[e] = 1;
+    }
+
+    int steps = 1;
+    for (long n = opt.from; n <= opt.to / opt.factor; n *= opt.factor) {
+        ++steps;
+    }
+    sweep_point_t points = malloc(steps * sizeof(sweep_point_s));
+    FILE *fp = opt.json ? fopen(opt.json, "w") : NULL;
+    if (!points || (opt.json && !fp)) {
+        fprintf(stderr, "cannot start the sweep\n");
+        return 1;
+    }
+    if (fp) {
+        fprintf(fp, "{\n  \"stack_kb\": %ld,\n  \"points\": [", opt.stack_kb);
+    }
+
+    proc_quiet = 1;
+    proc_stats_enable(1);
+    int first = 1;
+    for (size_t i = 0; i < SWEEP_WORKLOAD_COUNT; ++i) {
+        sweep_workload_t w = &sweep_workloads[i];
+        if (opt.workloads && !strstr(opt.workloads, w->name)) {
+            continue;
+        }
+        for (int e = 0; e < ENGINE_COUNT; ++e) {
+            if (!opt.engines[e]) {
+                continue;
+            }
+            int count = sweep_series(&opt, w, e, points);
+            for (int k = 0; fp && k < count; ++k, first = 0) {
+                write_point(fp, first, w, e, &points[k]);
+            }
+        }
+    }
+    if (fp) {
+        fputs("\n  ]\n}\n", fp);
+        fclose(fp);
+    }
+    free(points);
+    return 0;
+}
@@ -1,28 +1,49 @@
 /* simple symbol table from the book bison and flex */
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include "proc.h"
 #include "proc_parser.h"
 
-static unsigned symhash(const char *sym) {
+symbol_s symtab[NHASH];
+
+/* names made by passes, numbered from NHASH on */
+typedef struct symbol_gensym_s *symbol_gensym_t;
+struct symbol_gensym_s {
+    symbol_s sym;
+    size_t index;
+    symbol_gensym_t next;
+};
+
+static symbol_gensym_t gensyms;
+static size_t ngensyms;
+
+unsigned symbol_hash(const char *sym, size_t len) {
     unsigned int hash = 0;
-    unsigned c;
-    while ((c = *sym++)) {
-        hash = hash * 9 ^ c;
+    while (len--) {
+        hash = hash * 9 ^ (unsigned char)*sym++;
     }
     return hash;
 }
 
 symbol_t symbol_lookup(symbol_t table, char *name) {
-    symbol_t sp = table + (symhash(name) % NHASH);
+    size_t len = strlen(name);
+    return symbol_lookup_len(table, name, len, symbol_hash(name, len));
+}
+
+/* for scanners that already know the length and hash of the name, which
+ * need not be NUL-terminated */
+symbol_t symbol_lookup_len(symbol_t table, const char *name, size_t len, unsigned hash) {
+    symbol_t sp = table + (hash % NHASH);
     int scount = NHASH; /* how many have we looked at */
     while (--scount >= 0) {
-        if (sp->name && !strcmp(sp->name, name)) {
+        if (sp->name && !strncmp(sp->name, name, len) && sp->name[len] == '\0') {
             return sp;
         }
         if (!sp->name) { /* new entry */
-            sp->name = malloc(strlen(name) + 1);
-            strcpy(sp->name, name);
+            sp->name = malloc(len + 1);
+            memcpy(sp->name, name, len);
+            sp->name[len] = '\0';
             return sp;
         }
         if (++sp >= table + NHASH) {
@@ -37,4 +58,39 @@ void symbol_table_free(symbol_t table) {
     for (int i = 0; i < NHASH; ++i) {
         free(table[i].name);
     }
+    if (table == symtab) {
+        while (gensyms) {
+            symbol_gensym_t g = gensyms;
+            gensyms = g->next;
+            free(g->sym.name);
+            free(g);
+        }
+        ngensyms = 0;
+    }
+}
+
+/* a symbol of its own, never found by symbol_lookup, so that a pass can
+ * make as many names as it likes without filling the table up */
+symbol_t symbol_gensym(const char *name) {
+    symbol_gensym_t g = malloc(sizeof(struct symbol_gensym_s));
+    if (!g || !(g->sym.name = malloc(strlen(name) + 1))) {
+        yyerror(NULL, symtab, NULL, "out of memory for symbols\n");
+        abort();
+    }
+    strcpy(g->sym.name, name);
+    g->index = NHASH + ngensyms++;
+    g->next = gensyms;
+    gensyms = g;
+    return &g->sym;
+}
+
+size_t symbol_index(symbol_t sym) {
+    if ((uintptr_t)sym - (uintptr_t)symtab < sizeof(symtab)) {
+        return (size_t)(sym - symtab);
+    }
+    return ((symbol_gensym_t)sym)->index;
+}
+
+size_t symbol_count(void) {
+    return NHASH + ngensyms;
 }
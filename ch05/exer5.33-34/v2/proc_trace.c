@@ -0,0 +1,167 @@
+/* chrome trace_event export of guest calls and interpreter phases */
+#define _XOPEN_SOURCE 700
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "proc.h"
+
+#define TRACE_RING_SIZE 4096 /* events per thread, a power of two */
+#define TRACE_NAME_LEN 32
+
+/* names are copied in, since symbols may be freed before the flush */
+typedef struct trace_event_s {
+    uint64_t ts;
+    char phase;
+    int line;
+    long arg;
+    const char *arg_name;
+    char name[TRACE_NAME_LEN];
+} trace_event_s, *trace_event_t;
+
+/*
+ * One ring per producing thread. Only the owner moves head and only the
+ * flusher moves tail, so each side needs nothing more than acquire and
+ * release on the other side's index.
+ */
+typedef struct trace_ring_s {
+    trace_event_s events[TRACE_RING_SIZE];
+    uint64_t head;
+    uint64_t tail;
+    int tid;
+    struct trace_ring_s *next;
+} trace_ring_s, *trace_ring_t;
+
+int trace_on;
+static FILE *trace_fp;
+static trace_ring_t trace_rings;
+static int trace_nrings;
+static int trace_stopping;
+static int trace_events;
+static pthread_t trace_flusher;
+static uint64_t trace_epoch;
+static __thread trace_ring_t trace_ring;
+
+static uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static trace_ring_t trace_ring_register() {
+    trace_ring_t r = calloc(1, sizeof(trace_ring_s));
+    if (!r) {
+        fprintf(stderr, "failed to create a trace ring!\n");
+        exit(1);
+    }
+    r->tid = __atomic_add_fetch(&trace_nrings, 1, __ATOMIC_RELAXED);
+    r->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&trace_rings, &r->next, r, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    trace_ring = r;
+    return r;
+}
+
+/* a full ring waits for the flusher rather than dropping half of a
+ * begin/end pair */
+static void trace_push(char phase, const char *name, int line, const char *arg_name, long arg) {
+    trace_ring_t r = trace_ring ? trace_ring : trace_ring_register();
+    uint64_t head = r->head;
+    while (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE) {
+        sched_yield();
+    }
+    trace_event_t e = &r->events[head & (TRACE_RING_SIZE - 1)];
+    e->ts = trace_now() - trace_epoch;
+    e->phase = phase;
+    e->line = line;
+    e->arg_name = arg_name;
+    e->arg = arg;
+    strncpy(e->name, name, TRACE_NAME_LEN - 1);
+    e->name[TRACE_NAME_LEN - 1] = '\0';
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_begin(const char *name, int line, const char *arg_name, long arg) {
+    trace_push('B', name, line, arg_name, arg);
+}
+
+void trace_end(const char *name) {
+    trace_push('E', name, 0, NULL, 0);
+}
+
+static void trace_write(trace_event_t e, int tid) {
+    fprintf(trace_fp, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%d",
+            trace_events++ ? "," : "", e->name, e->phase,
+            (unsigned long long)(e->ts / 1000), (unsigned)(e->ts % 1000), (int)getpid(), tid);
+    if (e->line || e->arg_name) {
+        fputs(",\"args\":{", trace_fp);
+        if (e->line) {
+            fprintf(trace_fp, "\"line\":%d%s", e->line, e->arg_name ? "," : "");
+        }
+        if (e->arg_name) {
+            fprintf(trace_fp, "\"%s\":%ld", e->arg_name, e->arg);
+        }
+        fputc('}', trace_fp);
+    }
+    fputc('}', trace_fp);
+}
+
+static void trace_drain() {
+    for (trace_ring_t r = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        uint64_t tail = r->tail;
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        for (; tail != head; ++tail) {
+            trace_write(&r->events[tail & (TRACE_RING_SIZE - 1)], r->tid);
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+}
+
+static void *trace_flush_loop(void *arg) {
+    struct timespec nap = { 0, 1000000 };
+    while (!__atomic_load_n(&trace_stopping, __ATOMIC_ACQUIRE)) {
+        trace_drain();
+        nanosleep(&nap, NULL);
+    }
+    trace_drain();
+    return NULL;
+}
+
+/* joins the flusher and closes the json; registered with atexit, so a
+ * program that stops on an error still leaves a readable trace */
+void trace_stop() {
+    if (!trace_fp) {
+        return;
+    }
+    trace_on = 0;
+    __atomic_store_n(&trace_stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(trace_flusher, NULL);
+    fputs("\n],\"displayTimeUnit\":\"ns\"}\n", trace_fp);
+    fclose(trace_fp);
+    trace_fp = NULL;
+    for (trace_ring_t r = trace_rings, next; r; r = next) {
+        next = r->next;
+        free(r);
+    }
+    trace_rings = NULL;
+}
+
+void trace_start(const char *path) {
+    trace_fp = fopen(path, "w");
+    if (!trace_fp) {
+        fprintf(stderr, "cannot open %s for the trace\n", path);
+        exit(1);
+    }
+    fputs("{\"traceEvents\":[", trace_fp);
+    trace_epoch = trace_now();
+    if (pthread_create(&trace_flusher, NULL, trace_flush_loop, NULL) != 0) {
+        fprintf(stderr, "failed to start the trace flusher!\n");
+        exit(1);
+    }
+    atexit(trace_stop);
+    trace_on = 1;
+}
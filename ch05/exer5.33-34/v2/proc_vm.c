@@ -0,0 +1,938 @@
+/* register vm: three-address bytecode over per-frame virtual registers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proc.h"
+#include "proc_vm.h"
+
+static const char *vm_op_names[VM_OP_COUNT] = {
+    [VM_LOADK] = "loadk",
+    [VM_MOV] = "mov",
+    [VM_FREE] = "free",
+    [VM_SELF] = "self",
+    [VM_SUB] = "sub",
+    [VM_SUBK] = "subk",
+    [VM_ISZERO] = "iszero",
+    [VM_JMPF] = "jmpf",
+    [VM_JMP] = "jmp",
+    [VM_CLOSURE] = "closure",
+    [VM_CALL] = "call",
+    [VM_TAILCALL] = "tailcall",
+    [VM_RET] = "ret",
+    [VM_UNBOUND] = "unbound",
+};
+
+/* compiler */
+
+/*
+ * The compiler walks the tree with an explicit task stack, as ast_free and
+ * the flat builder do, so a deeply nested program cannot overflow the C
+ * stack. A task either compiles an expression into a register or finishes
+ * a node once its operands are done.
+ */
+typedef enum {
+    TASK_EXP = 0x00,
+    TASK_DIFF,
+    TASK_ZERO,
+    TASK_IF_TEST,
+    TASK_IF_THEN,
+    TASK_IF_END,
+    TASK_LET_BIND,
+    TASK_SCOPE_END,
+    TASK_CALL,
+    TASK_PROC_END,
+} vm_task_kind_t;
+
+typedef struct vm_task_s {
+    vm_task_kind_t kind;
+    ast_node_t exp;
+    symbol_t var;
+    uint32_t dst;
+    uint32_t r1;
+    uint32_t r2;
+    int32_t k;
+    int konst;       /* r2 is the immediate k */
+    int tail;
+    uint32_t mark;   /* registers above this are temporaries of the task */
+    uint32_t binds;  /* bindings to keep at scope end */
+} vm_task_s, *vm_task_t;
+
+typedef struct vm_binding_s {
+    symbol_t var;
+    uint32_t reg;
+} vm_binding_s;
+
+typedef struct vm_context_s {
+    uint32_t fn;
+    uint32_t bind_base;  /* first binding of this function */
+    symbol_t self;       /* letrec name, bound to the running closure */
+    uint32_t next_reg;
+} vm_context_s, *vm_context_t;
+
+typedef struct vm_compiler_s {
+    vm_program_t prog;
+    vm_task_s *tasks;
+    uint32_t ntasks;
+    uint32_t tasks_cap;
+    vm_binding_s *binds;
+    uint32_t nbinds;
+    uint32_t binds_cap;
+    vm_context_s *ctxs;
+    uint32_t nctxs;
+    uint32_t ctxs_cap;
+    uint32_t *patches;  /* jumps waiting for their target */
+    uint32_t npatches;
+    uint32_t patches_cap;
+} vm_compiler_s, *vm_compiler_t;
+
+/* a resolved variable */
+typedef struct vm_place_s {
+    vm_op_t op;  /* VM_MOV, VM_FREE, VM_SELF or VM_UNBOUND */
+    uint32_t index;
+} vm_place_s;
+
+static void report_vm_malloc_fail(const char *what) {
+    fprintf(stderr, "failed to grow vm %s!\n", what);
+    exit(1);
+}
+
+/* grows *array so that one more element of size fits */
+static void *vm_grow(void *array, uint32_t n, uint32_t *cap, size_t size, const char *what) {
+    if (n < *cap) {
+        return array;
+    }
+    *cap = *cap ? *cap * 2 : 16;
+    array = realloc(array, *cap * size);
+    if (!array) {
+        report_vm_malloc_fail(what);
+    }
+    return array;
+}
+
+static vm_context_t vm_ctx(vm_compiler_t c) {
+    return &c->ctxs[c->nctxs - 1];
+}
+
+static vm_function_t vm_fn(vm_compiler_t c) {
+    return &c->prog->fns[vm_ctx(c)->fn];
+}
+
+static uint32_t vm_emit(vm_compiler_t c, vm_op_t op, uint32_t a, int32_t b, int32_t cc) {
+    vm_function_t f = vm_fn(c);
+    f->code = vm_grow(f->code, f->ncode, &f->code_cap, sizeof(vm_insn_s), "code");
+    vm_insn_t i = &f->code[f->ncode];
+    i->op = op;
+    i->a = a;
+    i->b = b;
+    i->c = cc;
+    return f->ncode++;
+}
+
+static uint32_t vm_reg(vm_compiler_t c) {
+    vm_context_t ctx = vm_ctx(c);
+    vm_function_t f = vm_fn(c);
+    uint32_t r = ctx->next_reg++;
+    if (ctx->next_reg > f->nregs) {
+        f->nregs = ctx->next_reg;
+    }
+    return r;
+}
+
+static uint32_t vm_new_function(vm_compiler_t c, symbol_t param, symbol_t name, int line) {
+    vm_program_t prog = c->prog;
+    prog->fns = vm_grow(prog->fns, prog->nfns, &prog->fns_cap, sizeof(vm_function_s), "functions");
+    vm_function_t f = &prog->fns[prog->nfns];
+    memset(f, 0x00, sizeof(*f));
+    f->param = param;
+    f->name = name;
+    f->line = line;
+    return prog->nfns++;
+}
+
+static void vm_bind(vm_compiler_t c, symbol_t var, uint32_t reg) {
+    c->binds = vm_grow(c->binds, c->nbinds, &c->binds_cap, sizeof(vm_binding_s), "bindings");
+    c->binds[c->nbinds].var = var;
+    c->binds[c->nbinds].reg = reg;
+    c->nbinds += 1;
+}
+
+/* enters function fn: r0 is its parameter, r1 its result */
+static uint32_t vm_enter(vm_compiler_t c, uint32_t fn, symbol_t self) {
+    c->ctxs = vm_grow(c->ctxs, c->nctxs, &c->ctxs_cap, sizeof(vm_context_s), "contexts");
+    vm_context_t ctx = &c->ctxs[c->nctxs++];
+    ctx->fn = fn;
+    ctx->bind_base = c->nbinds;
+    ctx->self = self;
+    ctx->next_reg = 0;
+    c->prog->fns[fn].nregs = 0;
+    uint32_t param = vm_reg(c);
+    if (c->prog->fns[fn].param) {
+        vm_bind(c, c->prog->fns[fn].param, param);
+    }
+    return vm_reg(c);
+}
+
+static void vm_push(vm_compiler_t c, vm_task_s task) {
+    c->tasks = vm_grow(c->tasks, c->ntasks, &c->tasks_cap, sizeof(vm_task_s), "tasks");
+    c->tasks[c->ntasks++] = task;
+}
+
+static void vm_push_exp(vm_compiler_t c, ast_node_t exp, uint32_t dst, int tail) {
+    vm_task_s t;
+    memset(&t, 0x00, sizeof(t));
+    t.kind = TASK_EXP;
+    t.exp = exp;
+    t.dst = dst;
+    t.tail = tail;
+    vm_push(c, t);
+}
+
+static void vm_patch_push(vm_compiler_t c, uint32_t at) {
+    c->patches = vm_grow(c->patches, c->npatches, &c->patches_cap, sizeof(uint32_t), "patches");
+    c->patches[c->npatches++] = at;
+}
+
+static void vm_patch_pop(vm_compiler_t c) {
+    vm_function_t f = vm_fn(c);
+    f->code[c->patches[--c->npatches]].b = f->ncode;
+}
+
+static uint32_t vm_symbol(vm_compiler_t c, symbol_t var) {
+    vm_program_t prog = c->prog;
+    for (uint32_t i = 0; i < prog->nsyms; ++i) {
+        if (prog->syms[i] == var) {
+            return i;
+        }
+    }
+    prog->syms = vm_grow(prog->syms, prog->nsyms, &prog->syms_cap, sizeof(symbol_t), "symbols");
+    prog->syms[prog->nsyms] = var;
+    return prog->nsyms++;
+}
+
+/* var as seen from function level, without capturing anything */
+static int vm_lookup(vm_compiler_t c, uint32_t level, symbol_t var, vm_place_s *place) {
+    vm_context_t ctx = &c->ctxs[level];
+    uint32_t end = level + 1 < c->nctxs ? c->ctxs[level + 1].bind_base : c->nbinds;
+    for (uint32_t i = end; i-- > ctx->bind_base;) {
+        if (c->binds[i].var == var) {
+            place->op = VM_MOV;
+            place->index = c->binds[i].reg;
+            return 1;
+        }
+    }
+    if (ctx->self == var) {
+        place->op = VM_SELF;
+        place->index = 0;
+        return 1;
+    }
+    vm_function_t f = &c->prog->fns[ctx->fn];
+    for (uint32_t i = 0; i < f->ncaps; ++i) {
+        if (f->caps[i].var == var) {
+            place->op = VM_FREE;
+            place->index = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Closures are flat: a variable from an enclosing function is captured
+ * into every function between its binding and the use, innermost last,
+ * so each closure only ever copies from the frame that creates it.
+ */
+static vm_place_s vm_resolve(vm_compiler_t c, symbol_t var) {
+    vm_place_s place;
+    uint32_t level = c->nctxs;
+    while (level-- > 0) {
+        if (vm_lookup(c, level, var, &place)) {
+            break;
+        }
+    }
+    if (level == (uint32_t)-1) {
+        place.op = VM_UNBOUND;
+        place.index = vm_symbol(c, var);
+        return place;
+    }
+    for (uint32_t m = level + 1; m < c->nctxs; ++m) {
+        vm_function_t f = &c->prog->fns[c->ctxs[m].fn];
+        f->caps = vm_grow(f->caps, f->ncaps, &f->caps_cap, sizeof(vm_capture_s), "captures");
+        f->caps[f->ncaps].kind = place.op == VM_MOV ? VM_CAP_REG : place.op == VM_FREE ? VM_CAP_FREE : VM_CAP_SELF;
+        f->caps[f->ncaps].index = place.index;
+        f->caps[f->ncaps].var = var;
+        place.op = VM_FREE;
+        place.index = f->ncaps++;
+    }
+    return place;
+}
+
+/* an operand register: a local variable is used where it lives, anything
+ * else is compiled into a fresh temporary */
+static uint32_t vm_operand(vm_compiler_t c, ast_node_t exp, int *pending) {
+    if (exp->type == VAR_EXP) {
+        vm_place_s place = vm_resolve(c, ((ast_var_t)exp)->var);
+        if (place.op == VM_MOV) {
+            *pending = 0;
+            return place.index;
+        }
+    }
+    *pending = 1;
+    return vm_reg(c);
+}
+
+static void vm_compile_exp(vm_compiler_t c, vm_task_t t) {
+    ast_node_t exp = t->exp;
+    vm_task_s post;
+    memset(&post, 0x00, sizeof(post));
+    post.dst = t->dst;
+    post.tail = t->tail;
+    post.mark = vm_ctx(c)->next_reg;
+    post.binds = c->nbinds;
+    switch (exp->type) {
+        case CONST_EXP: {
+            vm_emit(c, VM_LOADK, t->dst, ((ast_const_t)exp)->num, 0);
+            break;
+        }
+        case VAR_EXP: {
+            vm_place_s place = vm_resolve(c, ((ast_var_t)exp)->var);
+            if (place.op != VM_MOV || place.index != t->dst) {
+                vm_emit(c, place.op, t->dst, place.index, 0);
+            }
+            break;
+        }
+        case PROC_EXP: {
+            ast_proc_t pexp = (ast_proc_t)exp;
+            uint32_t fn = vm_new_function(c, pexp->var, pexp->name, pexp->line);
+            post.kind = TASK_PROC_END;
+            post.r1 = fn;
+            vm_push(c, post);
+            post.r2 = vm_enter(c, fn, NULL);
+            c->tasks[c->ntasks - 1].r2 = post.r2;
+            vm_push_exp(c, pexp->body, post.r2, 1);
+            break;
+        }
+        case LETREC_EXP: {
+            ast_letrec_t lexp = (ast_letrec_t)exp;
+            uint32_t rf = vm_reg(c);
+            uint32_t fn = vm_new_function(c, lexp->p_var, lexp->p_name, lexp->line);
+            post.kind = TASK_SCOPE_END;
+            vm_push(c, post);
+            vm_push_exp(c, lexp->letrec_body, t->dst, t->tail);
+            post.kind = TASK_LET_BIND;
+            post.var = lexp->p_name;
+            post.r1 = rf;
+            vm_push(c, post);
+            post.kind = TASK_PROC_END;
+            post.dst = rf;
+            post.mark = rf + 1;
+            post.r1 = fn;
+            post.r2 = vm_enter(c, fn, lexp->p_name);
+            vm_push(c, post);
+            vm_push_exp(c, lexp->p_body, post.r2, 1);
+            break;
+        }
+        case ZERO_EXP: {
+            int pending;
+            post.kind = TASK_ZERO;
+            post.r1 = vm_operand(c, ((ast_zero_t)exp)->exp1, &pending);
+            vm_push(c, post);
+            if (pending) {
+                vm_push_exp(c, ((ast_zero_t)exp)->exp1, post.r1, 0);
+            }
+            break;
+        }
+        case IF_EXP: {
+            ast_if_t iexp = (ast_if_t)exp;
+            int pending;
+            post.kind = TASK_IF_END;
+            vm_push(c, post);
+            vm_push_exp(c, iexp->exp2, t->dst, t->tail);
+            post.kind = TASK_IF_THEN;
+            vm_push(c, post);
+            vm_push_exp(c, iexp->exp1, t->dst, t->tail);
+            post.kind = TASK_IF_TEST;
+            post.r1 = vm_operand(c, iexp->cond, &pending);
+            vm_push(c, post);
+            if (pending) {
+                vm_push_exp(c, iexp->cond, post.r1, 0);
+            }
+            break;
+        }
+        case LET_EXP: {
+            ast_let_t lexp = (ast_let_t)exp;
+            uint32_t rx = vm_reg(c);
+            post.kind = TASK_SCOPE_END;
+            vm_push(c, post);
+            vm_push_exp(c, lexp->exp2, t->dst, t->tail);
+            post.kind = TASK_LET_BIND;
+            post.var = lexp->id;
+            post.r1 = rx;
+            vm_push(c, post);
+            vm_push_exp(c, lexp->exp1, rx, 0);
+            break;
+        }
+        case DIFF_EXP: {
+            ast_diff_t dexp = (ast_diff_t)exp;
+            int pending1, pending2 = 0;
+            post.kind = TASK_DIFF;
+            post.r1 = vm_operand(c, dexp->exp1, &pending1);
+            if (dexp->exp2->type == CONST_EXP) {
+                post.konst = 1;
+                post.k = ((ast_const_t)dexp->exp2)->num;
+            } else {
+                post.r2 = vm_operand(c, dexp->exp2, &pending2);
+            }
+            vm_push(c, post);
+            if (pending2) {
+                vm_push_exp(c, dexp->exp2, post.r2, 0);
+            }
+            if (pending1) {
+                vm_push_exp(c, dexp->exp1, post.r1, 0);
+            }
+            break;
+        }
+        case CALL_EXP: {
+            ast_call_t cexp = (ast_call_t)exp;
+            int pending1, pending2;
+            post.kind = TASK_CALL;
+            post.r1 = vm_operand(c, cexp->rator, &pending1);
+            post.r2 = vm_operand(c, cexp->rand, &pending2);
+            vm_push(c, post);
+            if (pending2) {
+                vm_push_exp(c, cexp->rand, post.r2, 0);
+            }
+            if (pending1) {
+                vm_push_exp(c, cexp->rator, post.r1, 0);
+            }
+            break;
+        }
+        default: {
+            fprintf(stderr, "cannot compile a %s node\n", exp_type_name(exp->type));
+            exit(1);
+        }
+    }
+}
+
+static void vm_compile_task(vm_compiler_t c, vm_task_t t) {
+    switch (t->kind) {
+        case TASK_EXP: {
+            vm_compile_exp(c, t);
+            return;
+        }
+        case TASK_DIFF: {
+            if (t->konst) {
+                vm_emit(c, VM_SUBK, t->dst, t->r1, t->k);
+            } else {
+                vm_emit(c, VM_SUB, t->dst, t->r1, t->r2);
+            }
+            break;
+        }
+        case TASK_ZERO: {
+            vm_emit(c, VM_ISZERO, t->dst, t->r1, 0);
+            break;
+        }
+        case TASK_IF_TEST: {
+            vm_patch_push(c, vm_emit(c, VM_JMPF, t->r1, 0, 0));
+            break;
+        }
+        case TASK_IF_THEN: {
+            uint32_t jmp = vm_emit(c, VM_JMP, 0, 0, 0);
+            vm_patch_pop(c);
+            vm_patch_push(c, jmp);
+            break;
+        }
+        case TASK_IF_END: {
+            vm_patch_pop(c);
+            break;
+        }
+        case TASK_LET_BIND: {
+            vm_bind(c, t->var, t->r1);
+            return;
+        }
+        case TASK_SCOPE_END: {
+            c->nbinds = t->binds;
+            break;
+        }
+        case TASK_CALL: {
+            if (t->tail) {
+                vm_emit(c, VM_TAILCALL, 0, t->r1, t->r2);
+            } else {
+                vm_emit(c, VM_CALL, t->dst, t->r1, t->r2);
+            }
+            break;
+        }
+        case TASK_PROC_END: {
+            vm_emit(c, VM_RET, t->r2, 0, 0);
+            c->nbinds = vm_ctx(c)->bind_base;
+            c->nctxs -= 1;
+            vm_emit(c, VM_CLOSURE, t->dst, t->r1, 0);
+            break;
+        }
+    }
+    /* the node is done, its temporaries are free again */
+    vm_ctx(c)->next_reg = t->mark;
+}
+
+vm_program_t vm_compile(ast_program_t prgm) {
+    vm_compiler_s c;
+    memset(&c, 0x00, sizeof(c));
+    c.prog = calloc(1, sizeof(struct vm_program_s));
+    if (!c.prog) {
+        report_vm_malloc_fail("program");
+    }
+    uint32_t main = vm_new_function(&c, NULL, NULL, 0);
+    uint32_t result = vm_enter(&c, main, NULL);
+    vm_push_exp(&c, prgm->exp, result, 0);
+    while (c.ntasks > 0) {
+        vm_task_s t = c.tasks[--c.ntasks];
+        vm_compile_task(&c, &t);
+    }
+    vm_emit(&c, VM_RET, result, 0, 0);
+    free(c.tasks);
+    free(c.binds);
+    free(c.ctxs);
+    free(c.patches);
+    return c.prog;
+}
+
+void vm_program_free(vm_program_t prog) {
+    if (prog) {
+        for (uint32_t i = 0; i < prog->nfns; ++i) {
+            vm_jit_free_code(&prog->fns[i]);
+            free(prog->fns[i].code);
+            free(prog->fns[i].caps);
+        }
+        free(prog->fns);
+        free(prog->syms);
+        free(prog);
+    }
+}
+
+static const char *vm_function_name(vm_function_t f) {
+    return f->name ? f->name->name : f->param ? "proc" : "main";
+}
+
+void vm_program_dump(vm_program_t prog, FILE *fp) {
+    static const char *cap_names[] = { [VM_CAP_REG] = "r", [VM_CAP_FREE] = "free", [VM_CAP_SELF] = "self" };
+    uint32_t total = 0;
+    for (uint32_t n = 0; n < prog->nfns; ++n) {
+        vm_function_t f = &prog->fns[n];
+        fprintf(fp, "fn %u %s(%s) line %d, %u regs", n, vm_function_name(f),
+                f->param ? f->param->name : "", f->line, f->nregs);
+        for (uint32_t i = 0; i < f->ncaps; ++i) {
+            vm_capture_s *cap = &f->caps[i];
+            fprintf(fp, "%s%s=%s", i ? ", " : ", captures ", cap->var->name, cap_names[cap->kind]);
+            if (cap->kind != VM_CAP_SELF) {
+                fprintf(fp, "%u", cap->index);
+            }
+        }
+        fputc('\n', fp);
+        for (uint32_t pc = 0; pc < f->ncode; ++pc) {
+            vm_insn_t i = &f->code[pc];
+            fprintf(fp, "  %04u  %-9s", pc, vm_op_names[i->op]);
+            switch (i->op) {
+                case VM_LOADK: fprintf(fp, "r%u, %d", i->a, i->b); break;
+                case VM_MOV: fprintf(fp, "r%u, r%d", i->a, i->b); break;
+                case VM_FREE: fprintf(fp, "r%u, free%d", i->a, i->b); break;
+                case VM_SELF: fprintf(fp, "r%u", i->a); break;
+                case VM_SUB: fprintf(fp, "r%u, r%d, r%d", i->a, i->b, i->c); break;
+                case VM_SUBK: fprintf(fp, "r%u, r%d, %d", i->a, i->b, i->c); break;
+                case VM_ISZERO: fprintf(fp, "r%u, r%d", i->a, i->b); break;
+                case VM_JMPF: fprintf(fp, "r%u, %04d", i->a, i->b); break;
+                case VM_JMP: fprintf(fp, "%04d", i->b); break;
+                case VM_CLOSURE: fprintf(fp, "r%u, fn %d", i->a, i->b); break;
+                case VM_CALL: fprintf(fp, "r%u, r%d, r%d", i->a, i->b, i->c); break;
+                case VM_TAILCALL: fprintf(fp, "r%d, r%d", i->b, i->c); break;
+                case VM_RET: fprintf(fp, "r%u", i->a); break;
+                case VM_UNBOUND: fprintf(fp, "r%u, %s", i->a, prog->syms[i->b]->name); break;
+            }
+            fputc('\n', fp);
+        }
+        total += f->ncode;
+    }
+    fprintf(fp, "%u functions, %u instructions\n", prog->nfns, total);
+}
+
+/* machine */
+
+typedef struct vm_frame_s {
+    uint32_t fn;
+    uint32_t pc;
+    uint32_t base;       /* of its registers in the register stack */
+    uint32_t ret;        /* caller register for the result */
+    vm_closure_t closure;
+} vm_frame_s, *vm_frame_t;
+
+/* a closure chain can be as long as the program ran, so releasing one
+ * walks a list instead of recursing */
+static void vm_closure_free(vm_closure_t c) {
+    c->next = NULL;
+    while (c) {
+        vm_closure_t next = c->next;
+        for (uint32_t i = 0; i < c->nfree; ++i) {
+            vm_value_t v = &c->free[i];
+            if (v->type == PROC_VAL && --v->v.cv->ref == 0) {
+                v->v.cv->next = next;
+                next = v->v.cv;
+            }
+        }
+        heap_free(c);
+        c = next;
+    }
+}
+
+#define VM_RETAIN(x)                                                    \
+    do {                                                                \
+        if ((x).type == PROC_VAL) {                                     \
+            (x).v.cv->ref += 1;                                         \
+        }                                                               \
+    } while (0)
+#define VM_RELEASE(x)                                                   \
+    do {                                                                \
+        if ((x).type == PROC_VAL && --(x).v.cv->ref == 0) {             \
+            vm_closure_free((x).v.cv);                                  \
+        }                                                               \
+    } while (0)
+#define VM_SET_INT(x, n)                                                \
+    do {                                                                \
+        VM_RELEASE(x);                                                  \
+        (x).type = NUM_VAL;                                             \
+        (x).v.iv = (n);                                                 \
+    } while (0)
+
+static void report_vm_type(const char *type) {
+    fprintf(stderr, "not a valid exp val of type %s!\n", type);
+    exit(1);
+}
+
+/* the instructions that touch closures, shared by the loop and the jit */
+void vm_op_free(vm_value_t R, uint32_t a, uint32_t b, vm_closure_t self) {
+    vm_value_s v = self->free[b];
+    VM_RETAIN(v);
+    VM_RELEASE(R[a]);
+    R[a] = v;
+}
+
+void vm_op_self(vm_value_t R, uint32_t a, uint32_t b, vm_closure_t self) {
+    self->ref += 1;
+    VM_RELEASE(R[a]);
+    R[a].type = PROC_VAL;
+    R[a].v.cv = self;
+}
+
+void vm_op_closure(vm_value_t R, uint32_t a, uint32_t b, vm_closure_t self, vm_program_t prog) {
+    vm_function_t f = &prog->fns[b];
+    vm_closure_t c = heap_alloc(HEAP_VM_CLOSURE, sizeof(struct vm_closure_s) + f->ncaps * sizeof(vm_value_s));
+    if (!c) {
+        report_vm_malloc_fail("closure");
+    }
+    c->ref = 1;
+    c->fn = b;
+    c->nfree = f->ncaps;
+    for (uint32_t k = 0; k < f->ncaps; ++k) {
+        vm_capture_s *cap = &f->caps[k];
+        if (cap->kind == VM_CAP_REG) {
+            c->free[k] = R[cap->index];
+        } else if (cap->kind == VM_CAP_FREE) {
+            c->free[k] = self->free[cap->index];
+        } else {
+            c->free[k].type = PROC_VAL;
+            c->free[k].v.cv = self;
+        }
+        VM_RETAIN(c->free[k]);
+    }
+    VM_RELEASE(R[a]);
+    R[a].type = PROC_VAL;
+    R[a].v.cv = c;
+}
+
+static void vm_print_value(vm_program_t prog, vm_value_t v) {
+    switch (v->type) {
+        case NUM_VAL: printf("%d\n", v->v.iv); break;
+        case BOOL_VAL: printf("%s\n", v->v.bv == TRUE ? "#t" : "#f"); break;
+        case PROC_VAL: printf("(procedure (%s) ...)\n", prog->fns[v->v.cv->fn].param->name); break;
+    }
+}
+
+/* the register stack, grown so a new frame of n registers fits at base;
+ * every register starts out as a number so that releasing it is a no-op */
+static vm_value_t vm_frame_regs(vm_value_t *regs, uint32_t *cap, uint32_t base, uint32_t n) {
+    if (base + n > *cap) {
+        while (base + n > *cap) {
+            *cap = *cap ? *cap * 2 : 1024;
+        }
+        *regs = realloc(*regs, *cap * sizeof(vm_value_s));
+        if (!*regs) {
+            report_vm_malloc_fail("registers");
+        }
+    }
+    vm_value_t r = *regs + base;
+    for (uint32_t i = 0; i < n; ++i) {
+        r[i].type = NUM_VAL;
+        r[i].v.iv = 0;
+    }
+    return r;
+}
+
+static void vm_frame_release(vm_value_t r, uint32_t n, vm_closure_t closure) {
+    for (uint32_t i = 0; i < n; ++i) {
+        VM_RELEASE(r[i]);
+    }
+    if (closure && --closure->ref == 0) {
+        vm_closure_free(closure);
+    }
+}
+
+/*
+ * The frames of the running program, for the sampling profiler. The loop
+ * publishes its frame count only once the frames below it are filled in,
+ * and drops it to 0 while the array moves, so a signal handler never
+ * reads a frame that is not there.
+ */
+static vm_program_t vm_prof_prog;
+static vm_frame_t volatile vm_prof_frames;
+static volatile uint32_t vm_prof_nframes;
+
+/* machine code and traces run inside the frame of their function, so the
+ * frames are the whole stack; frame 0 is the program, which is main */
+static int vm_call_stack(guest_frame_s *out, int max, int *more) {
+    vm_frame_t frames = vm_prof_frames;
+    int n = 0;
+    *more = 0;
+    for (uint32_t i = vm_prof_nframes; i > 1; --i) {
+        if (n == max) {
+            *more = 1;
+            break;
+        }
+        vm_function_t f = &vm_prof_prog->fns[frames[i - 1].fn];
+        out[n].name = f->name;
+        out[n].line = f->line;
+        n += 1;
+    }
+    return n;
+}
+
+void value_of_program_vm(vm_program_t prog) {
+    uint32_t reg_cap = 0, frame_cap = 64, nframes = 1;
+    vm_value_t regs = NULL;
+    vm_frame_t frames = malloc(frame_cap * sizeof(vm_frame_s));
+    if (!frames) {
+        report_vm_malloc_fail("frames");
+    }
+    vm_function_t fn = &prog->fns[0];
+    vm_insn_t code = fn->code;
+    vm_frame_t frame = &frames[0];
+    frame->fn = 0;
+    frame->base = 0;
+    frame->closure = NULL;
+    vm_prof_prog = prog;
+    vm_prof_frames = frames;
+    vm_prof_nframes = nframes;
+    engine_call_stack = vm_call_stack;
+    vm_value_t R = vm_frame_regs(&regs, &reg_cap, 0, fn->nregs);
+    uint32_t pc = 0;
+    vm_value_s result;
+    vm_loop_rec_s rec;
+    rec.fn = NULL;
+
+    for (;;) {
+        if (rec.fn) {
+            /* recording runs each instruction here, machine code or not */
+            vm_loop_record(&rec, fn, pc, R);
+        } else if (fn->jit) {
+            /* run natively up to the next instruction left to the loop */
+            STATS_INC(jit_entries);
+            pc = fn->jit(R, pc, frame->closure);
+        }
+        vm_insn_t i = &code[pc++];
+        STATS_INC(vm_insns);
+        switch (i->op) {
+            case VM_LOADK: {
+                VM_SET_INT(R[i->a], i->b);
+                break;
+            }
+            case VM_MOV: {
+                vm_value_s v = R[i->b];
+                VM_RETAIN(v);
+                VM_RELEASE(R[i->a]);
+                R[i->a] = v;
+                break;
+            }
+            case VM_FREE: {
+                vm_op_free(R, i->a, i->b, frame->closure);
+                break;
+            }
+            case VM_SELF: {
+                vm_op_self(R, i->a, 0, frame->closure);
+                break;
+            }
+            case VM_SUB: {
+                if (R[i->b].type != NUM_VAL || R[i->c].type != NUM_VAL) {
+                    report_vm_type("number");
+                }
+                VM_SET_INT(R[i->a], R[i->b].v.iv - R[i->c].v.iv);
+                break;
+            }
+            case VM_SUBK: {
+                if (R[i->b].type != NUM_VAL) {
+                    report_vm_type("number");
+                }
+                VM_SET_INT(R[i->a], R[i->b].v.iv - i->c);
+                break;
+            }
+            case VM_ISZERO: {
+                if (R[i->b].type != NUM_VAL) {
+                    report_vm_type("number");
+                }
+                boolean_t z = R[i->b].v.iv == 0 ? TRUE : FALSE;
+                VM_RELEASE(R[i->a]);
+                R[i->a].type = BOOL_VAL;
+                R[i->a].v.bv = z;
+                break;
+            }
+            case VM_JMPF: {
+                if (R[i->a].type != BOOL_VAL) {
+                    report_vm_type("boolean");
+                }
+                if (R[i->a].v.bv == FALSE) {
+                    pc = i->b;
+                }
+                break;
+            }
+            case VM_JMP: {
+                pc = i->b;
+                break;
+            }
+            case VM_CLOSURE: {
+                vm_op_closure(R, i->a, i->b, frame->closure, prog);
+                break;
+            }
+            case VM_CALL: {
+                if (R[i->b].type != PROC_VAL) {
+                    report_vm_type("procedure");
+                }
+                vm_closure_t c = R[i->b].v.cv;
+                vm_value_s arg = R[i->c];
+                VM_RETAIN(arg);
+                c->ref += 1;
+                frame->pc = pc;
+                if (nframes == frame_cap) {
+                    frame_cap *= 2;
+                    vm_prof_nframes = 0;
+                    frames = realloc(frames, frame_cap * sizeof(vm_frame_s));
+                    if (!frames) {
+                        report_vm_malloc_fail("frames");
+                    }
+                    vm_prof_frames = frames;
+                }
+                uint32_t base = frames[nframes - 1].base + fn->nregs;
+                frame = &frames[nframes++];
+                frame->fn = c->fn;
+                frame->base = base;
+                frame->ret = i->a;
+                frame->closure = c;
+                vm_prof_nframes = nframes;
+                fn = &prog->fns[c->fn];
+                if (vm_jit_threshold && ++fn->calls == vm_jit_threshold) {
+                    vm_jit_compile(prog, fn);
+                }
+                code = fn->code;
+                pc = 0;
+                R = vm_frame_regs(&regs, &reg_cap, base, fn->nregs);
+                R[0] = arg;
+                if (nframes > proc_stats->vm_frame_peak) {
+                    proc_stats->vm_frame_peak = nframes;
+                }
+                PROC_PROBE3(call_entry, vm_function_name(fn), fn->line,
+                            arg.type == NUM_VAL ? (long)arg.v.iv : 0L);
+                TRACE_BEGIN(vm_function_name(fn), fn->line,
+                            arg.type == NUM_VAL ? "arg" : NULL, arg.type == NUM_VAL ? arg.v.iv : 0);
+                if (fn->loop && !rec.fn) {
+                    STATS_INC(loop_entries);
+                    pc = fn->loop(R, 0, c);
+                }
+                break;
+            }
+            case VM_TAILCALL: {
+                if (R[i->b].type != PROC_VAL) {
+                    report_vm_type("procedure");
+                }
+                vm_closure_t c = R[i->b].v.cv;
+                vm_value_s arg = R[i->c];
+                VM_RETAIN(arg);
+                c->ref += 1;
+                int self_call = c == frame->closure;
+                TRACE_END(vm_function_name(fn));
+                PROC_PROBE1(call_return, vm_function_name(fn));
+                vm_frame_release(R, fn->nregs, frame->closure);
+                frame->fn = c->fn;
+                frame->closure = c;
+                fn = &prog->fns[c->fn];
+                if (vm_jit_threshold && ++fn->calls == vm_jit_threshold) {
+                    vm_jit_compile(prog, fn);
+                }
+                code = fn->code;
+                pc = 0;
+                R = vm_frame_regs(&regs, &reg_cap, frame->base, fn->nregs);
+                R[0] = arg;
+                PROC_PROBE3(call_entry, vm_function_name(fn), fn->line,
+                            arg.type == NUM_VAL ? (long)arg.v.iv : 0L);
+                TRACE_BEGIN(vm_function_name(fn), fn->line,
+                            arg.type == NUM_VAL ? "arg" : NULL, arg.type == NUM_VAL ? arg.v.iv : 0);
+                if (self_call && vm_loop_threshold && !fn->loop && !rec.fn &&
+                    fn->loop_aborts < VM_LOOP_TRIES && ++fn->loops == vm_loop_threshold) {
+                    /* a hot loop header: record the next iteration */
+                    rec.fn = fn;
+                    rec.len = 0;
+                }
+                if (fn->loop && !rec.fn) {
+                    /* iterations inside the trace make no call events */
+                    STATS_INC(loop_entries);
+                    pc = fn->loop(R, 0, c);
+                }
+                break;
+            }
+            case VM_RET: {
+                vm_value_s v = R[i->a];
+                VM_RETAIN(v);
+                if (nframes > 1) {
+                    TRACE_END(vm_function_name(fn));
+                    PROC_PROBE1(call_return, vm_function_name(fn));
+                }
+                vm_frame_release(R, fn->nregs, frame->closure);
+                vm_prof_nframes = --nframes;
+                if (nframes == 0) {
+                    result = v;
+                    goto DONE;
+                }
+                uint32_t ret = frame->ret;
+                frame = &frames[nframes - 1];
+                fn = &prog->fns[frame->fn];
+                code = fn->code;
+                pc = frame->pc;
+                R = regs + frame->base;
+                VM_RELEASE(R[ret]);
+                R[ret] = v;
+                break;
+            }
+            case VM_UNBOUND: {
+                fprintf(stderr, "no binding for %s\n", prog->syms[i->b]->name);
+                exit(1);
+            }
+            default: {
+                fprintf(stderr, "bad vm instruction %u\n", i->op);
+                exit(1);
+            }
+        }
+    }
+
+DONE:
+    engine_call_stack = NULL;
+    if (!proc_quiet) {
+        printf("End of computation.\n");
+        vm_print_value(prog, &result);
+    }
+    VM_RELEASE(result);
+    free(regs);
+    free(frames);
+}
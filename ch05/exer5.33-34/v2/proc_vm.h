@@ -0,0 +1,138 @@
+#ifndef __PROC_VM_H__
+#define __PROC_VM_H__
+
+/*
+ * Internals of the register vm, shared by its compiler and loop in
+ * proc_vm.c and the jit in proc_jit.c. Must be included after proc.h.
+ */
+typedef enum {
+    VM_LOADK = 0x00, /* r[a] = b */
+    VM_MOV,          /* r[a] = r[b] */
+    VM_FREE,         /* r[a] = free[b] of the running closure */
+    VM_SELF,         /* r[a] = the running closure */
+    VM_SUB,          /* r[a] = r[b] - r[c] */
+    VM_SUBK,         /* r[a] = r[b] - c */
+    VM_ISZERO,       /* r[a] = zero?(r[b]) */
+    VM_JMPF,         /* if r[a] is false, pc = b */
+    VM_JMP,          /* pc = b */
+    VM_CLOSURE,      /* r[a] = function b over its captures */
+    VM_CALL,         /* r[a] = (r[b] r[c]) */
+    VM_TAILCALL,     /* return (r[b] r[c]), reusing the frame */
+    VM_RET,          /* return r[a] */
+    VM_UNBOUND,      /* no binding for symbol b, reported when reached */
+    VM_OP_COUNT
+} vm_op_t;
+
+typedef struct vm_closure_s *vm_closure_t;
+
+/* numbers and booleans live in the registers; only closures are boxed */
+typedef struct vm_value_s {
+    EXP_VAL type;
+    union {
+        int iv;
+        boolean_t bv;
+        vm_closure_t cv;
+    } v;
+} vm_value_s, *vm_value_t;
+
+struct vm_closure_s {
+    int ref;
+    uint32_t fn;
+    vm_closure_t next;  /* on the list of closures being freed */
+    uint32_t nfree;
+    vm_value_s free[];
+};
+
+/*
+ * Machine code for one function, entered at the instruction pc with the
+ * frame's registers and closure. It runs until an instruction it leaves to
+ * the vm loop and returns that instruction's pc.
+ */
+typedef uint32_t (*vm_jit_code_t)(vm_value_t regs, uint32_t pc, vm_closure_t self);
+
+typedef struct vm_insn_s {
+    uint32_t op;
+    uint32_t a;
+    int32_t b;
+    int32_t c;
+} vm_insn_s, *vm_insn_t;
+
+/* where a closure gets one of its free values from, in the frame that
+ * creates it */
+typedef enum {
+    VM_CAP_REG = 0x00,
+    VM_CAP_FREE,
+    VM_CAP_SELF
+} vm_cap_kind_t;
+
+typedef struct vm_capture_s {
+    vm_cap_kind_t kind;
+    uint32_t index;
+    symbol_t var;
+} vm_capture_s;
+
+typedef struct vm_function_s {
+    symbol_t param;  /* NULL for the program itself */
+    symbol_t name;   /* letrec or let name, NULL if anonymous */
+    int line;
+    uint32_t nregs;  /* r0 is the argument */
+    vm_insn_s *code;
+    uint32_t ncode;
+    uint32_t code_cap;
+    vm_capture_s *caps;
+    uint32_t ncaps;
+    uint32_t caps_cap;
+    uint32_t calls;        /* counted only while the jit is on */
+    vm_jit_code_t jit;     /* machine code, NULL until the function is hot */
+    void *jit_mem;
+    size_t jit_size;
+    uint32_t loops;        /* self tail calls, counted while traces are on */
+    uint32_t loop_aborts;  /* recordings that did not make a trace */
+    vm_jit_code_t loop;    /* the loop trace, entered at pc 0 only */
+    void *loop_mem;
+    size_t loop_size;
+} vm_function_s, *vm_function_t;
+
+/* function 0 is the program */
+struct vm_program_s {
+    vm_function_s *fns;
+    uint32_t nfns;
+    uint32_t fns_cap;
+    symbol_t *syms;  /* for unbound */
+    uint32_t nsyms;
+    uint32_t syms_cap;
+};
+
+/* instructions on closures, called by the loop and by machine code alike;
+ * the arguments line up with the registers the jit passes them in */
+void vm_op_free(vm_value_t regs, uint32_t a, uint32_t b, vm_closure_t self);
+void vm_op_self(vm_value_t regs, uint32_t a, uint32_t b, vm_closure_t self);
+void vm_op_closure(vm_value_t regs, uint32_t a, uint32_t b, vm_closure_t self, vm_program_t prog);
+
+/* compiles fn, or leaves it to the interpreter where there is no jit */
+void vm_jit_compile(vm_program_t prog, vm_function_t fn);
+void vm_jit_free_code(vm_function_t fn);
+
+/* the longest iteration a loop trace is recorded for, and how many
+ * recordings a function gets before it is left alone */
+#define VM_LOOP_MAX 64
+#define VM_LOOP_TRIES 3
+
+/*
+ * One iteration of a self tail calling function as the loop ran it, from
+ * its entry to the tail call back into itself. taken[k] is the way the
+ * JMPF at pcs[k] went; fn is NULL while nothing is being recorded.
+ */
+typedef struct vm_loop_rec_s {
+    vm_function_t fn;
+    uint32_t len;
+    uint32_t pcs[VM_LOOP_MAX];
+    uint8_t taken[VM_LOOP_MAX];
+} vm_loop_rec_s, *vm_loop_rec_t;
+
+/* records the instruction at pc before the loop runs it. At the tail
+ * call the iteration is compiled into fn->loop; recording stops there,
+ * or at anything a trace cannot hold. */
+void vm_loop_record(vm_loop_rec_t rec, vm_function_t fn, uint32_t pc, vm_value_t regs);
+
+#endif
@@ -0,0 +1,308 @@
+/* procc: compiles a PROC program ahead of time into a standalone C file */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proc.h"
+#include "proc_vm.h"
+
+/*
+ * The program is lowered by vm_compile and each vm function is written out
+ * as straight C in one function, main, in the manner of exercise 5.23:
+ *   F<n>      entry of function n, F<n>_<pc> a jump target inside it
+ *   K<k>      continuation point k, just after a call returns
+ *   val       the value being returned, arg the one being passed
+ *   R, self   the running frame's registers and closure (the environment)
+ *   pc_frames the continuation, one frame per call in progress
+ * A call pushes the continuation point and goes through pc_enter, which
+ * switches on the callee's function; a return pops the frame and goes
+ * through pc_return, which switches on the continuation point. Tail calls
+ * reuse the frame and push nothing.
+ */
+typedef struct aot_s {
+    vm_program_t prog;
+    FILE *out;
+    uint32_t nks;      /* continuation points so far */
+    uint8_t *targets;  /* per pc of the function being written: jumped to */
+    uint32_t targets_cap;
+    int calls;         /* whether anything is called, so pc_enter is used */
+} aot_s, *aot_t;
+
+static const char *aot_function_name(vm_function_t f) {
+    return f->name ? f->name->name : f->param ? "proc" : "main";
+}
+
+/* identifiers cannot hold either, but the output must compile regardless */
+static void aot_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', out);
+        }
+        fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+static void aot_mark_targets(aot_t a, vm_function_t f) {
+    if (f->ncode + 1 > a->targets_cap) {
+        a->targets_cap = f->ncode + 1;
+        a->targets = realloc(a->targets, a->targets_cap);
+        if (!a->targets) {
+            fprintf(stderr, "failed to grow procc targets!\n");
+            exit(1);
+        }
+    }
+    memset(a->targets, 0, f->ncode + 1);
+    for (uint32_t pc = 0; pc < f->ncode; ++pc) {
+        if (f->code[pc].op == VM_JMPF || f->code[pc].op == VM_JMP) {
+            a->targets[f->code[pc].b] = 1;
+        }
+    }
+}
+
+static void aot_closure(aot_t a, vm_insn_t i) {
+    vm_function_t g = &a->prog->fns[i->b];
+    fprintf(a->out, "    {\n        pc_closure_t c = pc_closure_new(%d, %u);\n", i->b, g->ncaps);
+    for (uint32_t k = 0; k < g->ncaps; ++k) {
+        vm_capture_s *cap = &g->caps[k];
+        if (cap->kind == VM_CAP_REG) {
+            fprintf(a->out, "        c->free[%u] = R[%u];\n", k, cap->index);
+        } else if (cap->kind == VM_CAP_FREE) {
+            fprintf(a->out, "        c->free[%u] = self->free[%u];\n", k, cap->index);
+        } else {
+            fprintf(a->out, "        c->free[%u].type = PC_PROC;\n"
+                    "        c->free[%u].v.cv = self;\n", k, k);
+        }
+        fprintf(a->out, "        PC_RETAIN(c->free[%u]);\n", k);
+    }
+    fprintf(a->out, "        PC_SET(R[%u], PC_PROC, cv, c);\n    }\n", i->a);
+}
+
+/* leaves the closure called in callee and its argument in arg */
+static void aot_callee(aot_t a, vm_insn_t i) {
+    fprintf(a->out,
+            "    if (R[%d].type != PC_PROC) {\n"
+            "        pc_type_fail(\"procedure\");\n"
+            "    }\n"
+            "    arg = R[%d];\n"
+            "    PC_RETAIN(arg);\n"
+            "    callee = R[%d].v.cv;\n"
+            "    callee->ref += 1;\n",
+            i->b, i->c, i->b);
+}
+
+static void aot_insn(aot_t a, uint32_t n, vm_function_t f, vm_insn_t i) {
+    FILE *out = a->out;
+    switch (i->op) {
+        case VM_LOADK: {
+            fprintf(out, "    PC_SET(R[%u], PC_NUM, iv, %d);\n", i->a, i->b);
+            break;
+        }
+        case VM_MOV:
+        case VM_FREE: {
+            fprintf(out, "    {\n        pc_value_s v = %s[%d];\n"
+                    "        PC_RETAIN(v);\n        PC_RELEASE(R[%u]);\n        R[%u] = v;\n    }\n",
+                    i->op == VM_MOV ? "R" : "self->free", i->b, i->a, i->a);
+            break;
+        }
+        case VM_SELF: {
+            fprintf(out, "    self->ref += 1;\n    PC_SET(R[%u], PC_PROC, cv, self);\n", i->a);
+            break;
+        }
+        case VM_SUB: {
+            fprintf(out, "    {\n        int x = PC_NUM_OF(R[%d]), y = PC_NUM_OF(R[%d]);\n"
+                    "        PC_SET(R[%u], PC_NUM, iv, PC_SUB(x, y));\n    }\n", i->b, i->c, i->a);
+            break;
+        }
+        case VM_SUBK: {
+            fprintf(out, "    {\n        int x = PC_NUM_OF(R[%d]);\n"
+                    "        PC_SET(R[%u], PC_NUM, iv, PC_SUB(x, %d));\n    }\n", i->b, i->a, i->c);
+            break;
+        }
+        case VM_ISZERO: {
+            fprintf(out, "    {\n        int z = PC_NUM_OF(R[%d]) == 0;\n"
+                    "        PC_SET(R[%u], PC_BOOL, bv, z);\n    }\n", i->b, i->a);
+            break;
+        }
+        case VM_JMPF: {
+            fprintf(out, "    if (R[%u].type != PC_BOOL) {\n        pc_type_fail(\"boolean\");\n    }\n"
+                    "    if (!R[%u].v.bv) {\n        goto F%u_%d;\n    }\n", i->a, i->a, n, i->b);
+            break;
+        }
+        case VM_JMP: {
+            fprintf(out, "    goto F%u_%d;\n", n, i->b);
+            break;
+        }
+        case VM_CLOSURE: {
+            aot_closure(a, i);
+            break;
+        }
+        case VM_CALL: {
+            aot_callee(a, i);
+            fprintf(out, "    pc_push_frame(%u, base, self);\n"
+                    "    base += %u;\n    self = callee;\n    goto pc_enter;\n"
+                    "K%u:\n    PC_RELEASE(R[%u]);\n    R[%u] = val;\n",
+                    a->nks, f->nregs, a->nks, i->a, i->a);
+            a->nks += 1;
+            break;
+        }
+        case VM_TAILCALL: {
+            aot_callee(a, i);
+            fprintf(out, "    pc_frame_release(R, %u, self);\n    self = callee;\n    goto pc_enter;\n",
+                    f->nregs);
+            break;
+        }
+        case VM_RET: {
+            fprintf(out, "    val = R[%u];\n    PC_RETAIN(val);\n"
+                    "    pc_frame_release(R, %u, self);\n    goto pc_return;\n", i->a, f->nregs);
+            break;
+        }
+        case VM_UNBOUND: {
+            fputs("    pc_unbound(", out);
+            aot_string(out, a->prog->syms[i->b]->name);
+            fputs(");\n", out);
+            break;
+        }
+        default: {
+            fprintf(stderr, "bad vm instruction %u\n", i->op);
+            exit(1);
+        }
+    }
+}
+
+static void aot_function(aot_t a, uint32_t n) {
+    vm_function_t f = &a->prog->fns[n];
+    fprintf(a->out, "\n    /* fn %u %s(%s), line %d */\n", n, aot_function_name(f),
+            f->param ? f->param->name : "", f->line);
+    if (n > 0) {
+        fprintf(a->out, "F%u:\n    R = pc_frame_regs(base, %u);\n    R[0] = arg;\n", n, f->nregs);
+    } else {
+        fprintf(a->out, "    R = pc_frame_regs(base, %u);\n", f->nregs);
+    }
+    aot_mark_targets(a, f);
+    for (uint32_t pc = 0; pc < f->ncode; ++pc) {
+        if (a->targets[pc]) {
+            fprintf(a->out, "F%u_%u:;\n", n, pc);
+        }
+        aot_insn(a, n, f, &f->code[pc]);
+    }
+}
+
+static void aot_program(aot_t a) {
+    vm_program_t prog = a->prog;
+    FILE *out = a->out;
+    for (uint32_t n = 0; n < prog->nfns; ++n) {
+        for (uint32_t pc = 0; pc < prog->fns[n].ncode; ++pc) {
+            a->calls |= prog->fns[n].code[pc].op == VM_CALL || prog->fns[n].code[pc].op == VM_TAILCALL;
+        }
+    }
+
+    fputs("\n/* the program */\nstatic const char *const pc_params[] = {", out);
+    for (uint32_t n = 0; n < prog->nfns; ++n) {
+        fputs(n ? ", " : "", out);
+        aot_string(out, prog->fns[n].param ? prog->fns[n].param->name : "");
+    }
+    fputs("};\n\nint main(void) {\n"
+          "    uint32_t base = 0;\n"
+          "    pc_closure_t self = NULL;\n"
+          "    pc_value_t R;\n"
+          "    pc_value_s val;\n", out);
+    if (a->calls) {
+        fputs("    pc_value_s arg;\n    pc_closure_t callee;\n", out);
+    }
+    /* with no calls, only the program itself can run */
+    for (uint32_t n = 0; n < (a->calls ? prog->nfns : 1); ++n) {
+        aot_function(a, n);
+    }
+
+    if (a->calls) {
+        fputs("\npc_enter:\n    switch (self->fn) {\n", out);
+        for (uint32_t n = 1; n < prog->nfns; ++n) {
+            fprintf(out, "        case %u: goto F%u;\n", n, n);
+        }
+        fputs("    }\n", out);
+    }
+    fputs("\npc_return:\n"
+          "    if (pc_nframes > 0) {\n"
+          "        pc_frame_t f = &pc_frames[--pc_nframes];\n"
+          "        base = f->base;\n"
+          "        self = f->self;\n"
+          "        R = pc_regs + base;\n"
+          "        switch (f->k) {\n", out);
+    for (uint32_t k = 0; k < a->nks; ++k) {
+        fprintf(out, "            case %u: goto K%u;\n", k, k);
+    }
+    fputs("        }\n"
+          "    }\n"
+          "    printf(\"End of computation.\\n\");\n"
+          "    pc_print(val, pc_params);\n"
+          "    PC_RELEASE(val);\n"
+          "    free(pc_regs);\n"
+          "    free(pc_frames);\n"
+          "    return 0;\n"
+          "}\n", out);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [options] FILE\n"
+            "writes the PROC program in FILE as one standalone C file, to be built\n"
+            "with e.g. cc -O3 -o prog prog.c\n"
+            "options: -o OUT           write the C to OUT instead of stdout\n"
+            "         --runtime=H      the runtime copied into the output,\n"
+            "                          %s by default\n",
+            name, PROCC_RUNTIME);
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = NULL, *out_path = NULL, *runtime = PROCC_RUNTIME;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (strncmp(argv[i], "--runtime=", 10) == 0) {
+            runtime = argv[i] + 10;
+        } else if (argv[i][0] != '-' && !path) {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!path) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    memset(symtab, 0x00, sizeof(symtab));
+    char *string = read_file(path);
+    char *rt = read_file(runtime);
+    ast_program_t prgm = proc_parse(string);
+    vm_program_t prog = vm_compile(prgm);
+    FILE *out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "cannot open %s\n", out_path);
+        return 1;
+    }
+
+    aot_s a = { prog, out, 0, NULL, 0, 0 };
+    fputs("/* compiled from ", out);
+    fputs(path, out);
+    fputs(" by procc */\n", out);
+    fputs(rt, out);
+    aot_program(&a);
+    free(a.targets);
+
+    int failed = ferror(out);
+    if (out != stdout && fclose(out) != 0) {
+        failed = 1;
+    }
+    if (failed) {
+        fprintf(stderr, "failed to write %s\n", out_path ? out_path : "the output");
+    }
+    vm_program_free(prog);
+    ast_program_free(prgm);
+    symbol_table_free(symtab);
+    free(string);
+    free(rt);
+    return failed;
+}
@@ -0,0 +1,169 @@
+/*
+ * Runtime of the C that procc emits, copied to the top of every output so
+ * that the output builds on its own. It mirrors the register vm: numbers
+ * and booleans live in the registers, closures are boxed and refcounted,
+ * and the registers of every frame sit on one growable stack. Everything
+ * is static inline so that an output using only part of it builds cleanly.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef enum {
+    PC_BOOL = 0x01,
+    PC_NUM,
+    PC_PROC
+} pc_type_t;
+
+typedef struct pc_closure_s *pc_closure_t;
+
+typedef struct pc_value_s {
+    pc_type_t type;
+    union {
+        int iv;
+        int bv;
+        pc_closure_t cv;
+    } v;
+} pc_value_s, *pc_value_t;
+
+struct pc_closure_s {
+    int ref;
+    uint32_t fn;
+    pc_closure_t next;  /* on the list of closures being freed */
+    uint32_t nfree;
+    pc_value_s free[];
+};
+
+/* the caller's side of a call: where to go back to, its registers and its
+ * closure */
+typedef struct pc_frame_s {
+    uint32_t k;
+    uint32_t base;
+    pc_closure_t self;
+} pc_frame_s, *pc_frame_t;
+
+static pc_value_t pc_regs;
+static uint32_t pc_regs_cap;
+static pc_frame_t pc_frames;
+static uint32_t pc_nframes;
+static uint32_t pc_frames_cap;
+
+static inline void pc_malloc_fail(const char *what) {
+    fprintf(stderr, "failed to grow %s!\n", what);
+    exit(1);
+}
+
+static inline void pc_type_fail(const char *type) {
+    fprintf(stderr, "not a valid exp val of type %s!\n", type);
+    exit(1);
+}
+
+static inline void pc_unbound(const char *name) {
+    fprintf(stderr, "no binding for %s\n", name);
+    exit(1);
+}
+
+/* a closure chain can be as long as the program ran, so releasing one
+ * walks a list instead of recursing */
+static inline void pc_closure_free(pc_closure_t c) {
+    c->next = NULL;
+    while (c) {
+        pc_closure_t next = c->next;
+        for (uint32_t i = 0; i < c->nfree; ++i) {
+            pc_value_t v = &c->free[i];
+            if (v->type == PC_PROC && --v->v.cv->ref == 0) {
+                v->v.cv->next = next;
+                next = v->v.cv;
+            }
+        }
+        free(c);
+        c = next;
+    }
+}
+
+#define PC_RETAIN(x)                                                    \
+    do {                                                                \
+        if ((x).type == PC_PROC) {                                      \
+            (x).v.cv->ref += 1;                                         \
+        }                                                               \
+    } while (0)
+#define PC_RELEASE(x)                                                   \
+    do {                                                                \
+        if ((x).type == PC_PROC && --(x).v.cv->ref == 0) {              \
+            pc_closure_free((x).v.cv);                                  \
+        }                                                               \
+    } while (0)
+#define PC_SET(x, t, field, n)                                          \
+    do {                                                                \
+        PC_RELEASE(x);                                                  \
+        (x).type = (t);                                                 \
+        (x).v.field = (n);                                              \
+    } while (0)
+#define PC_NUM_OF(x)                                                    \
+    ((x).type == PC_NUM ? (x).v.iv : (pc_type_fail("number"), 0))
+/* wraps around as the interpreters do in practice, without the undefined
+ * signed overflow that -O3 is free to assume away */
+#define PC_SUB(a, b) ((int)((unsigned)(a) - (unsigned)(b)))
+
+static inline pc_closure_t pc_closure_new(uint32_t fn, uint32_t nfree) {
+    pc_closure_t c = malloc(sizeof(struct pc_closure_s) + nfree * sizeof(pc_value_s));
+    if (!c) {
+        pc_malloc_fail("closure");
+    }
+    c->ref = 1;
+    c->fn = fn;
+    c->nfree = nfree;
+    return c;
+}
+
+/* the registers of a new frame of n at base; every register starts out as
+ * a number so that releasing it is a no-op */
+static inline pc_value_t pc_frame_regs(uint32_t base, uint32_t n) {
+    if (base + n > pc_regs_cap) {
+        while (base + n > pc_regs_cap) {
+            pc_regs_cap = pc_regs_cap ? pc_regs_cap * 2 : 1024;
+        }
+        pc_regs = realloc(pc_regs, pc_regs_cap * sizeof(pc_value_s));
+        if (!pc_regs) {
+            pc_malloc_fail("registers");
+        }
+    }
+    pc_value_t r = pc_regs + base;
+    for (uint32_t i = 0; i < n; ++i) {
+        r[i].type = PC_NUM;
+        r[i].v.iv = 0;
+    }
+    return r;
+}
+
+static inline void pc_frame_release(pc_value_t r, uint32_t n, pc_closure_t self) {
+    for (uint32_t i = 0; i < n; ++i) {
+        PC_RELEASE(r[i]);
+    }
+    if (self && --self->ref == 0) {
+        pc_closure_free(self);
+    }
+}
+
+static inline pc_frame_t pc_push_frame(uint32_t k, uint32_t base, pc_closure_t self) {
+    if (pc_nframes == pc_frames_cap) {
+        pc_frames_cap = pc_frames_cap ? pc_frames_cap * 2 : 64;
+        pc_frames = realloc(pc_frames, pc_frames_cap * sizeof(pc_frame_s));
+        if (!pc_frames) {
+            pc_malloc_fail("frames");
+        }
+    }
+    pc_frame_t f = &pc_frames[pc_nframes++];
+    f->k = k;
+    f->base = base;
+    f->self = self;
+    return f;
+}
+
+static inline void pc_print(pc_value_s v, const char *const *params) {
+    switch (v.type) {
+        case PC_NUM: printf("%d\n", v.v.iv); break;
+        case PC_BOOL: printf("%s\n", v.v.bv ? "#t" : "#f"); break;
+        case PC_PROC: printf("(procedure (%s) ...)\n", params[v.v.cv->fn]); break;
+    }
+}